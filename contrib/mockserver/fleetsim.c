@@ -0,0 +1,502 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file fleetsim.c
+    @brief Drives simulated clients through a gateway, for load tests
+
+    Each client goes through what a phone does on a captive network:
+
+    - redirect: any web page, asked of the gateway, is answered with a
+      redirect to the login page of the portal;
+    - login: the login page sends the client back to /smartwifi/auth on
+      the gateway with a token (wdmockserver does this at once);
+    - auth: the gateway checks the token with the auth server and
+      redirects the client to the portal, or to a message if refused;
+    - counters: with -w, the mock server is asked until the gateway has
+      reported counters for the token, which times the first report.
+
+    The gateway must find the MAC of every client in its ARP table, so
+    the clients are usually given addresses of their own with -s, on an
+    interface the gateway serves (see README). The time each step took is
+    reported as percentiles, with the throughput of the whole run.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/** Largest answer that is read */
+#define SIM_ANSWER_MAX 65536
+
+/** Steps of a client */
+typedef enum {
+    STEP_REDIRECT,
+    STEP_LOGIN,
+    STEP_AUTH,
+    STEP_COUNTERS,
+    STEP_COUNT
+} t_step;
+
+static const char *step_names[STEP_COUNT] = {
+    "redirect", "login", "auth", "counters"
+};
+
+/** Results of one step over the whole run */
+typedef struct {
+    double *ms;			/**< @brief Time taken by each success */
+    int ok;
+    int failed;
+} t_step_stats;
+
+/** An answer to one request */
+typedef struct {
+    int status;
+    char location[1024];
+    char body[SIM_ANSWER_MAX + 1];
+} t_sim_answer;
+
+/** Command line settings */
+static struct {
+    char gateway[256];		/**< @brief host:port of the gateway */
+    char mock[256];		/**< @brief host:port of the mock server, or empty */
+    char host[256];		/**< @brief Host of the page first asked for */
+    int clients;
+    int concurrency;
+    struct in_addr source;	/**< @brief Address of the first client */
+    int use_source;
+    int counters_wait;		/**< @brief Seconds to wait for counters, 0 to skip */
+    int timeout;		/**< @brief Seconds for each request */
+    int oneline;		/**< @brief Also print a key=value summary line */
+} opt = { "127.0.0.1:2060", "", "www.example.com", 100, 10, { 0 }, 0, 0, 10, 0 };
+
+static t_step_stats steps[STEP_COUNT];
+static int next_client = 0;
+static int denied = 0;
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * @brief Milliseconds since a time
+ */
+static double
+_sim_since(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+/** @internal
+ * @brief Records how a step went
+ */
+static void
+_sim_record(t_step step, int ok, double ms)
+{
+    pthread_mutex_lock(&sim_mutex);
+    if (ok)
+        steps[step].ms[steps[step].ok++] = ms;
+    else
+        steps[step].failed++;
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+/** @internal
+ * @brief Splits http://host[:port]/path
+ * @return 0 on success
+ */
+static int
+_sim_parse_url(const char *url, char *host, size_t hsize, int *port, const char **path)
+{
+    const char *p, *end;
+    size_t len;
+
+    if (strncmp(url, "http://", 7) != 0)
+        return -1;
+    p = url + 7;
+    end = p + strcspn(p, "/");
+    *path = (*end != '\0') ? end : "/";
+    len = end - p;
+    if (len >= hsize)
+        return -1;
+    memcpy(host, p, len);
+    host[len] = '\0';
+    *port = 80;
+    if ((p = strchr(host, ':')) != NULL) {
+        *port = atoi(p + 1);
+        host[p - host] = '\0';
+    }
+    return 0;
+}
+
+/** @internal
+ * @brief Sends a GET and reads the whole answer. HTTP/1.0, so the server
+ * ends it by closing the connection.
+ * @param source Address to send from, or NULL
+ * @return 0 on success, -1 on failure
+ */
+static int
+_sim_get(const char *host, int port, const char *path, const char *host_header,
+        const struct in_addr *source, t_sim_answer *answer)
+{
+    struct addrinfo hints, *res;
+    struct sockaddr_in local;
+    struct timeval tv;
+    char request[2048], service[16], *p, *end;
+    size_t len = 0;
+    ssize_t n;
+    int fd, rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0)
+        return -1;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        freeaddrinfo(res);
+        return -1;
+    }
+    tv.tv_sec = opt.timeout;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (source != NULL) {
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr = *source;
+        if (bind(fd, (struct sockaddr *)&local, sizeof(local)) == -1) {
+            perror("bind");
+            close(fd);
+            freeaddrinfo(res);
+            return -1;
+        }
+    }
+    rc = connect(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rc == -1) {
+        close(fd);
+        return -1;
+    }
+
+    n = snprintf(request, sizeof(request),
+            "GET %s HTTP/1.0\r\n"
+            "Host: %s\r\n"
+            "User-Agent: wdfleetsim\r\n"
+            "\r\n",
+            path, host_header);
+    if (send(fd, request, n, MSG_NOSIGNAL) != n) {
+        close(fd);
+        return -1;
+    }
+    while (len < SIM_ANSWER_MAX && (n = read(fd, answer->body + len, SIM_ANSWER_MAX - len)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return -1;
+        }
+        len += n;
+    }
+    close(fd);
+    answer->body[len] = '\0';
+
+    answer->location[0] = '\0';
+    if (sscanf(answer->body, "HTTP/%*d.%*d %d", &answer->status) != 1)
+        return -1;
+    if ((p = strcasestr(answer->body, "\r\nLocation:")) != NULL) {
+        for (p += 11; *p == ' '; p++)
+            ;
+        end = p + strcspn(p, "\r\n");
+        len = end - p;
+        if (len >= sizeof(answer->location))
+            len = sizeof(answer->location) - 1;
+        memcpy(answer->location, p, len);
+        answer->location[len] = '\0';
+    }
+    return 0;
+}
+
+/** @internal
+ * @brief Sends a GET to a URL
+ */
+static int
+_sim_get_url(const char *url, const struct in_addr *source, t_sim_answer *answer)
+{
+    char host[256];
+    const char *path;
+    int port;
+
+    if (_sim_parse_url(url, host, sizeof(host), &port, &path) != 0)
+        return -1;
+    return _sim_get(host, port, path, host, source, answer);
+}
+
+/** @internal
+ * @brief Takes a copy of the value of a parameter in a URL
+ */
+static int
+_sim_param(const char *url, const char *name, char *buf, size_t size)
+{
+    const char *p = url;
+    size_t nlen = strlen(name), len;
+
+    while ((p = strstr(p, name)) != NULL) {
+        if ((p[-1] == '?' || p[-1] == '&') && p[nlen] == '=') {
+            p += nlen + 1;
+            len = strcspn(p, "&");
+            if (len >= size)
+                len = size - 1;
+            memcpy(buf, p, len);
+            buf[len] = '\0';
+            return 1;
+        }
+        p += nlen;
+    }
+    return 0;
+}
+
+/** @internal
+ * @brief Takes one client through the captive portal
+ */
+static void
+_sim_client(int index, t_sim_answer *answer)
+{
+    struct in_addr source, *from = NULL;
+    struct timeval start, authed;
+    char gw_host[256], token[256], path[1024];
+    char *colon;
+    int gw_port, waited;
+
+    strcpy(gw_host, opt.gateway);
+    gw_port = 2060;
+    if ((colon = strchr(gw_host, ':')) != NULL) {
+        *colon = '\0';
+        gw_port = atoi(colon + 1);
+    }
+    if (opt.use_source) {
+        source.s_addr = htonl(ntohl(opt.source.s_addr) + index);
+        from = &source;
+    }
+
+    /* Any page is answered with the way to the portal */
+    gettimeofday(&start, NULL);
+    if (_sim_get(gw_host, gw_port, "/", opt.host, from, answer) != 0 ||
+            answer->status / 100 != 3 || answer->location[0] == '\0') {
+        _sim_record(STEP_REDIRECT, 0, 0);
+        return;
+    }
+    _sim_record(STEP_REDIRECT, 1, _sim_since(&start));
+
+    /* The login page sends the client back to the gateway */
+    gettimeofday(&start, NULL);
+    if (_sim_get_url(answer->location, NULL, answer) != 0 || answer->status / 100 != 3 ||
+            strstr(answer->location, "/smartwifi/auth?") == NULL ||
+            !_sim_param(answer->location, "token", token, sizeof(token))) {
+        _sim_record(STEP_LOGIN, 0, 0);
+        return;
+    }
+    _sim_record(STEP_LOGIN, 1, _sim_since(&start));
+
+    /* Sent to the gateway as it is, whatever host the portal wrote */
+    gettimeofday(&start, NULL);
+    snprintf(path, sizeof(path), "/smartwifi/auth?token=%s", token);
+    if (_sim_get(gw_host, gw_port, path, opt.host, from, answer) != 0 ||
+            answer->status / 100 != 3) {
+        _sim_record(STEP_AUTH, 0, 0);
+        return;
+    }
+    if (strstr(answer->location, "message=") != NULL) {
+        pthread_mutex_lock(&sim_mutex);
+        denied++;
+        pthread_mutex_unlock(&sim_mutex);
+        _sim_record(STEP_AUTH, 0, 0);
+        return;
+    }
+    _sim_record(STEP_AUTH, 1, _sim_since(&start));
+
+    if (opt.counters_wait <= 0 || opt.mock[0] == '\0')
+        return;
+
+    /* Until the gateway has reported the client once */
+    gettimeofday(&authed, NULL);
+    snprintf(path, sizeof(path), "http://%s/mock/client?token=%s", opt.mock, token);
+    for (waited = 0; _sim_since(&authed) < opt.counters_wait * 1000.0; waited++) {
+        if (_sim_get_url(path, NULL, answer) == 0 && answer->status == 200 &&
+                strstr(answer->body, "\"reports\":0,") == NULL &&
+                strstr(answer->body, "\"reports\":") != NULL) {
+            _sim_record(STEP_COUNTERS, 1, _sim_since(&authed));
+            return;
+        }
+        usleep(waited < 10 ? 100000 : 500000);
+    }
+    _sim_record(STEP_COUNTERS, 0, 0);
+}
+
+/** @internal
+ * @brief Takes clients until there are none left
+ */
+static void *
+_sim_worker(void *arg)
+{
+    t_sim_answer *answer = malloc(sizeof(t_sim_answer));
+    int index;
+
+    for (;;) {
+        pthread_mutex_lock(&sim_mutex);
+        index = next_client < opt.clients ? next_client++ : -1;
+        pthread_mutex_unlock(&sim_mutex);
+        if (index == -1)
+            break;
+        _sim_client(index, answer);
+    }
+    free(answer);
+    return NULL;
+}
+
+/** @internal
+ * @brief Sorts milliseconds
+ */
+static int
+_sim_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/** @internal
+ * @brief A percentile of sorted values
+ */
+static double
+_sim_percentile(const double *ms, int count, int pct)
+{
+    int i;
+
+    if (count == 0)
+        return 0;
+    i = (count * pct + 99) / 100 - 1;
+    return ms[i < 0 ? 0 : i];
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "Usage: wdfleetsim [options]\n"
+            "  -g host:port  Gateway (127.0.0.1:2060)\n"
+            "  -n clients    Clients to simulate (100)\n"
+            "  -c threads    Clients in flight at a time (10)\n"
+            "  -s address    Address of the first client, the next ones follow\n"
+            "  -m host:port  wdmockserver, to follow the counters of each client\n"
+            "  -w seconds    Wait this long for the first counters report (0, skip)\n"
+            "  -H host       Host of the page first asked for (www.example.com)\n"
+            "  -t seconds    Timeout of each request (10)\n"
+            "  -o            Also print a single key=value summary line\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timeval start;
+    pthread_t *threads;
+    double secs, *ms;
+    int c, i, ok;
+
+    while ((c = getopt(argc, argv, "g:n:c:s:m:w:H:t:oh")) != -1) {
+        switch (c) {
+            case 'g': snprintf(opt.gateway, sizeof(opt.gateway), "%s", optarg); break;
+            case 'n': opt.clients = atoi(optarg); break;
+            case 'c': opt.concurrency = atoi(optarg); break;
+            case 's':
+                if (inet_aton(optarg, &opt.source) == 0)
+                    usage();
+                opt.use_source = 1;
+                break;
+            case 'm': snprintf(opt.mock, sizeof(opt.mock), "%s", optarg); break;
+            case 'w': opt.counters_wait = atoi(optarg); break;
+            case 'H': snprintf(opt.host, sizeof(opt.host), "%s", optarg); break;
+            case 't': opt.timeout = atoi(optarg); break;
+            case 'o': opt.oneline = 1; break;
+            default: usage();
+        }
+    }
+    if (opt.clients <= 0 || opt.concurrency <= 0)
+        usage();
+    if (opt.concurrency > opt.clients)
+        opt.concurrency = opt.clients;
+    signal(SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < STEP_COUNT; i++)
+        steps[i].ms = malloc(sizeof(double) * opt.clients);
+
+    gettimeofday(&start, NULL);
+    threads = malloc(sizeof(pthread_t) * opt.concurrency);
+    for (i = 0; i < opt.concurrency; i++)
+        pthread_create(&threads[i], NULL, _sim_worker, NULL);
+    for (i = 0; i < opt.concurrency; i++)
+        pthread_join(threads[i], NULL);
+    secs = _sim_since(&start) / 1000.0;
+
+    ok = steps[STEP_AUTH].ok;
+    printf("%d clients, %d logged in, %d denied, in %.2f s: %.1f logins/s\n",
+            opt.clients, ok, denied, secs, secs > 0 ? ok / secs : 0.0);
+    printf("%-10s %7s %7s %9s %9s %9s %9s\n", "step", "ok", "failed", "p50 ms", "p95 ms", "p99 ms", "max ms");
+    for (i = 0; i < STEP_COUNT; i++) {
+        if (i == STEP_COUNTERS && opt.counters_wait <= 0)
+            continue;
+        ms = steps[i].ms;
+        qsort(ms, steps[i].ok, sizeof(double), _sim_compare);
+        printf("%-10s %7d %7d %9.1f %9.1f %9.1f %9.1f\n", step_names[i], steps[i].ok, steps[i].failed,
+                _sim_percentile(ms, steps[i].ok, 50), _sim_percentile(ms, steps[i].ok, 95),
+                _sim_percentile(ms, steps[i].ok, 99), _sim_percentile(ms, steps[i].ok, 100));
+    }
+
+    if (opt.oneline) {
+        printf("clients=%d ok=%d denied=%d secs=%.2f rate=%.1f", opt.clients, ok, denied, secs,
+                secs > 0 ? ok / secs : 0.0);
+        for (i = 0; i < STEP_COUNT; i++) {
+            if (i == STEP_COUNTERS && opt.counters_wait <= 0)
+                continue;
+            printf(" %s_failed=%d %s_p50=%.1f %s_p99=%.1f", step_names[i], steps[i].failed,
+                    step_names[i], _sim_percentile(steps[i].ms, steps[i].ok, 50),
+                    step_names[i], _sim_percentile(steps[i].ms, steps[i].ok, 99));
+        }
+        printf("\n");
+    }
+
+    return ok == opt.clients ? 0 : 1;
+}
@@ -0,0 +1,636 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file httptest.c
+    @brief Tests the HTTP client of the gateway against a stub server
+
+    http_client.o from src is linked as it is. The connections to the
+    central servers, the pool, the health tracking and TLS are replaced by
+    stand-ins that open a plain connection to a stub server run in a
+    thread. Each test asks the stub for a canned answer, which it writes
+    in pieces of a given size, and checks what the client made of it:
+    lengths, chunks, bodies larger than MAX_BUF, streaming, keep-alive,
+    malformed answers and timeouts.
+
+    With -b, the response parser is also timed on canned answers fed in
+    pieces of several sizes.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "conf.h"
+#include "tls.h"
+#include "http_client.h"
+
+/** Size of the large bodies, well over MAX_BUF */
+#define TEST_BIG 300000
+
+/** A canned answer of the stub server */
+typedef struct {
+    const char *path;		/**< @brief Asked as GET <path> */
+    char *answer;		/**< @brief Sent as it is, NULL for none */
+    size_t len;			/**< @brief Length of answer */
+    size_t piece;		/**< @brief Written this many bytes at a time */
+    int close;			/**< @brief Close the connection after it */
+    int delay;			/**< @brief Seconds to wait before answering */
+} t_stub_answer;
+
+static t_stub_answer answers[16];
+static int answer_count = 0;
+
+static s_config test_config;
+static t_serv test_serv;
+static int stub_port;
+static int stub_connections = 0;
+static int pooled_fd = -1;
+static int verbose = 0;
+static int failures = 0;
+static pthread_mutex_t stub_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* What http_client.o needs from the rest of the gateway */
+
+void
+_debug(const char *filename, int line, int level, const char *format, ...)
+{
+    va_list vlist;
+
+    if (!verbose)
+        return;
+    va_start(vlist, format);
+    fprintf(stderr, "[%d](%s:%d) ", level, filename, line);
+    vfprintf(stderr, format, vlist);
+    fputc('\n', stderr);
+    va_end(vlist);
+}
+
+void *
+safe_malloc(size_t size)
+{
+    void *p = calloc(1, size);
+
+    if (p == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    return p;
+}
+
+void *
+safe_realloc(void *ptr, size_t size)
+{
+    void *p = realloc(ptr, size);
+
+    if (p == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    return p;
+}
+
+s_config *
+config_get_config(void)
+{
+    return &test_config;
+}
+
+t_serv *get_auth_server(void) { return &test_serv; }
+t_serv *get_log_server(void) { return &test_serv; }
+t_serv *get_update_server(void) { return &test_serv; }
+
+static int
+_stub_connect(void)
+{
+    struct sockaddr_in addr;
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(stub_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int connect_auth_server(void) { return _stub_connect(); }
+int connect_log_server(void) { return _stub_connect(); }
+int connect_update_server(void) { return _stub_connect(); }
+int connect_auth_server_ssl(void) { return -1; }
+int connect_log_server_ssl(void) { return -1; }
+int connect_update_server_ssl(void) { return -1; }
+
+/* A pool of one connection */
+int
+conn_pool_get(t_serv *serv)
+{
+    int fd = pooled_fd;
+
+    pooled_fd = -1;
+    return fd;
+}
+
+void
+conn_pool_put(t_serv *serv, int fd)
+{
+    if (pooled_fd != -1)
+        close(pooled_fd);
+    pooled_fd = fd;
+}
+
+void server_health_success(t_serv *serv, unsigned long latency_ms) { }
+void server_health_failure(t_serv *serv) { }
+
+SSL *tls_connect(int fd, const char *hostname) { return NULL; }
+int tls_write(SSL *ssl, const char *buf, size_t len) { return -1; }
+ssize_t tls_read(void *conn, char *buf, size_t len) { return -1; }
+void tls_close(SSL *ssl) { }
+
+/* The stub server */
+
+static void
+_stub_add(const char *path, const char *answer, size_t len, size_t piece, int close, int delay)
+{
+    /* len 0 with an answer means up to its NUL */
+    t_stub_answer *a = &answers[answer_count++];
+
+    a->path = path;
+    a->answer = NULL;
+    a->len = (answer != NULL && len == 0) ? strlen(answer) : len;
+    len = a->len;
+    if (answer != NULL) {
+        a->answer = safe_malloc(len);
+        memcpy(a->answer, answer, len);
+    }
+    a->piece = piece ? piece : len;
+    a->close = close;
+    a->delay = delay;
+}
+
+/** A body of TEST_BIG bytes, with the framing asked for */
+static void
+_stub_add_big(const char *path, int chunked, size_t piece)
+{
+    char *answer, *p;
+    size_t i, j, n;
+
+    answer = safe_malloc(TEST_BIG * 2);
+    if (chunked)
+        p = answer + sprintf(answer, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+    else
+        p = answer + sprintf(answer, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", TEST_BIG);
+    for (i = 0; i < TEST_BIG; i += n) {
+        n = chunked ? 4000 : TEST_BIG;
+        if (n > TEST_BIG - i)
+            n = TEST_BIG - i;
+        if (chunked)
+            p += sprintf(p, "%lx\r\n", (unsigned long)n);
+        for (j = 0; j < n; j++)
+            *p++ = 'a' + (i + j) % 26;
+        if (chunked)
+            p += sprintf(p, "\r\n");
+    }
+    if (chunked)
+        p += sprintf(p, "0\r\n\r\n");
+    _stub_add(path, answer, p - answer, piece, 0, 0);
+    free(answer);
+}
+
+static void *
+_stub_serve(void *arg)
+{
+    int fd = (int)(long)arg;
+    char req[4096], path[256];
+    size_t len = 0, off, n;
+    ssize_t got;
+    t_stub_answer *a;
+    char *end;
+    int i;
+
+    for (;;) {
+        while ((end = memmem(req, len, "\r\n\r\n", 4)) == NULL) {
+            if (len == sizeof(req) || (got = read(fd, req + len, sizeof(req) - len)) <= 0) {
+                close(fd);
+                return NULL;
+            }
+            len += got;
+        }
+        if (sscanf(req, "%*s %255s", path) != 1)
+            path[0] = '\0';
+        len -= end + 4 - req;
+        memmove(req, end + 4, len);
+
+        for (a = NULL, i = 0; i < answer_count; i++)
+            if (strcmp(answers[i].path, path) == 0)
+                a = &answers[i];
+        if (a == NULL || a->answer == NULL) {
+            if (a != NULL)
+                sleep(a->delay);
+            close(fd);
+            return NULL;
+        }
+        sleep(a->delay);
+        for (off = 0; off < a->len; off += n) {
+            n = (a->len - off < a->piece) ? a->len - off : a->piece;
+            if (write(fd, a->answer + off, n) != (ssize_t)n)
+                break;
+            if (n < a->len)
+                usleep(200);
+        }
+        if (a->close)
+            break;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *
+_stub_listen(void *arg)
+{
+    int sock = (int)(long)arg, fd;
+    pthread_t tid;
+
+    while ((fd = accept(sock, NULL, NULL)) != -1) {
+        pthread_mutex_lock(&stub_mutex);
+        stub_connections++;
+        pthread_mutex_unlock(&stub_mutex);
+        pthread_create(&tid, NULL, _stub_serve, (void *)(long)fd);
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+static int
+_stub_start(void)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    pthread_t tid;
+    int sock;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sock == -1 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(sock, 16) == -1 || getsockname(sock, (struct sockaddr *)&addr, &addrlen) == -1) {
+        perror("stub server");
+        return -1;
+    }
+    stub_port = ntohs(addr.sin_port);
+    pthread_create(&tid, NULL, _stub_listen, (void *)(long)sock);
+    pthread_detach(tid);
+    return 0;
+}
+
+/* The tests */
+
+static void
+_check(int ok, const char *name, const char *format, ...)
+{
+    va_list vlist;
+
+    if (ok) {
+        printf("ok      %s\n", name);
+        return;
+    }
+    failures++;
+    printf("FAILED  %s: ", name);
+    va_start(vlist, format);
+    vprintf(format, vlist);
+    va_end(vlist);
+    putchar('\n');
+}
+
+static int
+_get(const char *path, t_http_response *response)
+{
+    char request[512];
+
+    snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: stub\r\n\r\n", path);
+    return http_client_request(HTTP_SERVER_UPDATE, request, response);
+}
+
+static int
+_big_body_ok(const char *body, size_t len)
+{
+    size_t i;
+
+    if (len != TEST_BIG)
+        return 0;
+    for (i = 0; i < len; i++)
+        if (body[i] != 'a' + i % 26)
+            return 0;
+    return 1;
+}
+
+/** What the streaming tests saw */
+typedef struct {
+    size_t len;
+    int bad;
+    int abort_at;
+} t_stream_state;
+
+static int
+_stream_cb(const char *data, size_t len, void *arg)
+{
+    t_stream_state *st = arg;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        if (data[i] != 'a' + (st->len + i) % 26)
+            st->bad = 1;
+    st->len += len;
+    return (st->abort_at && st->len >= (size_t)st->abort_at) ? -1 : 0;
+}
+
+static void
+_test_client(void)
+{
+    t_http_response response;
+    t_stream_state st;
+    time_t start;
+    int rc, before;
+
+    rc = _get("/length", &response);
+    _check(rc == 0 && response.status == 200 && response.body_len == 5 &&
+            strcmp(response.body, "hello") == 0 && response.keep_alive,
+            "content-length", "rc %d status %d body [%s]", rc, response.status, rc ? "" : response.body);
+    if (rc == 0)
+        http_response_free(&response);
+
+    before = stub_connections;
+    rc = _get("/length", &response);
+    if (rc == 0)
+        http_response_free(&response);
+    _check(rc == 0 && stub_connections == before, "keep-alive",
+            "rc %d, %d new connections", rc, stub_connections - before);
+
+    rc = _get("/chunked", &response);
+    _check(rc == 0 && response.status == 200 && response.body_len == 11 &&
+            strcmp(response.body, "hello world") == 0,
+            "chunked, a byte at a time", "rc %d body [%s]", rc, rc ? "" : response.body);
+    if (rc == 0)
+        http_response_free(&response);
+
+    rc = _get("/big", &response);
+    _check(rc == 0 && _big_body_ok(response.body, response.body_len),
+            "content-length over MAX_BUF", "rc %d, %lu bytes", rc, rc ? 0UL : (unsigned long)response.body_len);
+    if (rc == 0)
+        http_response_free(&response);
+
+    rc = _get("/bigchunked", &response);
+    _check(rc == 0 && _big_body_ok(response.body, response.body_len),
+            "chunked over MAX_BUF", "rc %d, %lu bytes", rc, rc ? 0UL : (unsigned long)response.body_len);
+    if (rc == 0)
+        http_response_free(&response);
+
+    rc = _get("/eof", &response);
+    _check(rc == 0 && strcmp(response.body, "until the end") == 0 && !response.keep_alive,
+            "body ended by the connection", "rc %d body [%s]", rc, rc ? "" : response.body);
+    if (rc == 0)
+        http_response_free(&response);
+
+    rc = _get("/notfound", &response);
+    _check(rc == 0 && response.status == 404, "error status", "rc %d status %d", rc, response.status);
+    if (rc == 0)
+        http_response_free(&response);
+
+    rc = _get("/malformed", &response);
+    _check(rc == -1, "malformed status line", "rc %d", rc);
+    if (rc == 0)
+        http_response_free(&response);
+
+    rc = _get("/truncated", &response);
+    _check(rc == -1, "body cut short", "rc %d", rc);
+    if (rc == 0)
+        http_response_free(&response);
+
+    rc = _get("/empty", &response);
+    _check(rc == -1, "closed without an answer", "rc %d", rc);
+    if (rc == 0)
+        http_response_free(&response);
+
+    start = time(NULL);
+    rc = _get("/silent", &response);
+    _check(rc == -1 && time(NULL) - start <= test_config.io_timeout + 1, "timeout",
+            "rc %d after %ld s", rc, (long)(time(NULL) - start));
+    if (rc == 0)
+        http_response_free(&response);
+
+    memset(&st, 0, sizeof(st));
+    rc = http_client_request_stream(HTTP_SERVER_UPDATE, "GET /big HTTP/1.1\r\nHost: stub\r\n\r\n",
+            &response, _stream_cb, &st);
+    _check(rc == 0 && st.len == TEST_BIG && !st.bad && response.status == 200,
+            "streamed body", "rc %d, %lu bytes", rc, (unsigned long)st.len);
+    if (rc == 0)
+        http_response_free(&response);
+
+    memset(&st, 0, sizeof(st));
+    st.abort_at = 10000;
+    rc = http_client_request_stream(HTTP_SERVER_UPDATE, "GET /big HTTP/1.1\r\nHost: stub\r\n\r\n",
+            &response, _stream_cb, &st);
+    _check(rc == -1 && st.len < TEST_BIG, "streamed body refused", "rc %d, %lu bytes", rc, (unsigned long)st.len);
+    if (rc == 0)
+        http_response_free(&response);
+}
+
+static void
+_test_url_path(void)
+{
+    static const struct {
+        const char *url;
+        const char *path;
+    } cases[] = {
+        { "http://stub.example:%d/upload/fw.bin", "/upload/fw.bin" },
+        { "HTTP://STUB.example:%d/fw.bin?v=1", "/fw.bin?v=1" },
+        { "https://stub.example/fw.bin", "/fw.bin" },
+        { "http://stub.example/fw.bin", NULL },
+        { "http://other.example:%d/fw.bin", NULL },
+        { "http://stub.example.other:%d/fw.bin", NULL },
+        { "http://stub.example:%d@other.example/fw.bin", NULL },
+        { "http://stub.example:%dx/fw.bin", NULL },
+        { "http://stub.example:%d", NULL },
+        { "ftp://stub.example:%d/fw.bin", NULL },
+    };
+    const char *path;
+    char url[256];
+    unsigned int i;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        snprintf(url, sizeof(url), cases[i].url, stub_port);
+        path = http_client_url_path(HTTP_SERVER_UPDATE, url);
+        _check(cases[i].path ? (path != NULL && strcmp(path, cases[i].path) == 0) : path == NULL,
+                url, "got %s", path ? path : "NULL");
+    }
+}
+
+/* The parser benchmark */
+
+static double
+_bench_cpu_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void
+_bench_parser(int rounds)
+{
+    static const size_t pieces[] = { 1, 16, 1460, 0 };
+    const char *names[3];
+    t_stub_answer *bench[3];
+    t_http_parser parser;
+    t_http_response response;
+    double start, ms;
+    size_t off, n, piece;
+    int i, j, k, count, rc;
+
+    names[0] = "auth reply";
+    bench[0] = &answers[0];
+    names[1] = "300 KB length";
+    bench[1] = &answers[3];
+    names[2] = "300 KB chunked";
+    bench[2] = &answers[4];
+
+    printf("\n%-16s %8s %10s %12s %10s\n", "answer", "piece", "bytes", "answers/s", "MB/s");
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 4; j++) {
+            piece = pieces[j] ? pieces[j] : bench[i]->len;
+            /* Fewer rounds for the large bodies */
+            count = (bench[i]->len > 1000) ? rounds / 100 + 1 : rounds;
+            start = _bench_cpu_ms();
+            for (k = 0, rc = 0; k < count && rc != -1; k++) {
+                http_parser_init(&parser);
+                for (off = 0, rc = HTTP_PARSE_MORE; off < bench[i]->len && rc == HTTP_PARSE_MORE; off += n) {
+                    n = (bench[i]->len - off < piece) ? bench[i]->len - off : piece;
+                    rc = http_parser_feed(&parser, bench[i]->answer + off, n);
+                }
+                if (rc != HTTP_PARSE_DONE)
+                    rc = -1;
+                http_parser_finish(&parser, &response);
+                http_response_free(&response);
+            }
+            if (rc == -1) {
+                printf("%-16s %8lu failed to parse\n", names[i], (unsigned long)piece);
+                failures++;
+                continue;
+            }
+            ms = _bench_cpu_ms() - start;
+            if (ms < 0.001)
+                ms = 0.001;
+            printf("%-16s %8lu %10lu %12.0f %10.1f\n", names[i], (unsigned long)piece,
+                    (unsigned long)bench[i]->len, count * 1000.0 / ms,
+                    count * (double)bench[i]->len / 1048.576 / ms);
+        }
+    }
+}
+
+static void
+_usage(void)
+{
+    fprintf(stderr, "Usage: wdhttptest [-b] [-r rounds] [-v]\n"
+            "  -b            Also time the response parser\n"
+            "  -r rounds     Answers parsed for each case of -b (default 100000)\n"
+            "  -v            Show the debug output of the client\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    static const char auth[] =
+        "HTTP/1.1 200 OK\r\n"
+        "Server: nginx\r\n"
+        "Date: Thu, 01 Jan 2015 00:00:00 GMT\r\n"
+        "Content-Type: text/plain; charset=utf-8\r\n"
+        "Content-Length: 7\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n"
+        "Auth: 1";
+    static const char chunked[] =
+        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "5;name=value\r\nhello\r\n6\r\n world\r\n0\r\nX-Trailer: yes\r\n\r\n";
+    static const char eof[] = "HTTP/1.0 200 OK\r\n\r\nuntil the end";
+    static const char notfound[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    static const char malformed[] = "SPDY/9 OK\r\n\r\n";
+    static const char truncated[] = "HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\nshort";
+    int bench = 0, rounds = 100000, c;
+
+    while ((c = getopt(argc, argv, "br:vh")) != -1) {
+        switch (c) {
+            case 'b': bench = 1; break;
+            case 'r': rounds = atoi(optarg); break;
+            case 'v': verbose = 1; break;
+            default: _usage(); return (c == 'h') ? 0 : 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if (_stub_start() == -1)
+        return 1;
+
+    test_config.io_timeout = 1;
+    test_config.pool_max_idle = 1;
+    test_serv.serv_hostname = "stub.example";
+    test_serv.serv_http_port = stub_port;
+    test_serv.serv_ssl_port = 443;
+
+    /* The order of the first ones is used by _bench_parser() */
+    _stub_add("/auth", auth, 0, 0, 0, 0);
+    _stub_add("/length", "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello", 0, 7, 0, 0);
+    _stub_add("/chunked", chunked, 0, 1, 0, 0);
+    _stub_add_big("/big", 0, 1000);
+    _stub_add_big("/bigchunked", 1, 1460);
+    _stub_add("/eof", eof, 0, 5, 1, 0);
+    _stub_add("/notfound", notfound, 0, 0, 0, 0);
+    _stub_add("/malformed", malformed, 0, 0, 1, 0);
+    _stub_add("/truncated", truncated, 0, 0, 1, 0);
+    _stub_add("/empty", NULL, 0, 0, 1, 0);
+    _stub_add("/silent", NULL, 0, 0, 1, 3);
+
+    _test_client();
+    _test_url_path();
+    if (bench)
+        _bench_parser(rounds);
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,901 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file mockserver.c
+    @brief Stand-in for the auth, log and update servers, for load tests
+
+    wdmockserver answers everything the gateway asks the central servers
+    (see doc/central_server_protocol.txt) on one port, so the auth, log and
+    update servers of the gateway can all point at it. It also plays the
+    portal: the login page redirects straight back to the gateway with a
+    new token, which is what wdfleetsim follows.
+
+    Every answer to the gateway can be slowed down (-l, -j), turned into a
+    500 (-e) or dropped without an answer (-d), and the auth verdict and
+    quota are set with -a, -q and -Q. -T queues a task for the next ping,
+    taskrequest or control channel poll, and SIGUSR1 queues another one.
+
+    Requests per endpoint are reported every -r seconds and on exit. What
+    the gateway reported for a token can be read back with
+    GET /mock/client?token=.., and the totals with GET /mock/stats.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "cJSON.h"
+
+/** Largest request head that is read */
+#define MOCK_HEAD_MAX 16384
+/** Largest request body that is read */
+#define MOCK_BODY_MAX (4 * 1024 * 1024)
+/** Buckets of the token table */
+#define MOCK_BUCKETS 4096
+/** Longest a control channel poll is held */
+#define MOCK_POLL_MAX 300
+/** Page of the portal */
+#define MOCK_PORTAL_PAGE "<html><body>Mock portal</body></html>\n"
+
+/** What a request was for */
+typedef enum {
+    EP_PING,
+    EP_LOGIN,
+    EP_COUNTERS,
+    EP_LOGOUT,
+    EP_BATCH,
+    EP_TASKREQUEST,
+    EP_TASKRESULT,
+    EP_TASKPOLL,
+    EP_UPDATE,
+    EP_FIRMWARE,
+    EP_PORTAL,
+    EP_OTHER,
+    EP_COUNT
+} t_endpoint;
+
+static const char *endpoint_names[EP_COUNT] = {
+    "ping", "login", "counters", "logout", "batch", "taskrequest",
+    "taskresult", "taskpoll", "update", "firmware", "portal", "other"
+};
+
+/** Requests seen by an endpoint */
+typedef struct {
+    unsigned long requests;
+    unsigned long errors;	/**< @brief Answered with a 500 */
+    unsigned long dropped;	/**< @brief Closed without an answer */
+} t_endpoint_stats;
+
+/** What the gateway said about a client */
+typedef struct _t_mock_client {
+    struct _t_mock_client *next;
+    char *token;
+    char *mac;
+    time_t login;		/**< @brief When the gateway logged it in */
+    unsigned long reports;	/**< @brief Counters received, from either server */
+    unsigned long long incoming;
+    unsigned long long outgoing;
+    int logout;			/**< @brief The gateway logged it out */
+} t_mock_client;
+
+/** A request read from the gateway */
+typedef struct {
+    char head[MOCK_HEAD_MAX + 1];
+    char *method;
+    char *path;			/**< @brief Without scheme, host and query */
+    char *query;		/**< @brief After the '?', or empty */
+    char *headers;		/**< @brief From the protocol version on */
+    char *body;
+    size_t body_len;
+    int keep_alive;
+} t_mock_request;
+
+/** Command line settings */
+static struct {
+    int port;
+    int latency_ms;		/**< @brief Added to every answer */
+    int jitter_ms;		/**< @brief Up to this much more, at random */
+    int error_pct;		/**< @brief Answers turned into a 500 */
+    int drop_pct;		/**< @brief Connections closed without answer */
+    int verdict;		/**< @brief Auth: code of every answer */
+    long long quota_bytes;	/**< @brief Quota-Bytes of logins, 0 for none */
+    long quota_time;		/**< @brief Quota-Time of logins, 0 for none */
+    int task_code;		/**< @brief Code of the tasks queued, 0 for none */
+    int no_batch;		/**< @brief Refuse batch counters */
+    long firmware_size;		/**< @brief Offer firmware of this size, 0 for none */
+    int report_interval;
+} opt = { 8080, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 10 };
+
+static t_endpoint_stats stats[EP_COUNT];
+static t_mock_client *clients[MOCK_BUCKETS];
+static unsigned long nclients = 0;
+static int tasks_pending = 0;
+static unsigned long tasks_sent = 0;
+static unsigned long tasks_done = 0;
+static unsigned long next_token = 0;
+static pthread_mutex_t mock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * @brief Hashes a token
+ */
+static unsigned int
+_mock_hash(const char *token)
+{
+    unsigned int h = 5381;
+
+    while (*token)
+        h = (h << 5) + h + (unsigned char)*token++;
+    return h % MOCK_BUCKETS;
+}
+
+/** @internal
+ * @brief Finds a client by token, adding it if asked to. Must be called
+ * with mock_mutex held.
+ */
+static t_mock_client *
+_mock_client(const char *token, const char *mac, int add)
+{
+    t_mock_client *client;
+    unsigned int h = _mock_hash(token);
+
+    for (client = clients[h]; client != NULL; client = client->next)
+        if (strcmp(client->token, token) == 0)
+            return client;
+    if (!add)
+        return NULL;
+
+    client = calloc(1, sizeof(t_mock_client));
+    client->token = strdup(token);
+    client->mac = strdup(mac ? mac : "");
+    client->next = clients[h];
+    clients[h] = client;
+    nclients++;
+    return client;
+}
+
+/** @internal
+ * @brief Records counters the gateway reported for a client
+ */
+static void
+_mock_counters(const char *token, const char *mac, unsigned long long incoming,
+        unsigned long long outgoing)
+{
+    t_mock_client *client;
+
+    pthread_mutex_lock(&mock_mutex);
+    client = _mock_client(token, mac, 1);
+    client->reports++;
+    client->incoming = incoming;
+    client->outgoing = outgoing;
+    pthread_mutex_unlock(&mock_mutex);
+}
+
+/** @internal
+ * @brief Takes a queued task, if there is one
+ * @return Its id, or 0
+ */
+static unsigned long
+_mock_take_task(void)
+{
+    unsigned long id = 0;
+
+    pthread_mutex_lock(&mock_mutex);
+    if (tasks_pending > 0) {
+        tasks_pending--;
+        id = ++tasks_sent;
+    }
+    pthread_mutex_unlock(&mock_mutex);
+    return id;
+}
+
+/** @internal
+ * @brief Copies a query parameter, URL-decoded
+ * @return 1 if the parameter is there
+ */
+static int
+_mock_param(const char *query, const char *name, char *buf, size_t size)
+{
+    size_t nlen = strlen(name), len = 0;
+    const char *p = query;
+    unsigned int c;
+
+    while (p != NULL && *p) {
+        if (strncmp(p, name, nlen) == 0 && p[nlen] == '=') {
+            for (p += nlen + 1; *p && *p != '&' && len + 1 < size; p++) {
+                if (*p == '%' && p[1] && p[2] && sscanf(p + 1, "%2x", &c) == 1) {
+                    buf[len++] = c;
+                    p += 2;
+                } else {
+                    buf[len++] = (*p == '+') ? ' ' : *p;
+                }
+            }
+            buf[len] = '\0';
+            return 1;
+        }
+        if ((p = strchr(p, '&')) != NULL)
+            p++;
+    }
+    if (size > 0)
+        buf[0] = '\0';
+    return 0;
+}
+
+/** @internal
+ * @brief Reads until a whole request is in, or the connection ends
+ * @return 0 on success, -1 if the connection is done
+ */
+static int
+_mock_read_request(int fd, t_mock_request *req, char *buf, size_t *have)
+{
+    char *end, *p, *cl;
+    size_t head_len, need;
+    ssize_t n;
+
+    while ((end = memmem(buf, *have, "\r\n\r\n", 4)) == NULL) {
+        if (*have >= MOCK_HEAD_MAX)
+            return -1;
+        if ((n = read(fd, buf + *have, MOCK_HEAD_MAX - *have)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        *have += n;
+    }
+    head_len = end + 4 - buf;
+    memcpy(req->head, buf, head_len);
+    req->head[head_len] = '\0';
+
+    req->body_len = 0;
+    if ((cl = strcasestr(req->head, "\r\nContent-Length:")) != NULL)
+        req->body_len = strtoul(cl + 17, NULL, 10);
+    if (req->body_len > MOCK_BODY_MAX)
+        return -1;
+
+    /* The body follows what is left of the buffer */
+    req->body = malloc(req->body_len + 1);
+    need = req->body_len;
+    n = *have - head_len;
+    if ((size_t)n > need)
+        n = need;
+    memcpy(req->body, buf + head_len, n);
+    memmove(buf, buf + head_len + n, *have - head_len - n);
+    *have -= head_len + n;
+    for (p = req->body + n, need -= n; need > 0; p += n, need -= n) {
+        if ((n = read(fd, p, need)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            free(req->body);
+            return -1;
+        }
+    }
+    req->body[req->body_len] = '\0';
+
+    /* Request line: METHOD target HTTP/1.x */
+    req->method = req->head;
+    if ((p = strchr(req->head, ' ')) == NULL) {
+        free(req->body);
+        return -1;
+    }
+    *p++ = '\0';
+    req->path = p;
+    if ((p = strchr(p, ' ')) == NULL) {
+        free(req->body);
+        return -1;
+    }
+    *p++ = '\0';
+    req->headers = p;
+    req->keep_alive = strncmp(p, "HTTP/1.1", 8) == 0;
+    if (strcasestr(p, "\r\nConnection: close") != NULL)
+        req->keep_alive = 0;
+
+    /* The log server is sent absolute URLs */
+    if (strncmp(req->path, "http://", 7) == 0) {
+        if ((req->path = strchr(req->path + 7, '/')) == NULL)
+            req->path = "/";
+    }
+    if ((p = strchr(req->path, '?')) != NULL) {
+        *p++ = '\0';
+        req->query = p;
+    } else {
+        req->query = "";
+    }
+    return 0;
+}
+
+/** @internal
+ * @brief Writes a whole buffer
+ */
+static int
+_mock_write(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = send(fd, buf, len, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/** @internal
+ * @brief Reason phrase of a status
+ */
+static const char *
+_mock_reason(int status)
+{
+    switch (status) {
+        case 200: return "OK";
+        case 302: return "Found";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        default: return "Internal Server Error";
+    }
+}
+
+/** @internal
+ * @brief Sends an answer
+ * @param extra More header lines, each ending in CRLF, or NULL
+ */
+static int
+_mock_answer(int fd, const t_mock_request *req, int status, const char *type,
+        const char *extra, const char *body, size_t len)
+{
+    char head[1024];
+    int hlen;
+
+    hlen = snprintf(head, sizeof(head),
+            "HTTP/1.1 %d %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %lu\r\n"
+            "Connection: %s\r\n"
+            "%s"
+            "\r\n",
+            status, _mock_reason(status),
+            type, (unsigned long)len, req->keep_alive ? "keep-alive" : "close",
+            extra ? extra : "");
+    if (_mock_write(fd, head, hlen) == -1)
+        return -1;
+    return _mock_write(fd, body, len);
+}
+
+/** @internal
+ * @brief Sends a text answer
+ */
+static int
+_mock_text(int fd, const t_mock_request *req, int status, const char *body)
+{
+    return _mock_answer(fd, req, status, "text/plain", NULL, body, strlen(body));
+}
+
+/** @internal
+ * @brief Formats the answer to a task request
+ */
+static void
+_mock_task(char *buf, size_t size, unsigned long id)
+{
+    snprintf(buf, size, "{\"result\":\"OK\",\"task\":{\"task_id\":\"mock-%lu\",\"task_code\":%d%s}}",
+            id, opt.task_code, opt.task_code == 2003 ?
+            ",\"task_params\":{\"ssid\":\"mock\",\"hostname\":\"mock\"}" : "");
+}
+
+/** @internal
+ * @brief Formats the Auth: answer to a login or counters request
+ */
+static void
+_mock_verdict(char *buf, size_t size, int login)
+{
+    int len;
+
+    len = snprintf(buf, size, "Auth: %d\n", opt.verdict);
+    if (login && opt.quota_bytes > 0)
+        len += snprintf(buf + len, size - len, "Quota-Bytes: %lld\n", opt.quota_bytes);
+    if (login && opt.quota_time > 0)
+        snprintf(buf + len, size - len, "Quota-Time: %ld\n", opt.quota_time);
+}
+
+/** @internal
+ * @brief Answers batch counters, from either server
+ */
+static int
+_mock_batch(int fd, const t_mock_request *req)
+{
+    cJSON *root, *list, *item, *answer, *answers, *mac, *token, *in, *out;
+    char *body;
+    int i, rc;
+
+    if (opt.no_batch)
+        return _mock_text(fd, req, 404, "Unknown stage\n");
+
+    /* Compact reports are counted, not decoded */
+    if (strcasestr(req->headers, "\r\nContent-Type: application/json") == NULL)
+        return _mock_text(fd, req, 200, "{\"result\":\"OK\"}");
+
+    if ((root = cJSON_Parse(req->body)) == NULL ||
+            (list = cJSON_GetObjectItem(root, "clients")) == NULL) {
+        if (root)
+            cJSON_Delete(root);
+        return _mock_text(fd, req, 400, "Bad batch\n");
+    }
+
+    answer = cJSON_CreateObject();
+    answers = cJSON_CreateArray();
+    cJSON_AddItemToObject(answer, "clients", answers);
+    for (i = 0; i < cJSON_GetArraySize(list); i++) {
+        item = cJSON_GetArrayItem(list, i);
+        mac = cJSON_GetObjectItem(item, "mac");
+        token = cJSON_GetObjectItem(item, "token");
+        in = cJSON_GetObjectItem(item, "incoming");
+        out = cJSON_GetObjectItem(item, "outgoing");
+        if (!mac || !token || mac->type != cJSON_String || token->type != cJSON_String)
+            continue;
+        _mock_counters(token->valuestring, mac->valuestring,
+                in ? (unsigned long long)in->valuedouble : 0,
+                out ? (unsigned long long)out->valuedouble : 0);
+        item = cJSON_CreateObject();
+        cJSON_AddItemToObject(item, "mac", cJSON_CreateString(mac->valuestring));
+        cJSON_AddItemToObject(item, "token", cJSON_CreateString(token->valuestring));
+        cJSON_AddItemToObject(item, "auth", cJSON_CreateNumber(opt.verdict));
+        cJSON_AddItemToArray(answers, item);
+    }
+    cJSON_Delete(root);
+
+    body = cJSON_PrintUnformatted(answer);
+    cJSON_Delete(answer);
+    rc = _mock_answer(fd, req, 200, "application/json", NULL, body, strlen(body));
+    free(body);
+    return rc;
+}
+
+/** @internal
+ * @brief Answers GET /mock/client?token=..
+ */
+static int
+_mock_show_client(int fd, const t_mock_request *req)
+{
+    t_mock_client *client;
+    char token[256], body[512];
+
+    _mock_param(req->query, "token", token, sizeof(token));
+    pthread_mutex_lock(&mock_mutex);
+    if ((client = _mock_client(token, NULL, 0)) != NULL)
+        snprintf(body, sizeof(body),
+                "{\"token\":\"%s\",\"mac\":\"%s\",\"login\":%ld,\"reports\":%lu,"
+                "\"incoming\":%llu,\"outgoing\":%llu,\"logout\":%d}\n",
+                client->token, client->mac, (long)client->login, client->reports,
+                client->incoming, client->outgoing, client->logout);
+    pthread_mutex_unlock(&mock_mutex);
+
+    if (client == NULL)
+        return _mock_answer(fd, req, 404, "application/json", NULL, "{}\n", 3);
+    return _mock_answer(fd, req, 200, "application/json", NULL, body, strlen(body));
+}
+
+/** @internal
+ * @brief Formats the totals, as JSON or as a report line
+ */
+static void
+_mock_format_stats(char *buf, size_t size, int json)
+{
+    size_t len;
+    int i;
+
+    len = snprintf(buf, size, json ? "{\"clients\":%lu,\"tasks_sent\":%lu,\"tasks_done\":%lu" :
+            "clients=%lu tasks_sent=%lu tasks_done=%lu",
+            nclients, tasks_sent, tasks_done);
+    for (i = 0; i < EP_COUNT && len < size; i++) {
+        if (json)
+            len += snprintf(buf + len, size - len,
+                    ",\"%s\":{\"requests\":%lu,\"errors\":%lu,\"dropped\":%lu}",
+                    endpoint_names[i], stats[i].requests, stats[i].errors, stats[i].dropped);
+        else if (stats[i].requests > 0)
+            len += snprintf(buf + len, size - len, " %s=%lu/%lu/%lu",
+                    endpoint_names[i], stats[i].requests, stats[i].errors, stats[i].dropped);
+    }
+    if (json && len < size)
+        snprintf(buf + len, size - len, "}\n");
+}
+
+/** @internal
+ * @brief Tells what a request is for
+ */
+static t_endpoint
+_mock_classify(const t_mock_request *req, char *stage, size_t size)
+{
+    size_t len = strlen(req->path);
+
+    if (_mock_param(req->query, "stage", stage, size)) {
+        if (strcmp(stage, "login") == 0)
+            return EP_LOGIN;
+        if (strcmp(stage, "counters") == 0)
+            return EP_COUNTERS;
+        if (strcmp(stage, "logout") == 0)
+            return EP_LOGOUT;
+        if (strcmp(stage, "counters_batch") == 0)
+            return EP_BATCH;
+        return EP_OTHER;
+    }
+    if (strstr(req->query, "sys_uptime=") != NULL)
+        return EP_PING;
+    if (strstr(req->path, "taskrequest") != NULL)
+        return EP_TASKREQUEST;
+    if (strstr(req->path, "taskresult") != NULL)
+        return EP_TASKRESULT;
+    if (strstr(req->path, "taskpoll") != NULL || strstr(req->query, "wait=") != NULL)
+        return EP_TASKPOLL;
+    if (strstr(req->query, "rdMD5=") != NULL)
+        return EP_UPDATE;
+    if (len > 4 && strcmp(req->path + len - 4, ".bin") == 0)
+        return EP_FIRMWARE;
+    if (strstr(req->path, "login") != NULL || strstr(req->path, "portal") != NULL ||
+            strstr(req->path, "gw_message") != NULL)
+        return EP_PORTAL;
+    return EP_OTHER;
+}
+
+/** @internal
+ * @brief Answers one request
+ * @return 0 to keep the connection, -1 to close it
+ */
+static int
+_mock_handle(int fd, t_mock_request *req)
+{
+    char stage[32], token[256], mac[32], buf[1024], extra[512], *data;
+    unsigned long long incoming, outgoing;
+    unsigned long id;
+    t_mock_client *client;
+    t_endpoint ep;
+    int delay, wait, rc;
+
+    if (strcmp(req->path, "/mock/stats") == 0) {
+        pthread_mutex_lock(&mock_mutex);
+        _mock_format_stats(buf, sizeof(buf), 1);
+        pthread_mutex_unlock(&mock_mutex);
+        return _mock_answer(fd, req, 200, "application/json", NULL, buf, strlen(buf));
+    }
+    if (strcmp(req->path, "/mock/client") == 0)
+        return _mock_show_client(fd, req);
+
+    ep = _mock_classify(req, stage, sizeof(stage));
+
+    pthread_mutex_lock(&mock_mutex);
+    stats[ep].requests++;
+    pthread_mutex_unlock(&mock_mutex);
+
+    /* The portal is not one of the servers being simulated */
+    if (ep != EP_PORTAL) {
+        delay = opt.latency_ms + (opt.jitter_ms > 0 ? rand() % (opt.jitter_ms + 1) : 0);
+        if (delay > 0)
+            usleep(delay * 1000);
+        if (opt.drop_pct > 0 && rand() % 100 < opt.drop_pct) {
+            pthread_mutex_lock(&mock_mutex);
+            stats[ep].dropped++;
+            pthread_mutex_unlock(&mock_mutex);
+            return -1;
+        }
+        if (opt.error_pct > 0 && rand() % 100 < opt.error_pct) {
+            pthread_mutex_lock(&mock_mutex);
+            stats[ep].errors++;
+            pthread_mutex_unlock(&mock_mutex);
+            return _mock_text(fd, req, 500, "Mock error\n");
+        }
+    }
+
+    _mock_param(req->query, "token", token, sizeof(token));
+    _mock_param(req->query, "mac", mac, sizeof(mac));
+    _mock_param(req->query, "incoming", buf, sizeof(buf));
+    incoming = strtoull(buf, NULL, 10);
+    _mock_param(req->query, "outgoing", buf, sizeof(buf));
+    outgoing = strtoull(buf, NULL, 10);
+
+    switch (ep) {
+        case EP_LOGIN:
+            pthread_mutex_lock(&mock_mutex);
+            client = _mock_client(token, mac, 1);
+            client->login = time(NULL);
+            client->logout = 0;
+            pthread_mutex_unlock(&mock_mutex);
+            _mock_verdict(buf, sizeof(buf), 1);
+            return _mock_text(fd, req, 200, buf);
+
+        case EP_COUNTERS:
+            _mock_counters(token, mac, incoming, outgoing);
+            /* The log server only needs a 2xx */
+            _mock_verdict(buf, sizeof(buf), 0);
+            return _mock_text(fd, req, 200, buf);
+
+        case EP_LOGOUT:
+            pthread_mutex_lock(&mock_mutex);
+            _mock_client(token, mac, 1)->logout = 1;
+            pthread_mutex_unlock(&mock_mutex);
+            return _mock_text(fd, req, 200, "Auth: 0\n");
+
+        case EP_BATCH:
+            return _mock_batch(fd, req);
+
+        case EP_PING:
+            /* Only the auth server heartbeat takes a task along */
+            if (strstr(req->query, "task_inline=1") != NULL && (id = _mock_take_task()) != 0) {
+                strcpy(buf, "Task ");
+                _mock_task(buf + 5, sizeof(buf) - 5, id);
+                return _mock_text(fd, req, 200, buf);
+            }
+            return _mock_text(fd, req, 200, "Pong");
+
+        case EP_TASKREQUEST:
+            if ((id = _mock_take_task()) == 0)
+                return _mock_text(fd, req, 200, "{\"result\":\"NONE\"}");
+            _mock_task(buf, sizeof(buf), id);
+            return _mock_text(fd, req, 200, buf);
+
+        case EP_TASKRESULT:
+            pthread_mutex_lock(&mock_mutex);
+            tasks_done++;
+            pthread_mutex_unlock(&mock_mutex);
+            return _mock_text(fd, req, 200, "OK");
+
+        case EP_TASKPOLL:
+            _mock_param(req->query, "task_results", buf, sizeof(buf));
+            if (buf[0] != '\0') {
+                pthread_mutex_lock(&mock_mutex);
+                tasks_done++;
+                pthread_mutex_unlock(&mock_mutex);
+            }
+            _mock_param(req->query, "wait", buf, sizeof(buf));
+            wait = atoi(buf);
+            if (wait > MOCK_POLL_MAX)
+                wait = MOCK_POLL_MAX;
+            /* Held until a task is queued or the wait is over */
+            for (;;) {
+                if ((id = _mock_take_task()) != 0) {
+                    _mock_task(buf, sizeof(buf), id);
+                    return _mock_text(fd, req, 200, buf);
+                }
+                if (wait-- <= 0)
+                    return _mock_text(fd, req, 200, "");
+                sleep(1);
+            }
+
+        case EP_UPDATE:
+            if (opt.firmware_size <= 0)
+                return _mock_text(fd, req, 200, "");
+            return _mock_text(fd, req, 200, "http://apupgrade.51awifi.com/upload/mock-1.0.0.bin");
+
+        case EP_FIRMWARE:
+            if (opt.firmware_size <= 0)
+                return _mock_text(fd, req, 404, "No firmware\n");
+            data = calloc(1, opt.firmware_size);
+            rc = _mock_answer(fd, req, 200, "application/octet-stream", NULL, data, opt.firmware_size);
+            free(data);
+            return rc;
+
+        case EP_PORTAL:
+            /* The login page logs the client in at once */
+            if (strstr(req->path, "login") != NULL) {
+                char address[64], port[16], url[256];
+
+                _mock_param(req->query, "gw_address", address, sizeof(address));
+                _mock_param(req->query, "gw_port", port, sizeof(port));
+                _mock_param(req->query, "url", url, sizeof(url));
+                if (address[0] != '\0' && port[0] != '\0') {
+                    pthread_mutex_lock(&mock_mutex);
+                    id = ++next_token;
+                    pthread_mutex_unlock(&mock_mutex);
+                    snprintf(extra, sizeof(extra),
+                            "Location: http://%s:%s/smartwifi/auth?token=mock%08lx%08lx\r\n",
+                            address, port, id, (unsigned long)rand());
+                    return _mock_answer(fd, req, 302, "text/plain", extra, "", 0);
+                }
+            }
+            return _mock_answer(fd, req, 200, "text/html", NULL, MOCK_PORTAL_PAGE,
+                    strlen(MOCK_PORTAL_PAGE));
+
+        default:
+            return _mock_text(fd, req, 404, "Not found\n");
+    }
+}
+
+/** @internal
+ * @brief Serves one connection from the gateway until it closes
+ */
+static void *
+_mock_connection(void *arg)
+{
+    int fd = (int)(long)arg;
+    t_mock_request *req = malloc(sizeof(t_mock_request));
+    char *buf = malloc(MOCK_HEAD_MAX);
+    size_t have = 0;
+    int done;
+
+    while (_mock_read_request(fd, req, buf, &have) == 0) {
+        done = _mock_handle(fd, req) == -1 || !req->keep_alive;
+        free(req->body);
+        if (done)
+            break;
+    }
+
+    close(fd);
+    free(buf);
+    free(req);
+    return NULL;
+}
+
+/** @internal
+ * @brief Accepts connections, each served by a thread of its own
+ */
+static void *
+_mock_accept(void *arg)
+{
+    int server = (int)(long)arg;
+    pthread_attr_t attr;
+    pthread_t tid;
+    int fd, one = 1;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+    for (;;) {
+        if ((fd = accept(server, NULL, NULL)) == -1) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("accept");
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (pthread_create(&tid, &attr, _mock_connection, (void *)(long)fd) != 0)
+            close(fd);
+    }
+    return NULL;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "Usage: wdmockserver [options]\n"
+            "  -p port       Port to listen on (8080)\n"
+            "  -l ms         Latency added to every answer (0)\n"
+            "  -j ms         Up to this much more latency, at random (0)\n"
+            "  -e percent    Answers turned into a 500 (0)\n"
+            "  -d percent    Connections closed without an answer (0)\n"
+            "  -a code       Auth: verdict of every answer (1)\n"
+            "  -q bytes      Quota-Bytes of login answers\n"
+            "  -Q seconds    Quota-Time of login answers\n"
+            "  -T code       Queue a task with this code; SIGUSR1 queues another\n"
+            "  -B            Refuse batch counters\n"
+            "  -u bytes      Offer a firmware update of this size\n"
+            "  -r seconds    Report interval (10)\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct sockaddr_in addr;
+    struct timespec timeout;
+    struct timeval start, now, then;
+    unsigned long last[EP_COUNT], total, delta;
+    char line[1024];
+    double elapsed;
+    pthread_t tid;
+    sigset_t set;
+    int server, one = 1, c, i, sig;
+
+    while ((c = getopt(argc, argv, "p:l:j:e:d:a:q:Q:T:Bu:r:h")) != -1) {
+        switch (c) {
+            case 'p': opt.port = atoi(optarg); break;
+            case 'l': opt.latency_ms = atoi(optarg); break;
+            case 'j': opt.jitter_ms = atoi(optarg); break;
+            case 'e': opt.error_pct = atoi(optarg); break;
+            case 'd': opt.drop_pct = atoi(optarg); break;
+            case 'a': opt.verdict = atoi(optarg); break;
+            case 'q': opt.quota_bytes = atoll(optarg); break;
+            case 'Q': opt.quota_time = atol(optarg); break;
+            case 'T': opt.task_code = atoi(optarg); break;
+            case 'B': opt.no_batch = 1; break;
+            case 'u': opt.firmware_size = atol(optarg); break;
+            case 'r': opt.report_interval = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if (opt.report_interval <= 0)
+        opt.report_interval = 10;
+    if (opt.task_code != 0)
+        tasks_pending = 1;
+    srand(time(NULL) ^ getpid());
+
+    /* Signals are taken by the main thread only */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((server = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("socket");
+        return 1;
+    }
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(opt.port);
+    if (bind(server, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(server, 1024) == -1) {
+        perror("bind");
+        return 1;
+    }
+    pthread_create(&tid, NULL, _mock_accept, (void *)(long)server);
+    printf("wdmockserver listening on port %d\n", opt.port);
+    fflush(stdout);
+
+    memset(last, 0, sizeof(last));
+    gettimeofday(&start, NULL);
+    then = start;
+    for (;;) {
+        timeout.tv_sec = opt.report_interval;
+        timeout.tv_nsec = 0;
+        sig = sigtimedwait(&set, NULL, &timeout);
+        if (sig == SIGUSR1) {
+            pthread_mutex_lock(&mock_mutex);
+            tasks_pending++;
+            pthread_mutex_unlock(&mock_mutex);
+            continue;
+        }
+
+        gettimeofday(&now, NULL);
+        pthread_mutex_lock(&mock_mutex);
+        for (total = 0, delta = 0, i = 0; i < EP_COUNT; i++) {
+            total += stats[i].requests;
+            delta += stats[i].requests - last[i];
+            last[i] = stats[i].requests;
+        }
+        _mock_format_stats(line, sizeof(line), 0);
+        pthread_mutex_unlock(&mock_mutex);
+        elapsed = (now.tv_sec - then.tv_sec) + (now.tv_usec - then.tv_usec) / 1e6;
+        then = now;
+        printf("t=%lds requests=%lu rate=%.1f/s %s\n", (long)(now.tv_sec - start.tv_sec), total,
+                elapsed > 0 ? delta / elapsed : 0.0, line);
+        fflush(stdout);
+        if (sig == SIGINT || sig == SIGTERM)
+            break;
+    }
+    return 0;
+}
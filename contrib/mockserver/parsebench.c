@@ -0,0 +1,171 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file parsebench.c
+    @brief Times the request parser of libhttpd
+
+    Parses each ok-* request of the fuzz corpus again and again with
+    httpdReadRequest(), which reads it line by line with
+    _httpd_readLine(). It does so from memory, as the event loop hands the
+    headers over, and from a socket, where the time of the system calls is
+    included. It prints the requests, lines and megabytes parsed per
+    second of CPU time.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "httpd.h"
+
+static double
+_bench_cpu_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/** Parses a request rounds times, from memory or from a socket
+ * @return CPU milliseconds it took, or -1 if it did not parse
+ */
+static double
+_bench_parse(httpd *server, const char *data, size_t len, int rounds, int from_socket)
+{
+    request *r = malloc(sizeof(request));
+    char *copy = malloc(len + 1);
+    double start = _bench_cpu_ms();
+    int sv[2], i, rc = 0;
+
+    for (i = 0; i < rounds && rc == 0; i++) {
+        memset(r, 0, sizeof(request));
+        if (from_socket) {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1 ||
+                    write(sv[1], data, len) != (ssize_t)len) {
+                perror("socketpair");
+                exit(1);
+            }
+            close(sv[1]);
+            r->clientSock = sv[0];
+        } else {
+            /* The request is parsed in place */
+            memcpy(copy, data, len);
+            r->conn = r;
+            r->readBufPtr = copy;
+            r->readBufRemain = len;
+        }
+        rc = httpdReadRequest(server, r);
+        if (from_socket)
+            close(r->clientSock);
+        httpdFreeVariables(r);
+        free(r->outBuf);
+    }
+
+    free(copy);
+    free(r);
+    return (rc == 0) ? _bench_cpu_ms() - start : -1;
+}
+
+static void
+_usage(void)
+{
+    fprintf(stderr, "Usage: wdparsebench [-c corpus] [-r rounds]\n"
+            "  -c corpus     Directory of requests (default $srcdir/corpus)\n"
+            "  -r rounds     Times each request is parsed (default 200000)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    static char data[HTTP_MAX_LEN * 2];
+    char dir[1024], path[1024];
+    struct dirent **names;
+    struct stat st;
+    httpd server;
+    double ms[2];
+    size_t len, lines;
+    int rounds = 200000, count, i, n, mode, c;
+    FILE *fh;
+
+    snprintf(dir, sizeof(dir), "%s/corpus", getenv("srcdir") ? getenv("srcdir") : ".");
+    while ((c = getopt(argc, argv, "c:r:h")) != -1) {
+        switch (c) {
+            case 'c': snprintf(dir, sizeof(dir), "%s", optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            default: _usage(); return (c == 'h') ? 0 : 1;
+        }
+    }
+    if (rounds <= 0) {
+        _usage();
+        return 1;
+    }
+    if ((count = scandir(dir, &names, NULL, alphasort)) == -1) {
+        perror(dir);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(&server, 0, sizeof(server));
+
+    printf("%-20s %6s %6s %12s %12s %10s %12s\n", "request", "bytes", "lines",
+            "memory req/s", "lines/s", "MB/s", "socket req/s");
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+        if (strncmp(names[i]->d_name, "ok-", 3) != 0 || stat(path, &st) == -1 ||
+                st.st_size > (off_t)sizeof(data) || (fh = fopen(path, "rb")) == NULL)
+            continue;
+        len = fread(data, 1, sizeof(data), fh);
+        fclose(fh);
+        for (lines = 0, n = 0; (size_t)n < len; n++)
+            if (data[n] == '\n')
+                lines++;
+
+        /* The socket costs system calls, fewer rounds are enough */
+        for (mode = 0; mode < 2; mode++) {
+            n = mode ? rounds / 10 + 1 : rounds;
+            if ((ms[mode] = _bench_parse(&server, data, len, n, mode)) < 0)
+                break;
+            ms[mode] = (ms[mode] > 0.001 ? ms[mode] : 0.001) / n;
+        }
+        if (mode < 2) {
+            printf("%-20s did not parse\n", names[i]->d_name);
+            continue;
+        }
+        printf("%-20s %6lu %6lu %12.0f %12.0f %10.1f %12.0f\n", names[i]->d_name,
+                (unsigned long)len, (unsigned long)lines, 1000.0 / ms[0],
+                lines * 1000.0 / ms[0], len / 1048.576 / ms[0], 1000.0 / ms[1]);
+    }
+
+    for (i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    return 0;
+}
@@ -0,0 +1,289 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file parsefuzz.c
+    @brief Feeds the request parser of libhttpd with broken requests
+
+    Every file of the corpus is a raw request. Each one is parsed as it
+    is, then many times mutated at random: bytes changed, runs of line
+    endings and separators inserted, the request cut short or given NUL
+    bytes. Requests are read the two ways libhttpd reads them: from a
+    socket, where _httpd_readLine() refills its buffer, and from memory as
+    the event loop hands them over.
+
+    A corpus file named ok-* must parse and one named bad-* must be
+    refused, either way. Whatever the input, what httpdReadRequest() fills
+    in must stay within its buffers. Run it under valgrind or built with
+    -fsanitize=address to catch what does not crash at once.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "httpd.h"
+
+/** Largest request built by the mutations */
+#define FUZZ_MAX 32768
+
+/** A request of the corpus */
+typedef struct {
+    char *name;
+    char *data;
+    size_t len;
+} t_fuzz_seed;
+
+static int failures = 0;
+
+/** Bytes the insertions are made of */
+static const char fuzz_bytes[] = "\r\n\r\n :?&=%/.aZ09\t\x80\xff";
+
+/** Reads every file of a directory, sorted so that a seed gives the same
+ * mutations everywhere */
+static t_fuzz_seed *
+_fuzz_load(const char *dir, int *count)
+{
+    t_fuzz_seed *seeds = NULL;
+    struct dirent **names;
+    struct stat st;
+    char path[1024];
+    FILE *fh;
+    int i, n;
+
+    *count = 0;
+    if ((n = scandir(dir, &names, NULL, alphasort)) == -1) {
+        perror(dir);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+        if (names[i]->d_name[0] != '.' && stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+                st.st_size <= FUZZ_MAX && (fh = fopen(path, "rb")) != NULL) {
+            seeds = realloc(seeds, sizeof(t_fuzz_seed) * (*count + 1));
+            seeds[*count].name = strdup(names[i]->d_name);
+            seeds[*count].data = malloc(st.st_size + 1);
+            seeds[*count].len = fread(seeds[*count].data, 1, st.st_size, fh);
+            fclose(fh);
+            (*count)++;
+        }
+        free(names[i]);
+    }
+    free(names);
+    return seeds;
+}
+
+/** Checks that what the parser filled in is within its buffers */
+static int
+_fuzz_sane(request *r)
+{
+    httpVar *var, *val;
+
+    if (r->request.method != HTTP_GET && r->request.method != HTTP_POST)
+        return 0;
+    if (strnlen(r->request.path, HTTP_MAX_URL) >= HTTP_MAX_URL ||
+            strnlen(r->request.host, HTTP_MAX_URL) >= HTTP_MAX_URL ||
+            strnlen(r->request.query, sizeof(r->request.query)) >= sizeof(r->request.query) ||
+            strnlen(r->request.authUser, HTTP_MAX_AUTH) >= HTTP_MAX_AUTH ||
+            strnlen(r->request.authPassword, HTTP_MAX_AUTH) >= HTTP_MAX_AUTH)
+        return 0;
+    if (strstr(r->request.path, "//") != NULL || strstr(r->request.path, "/./") != NULL)
+        return 0;
+    for (var = r->variables; var != NULL; var = var->nextVariable)
+        for (val = var; val != NULL; val = val->nextValue)
+            if (val->name == NULL || val->value == NULL)
+                return 0;
+    return 1;
+}
+
+/** Parses a request, from a socket or as the event loop does
+ * @return 0 if it parsed, -1 if it was refused, -2 if the result is not sane
+ */
+static int
+_fuzz_parse(httpd *server, const char *data, size_t len, int from_socket)
+{
+    request *r = calloc(1, sizeof(request));
+    char *copy = NULL;
+    size_t done;
+    ssize_t n;
+    int sv[2], rc;
+
+    if (from_socket) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+            perror("socketpair");
+            exit(1);
+        }
+        for (done = 0; done < len; done += n)
+            if ((n = write(sv[1], data + done, len - done)) <= 0)
+                break;
+        close(sv[1]);
+        r->clientSock = sv[0];
+    } else {
+        /* Anything but NULL, the event loop is not used */
+        copy = malloc(len + 1);
+        memcpy(copy, data, len);
+        r->conn = r;
+        r->readBufPtr = copy;
+        r->readBufRemain = len;
+    }
+
+    rc = httpdReadRequest(server, r);
+    if (rc == 0 && !_fuzz_sane(r))
+        rc = -2;
+
+    if (from_socket)
+        close(r->clientSock);
+    httpdFreeVariables(r);
+    free(r->outBuf);
+    free(r);
+    free(copy);
+    return rc;
+}
+
+/** Changes a request at random */
+static size_t
+_fuzz_mutate(char *buf, size_t len)
+{
+    size_t pos, n, i;
+    int k, edits = 1 + rand() % 8;
+
+    for (k = 0; k < edits; k++) {
+        pos = len ? rand() % len : 0;
+        switch (rand() % 5) {
+            case 0:
+                if (len)
+                    buf[pos] = rand() % 256;
+                break;
+            case 1:
+                /* Mostly short runs, sometimes longer than a read */
+                n = (rand() % 4) ? rand() % 16 : rand() % (2 * HTTP_READ_BUF_LEN);
+                if (len + n > FUZZ_MAX)
+                    n = FUZZ_MAX - len;
+                memmove(buf + pos + n, buf + pos, len - pos);
+                for (i = 0; i < n; i++)
+                    buf[pos + i] = fuzz_bytes[rand() % (sizeof(fuzz_bytes) - 1)];
+                len += n;
+                break;
+            case 2:
+                len = pos;
+                break;
+            case 3:
+                if (len)
+                    buf[pos] = '\0';
+                break;
+            case 4:
+                /* Repeat a piece, as a header sent twice */
+                n = rand() % 64;
+                if (pos + n > len)
+                    n = len - pos;
+                if (len + n <= FUZZ_MAX) {
+                    memmove(buf + pos + n, buf + pos, len - pos);
+                    len += n;
+                }
+                break;
+        }
+    }
+    return len;
+}
+
+static void
+_usage(void)
+{
+    fprintf(stderr, "Usage: wdparsefuzz [-c corpus] [-n rounds] [-s seed]\n"
+            "  -c corpus     Directory of requests (default $srcdir/corpus)\n"
+            "  -n rounds     Mutated requests to parse (default 20000)\n"
+            "  -s seed       Seed of the mutations (default 1)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    static char buf[FUZZ_MAX];
+    char dir[1024];
+    t_fuzz_seed *seeds;
+    httpd server;
+    int count, rounds = 20000, seed = 1, i, mode, rc, c;
+    int parsed = 0, refused = 0;
+    size_t len;
+
+    snprintf(dir, sizeof(dir), "%s/corpus", getenv("srcdir") ? getenv("srcdir") : ".");
+    while ((c = getopt(argc, argv, "c:n:s:h")) != -1) {
+        switch (c) {
+            case 'c': snprintf(dir, sizeof(dir), "%s", optarg); break;
+            case 'n': rounds = atoi(optarg); break;
+            case 's': seed = atoi(optarg); break;
+            default: _usage(); return (c == 'h') ? 0 : 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(&server, 0, sizeof(server));
+    if ((seeds = _fuzz_load(dir, &count)) == NULL || count == 0) {
+        fprintf(stderr, "No requests in %s\n", dir);
+        return 1;
+    }
+
+    for (i = 0; i < count; i++) {
+        for (mode = 0; mode < 2; mode++) {
+            rc = _fuzz_parse(&server, seeds[i].data, seeds[i].len, mode);
+            if (rc == -2 || (strncmp(seeds[i].name, "ok-", 3) == 0 && rc != 0) ||
+                    (strncmp(seeds[i].name, "bad-", 4) == 0 && rc != -1)) {
+                printf("FAILED  %s read from %s: %s\n", seeds[i].name, mode ? "a socket" : "memory",
+                        rc == -2 ? "out of bounds" : rc == 0 ? "parsed" : "refused");
+                failures++;
+            }
+        }
+    }
+
+    srand(seed);
+    for (i = 0; i < rounds; i++) {
+        c = rand() % count;
+        memcpy(buf, seeds[c].data, seeds[c].len);
+        len = _fuzz_mutate(buf, seeds[c].len);
+        rc = _fuzz_parse(&server, buf, len, i % 2);
+        if (rc == -2) {
+            printf("FAILED  seed %d round %d, from %s: out of bounds\n", seed, i, seeds[c].name);
+            failures++;
+        } else if (rc == 0) {
+            parsed++;
+        } else {
+            refused++;
+        }
+    }
+
+    printf("%d requests in the corpus, %d mutated: %d parsed, %d refused\n",
+            count, rounds, parsed, refused);
+
+    for (i = 0; i < count; i++) {
+        free(seeds[i].name);
+        free(seeds[i].data);
+    }
+    free(seeds);
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
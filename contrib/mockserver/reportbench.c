@@ -0,0 +1,294 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file reportbench.c
+    @brief Compares the three ways counters reach the log server
+
+    For the same clients, builds what authlog.c sends:
+
+    - query: one GET ?stage=counters&ip=..&mac=.. per client;
+    - json: one POST of {"clients":[...]}, as log_server_request_batch();
+    - compact: one POST of compact_report.c records, deflated when built
+      with zlib, as log_server_request_compact().
+
+    and prints the bytes of the requests and the CPU spent building them,
+    per 1000 clients. The answers and the TCP/IP overhead of each request
+    are not counted, so the query string is better off here than on a
+    real network.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "cJSON.h"
+#include "compact_report.h"
+
+/** Same URL and host as authlog.c */
+#define BENCH_URL "http://Wifi-admin.ctbri.com.cn/auth"
+#define BENCH_HOST "124.127.116.177"
+#define BENCH_GW_MAC "00:1D:0F:12:34:56"
+
+/** What building one report of every client cost */
+typedef struct {
+    const char *name;
+    unsigned long requests;	/**< @brief Requests per report */
+    unsigned long bytes;	/**< @brief Bytes of those requests */
+    unsigned long body;		/**< @brief Of which bodies */
+    double cpu_ms;		/**< @brief CPU time of one report */
+} t_bench_result;
+
+/* compact_report.o calls these; the daemon's own pull in its config */
+
+void
+_debug(const char *filename, int line, int level, const char *format, ...)
+{
+    va_list vlist;
+
+    va_start(vlist, format);
+    fprintf(stderr, "[%d](%s:%d) ", level, filename, line);
+    vfprintf(stderr, format, vlist);
+    fputc('\n', stderr);
+    va_end(vlist);
+}
+
+void *
+safe_malloc(size_t size)
+{
+    void *p = calloc(1, size);
+
+    if (p == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    return p;
+}
+
+void *
+safe_realloc(void *ptr, size_t size)
+{
+    void *p = realloc(ptr, size);
+
+    if (p == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    return p;
+}
+
+static double
+_bench_cpu_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/** Clients with addresses, tokens and counters like those of a busy AP */
+static t_counters_report *
+_bench_clients(int count)
+{
+    t_counters_report *reports = safe_malloc(sizeof(t_counters_report) * count);
+    int i;
+
+    srand(1);
+    for (i = 0; i < count; i++) {
+        asprintf(&reports[i].ip, "10.%d.%d.%d", 10 + i / 65536, (i / 256) % 256, i % 256);
+        asprintf(&reports[i].mac, "%02x:%02x:%02x:%02x:%02x:%02x",
+                rand() % 256, rand() % 256, rand() % 256, rand() % 256, rand() % 256, rand() % 256);
+        asprintf(&reports[i].token, "%08x%08x%08x%08x", rand(), rand(), rand(), rand());
+        reports[i].incoming = (unsigned long long)rand() * 1000 + rand() % 1000;
+        reports[i].outgoing = (unsigned long long)rand() * 100 + rand() % 100;
+    }
+    return reports;
+}
+
+/** One GET per client, as log_server_build_request() */
+static void
+_bench_query(const t_counters_report *reports, int count, t_bench_result *result)
+{
+    char buf[1024];
+    int i, len;
+
+    result->requests = count;
+    result->bytes = 0;
+    for (i = 0; i < count; i++) {
+        len = snprintf(buf, sizeof(buf),
+                "GET %s?stage=%s&ip=%s&mac=%s&incoming=%llu&outgoing=%llu&gw_id=%s&token=%s HTTP/1.1\r\n"
+                "User-Agent: WiFiDog \r\n"
+                "Host: %s\r\n"
+                "\r\n",
+                BENCH_URL, "counters", reports[i].ip, reports[i].mac,
+                reports[i].incoming, reports[i].outgoing, BENCH_GW_MAC,
+                reports[i].token, BENCH_HOST);
+        result->bytes += len;
+    }
+    result->body = 0;
+}
+
+/** One POST of JSON, as log_server_request_batch() */
+static void
+_bench_json(const t_counters_report *reports, int count, t_bench_result *result)
+{
+    cJSON *root, *clients, *item;
+    char *body, *request;
+    int i, len;
+
+    root = cJSON_CreateObject();
+    clients = cJSON_CreateArray();
+    cJSON_AddItemToObject(root, "clients", clients);
+    for (i = 0; i < count; i++) {
+        item = cJSON_CreateObject();
+        cJSON_AddItemToObject(item, "ip", cJSON_CreateString(reports[i].ip));
+        cJSON_AddItemToObject(item, "mac", cJSON_CreateString(reports[i].mac));
+        cJSON_AddItemToObject(item, "token", cJSON_CreateString(reports[i].token));
+        cJSON_AddItemToObject(item, "incoming", cJSON_CreateNumber((double)reports[i].incoming));
+        cJSON_AddItemToObject(item, "outgoing", cJSON_CreateNumber((double)reports[i].outgoing));
+        cJSON_AddItemToArray(clients, item);
+    }
+    body = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+
+    len = asprintf(&request,
+            "POST %s?stage=%s&gw_id=%s HTTP/1.1\r\n"
+            "User-Agent: WiFiDog \r\n"
+            "Host: %s\r\n"
+            "Content-Type: application/json\r\n"
+            "Content-Length: %lu\r\n"
+            "\r\n"
+            "%s",
+            BENCH_URL, "counters_batch", BENCH_GW_MAC, BENCH_HOST,
+            (unsigned long)strlen(body), body);
+
+    result->requests = 1;
+    result->bytes = len;
+    result->body = strlen(body);
+    free(body);
+    free(request);
+}
+
+/** One POST of compact records, as log_server_request_compact() */
+static void
+_bench_compact(const t_counters_report *reports, int count, t_bench_result *result)
+{
+    char *body, *zbody, *headers;
+    size_t len, zlen;
+    int hlen;
+
+    body = compact_report_encode(reports, count, &len);
+    if ((zbody = compact_report_deflate(body, len, &zlen)) != NULL) {
+        free(body);
+        body = zbody;
+        len = zlen;
+    }
+
+    hlen = asprintf(&headers,
+            "POST %s?stage=%s&gw_id=%s HTTP/1.1\r\n"
+            "User-Agent: WiFiDog \r\n"
+            "Host: %s\r\n"
+            "Content-Type: %s\r\n"
+            "%s"
+            "Content-Length: %lu\r\n"
+            "\r\n",
+            BENCH_URL, "counters_batch", BENCH_GW_MAC, BENCH_HOST,
+            COMPACT_REPORT_TYPE, zbody ? "Content-Encoding: deflate\r\n" : "",
+            (unsigned long)len);
+
+    result->requests = 1;
+    result->bytes = hlen + len;
+    result->body = len;
+    free(headers);
+    free(body);
+}
+
+static void
+_bench_run(void (*build)(const t_counters_report *, int, t_bench_result *),
+        const t_counters_report *reports, int count, int rounds, t_bench_result *result)
+{
+    double start;
+    int i;
+
+    start = _bench_cpu_ms();
+    for (i = 0; i < rounds; i++)
+        build(reports, count, result);
+    result->cpu_ms = (_bench_cpu_ms() - start) / rounds;
+}
+
+static void
+_bench_usage(void)
+{
+    fprintf(stderr, "Usage: wdreportbench [-n clients] [-r rounds]\n"
+            "  -n clients    Clients in each report (default 1000)\n"
+            "  -r rounds     Reports built for each format (default 200)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    t_bench_result results[3];
+    t_counters_report *reports;
+    int count = 1000, rounds = 200, i, c;
+    double per;
+
+    while ((c = getopt(argc, argv, "n:r:h")) != -1) {
+        switch (c) {
+            case 'n': count = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            default: _bench_usage(); return (c == 'h') ? 0 : 1;
+        }
+    }
+    if (count <= 0 || rounds <= 0) {
+        _bench_usage();
+        return 1;
+    }
+
+    reports = _bench_clients(count);
+
+    results[0].name = "query";
+    _bench_run(_bench_query, reports, count, rounds, &results[0]);
+    results[1].name = "json";
+    _bench_run(_bench_json, reports, count, rounds, &results[1]);
+    results[2].name = "compact";
+    _bench_run(_bench_compact, reports, count, rounds, &results[2]);
+
+    /* Everything is given per 1000 clients */
+    per = 1000.0 / count;
+    printf("%d clients, %d rounds, per 1000 clients:\n", count, rounds);
+    printf("%-10s %9s %11s %11s %9s %12s\n", "format", "requests", "bytes", "body", "ratio", "cpu ms");
+    for (i = 0; i < 3; i++)
+        printf("%-10s %9.0f %11.0f %11.0f %8.1f%% %12.3f\n", results[i].name,
+                results[i].requests * per, results[i].bytes * per, results[i].body * per,
+                100.0 * results[i].bytes / results[0].bytes, results[i].cpu_ms * per);
+
+    for (i = 0; i < count; i++) {
+        free(reports[i].ip);
+        free(reports[i].mac);
+        free(reports[i].token);
+    }
+    free(reports);
+    return 0;
+}
@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <errno.h>
 
 #if defined(_WIN32)
 #include <winsock2.h>
@@ -36,12 +37,17 @@
 #include <netdb.h>
 #include <sys/socket.h> 
 #include <netdb.h>
+#include <limits.h>
 #endif
 
 #include "config.h"
 #include "httpd.h"
 #include "httpd_priv.h"
 
+#ifndef IOV_MAX
+#  define IOV_MAX	16
+#endif
+
 #ifdef HAVE_STDARG_H
 #  include <stdarg.h>
 #else
@@ -377,7 +383,7 @@ request *httpdGetConnection(server, timeout)
 
 int httpdReadRequest(httpd *server, request *r)
 {
-	static	char	buf[HTTP_MAX_LEN];
+	char	*buf;
 	int	count,
 		inHeaders;
 	char	*cp, *cp2;
@@ -399,7 +405,7 @@ int httpdReadRequest(httpd *server, request *r)
 	*/
 	count = 0;
 	inHeaders = 1;
-	while(_httpd_readLine(r, buf, HTTP_MAX_LEN) > 0)
+	while((buf = _httpd_readLine(r)) != NULL)
 	{
 		count++;
 
@@ -415,23 +421,25 @@ int httpdReadRequest(httpd *server, request *r)
 			cp = cp2 = buf;
 			while(isalpha((unsigned char)*cp2))
 				cp2++;
-			*cp2 = 0;
+			/* The line is parsed in place, don't run past its end */
+			if (*cp2 != 0)
+				*cp2++ = 0;
 			if (strcasecmp(cp,"GET") == 0)
 				r->request.method = HTTP_GET;
 			if (strcasecmp(cp,"POST") == 0)
 				r->request.method = HTTP_POST;
 			if (r->request.method == 0)
 			{
-				_httpd_net_write( r->clientSock,
+				_httpd_write(r,
 				      HTTP_METHOD_ERROR,
 				      strlen(HTTP_METHOD_ERROR));
-				_httpd_net_write( r->clientSock, cp, 
+				_httpd_write(r, cp, 
 				      strlen(cp));
 				_httpd_writeErrorLog(server, r, LEVEL_ERROR, 
 					"Invalid method received");
 				return(-1);
 			}
-			cp = cp2+1;
+			cp = cp2;
 			while(*cp == ' ')
 				cp++;
 			cp2 = cp;
@@ -577,6 +585,8 @@ int httpdReadRequest(httpd *server, request *r)
 			continue;
 		}
 	}
+	if (count == 0)
+		return(-1);
 
 
 #if 0
@@ -613,6 +623,12 @@ int httpdReadRequest(httpd *server, request *r)
 
 void httpdEndRequest(request *r)
 {
+	if (r->conn)
+	{
+		/* The event loop flushes the output and closes */
+		_httpd_eventEnd(r);
+		return;
+	}
 	_httpd_freeVariables(r->variables);
 	shutdown(r->clientSock,2);
 	close(r->clientSock);
@@ -916,7 +932,51 @@ void httpdOutput(request *r, const char *msg)
 	r->response.responseLength += strlen(buf);
 	if (r->response.headersSent == 0)
 		httpdSendHeaders(r);
-	_httpd_net_write( r->clientSock, buf, strlen(buf));
+	_httpd_write(r, buf, strlen(buf));
+}
+
+
+
+/*
+** Sends the pieces as they are, without expanding variables or copying
+** them through a buffer of limited size.  The iovec array is used up.
+** writev() refuses more than IOV_MAX pieces, so they go IOV_MAX at a time
+*/
+void httpdOutputVector(request *r, struct iovec *iov, int count)
+{
+	int	i,
+		result;
+
+	for (i = 0; i < count; i++)
+		r->response.responseLength += iov[i].iov_len;
+	if (r->response.headersSent == 0)
+		httpdSendHeaders(r);
+	if (r->conn)
+	{
+		for (i = 0; i < count; i++)
+			_httpd_write(r, iov[i].iov_base, iov[i].iov_len);
+		return;
+	}
+	while(count > 0)
+	{
+		result = writev(r->clientSock, iov,
+			count > IOV_MAX ? IOV_MAX : count);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result < 1)
+			return;
+		while(count > 0 && result >= (int)iov->iov_len)
+		{
+			result -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + result;
+			iov->iov_len -= result;
+		}
+	}
 }
 
 
@@ -945,7 +1005,7 @@ void httpdPrintf(va_alist)
 		httpdSendHeaders(r);
 	vsnprintf(buf, HTTP_MAX_LEN, fmt, args);
 	r->response.responseLength += strlen(buf);
-	_httpd_net_write( r->clientSock, buf, strlen(buf));
+	_httpd_write(r, buf, strlen(buf));
 }
 
 
@@ -0,0 +1,564 @@
+/*
+** Event driven connection handling, added for WiFiDog.
+**
+** One thread accepts the connections and reads the request headers
+** without blocking, however slowly they arrive.  A request is handed to
+** the application only once its headers are complete, and what the
+** content callbacks write is queued on the request and flushed by the
+** same thread.  A slow or idle client therefore costs a few hundred
+** bytes and no thread.
+**
+** $Id$
+**
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#if defined(_WIN32)
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#endif
+
+#include "httpd.h"
+#include "httpd_priv.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+
+/*
+** Connection states
+*/
+#define	CONN_READING		1	/* Waiting for the end of the headers */
+#define	CONN_BUSY		2	/* Owned by the application */
+#define	CONN_WRITING		3	/* Flushing the output queue */
+
+/*
+** Header parser states.  They follow _httpd_readLine(), which ends a
+** line on a LF and drops the CR before it
+*/
+#define	PARSE_LINE		0	/* Inside a line */
+#define	PARSE_EOL		1	/* At the start of a line */
+
+#define	EVENT_BATCH		64
+#define	CONN_BUF_LEN		512
+
+typedef struct _httpd_conn {
+	int	sock,
+		state,
+		parse,
+		inLen,
+		inSize,
+		outSent;
+	time_t	lastActive;
+	char	*inBuf,
+		clientAddr[HTTP_IP_ADDR_LEN];
+	request	*r;
+	struct	_httpd_event *event;
+	struct	_httpd_conn *prev,
+			*next,
+			*nextEnded;
+} httpConn;
+
+struct _httpd_event {
+	httpd	*server;
+	int	epollFd,
+		wakeFd[2],
+		maxConns,
+		numConns,
+		accepting;
+	int	(*ready)();
+	/* Connections read or written, least recently active first */
+	httpConn *head,
+		*tail;
+	/* Requests ended by the application, waiting for the loop */
+	httpConn *ended;
+	pthread_mutex_t endedMutex;
+};
+
+
+static int _httpd_setNonBlocking(sock)
+	int	sock;
+{
+	int	flags;
+
+	flags = fcntl(sock, F_GETFL, 0);
+	if (flags < 0)
+		return(-1);
+	return(fcntl(sock, F_SETFL, flags | O_NONBLOCK));
+}
+
+
+static void _httpd_eventUntrack(httpdEvent *ev, httpConn *conn)
+{
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else if (ev->head == conn)
+		ev->head = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	else if (ev->tail == conn)
+		ev->tail = conn->prev;
+	conn->prev = conn->next = NULL;
+}
+
+
+static void _httpd_eventTrack(httpdEvent *ev, httpConn *conn)
+{
+	_httpd_eventUntrack(ev, conn);
+	conn->lastActive = time(NULL);
+	conn->prev = ev->tail;
+	if (ev->tail)
+		ev->tail->next = conn;
+	else
+		ev->head = conn;
+	ev->tail = conn;
+}
+
+
+static void _httpd_eventListen(httpdEvent *ev, int on)
+{
+	struct	epoll_event event;
+
+	if (ev->accepting == on)
+		return;
+	memset(&event, 0, sizeof(event));
+	event.events = on ? EPOLLIN : 0;
+	event.data.ptr = ev->server;
+	if (epoll_ctl(ev->epollFd, EPOLL_CTL_MOD, ev->server->serverSock,
+		&event) == 0)
+	{
+		ev->accepting = on;
+	}
+}
+
+
+static void _httpd_eventClose(httpdEvent *ev, httpConn *conn)
+{
+	request	*r = conn->r;
+
+	if (conn->state != CONN_BUSY)
+		_httpd_eventUntrack(ev, conn);
+	if (r)
+	{
+		_httpd_freeVariables(r->variables);
+		if (r->outBuf)
+			free(r->outBuf);
+		free(r);
+	}
+	shutdown(conn->sock, 2);
+	close(conn->sock);
+	if (conn->inBuf)
+		free(conn->inBuf);
+	free(conn);
+
+	ev->numConns--;
+	if (!ev->accepting)
+		_httpd_eventListen(ev, 1);
+}
+
+
+/*
+** Scans the bytes received since the last call.  Returns 1 once the
+** empty line ending the headers has been seen
+*/
+static int _httpd_eventParse(httpConn *conn, int from)
+{
+	char	curChar;
+	int	i;
+
+	for (i = from; i < conn->inLen; i++)
+	{
+		curChar = conn->inBuf[i];
+		if (curChar == '\r')
+			continue;
+		if (curChar == '\n')
+		{
+			if (conn->parse == PARSE_EOL)
+				return(1);
+			conn->parse = PARSE_EOL;
+			continue;
+		}
+		conn->parse = PARSE_LINE;
+	}
+	return(0);
+}
+
+
+static void _httpd_eventDispatch(httpdEvent *ev, httpConn *conn)
+{
+	request	*r;
+
+	_httpd_eventUntrack(ev, conn);
+	epoll_ctl(ev->epollFd, EPOLL_CTL_DEL, conn->sock, NULL);
+	conn->state = CONN_BUSY;
+
+	r = (request *)malloc(sizeof(request));
+	if (r == NULL)
+	{
+		_httpd_eventClose(ev, conn);
+		return;
+	}
+	memset((void *)r, 0, sizeof(request));
+	r->clientSock = conn->sock;
+	strcpy(r->clientAddr, conn->clientAddr);
+	/*
+	** httpdReadRequest() parses the headers straight from the
+	** connection buffer, it never has to wait for the socket
+	*/
+	r->readBufPtr = conn->inBuf;
+	r->readBufRemain = conn->inLen;
+	r->conn = conn;
+	conn->r = r;
+
+	if (ev->server->defaultAcl)
+	{
+		if (httpdCheckAcl(ev->server, r, ev->server->defaultAcl)
+				== HTTP_ACL_DENY)
+		{
+			_httpd_eventClose(ev, conn);
+			return;
+		}
+	}
+	(*ev->ready)(ev->server, r);
+}
+
+
+static void _httpd_eventAccept(httpdEvent *ev)
+{
+	struct	epoll_event event;
+	struct	sockaddr_in addr;
+	socklen_t addrLen;
+	httpConn *conn;
+	char	*ipaddr;
+	int	sock;
+
+	while(1)
+	{
+		if (ev->maxConns > 0 && ev->numConns >= ev->maxConns)
+		{
+			/* Leave the others in the listen backlog */
+			_httpd_eventListen(ev, 0);
+			return;
+		}
+		addrLen = sizeof(addr);
+		sock = accept(ev->server->serverSock,
+			(struct sockaddr *)&addr, &addrLen);
+		if (sock < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EMFILE || errno == ENFILE ||
+			    errno == ENOBUFS || errno == ENOMEM)
+			{
+				/* Retried when a connection closes or
+				** on the next tick */
+				_httpd_eventListen(ev, 0);
+			}
+			return;
+		}
+		conn = (httpConn *)malloc(sizeof(httpConn));
+		if (conn == NULL || _httpd_setNonBlocking(sock) < 0)
+		{
+			if (conn)
+				free(conn);
+			close(sock);
+			continue;
+		}
+		memset((void *)conn, 0, sizeof(httpConn));
+		conn->sock = sock;
+		conn->state = CONN_READING;
+		conn->parse = PARSE_LINE;
+		conn->event = ev;
+		ipaddr = inet_ntoa(addr.sin_addr);
+		if (ipaddr)
+		{
+			strncpy(conn->clientAddr, ipaddr, HTTP_IP_ADDR_LEN);
+			conn->clientAddr[HTTP_IP_ADDR_LEN-1]=0;
+		}
+
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = conn;
+		if (epoll_ctl(ev->epollFd, EPOLL_CTL_ADD, sock, &event) < 0)
+		{
+			close(sock);
+			free(conn);
+			continue;
+		}
+		ev->numConns++;
+		_httpd_eventTrack(ev, conn);
+	}
+}
+
+
+static void _httpd_eventRead(httpdEvent *ev, httpConn *conn)
+{
+	char	*tmp;
+	int	size,
+		count;
+
+	if (conn->inLen == conn->inSize)
+	{
+		if (conn->inSize >= HTTP_MAX_LEN)
+		{
+			/* Headers too long */
+			_httpd_eventClose(ev, conn);
+			return;
+		}
+		size = conn->inSize ? conn->inSize * 2 : CONN_BUF_LEN;
+		if (size > HTTP_MAX_LEN)
+			size = HTTP_MAX_LEN;
+		tmp = realloc(conn->inBuf, size);
+		if (tmp == NULL)
+		{
+			_httpd_eventClose(ev, conn);
+			return;
+		}
+		conn->inBuf = tmp;
+		conn->inSize = size;
+	}
+
+	count = read(conn->sock, conn->inBuf + conn->inLen,
+		conn->inSize - conn->inLen);
+	if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+		errno == EINTR))
+	{
+		return;
+	}
+	if (count < 1)
+	{
+		_httpd_eventClose(ev, conn);
+		return;
+	}
+	conn->inLen += count;
+	if (_httpd_eventParse(conn, conn->inLen - count))
+	{
+		_httpd_eventDispatch(ev, conn);
+		return;
+	}
+	_httpd_eventTrack(ev, conn);
+}
+
+
+static void _httpd_eventWrite(httpdEvent *ev, httpConn *conn)
+{
+	request	*r = conn->r;
+	int	count;
+
+	while(conn->outSent < r->outLen)
+	{
+		count = send(conn->sock, r->outBuf + conn->outSent,
+			r->outLen - conn->outSent, MSG_NOSIGNAL);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			_httpd_eventTrack(ev, conn);
+			return;
+		}
+		if (count < 1)
+			break;
+		conn->outSent += count;
+	}
+	_httpd_eventClose(ev, conn);
+}
+
+
+/*
+** Takes back the requests the application has ended
+*/
+static void _httpd_eventWake(httpdEvent *ev)
+{
+	struct	epoll_event event;
+	httpConn *conn,
+		*next;
+	char	buf[64];
+
+	while(read(ev->wakeFd[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&ev->endedMutex);
+	conn = ev->ended;
+	ev->ended = NULL;
+	pthread_mutex_unlock(&ev->endedMutex);
+
+	for (; conn; conn = next)
+	{
+		next = conn->nextEnded;
+		conn->state = CONN_WRITING;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLOUT;
+		event.data.ptr = conn;
+		if (conn->r->outLen == 0 || epoll_ctl(ev->epollFd,
+			EPOLL_CTL_ADD, conn->sock, &event) < 0)
+		{
+			_httpd_eventClose(ev, conn);
+			continue;
+		}
+		_httpd_eventWrite(ev, conn);
+	}
+}
+
+
+static void _httpd_eventExpire(httpdEvent *ev)
+{
+	time_t	now = time(NULL);
+
+	while(ev->head && now - ev->head->lastActive >= HTTP_EVENT_TIMEOUT)
+		_httpd_eventClose(ev, ev->head);
+	if (!ev->accepting && (ev->maxConns <= 0 ||
+		ev->numConns < ev->maxConns))
+	{
+		_httpd_eventListen(ev, 1);
+	}
+}
+
+
+httpdEvent *httpdEventCreate(httpd *server, int maxConns, int (*ready)())
+{
+	struct	epoll_event event;
+	httpdEvent *ev;
+
+	ev = (httpdEvent *)malloc(sizeof(httpdEvent));
+	if (ev == NULL)
+		return(NULL);
+	memset((void *)ev, 0, sizeof(httpdEvent));
+	ev->server = server;
+	ev->maxConns = maxConns;
+	ev->ready = ready;
+	ev->accepting = 1;
+	ev->wakeFd[0] = ev->wakeFd[1] = -1;
+	pthread_mutex_init(&ev->endedMutex, NULL);
+
+	ev->epollFd = epoll_create(maxConns > 0 ? maxConns : 1024);
+	if (ev->epollFd < 0)
+	{
+		free(ev);
+		return(NULL);
+	}
+	if (_httpd_setNonBlocking(server->serverSock) < 0 ||
+	    pipe(ev->wakeFd) < 0 ||
+	    _httpd_setNonBlocking(ev->wakeFd[0]) < 0 ||
+	    _httpd_setNonBlocking(ev->wakeFd[1]) < 0)
+	{
+		goto error;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = server;
+	if (epoll_ctl(ev->epollFd, EPOLL_CTL_ADD, server->serverSock, &event) < 0)
+		goto error;
+	event.data.ptr = ev;
+	if (epoll_ctl(ev->epollFd, EPOLL_CTL_ADD, ev->wakeFd[0], &event) < 0)
+		goto error;
+	return(ev);
+
+error:
+	if (ev->wakeFd[0] >= 0)
+	{
+		close(ev->wakeFd[0]);
+		close(ev->wakeFd[1]);
+	}
+	close(ev->epollFd);
+	pthread_mutex_destroy(&ev->endedMutex);
+	free(ev);
+	return(NULL);
+}
+
+
+int httpdEventRun(httpdEvent *ev)
+{
+	struct	epoll_event events[EVENT_BATCH];
+	httpConn *conn;
+	time_t	lastTick = 0;
+	int	count,
+		i;
+
+	while(1)
+	{
+		count = epoll_wait(ev->epollFd, events, EVENT_BATCH,
+			(ev->head || !ev->accepting) ? 1000 : -1);
+		if (count < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			ev->server->lastError = -1;
+			return(-1);
+		}
+		for (i = 0; i < count; i++)
+		{
+			if (events[i].data.ptr == ev->server)
+			{
+				_httpd_eventAccept(ev);
+				continue;
+			}
+			if (events[i].data.ptr == ev)
+			{
+				_httpd_eventWake(ev);
+				continue;
+			}
+			conn = (httpConn *)events[i].data.ptr;
+			if (conn->state == CONN_READING)
+				_httpd_eventRead(ev, conn);
+			else if (conn->state == CONN_WRITING)
+				_httpd_eventWrite(ev, conn);
+		}
+		if (time(NULL) != lastTick)
+		{
+			lastTick = time(NULL);
+			_httpd_eventExpire(ev);
+		}
+	}
+}
+
+
+void _httpd_eventEnd(request *r)
+{
+	httpConn *conn = (httpConn *)r->conn;
+	httpdEvent *ev = conn->event;
+	int	wake;
+
+	/*
+	** Called from any thread.  The loop only needs waking when the
+	** list was empty, and a full pipe means it is awake already
+	*/
+	pthread_mutex_lock(&ev->endedMutex);
+	wake = (ev->ended == NULL);
+	conn->nextEnded = ev->ended;
+	ev->ended = conn;
+	pthread_mutex_unlock(&ev->endedMutex);
+	if (wake)
+		write(ev->wakeFd[1], "", 1);
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
+httpdEvent *httpdEventCreate(httpd *server, int maxConns, int (*ready)())
+{
+	return(NULL);
+}
+
+
+int httpdEventRun(httpdEvent *ev)
+{
+	return(-1);
+}
+
+
+void _httpd_eventEnd(request *r)
+{
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
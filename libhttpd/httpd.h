@@ -33,6 +33,9 @@
 #define LIB_HTTPD_H 1
 
 #include <sys/time.h>
+#if !defined(_WIN32)
+#include <sys/uio.h>
+#endif
 
 #if !defined(__ANSI_PROTO)
 #if defined(_WIN32) || defined(__STDC__) || defined(__cplusplus)
@@ -65,6 +68,8 @@ extern "C" {
 #define	HTTP_IP_ADDR_LEN	17
 #define	HTTP_TIME_STRING_LEN	40
 #define	HTTP_READ_BUF_LEN	4096
+#define	HTTP_EVENT_TIMEOUT	30	/* Seconds a connection may stall
+					   in event driven mode */
 #define	HTTP_ANY_ADDR		NULL
 
 #define	HTTP_GET		1
@@ -181,15 +186,21 @@ typedef struct {
 
 typedef struct {
 	int	clientSock,
-		readBufRemain;
+		readBufRemain,
+		outLen,
+		outSize;
 	httpReq	request;
 	httpRes response;
 	httpVar	*variables;
 	char	readBuf[HTTP_READ_BUF_LEN + 1],
 		*readBufPtr,
+		*outBuf,	/* Output queue in event driven mode */
 		clientAddr[HTTP_IP_ADDR_LEN];
+	void	*conn;		/* Event loop connection, NULL otherwise */
 } request;
 
+typedef struct _httpd_event httpdEvent;
+
 /***********************************************************************
 ** Function Prototypes
 */
@@ -205,6 +216,7 @@ request *httpdGetConnection __ANSI_PROTO((httpd*, struct timeval*));
 int httpdReadRequest __ANSI_PROTO((httpd*, request*));
 int httpdCheckAcl __ANSI_PROTO((httpd*, request *, httpAcl*));
 int httpdAddC404Content __ANSI_PROTO((httpd*,void(*)()));
+int httpdEventRun __ANSI_PROTO((httpdEvent*));
 
 char *httpdRequestMethodName __ANSI_PROTO((request*));
 char *httpdUrlEncode __ANSI_PROTO((const char *));
@@ -215,9 +227,11 @@ void httpdSetResponse __ANSI_PROTO((request*, const char*));
 void httpdEndRequest __ANSI_PROTO((request*));
 
 httpd *httpdCreate __ANSI_PROTO(());
+httpdEvent *httpdEventCreate __ANSI_PROTO((httpd*, int, int(*)()));
 void httpdFreeVariables __ANSI_PROTO((request*));
 void httpdDumpVariables __ANSI_PROTO((request*));
 void httpdOutput __ANSI_PROTO((request*, const char*));
+void httpdOutputVector __ANSI_PROTO((request*, struct iovec*, int));
 void httpdPrintf __ANSI_PROTO((request*, const char*, ...));
 void httpdProcessRequest __ANSI_PROTO((httpd*, request *));
 void httpdSendHeaders __ANSI_PROTO((request*));
@@ -66,13 +66,15 @@ void _httpd_formatTimeString __ANSI_PROTO((char*, int));
 void _httpd_storeData __ANSI_PROTO((request*, char*));
 void _httpd_writeAccessLog __ANSI_PROTO((httpd*, request*));
 void _httpd_writeErrorLog __ANSI_PROTO((httpd*, request *, char*, char*));
+void _httpd_eventEnd __ANSI_PROTO((request*));
 
 
 int _httpd_net_read __ANSI_PROTO((int, char*, int));
 int _httpd_net_write __ANSI_PROTO((int, char*, int));
+int _httpd_write __ANSI_PROTO((request*, char*, int));
 int _httpd_readBuf __ANSI_PROTO((request*, char*, int));
 int _httpd_readChar __ANSI_PROTO((request*, char*));
-int _httpd_readLine __ANSI_PROTO((request*, char*, int));
+char *_httpd_readLine __ANSI_PROTO((request*));
 int _httpd_checkLastModified __ANSI_PROTO((request*, int));
 int _httpd_sendDirectoryEntry __ANSI_PROTO((httpd*, request *r, httpContent*,
 			char*));
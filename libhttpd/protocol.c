@@ -79,11 +79,40 @@ int _httpd_net_write(sock, buf, len)
 #endif
 }
 
+int _httpd_write(request *r, char *buf, int len)
+{
+	char	*tmp;
+	int	size;
+
+	if (r->conn == NULL)
+		return(_httpd_net_write(r->clientSock, buf, len));
+
+	/*
+	** Event driven, queue it for the event loop
+	*/
+	if (r->outLen + len > r->outSize)
+	{
+		size = r->outSize ? r->outSize : 1024;
+		while(size < r->outLen + len)
+			size *= 2;
+		tmp = realloc(r->outBuf, size);
+		if (tmp == NULL)
+			return(-1);
+		r->outBuf = tmp;
+		r->outSize = size;
+	}
+	memcpy(r->outBuf + r->outLen, buf, len);
+	r->outLen += len;
+	return(len);
+}
+
 int _httpd_readChar(request *r, char *cp)
 {
 	if (r->readBufRemain == 0)
 	{
-		bzero(r->readBuf, HTTP_READ_BUF_LEN + 1);
+		/* In event driven mode all of the headers are buffered */
+		if (r->conn)
+			return(0);
 		r->readBufRemain = _httpd_net_read(r->clientSock, 
 			r->readBuf, HTTP_READ_BUF_LEN);
 		if (r->readBufRemain < 1)
@@ -97,38 +126,67 @@ int _httpd_readChar(request *r, char *cp)
 }
 
 
-int _httpd_readLine(request *r, char *destBuf, int len)
+/*
+** Returns the next line of the request without its line ending, in
+** place in the read buffer, or NULL once the input is exhausted.  The
+** line is valid until the next call.  A line longer than the read
+** buffer comes back in pieces
+*/
+char *_httpd_readLine(request *r)
 {
-	char	curChar,
-		*dst;
+	char	*line,
+		*end,
+		*cp;
 	int	count;
-	
 
-	count = 0;
-	dst = destBuf;
-	while(count < len)
+	while(1)
 	{
-		if (_httpd_readChar(r, &curChar) < 1)
-			return(0);
-		// Fixed by Mina - if we read binary junk it's probably not a regular HTTP client
-		//if (curChar == '\n')
-		if (curChar == '\n' || !isascii(curChar))
+		if (r->readBufRemain > 0)
 		{
-			*dst = 0;
-			return(1);
+			line = r->readBufPtr;
+			end = memchr(line, '\n', r->readBufRemain);
+			if (end)
+			{
+				r->readBufPtr = end + 1;
+				r->readBufRemain -= end + 1 - line;
+				break;
+			}
 		}
-		if (curChar == '\r')
+		/* In event driven mode all of the headers are buffered */
+		if (r->conn)
+			return(NULL);
+		if (r->readBufRemain == HTTP_READ_BUF_LEN)
 		{
-			continue;
+			line = r->readBuf;
+			end = line + HTTP_READ_BUF_LEN;
+			r->readBufRemain = 0;
+			break;
 		}
-		else
+		/* Keep the partial line and read the rest after it */
+		if (r->readBufRemain > 0 && r->readBufPtr != r->readBuf)
+			memmove(r->readBuf, r->readBufPtr, r->readBufRemain);
+		r->readBufPtr = r->readBuf;
+		count = _httpd_net_read(r->clientSock,
+			r->readBuf + r->readBufRemain,
+			HTTP_READ_BUF_LEN - r->readBufRemain);
+		if (count < 1)
+			return(NULL);
+		r->readBufRemain += count;
+	}
+
+	*end = 0;
+	if (end > line && *(end - 1) == '\r')
+		*(end - 1) = 0;
+	// Fixed by Mina - if we read binary junk it's probably not a regular HTTP client
+	for (cp = line; *cp; cp++)
+	{
+		if (!isascii(*cp))
 		{
-			*dst++ = curChar;
-			count++;
+			*cp = 0;
+			break;
 		}
 	}
-	*dst = 0;
-	return(1);
+	return(line);
 }
 
 
@@ -197,43 +255,42 @@ void _httpd_writeErrorLog(httpd *server, request *r, char *level, char *message)
 
 
 
+/*
+** Value of a base64 digit, 64 for anything else.  Computed rather than
+** looked up in a table filled on first use, which several request
+** threads could race on
+*/
+static int _httpd_decodeDigit(c)
+	char	c;
+{
+	if (c >= 'A' && c <= 'Z')
+		return(c - 'A');
+	if (c >= 'a' && c <= 'z')
+		return(c - 'a' + 26);
+	if (c >= '0' && c <= '9')
+		return(c - '0' + 52);
+	if (c == '+')
+		return(62);
+	if (c == '/')
+		return(63);
+	return(64);
+}
+
+
 int _httpd_decode (bufcoded, bufplain, outbufsize)
 	char *		bufcoded;
 	char *		bufplain;
 	int		outbufsize;
 {
-	static char six2pr[64] = {
-    		'A','B','C','D','E','F','G','H','I','J','K','L','M',
-    		'N','O','P','Q','R','S','T','U','V','W','X','Y','Z',
-    		'a','b','c','d','e','f','g','h','i','j','k','l','m',
-    		'n','o','p','q','r','s','t','u','v','w','x','y','z',
-    		'0','1','2','3','4','5','6','7','8','9','+','/'   
-	};
-  
-	static unsigned char pr2six[256];
-
 	/* single character decode */
-#	define DEC(c) pr2six[(int)c]
+#	define DEC(c) _httpd_decodeDigit(c)
 #	define _DECODE_MAXVAL 63
 
-	static int first = 1;
-
-	int nbytesdecoded, j;
+	int nbytesdecoded;
 	register char *bufin = bufcoded;
 	register char *bufout = bufplain;
 	register int nprbytes;
 
-	/*
-	** If this is the first call, initialize the mapping table.
-	** This code should work even on non-ASCII machines.
-	*/
-	if(first) 
-	{
-		first = 0;
-		for(j=0; j<256; j++) pr2six[j] = _DECODE_MAXVAL+1;
-		for(j=0; j<64; j++) pr2six[(int)six2pr[j]] = (unsigned char)j;
-	}
-
    	/* Strip leading whitespace. */
 
    	while(*bufcoded==' ' || *bufcoded == '\t') bufcoded++;
@@ -241,36 +298,39 @@ int _httpd_decode (bufcoded, bufplain, outbufsize)
 	/*
 	** Figure out how many characters are in the input buffer.
 	** If this would decode into more bytes than would fit into
-	** the output buffer, adjust the number of input bytes downwards.
+	** the output buffer and its terminator, adjust the number of
+	** input bytes downwards.  The input is parsed in place, so
+	** nothing past those characters may be read.
 	*/
 	bufin = bufcoded;
-	while(pr2six[(int)*(bufin++)] <= _DECODE_MAXVAL);
-	nprbytes = bufin - bufcoded - 1;
-	nbytesdecoded = ((nprbytes+3)/4) * 3;
-	if(nbytesdecoded > outbufsize) 
+	while(DEC(*bufin) <= _DECODE_MAXVAL)
+		bufin++;
+	nprbytes = bufin - bufcoded;
+	if((nprbytes * 3) / 4 > outbufsize - 1)
 	{
-		nprbytes = (outbufsize*4)/3;
+		nprbytes = ((outbufsize - 1) * 4) / 3;
 	}
 	bufin = bufcoded;
+	nbytesdecoded = 0;
    
-	while (nprbytes > 0) 
+	while (nprbytes >= 4) 
 	{
 		*(bufout++)=(DEC(*bufin)<<2|DEC(bufin[1])>>4);
 		*(bufout++)=(DEC(bufin[1])<<4|DEC(bufin[2])>>2);
 		*(bufout++)=(DEC(bufin[2])<<6|DEC(bufin[3]));
 		bufin += 4;
 		nprbytes -= 4;
+		nbytesdecoded += 3;
 	}
-	if(nprbytes & 03) 
+	if(nprbytes >= 2) 
 	{
-		if(pr2six[(int)bufin[-2]] > _DECODE_MAXVAL) 
-		{
-			nbytesdecoded -= 2;
-		}
-		else 
-		{
-			nbytesdecoded -= 1;
-		}
+		*(bufout++)=(DEC(*bufin)<<2|DEC(bufin[1])>>4);
+		nbytesdecoded++;
+	}
+	if(nprbytes == 3) 
+	{
+		*(bufout++)=(DEC(bufin[1])<<4|DEC(bufin[2])>>2);
+		nbytesdecoded++;
 	}
 	bufplain[nbytesdecoded] = 0;
 	return(nbytesdecoded);
@@ -424,36 +484,36 @@ void _httpd_sendHeaders(request *r, int contentLength, int modTime)
 		return;
 
 	r->response.headersSent = 1;
-	_httpd_net_write(r->clientSock, "HTTP/1.0 ", 9);
-	_httpd_net_write(r->clientSock, r->response.response, 
+	_httpd_write(r, "HTTP/1.0 ", 9);
+	_httpd_write(r, r->response.response, 
 		strlen(r->response.response));
-	_httpd_net_write(r->clientSock, r->response.headers, 
+	_httpd_write(r, r->response.headers, 
 		strlen(r->response.headers));
 
 	_httpd_formatTimeString(timeBuf, 0);
-	_httpd_net_write(r->clientSock,"Date: ", 6);
-	_httpd_net_write(r->clientSock, timeBuf, strlen(timeBuf));
-	_httpd_net_write(r->clientSock, "\n", 1);
+	_httpd_write(r,"Date: ", 6);
+	_httpd_write(r, timeBuf, strlen(timeBuf));
+	_httpd_write(r, "\n", 1);
 
-	_httpd_net_write(r->clientSock, "Connection: close\n", 18);
-	_httpd_net_write(r->clientSock, "Content-Type: ", 14);
-	_httpd_net_write(r->clientSock, r->response.contentType, 
+	_httpd_write(r, "Connection: close\n", 18);
+	_httpd_write(r, "Content-Type: ", 14);
+	_httpd_write(r, r->response.contentType, 
 		strlen(r->response.contentType));
-	_httpd_net_write(r->clientSock, "\n", 1);
+	_httpd_write(r, "\n", 1);
 
 	if (contentLength > 0)
 	{
-		_httpd_net_write(r->clientSock, "Content-Length: ", 16);
+		_httpd_write(r, "Content-Length: ", 16);
 		snprintf(tmpBuf, sizeof(tmpBuf), "%d", contentLength);
-		_httpd_net_write(r->clientSock, tmpBuf, strlen(tmpBuf));
-		_httpd_net_write(r->clientSock, "\n", 1);
+		_httpd_write(r, tmpBuf, strlen(tmpBuf));
+		_httpd_write(r, "\n", 1);
 
 		_httpd_formatTimeString(timeBuf, modTime);
-		_httpd_net_write(r->clientSock, "Last-Modified: ", 15);
-		_httpd_net_write(r->clientSock, timeBuf, strlen(timeBuf));
-		_httpd_net_write(r->clientSock, "\n", 1);
+		_httpd_write(r, "Last-Modified: ", 15);
+		_httpd_write(r, timeBuf, strlen(timeBuf));
+		_httpd_write(r, "\n", 1);
 	}
-	_httpd_net_write(r->clientSock, "\n", 1);
+	_httpd_write(r, "\n", 1);
 }
 
 httpDir *_httpd_findContentDir(server, dir, createFlag)
@@ -462,14 +522,15 @@ httpDir *_httpd_findContentDir(server, dir, createFlag)
 	int	createFlag;
 {
 	char	buffer[HTTP_MAX_URL],
-		*curDir;
+		*curDir,
+		*last;
 	httpDir	*curItem,
 		*curChild;
 
 	strncpy(buffer, dir, HTTP_MAX_URL);
         buffer[HTTP_MAX_URL-1]=0;
 	curItem = server->content;
-	curDir = strtok(buffer,"/");
+	curDir = strtok_r(buffer,"/",&last);
 	while(curDir)
 	{
 		curChild = curItem->children;
@@ -495,7 +556,7 @@ httpDir *_httpd_findContentDir(server, dir, createFlag)
 			}
 		}
 		curItem = curChild;
-		curDir = strtok(NULL,"/");
+		curDir = strtok_r(NULL,"/",&last);
 	}
 	return(curItem);
 }
@@ -583,7 +644,7 @@ void _httpd_catFile(request *r, char *path)
 	while(len > 0)
 	{
 		r->response.responseLength += len;
-		_httpd_net_write(r->clientSock, buf, len);
+		_httpd_write(r, buf, len);
 		len = read(fd, buf, HTTP_MAX_LEN);
 	}
 	close(fd);
@@ -650,7 +711,7 @@ int _httpd_sendDirectoryEntry(httpd *server, request *r, httpContent *entry,
 void _httpd_sendText(request *r, char *msg)
 {
 	r->response.responseLength += strlen(msg);
-	_httpd_net_write(r->clientSock,msg,strlen(msg));
+	_httpd_write(r,msg,strlen(msg));
 }
 
 
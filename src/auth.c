@@ -42,10 +42,14 @@
 #include "conf.h"
 #include "debug.h"
 #include "auth.h"
+#include "schedule.h"
 #include "centralserver.h"
 #include "fw_iptables.h"
 #include "firewall.h"
 #include "client_list.h"
+#include "quota.h"
+#include "auth_cache.h"
+#include "auth_dispatch.h"
 #include "util.h"
 
 /* Defined in clientlist.c */
@@ -62,28 +66,83 @@ extern long served_this_session;
 void
 thread_client_timeout_check(const void *arg)
 {
-	pthread_cond_t		cond = PTHREAD_COND_INITIALIZER;
-	pthread_mutex_t		cond_mutex = PTHREAD_MUTEX_INITIALIZER;
-	struct	timespec	timeout;
+	t_schedule		sched;
+
+	/* Offset within the first authinterval, see schedule.c */
+	schedule_init(&sched, "fw_counter", config_get_config()->authinterval);
 	
 	while (1) {
-		/* Sleep for config.checkinterval seconds... */
-		timeout.tv_sec = time(NULL) + config_get_config()->authinterval;
-		timeout.tv_nsec = 0;
-
-		/* Mutex must be locked for pthread_cond_timedwait... */
-		pthread_mutex_lock(&cond_mutex);
-		
-		/* Thread safe "sleep" */
-		pthread_cond_timedwait(&cond, &cond_mutex, &timeout);
-
-		/* No longer needs to be locked */
-		pthread_mutex_unlock(&cond_mutex);
+		/* Sleep until the next run is due... */
+		schedule_wait(&sched);
 	
 		debug(LOG_DEBUG, "Running fw_counter()");
 	
+		/* Clients time out even while the auth server is down, so this
+		 * one never backs off */
 		fw_sync_with_authserver();
+		schedule_done(&sched, config_get_config()->authinterval, 1);
+	}
+}
+
+/** @internal
+ * A login authorised from the cache, to be confirmed with the auth server
+ */
+typedef struct _t_auth_confirm {
+	char	*ip;
+	char	*mac;
+	char	*token;
+} t_auth_confirm;
+
+/** @internal
+ * @brief Takes the answer to the confirmation of a login that was
+ * authorised from the cache, called from an auth worker. The auth server
+ * still hears about the login, and a client it no longer accepts is cut
+ * off.
+ */
+static void
+_auth_confirmed(const t_authresponse *answer, void *arg)
+{
+	t_auth_confirm	*confirm = arg;
+	t_authresponse	auth_response = *answer;
+	t_client	*client;
+
+	auth_cache_put(confirm->token, confirm->mac, &auth_response);
+
+	LOCK_CLIENT_LIST();
+	client = client_list_find(confirm->ip, confirm->mac);
+	if (client != NULL && strcmp(client->token, confirm->token) == 0) {
+		if (auth_response.authcode == AUTH_ALLOWED) {
+			quota_update(client, &auth_response);
+		}
+		else if (auth_response.authcode != AUTH_ERROR) {
+			debug(LOG_NOTICE, "Auth server no longer accepts token %s from %s at %s (%d), removing client",
+					confirm->token, confirm->ip, confirm->mac, auth_response.authcode);
+			fw_deny(client->ip, client->mac, client->fw_connection_state);
+			client_list_delete(client);
+		}
+	}
+	UNLOCK_CLIENT_LIST();
+
+	free(confirm->ip);
+	free(confirm->mac);
+	free(confirm->token);
+	free(confirm);
+}
+
+/** @internal
+ * @brief Confirms a login that was authorised from the cache from the
+ * calling thread, when it cannot be queued to the auth workers
+ */
+static void
+_auth_confirm(t_auth_confirm *confirm)
+{
+	t_authresponse	auth_response;
+
+	if (auth_dispatch_login(&auth_response, confirm->ip, confirm->mac, confirm->token) == -1) {
+		/* Busy, the next sync pass will catch a revoked token */
+		auth_response.authcode = AUTH_ERROR;
 	}
+	_auth_confirmed(&auth_response, confirm);
 }
 
 /** Authenticates a single client against the central server and returns when done
@@ -95,6 +154,7 @@ authenticate_clienturl(request *r,const char *url)
 {
 	t_client	*client;
 	t_authresponse	auth_response;
+	t_auth_confirm	*confirm = NULL;
 	char	*mac,
 		*token,
 		*safe_url;
@@ -126,8 +186,27 @@ authenticate_clienturl(request *r,const char *url)
 	 * At this point we've released the lock while we do an HTTP request since it could
 	 * take multiple seconds to do and the gateway would effectively be frozen if we
 	 * kept the lock.
+	 *
+	 * A token recently accepted from the same MAC is authorised right away and
+	 * confirmed with the auth server in the background.
 	 */
-	auth_server_request(&auth_response, REQUEST_TYPE_LOGIN, r->clientAddr, mac, token, 0, 0);
+	if (auth_cache_get(token, mac, &auth_response)) {
+		debug(LOG_INFO, "Token %s from %s at %s was accepted recently, authorising from the cache", token, r->clientAddr, mac);
+		confirm = safe_malloc(sizeof(t_auth_confirm));
+		confirm->ip = safe_strdup(r->clientAddr);
+		confirm->mac = safe_strdup(mac);
+		confirm->token = safe_strdup(token);
+	}
+	else if (auth_dispatch_login(&auth_response, r->clientAddr, mac, token) == -1) {
+		send_http_page(r, "网络繁忙", "认证请求过多，请稍后再试");
+		free(token);
+		free(mac);
+		free(safe_url);
+		return;
+	}
+	else {
+		auth_cache_put(token, mac, &auth_response);
+	}
 	
 	LOCK_CLIENT_LIST();
 	
@@ -139,6 +218,12 @@ authenticate_clienturl(request *r,const char *url)
 		UNLOCK_CLIENT_LIST();
 		free(token);
 		free(mac);
+		if (confirm) {
+			free(confirm->ip);
+			free(confirm->mac);
+			free(confirm->token);
+			free(confirm);
+		}
 		return;
 	}
 	
@@ -174,6 +259,8 @@ authenticate_clienturl(request *r,const char *url)
 				"- adding to firewall and redirecting them to activate message", client->token,
 				client->ip, client->mac);
 		client->fw_connection_state = FW_MARK_PROBATION;
+		client_list_authorise(client);
+		quota_apply(client, &auth_response);
 		fw_allow(client->ip, client->mac, FW_MARK_PROBATION);
 		safe_asprintf(&urlFragment, "%smessage=%s",
 			auth_server->serv_msg_script_path_fragment,
@@ -188,6 +275,8 @@ authenticate_clienturl(request *r,const char *url)
 		debug(LOG_INFO, "Got ALLOWED from central server authenticating token %s from %s at %s - "
 				"adding to firewall and redirecting them to portal", client->token, client->ip, client->mac);
 		client->fw_connection_state = FW_MARK_KNOWN;
+		client_list_authorise(client);
+		quota_apply(client, &auth_response);
 		fw_allow(client->ip, client->mac, FW_MARK_KNOWN);
         served_this_session++;
 		safe_asprintf(&urlFragment, "%sgw_id=%s&mac=%s&dev_id=%s&url=%s",
@@ -222,6 +311,13 @@ authenticate_clienturl(request *r,const char *url)
 
 	UNLOCK_CLIENT_LIST();
 	free(safe_url);
+
+	/* The client has its answer, the confirmation goes to the auth workers
+	 * or, when there are none or they are busy, is sent from here */
+	if (confirm && auth_dispatch_login_async(confirm->ip, confirm->mac, confirm->token,
+				_auth_confirmed, confirm) == -1) {
+		_auth_confirm(confirm);
+	}
 	return;
 }
 
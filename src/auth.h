@@ -49,6 +49,10 @@ typedef enum {
  */
 typedef struct _t_authresponse {
     t_authcode authcode; /**< Authentication code returned by the server */
+    int has_quota; /**< Whether the server sent Quota-Bytes or Quota-Time */
+    unsigned long long quota_bytes; /**< Byte allowance, 0 is unlimited */
+    long quota_time; /**< Time allowance in seconds, 0 is unlimited */
+    long cache_ttl; /**< Seconds the verdict may be cached, -1 if the server did not say */
 } t_authresponse;
 
 
@@ -0,0 +1,269 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file auth_cache.c
+    @brief Recent login verdicts of the auth server
+
+    Devices that roam between access points or wake from sleep log in
+    again with the token they already had. The ALLOWED verdicts of the
+    auth server are kept per token and MAC for AuthCacheTTL seconds, or
+    for as long as the server says with a "Cache-TTL:" line, so such a
+    login is authorised without waiting for the server. At most
+    AuthCacheSize verdicts are kept, the least recently used one is
+    dropped first. A verdict is forgotten when its client logs out, is
+    denied, times out or runs out of quota.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "auth.h"
+#include "auth_cache.h"
+
+/** Number of hash buckets */
+#define AUTH_CACHE_BUCKETS 256
+
+/** @internal
+ * A cached verdict
+ */
+typedef struct _t_auth_cache_entry {
+    struct _t_auth_cache_entry *hnext;	/**< @brief Next in the hash bucket */
+    struct _t_auth_cache_entry *prev;	/**< @brief More recently used */
+    struct _t_auth_cache_entry *next;	/**< @brief Less recently used */
+    char *token;
+    char *mac;
+    t_authresponse authresponse;	/**< @brief What the server answered */
+    time_t expires;
+} t_auth_cache_entry;
+
+static t_auth_cache_entry *buckets[AUTH_CACHE_BUCKETS];
+
+/** Most recently used verdict */
+static t_auth_cache_entry *lru_head = NULL;
+/** Least recently used verdict */
+static t_auth_cache_entry *lru_tail = NULL;
+
+static int count = 0;
+static unsigned long hits = 0;
+static unsigned long misses = 0;
+
+static pthread_mutex_t auth_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * @brief Hashes a token
+ */
+static unsigned int
+_auth_cache_hash(const char *token)
+{
+    unsigned int h = 5381;
+
+    while (*token)
+        h = (h << 5) + h + (unsigned char)*token++;
+    return h % AUTH_CACHE_BUCKETS;
+}
+
+/** @internal
+ * @brief Unlinks an entry from the LRU list
+ */
+static void
+_auth_cache_lru_unlink(t_auth_cache_entry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        lru_head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        lru_tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+/** @internal
+ * @brief Makes an entry the most recently used one
+ */
+static void
+_auth_cache_lru_push(t_auth_cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head)
+        lru_head->prev = entry;
+    else
+        lru_tail = entry;
+    lru_head = entry;
+}
+
+/** @internal
+ * @brief Removes and frees an entry, must be called with the cache locked
+ */
+static void
+_auth_cache_remove(t_auth_cache_entry *entry)
+{
+    t_auth_cache_entry **pp;
+
+    for (pp = &buckets[_auth_cache_hash(entry->token)]; *pp != entry; pp = &(*pp)->hnext)
+        ;
+    *pp = entry->hnext;
+    _auth_cache_lru_unlink(entry);
+    count--;
+
+    free(entry->token);
+    free(entry->mac);
+    free(entry);
+}
+
+/** @internal
+ * @brief Finds the entry of a token and MAC, must be called with the cache
+ * locked
+ */
+static t_auth_cache_entry *
+_auth_cache_find(const char *token, const char *mac)
+{
+    t_auth_cache_entry *entry;
+
+    for (entry = buckets[_auth_cache_hash(token)]; entry != NULL; entry = entry->hnext) {
+        if (strcmp(entry->token, token) == 0 && strcasecmp(entry->mac, mac) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+/** Looks up a recent verdict for a token used from a MAC
+ * @param token Token of the client
+ * @param mac MAC of the client
+ * @param authresponse Receives the cached answer on a hit
+ * @return 1 if the login can be authorised from the cache, 0 otherwise
+ */
+int
+auth_cache_get(const char *token, const char *mac, t_authresponse *authresponse)
+{
+    t_auth_cache_entry *entry;
+    int found = 0;
+
+    pthread_mutex_lock(&auth_cache_mutex);
+    if ((entry = _auth_cache_find(token, mac)) != NULL) {
+        if (entry->expires > time(NULL)) {
+            *authresponse = entry->authresponse;
+            _auth_cache_lru_unlink(entry);
+            _auth_cache_lru_push(entry);
+            found = 1;
+        } else {
+            _auth_cache_remove(entry);
+        }
+    }
+    if (found)
+        hits++;
+    else
+        misses++;
+    pthread_mutex_unlock(&auth_cache_mutex);
+
+    return found;
+}
+
+/** Remembers the verdict of a login. Only ALLOWED verdicts are kept, any
+ * other answer but an error drops what was known for the token and MAC.
+ * @param token Token of the client
+ * @param mac MAC of the client
+ * @param authresponse The answer of the auth server
+ */
+void
+auth_cache_put(const char *token, const char *mac, const t_authresponse *authresponse)
+{
+    s_config *config = config_get_config();
+    t_auth_cache_entry *entry;
+    unsigned int h;
+    long ttl;
+
+    if (authresponse->authcode == AUTH_ERROR)
+        return;
+
+    ttl = (authresponse->cache_ttl >= 0) ? authresponse->cache_ttl : config->auth_cache_ttl;
+
+    pthread_mutex_lock(&auth_cache_mutex);
+
+    if ((entry = _auth_cache_find(token, mac)) != NULL)
+        _auth_cache_remove(entry);
+
+    if (authresponse->authcode != AUTH_ALLOWED || ttl <= 0 || config->auth_cache_size <= 0) {
+        pthread_mutex_unlock(&auth_cache_mutex);
+        return;
+    }
+
+    while (count >= config->auth_cache_size && lru_tail != NULL)
+        _auth_cache_remove(lru_tail);
+
+    entry = safe_malloc(sizeof(t_auth_cache_entry));
+    memset(entry, 0, sizeof(t_auth_cache_entry));
+    entry->token = safe_strdup(token);
+    entry->mac = safe_strdup(mac);
+    entry->authresponse = *authresponse;
+    entry->expires = time(NULL) + ttl;
+
+    h = _auth_cache_hash(token);
+    entry->hnext = buckets[h];
+    buckets[h] = entry;
+    _auth_cache_lru_push(entry);
+    count++;
+
+    pthread_mutex_unlock(&auth_cache_mutex);
+
+    debug(LOG_DEBUG, "Caching verdict for token %s at %s for %ld seconds", token, mac, ttl);
+}
+
+/** Forgets every verdict for a token, whatever MAC it was used from
+ * @param token Token of the client
+ */
+void
+auth_cache_invalidate(const char *token)
+{
+    t_auth_cache_entry *entry, *next;
+
+    pthread_mutex_lock(&auth_cache_mutex);
+    for (entry = buckets[_auth_cache_hash(token)]; entry != NULL; entry = next) {
+        next = entry->hnext;
+        if (strcmp(entry->token, token) == 0)
+            _auth_cache_remove(entry);
+    }
+    pthread_mutex_unlock(&auth_cache_mutex);
+}
+
+/** Reads the cache counters
+ * @param stats Receives the counters
+ */
+void
+auth_cache_get_stats(t_auth_cache_stats *stats)
+{
+    pthread_mutex_lock(&auth_cache_mutex);
+    stats->count = count;
+    stats->hits = hits;
+    stats->misses = misses;
+    pthread_mutex_unlock(&auth_cache_mutex);
+}
@@ -0,0 +1,52 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file auth_cache.h
+    @brief Recent login verdicts of the auth server
+*/
+
+#ifndef _AUTH_CACHE_H_
+#define _AUTH_CACHE_H_
+
+#include "auth.h"
+
+/**
+ * @brief Counters shown in the status page
+ */
+typedef struct _t_auth_cache_stats {
+    int count;			/**< @brief Verdicts cached */
+    unsigned long hits;		/**< @brief Logins authorised from the cache */
+    unsigned long misses;	/**< @brief Logins that went to the auth server */
+} t_auth_cache_stats;
+
+/** @brief Looks up a recent verdict for a token used from a MAC */
+int auth_cache_get(const char *token, const char *mac, t_authresponse *authresponse);
+
+/** @brief Remembers the verdict of a login, or forgets a refused one */
+void auth_cache_put(const char *token, const char *mac, const t_authresponse *authresponse);
+
+/** @brief Forgets every verdict for a token */
+void auth_cache_invalidate(const char *token);
+
+/** @brief Reads the cache counters */
+void auth_cache_get_stats(t_auth_cache_stats *stats);
+
+#endif /* _AUTH_CACHE_H_ */
@@ -0,0 +1,355 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file auth_dispatch.c
+    @brief Bounded pool of threads sending login requests to the auth server
+
+    Every portal connection runs in its own thread, so a crowd of phones
+    arriving together used to open as many simultaneous login requests to
+    the auth server. Logins now go through a queue served by AuthWorkers
+    threads. The queue holds at most AuthQueueMax logins; past that new
+    logins are refused at once so the portal can tell the user to retry
+    instead of piling up threads. A login for a token and MAC that is
+    already queued or being sent joins it, and every waiter gets the one
+    answer.
+
+    Logins nobody waits for, such as the confirmation of a login served
+    from the auth cache, go through the same queue with a callback the
+    worker calls with the answer.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "auth.h"
+#include "centralserver.h"
+#include "auth_dispatch.h"
+
+/** Weight of a new sample in the latency averages, as a shift */
+#define AUTH_DISPATCH_EWMA_SHIFT 3
+
+/** @internal
+ * A login queued or being sent
+ */
+typedef struct _t_auth_job {
+    struct _t_auth_job *next;	/**< @brief Next in the queue */
+    struct _t_auth_job *jnext;	/**< @brief Next in the list of jobs */
+    char *ip;
+    char *mac;
+    char *token;
+    t_authresponse authresponse;	/**< @brief Answer, once done */
+    int done;			/**< @brief The answer is in */
+    int waiters;		/**< @brief Threads waiting for the answer */
+    auth_dispatch_callback cb;	/**< @brief Called with the answer, or NULL */
+    void *cb_arg;		/**< @brief Passed to cb */
+    struct timeval queued_at;	/**< @brief When the first waiter came */
+} t_auth_job;
+
+/** Queue of logins waiting for a worker */
+static t_auth_job *queue_head = NULL;
+static t_auth_job *queue_tail = NULL;
+
+/** Every job not yet freed, queued or not, for coalescing */
+static t_auth_job *jobs = NULL;
+
+static t_auth_dispatch_stats stats;
+
+static pthread_mutex_t dispatch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signalled when a login is queued */
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/** Broadcast when a login is answered */
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+/** @internal
+ * @brief Milliseconds elapsed since a time
+ */
+static unsigned long
+_ms_since(const struct timeval *since)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_usec - since->tv_usec) / 1000;
+}
+
+/** @internal
+ * @brief Adds a latency sample to an average and a maximum
+ */
+static void
+_record(unsigned long *avg, unsigned long *max, unsigned long ms)
+{
+    if (*avg == 0)
+        *avg = ms;
+    else
+        *avg = *avg - (*avg >> AUTH_DISPATCH_EWMA_SHIFT) + (ms >> AUTH_DISPATCH_EWMA_SHIFT);
+    if (ms > *max)
+        *max = ms;
+}
+
+/** @internal
+ * @brief Unlinks and frees a job nobody waits for any more, must be called
+ * with the dispatcher locked
+ */
+static void
+_job_free(t_auth_job *job)
+{
+    t_auth_job **pp;
+
+    for (pp = &jobs; *pp != job; pp = &(*pp)->jnext)
+        ;
+    *pp = job->jnext;
+
+    free(job->ip);
+    free(job->mac);
+    free(job->token);
+    free(job);
+}
+
+/** @internal
+ * @brief Worker thread, sends queued logins one at a time
+ */
+static void
+_auth_worker(void *arg)
+{
+    t_authresponse authresponse;
+    struct timeval started;
+    t_auth_job *job;
+    auth_dispatch_callback cb;
+    void *cb_arg;
+
+    pthread_mutex_lock(&dispatch_mutex);
+    while (1) {
+        while (queue_head == NULL)
+            pthread_cond_wait(&queue_cond, &dispatch_mutex);
+
+        job = queue_head;
+        queue_head = job->next;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        stats.queued--;
+        stats.in_flight++;
+        _record(&stats.wait_ms, &stats.wait_ms_max, _ms_since(&job->queued_at));
+        pthread_mutex_unlock(&dispatch_mutex);
+
+        /* The job cannot go away while it is not done */
+        gettimeofday(&started, NULL);
+        auth_server_request(&authresponse, REQUEST_TYPE_LOGIN, job->ip, job->mac, job->token, 0, 0);
+
+        pthread_mutex_lock(&dispatch_mutex);
+        _record(&stats.upstream_ms, &stats.upstream_ms_max, _ms_since(&started));
+        stats.in_flight--;
+        job->authresponse = authresponse;
+        job->done = 1;
+        cb = job->cb;
+        cb_arg = job->cb_arg;
+        if (job->waiters == 0)
+            _job_free(job);
+        else
+            pthread_cond_broadcast(&done_cond);
+
+        if (cb != NULL) {
+            pthread_mutex_unlock(&dispatch_mutex);
+            cb(&authresponse, cb_arg);
+            pthread_mutex_lock(&dispatch_mutex);
+        }
+    }
+}
+
+/** @internal
+ * @brief Queues a new job for a login, must be called with the dispatcher
+ * locked
+ */
+static t_auth_job *
+_job_queue(const char *ip, const char *mac, const char *token)
+{
+    t_auth_job *job;
+
+    job = safe_malloc(sizeof(t_auth_job));
+    memset(job, 0, sizeof(t_auth_job));
+    job->ip = safe_strdup(ip);
+    job->mac = safe_strdup(mac);
+    job->token = safe_strdup(token);
+    gettimeofday(&job->queued_at, NULL);
+
+    job->jnext = jobs;
+    jobs = job;
+    if (queue_tail)
+        queue_tail->next = job;
+    else
+        queue_head = job;
+    queue_tail = job;
+
+    if (++stats.queued > stats.queued_peak)
+        stats.queued_peak = stats.queued;
+    pthread_cond_signal(&queue_cond);
+    return job;
+}
+
+/** Starts AuthWorkers worker threads. With no workers logins are sent
+ * from the calling thread, as before.
+ */
+void
+auth_dispatch_init(void)
+{
+    pthread_t tid;
+    int i, n = config_get_config()->auth_workers;
+
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&tid, NULL, (void *)_auth_worker, NULL) != 0) {
+            debug(LOG_ERR, "Failed to create auth worker thread: only %d started", i);
+            break;
+        }
+        pthread_detach(tid);
+    }
+
+    pthread_mutex_lock(&dispatch_mutex);
+    stats.workers = i;
+    pthread_mutex_unlock(&dispatch_mutex);
+    debug(LOG_INFO, "Started %d auth worker threads", i);
+}
+
+/** Sends a login to the auth server through the worker pool and waits for
+ * the answer. A login for the same token and MAC already in progress is
+ * joined instead of sent again.
+ * @param authresponse Returns the answer of the auth server
+ * @param ip IP of the client
+ * @param mac MAC of the client
+ * @param token Token of the client
+ * @return 0 if authresponse holds the answer, -1 if the queue is full
+ */
+int
+auth_dispatch_login(t_authresponse *authresponse, const char *ip, const char *mac, const char *token)
+{
+    s_config *config = config_get_config();
+    t_auth_job *job;
+    int workers;
+
+    pthread_mutex_lock(&dispatch_mutex);
+    stats.requests++;
+    workers = stats.workers;
+
+    for (job = jobs; job != NULL; job = job->jnext) {
+        if (!job->done && strcmp(job->token, token) == 0 && strcasecmp(job->mac, mac) == 0)
+            break;
+    }
+
+    if (job != NULL) {
+        debug(LOG_DEBUG, "Login for token %s at %s already in progress, waiting for it", token, mac);
+        stats.coalesced++;
+    } else if (workers == 0) {
+        pthread_mutex_unlock(&dispatch_mutex);
+        auth_server_request(authresponse, REQUEST_TYPE_LOGIN, ip, mac, token, 0, 0);
+        return 0;
+    } else if (config->auth_queue_max > 0 && stats.queued >= config->auth_queue_max) {
+        debug(LOG_WARNING, "Auth queue is full (%d logins), refusing login from %s", stats.queued, ip);
+        stats.rejected++;
+        pthread_mutex_unlock(&dispatch_mutex);
+        return -1;
+    } else {
+        job = _job_queue(ip, mac, token);
+    }
+
+    job->waiters++;
+    while (!job->done)
+        pthread_cond_wait(&done_cond, &dispatch_mutex);
+
+    *authresponse = job->authresponse;
+    if (--job->waiters == 0)
+        _job_free(job);
+    pthread_mutex_unlock(&dispatch_mutex);
+
+    return 0;
+}
+
+/** Queues a login to the auth server and returns at once; a worker calls
+ * cb with the answer. A login for the same token and MAC already in
+ * progress is joined when it has no callback yet.
+ * @param ip IP of the client
+ * @param mac MAC of the client
+ * @param token Token of the client
+ * @param cb Called from a worker thread with the answer
+ * @param arg Passed to cb
+ * @return 0 if the login was queued, -1 if there are no workers or the
+ * queue is full, in which case cb is not called
+ */
+int
+auth_dispatch_login_async(const char *ip, const char *mac, const char *token,
+        auth_dispatch_callback cb, void *arg)
+{
+    s_config *config = config_get_config();
+    t_auth_job *job;
+
+    pthread_mutex_lock(&dispatch_mutex);
+    if (stats.workers == 0) {
+        pthread_mutex_unlock(&dispatch_mutex);
+        return -1;
+    }
+
+    for (job = jobs; job != NULL; job = job->jnext) {
+        if (!job->done && job->cb == NULL && strcmp(job->token, token) == 0 &&
+                strcasecmp(job->mac, mac) == 0)
+            break;
+    }
+
+    /* Not counted when refused, the caller falls back to auth_dispatch_login() */
+    if (job == NULL && config->auth_queue_max > 0 && stats.queued >= config->auth_queue_max) {
+        pthread_mutex_unlock(&dispatch_mutex);
+        return -1;
+    }
+
+    stats.requests++;
+    stats.background++;
+    if (job != NULL) {
+        debug(LOG_DEBUG, "Login for token %s at %s already in progress, joining it", token, mac);
+        stats.coalesced++;
+    } else {
+        job = _job_queue(ip, mac, token);
+    }
+
+    job->cb = cb;
+    job->cb_arg = arg;
+    pthread_mutex_unlock(&dispatch_mutex);
+
+    return 0;
+}
+
+/** Reads the dispatcher counters
+ * @param out Receives the counters
+ */
+void
+auth_dispatch_get_stats(t_auth_dispatch_stats *out)
+{
+    pthread_mutex_lock(&dispatch_mutex);
+    *out = stats;
+    pthread_mutex_unlock(&dispatch_mutex);
+}
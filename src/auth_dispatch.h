@@ -0,0 +1,66 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file auth_dispatch.h
+    @brief Bounded pool of threads sending login requests to the auth server
+*/
+
+#ifndef _AUTH_DISPATCH_H_
+#define _AUTH_DISPATCH_H_
+
+#include "auth.h"
+
+/**
+ * @brief Counters shown in the status page
+ */
+typedef struct _t_auth_dispatch_stats {
+    int workers;		/**< @brief Worker threads */
+    int queued;			/**< @brief Logins waiting for a worker */
+    int queued_peak;		/**< @brief Highest queue depth seen */
+    int in_flight;		/**< @brief Logins sent to the auth server */
+    unsigned long requests;	/**< @brief Logins asked for */
+    unsigned long background;	/**< @brief Of which nobody waited for */
+    unsigned long coalesced;	/**< @brief Logins that joined an identical one */
+    unsigned long rejected;	/**< @brief Logins refused because the queue was full */
+    unsigned long wait_ms;	/**< @brief Average time in the queue (EWMA) */
+    unsigned long wait_ms_max;	/**< @brief Longest time in the queue */
+    unsigned long upstream_ms;	/**< @brief Average auth server round trip (EWMA) */
+    unsigned long upstream_ms_max;	/**< @brief Longest auth server round trip */
+} t_auth_dispatch_stats;
+
+/** @brief Called by a worker with the answer to a login queued by
+ * auth_dispatch_login_async() */
+typedef void (*auth_dispatch_callback)(const t_authresponse *authresponse, void *arg);
+
+/** @brief Starts the worker threads */
+void auth_dispatch_init(void);
+
+/** @brief Sends a login to the auth server through the worker pool */
+int auth_dispatch_login(t_authresponse *authresponse, const char *ip, const char *mac, const char *token);
+
+/** @brief Queues a login to the auth server without waiting for it */
+int auth_dispatch_login_async(const char *ip, const char *mac, const char *token,
+        auth_dispatch_callback cb, void *arg);
+
+/** @brief Reads the dispatcher counters */
+void auth_dispatch_get_stats(t_auth_dispatch_stats *stats);
+
+#endif /* _AUTH_DISPATCH_H_ */
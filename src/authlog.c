@@ -30,11 +30,13 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <time.h>
 
 #include "httpd.h"
 #include "http.h"
@@ -43,11 +45,17 @@
 #include "debug.h"
 #include "auth.h"
 #include "centralserver.h"
+#include "http_client.h"
 #include "fw_iptables.h"
 #include "firewall.h"
 #include "client_list.h"
 #include "util.h"
 #include "common.h"
+#include "cJSON.h"
+#include "journal.h"
+#include "authlog.h"
+#include "compact_report.h"
+#include "schedule.h"
 
 /* Defined in clientlist.c */
 extern	pthread_mutex_t	client_list_mutex;
@@ -55,104 +63,135 @@ extern	pthread_mutex_t	client_list_mutex;
 /* Defined in util.c */
 extern long served_this_session;
 
+/** Seconds before compact or batch counters are tried again on a log
+ * server that refused them */
+#define LOG_BATCH_RETRY 3600
+
 /** Launches a thread that periodically checks if any of the connections has timed out
 @param arg Must contain a pointer to a string containing the IP adress of the client to check to check
 @todo Also pass MAC adress? 
 @todo This thread loops infinitely, need a watchdog to verify that it is still running?
 */  
-void
-log_with_authserver(void);
 int
-log_server_request(const char *request_type, const char *ip, const char *mac, const char *token, unsigned long long int incoming, unsigned long long int outgoing);
+log_with_authserver(void);
 
 void
 thread_client_timeout_log(const void *arg)
 {
-	pthread_cond_t		cond = PTHREAD_COND_INITIALIZER;
-	pthread_mutex_t		cond_mutex = PTHREAD_MUTEX_INITIALIZER;
-	struct	timespec	timeout;
+	t_schedule		sched;
+
+	/* Offset within the first period, see schedule.c */
+	schedule_init(&sched, "authlog", LOG_INTERVAL);
 	
 	while (1) {
-		/* Sleep for config.checkinterval seconds... */
-		timeout.tv_sec = time(NULL)+30;
-		timeout.tv_nsec = 0;
-
-		/* Mutex must be locked for pthread_cond_timedwait... */
-		pthread_mutex_lock(&cond_mutex);
-		
-		/* Thread safe "sleep" */
-		pthread_cond_timedwait(&cond, &cond_mutex, &timeout);
-
-		/* No longer needs to be locked */
-		pthread_mutex_unlock(&cond_mutex);
+		/* Sleep until the next report is due... */
+		schedule_wait(&sched);
 	
 		debug(LOG_DEBUG, "Running fw_counter()");
 	
-		log_with_authserver();
+		schedule_done(&sched, LOG_INTERVAL, log_with_authserver() == 0);
 	}
 }
 
 
-void
+/** Reports the counters of the clients to the log server. Only clients
+ * whose counters changed since they were last reported are sent, except
+ * every LogKeyframeInterval seconds when all of them are, so the server
+ * can reconcile. They go in one batch request when the log server
+ * understands it, compact if CompactReports is set, otherwise one
+ * request per client. A format the log server refused is left out for
+ * LOG_BATCH_RETRY seconds before it is tried again.
+ * @return 0 on success, -1 if the log server could not be reached
+ */
+int
 log_with_authserver(void)
 {
-    char            *ip, *mac, *token;
-    t_client        *p1, *p2;
-    unsigned long long	    incoming, outgoing;
+    static time_t last_keyframe = 0;
+    static time_t batch_refused = 0;
+    static time_t compact_refused = 0;
+    t_counters_report *reports;
+    t_client_list_stats stats;
+    t_client        *p1;
+    time_t          now = time(NULL);
+    int             keyframe, count, i, rc;
 
+    keyframe = (now - last_keyframe >= config_get_config()->log_keyframe_interval);
+    if (keyframe)
+        last_keyframe = now;
 
     LOCK_CLIENT_LIST();
+    client_list_get_stats(&stats);
+    reports = safe_malloc(sizeof(t_counters_report) * (stats.count + 1));
+    count = 0;
+    for (p1 = client_get_first_client(); NULL != p1; p1 = p1->next) {
+        if (!keyframe && !p1->counters.log_dirty &&
+                p1->counters.incoming == p1->counters.log_incoming &&
+                p1->counters.outgoing == p1->counters.log_outgoing)
+            continue;
+        reports[count].ip = safe_strdup(p1->ip);
+        reports[count].mac = safe_strdup(p1->mac);
+        reports[count].token = safe_strdup(p1->token);
+        reports[count].incoming = p1->counters.log_incoming = p1->counters.incoming;
+        reports[count].outgoing = p1->counters.log_outgoing = p1->counters.outgoing;
+        p1->counters.log_dirty = 0;
+        count++;
+    }
+    UNLOCK_CLIENT_LIST();
 
-    for (p1 = p2 = client_get_first_client(); NULL != p1; p1 = p2) {
-        p2 = p1->next;
-
-        ip = safe_strdup(p1->ip);
-        token = safe_strdup(p1->token);
-        mac = safe_strdup(p1->mac);
-	    outgoing = p1->counters.outgoing;
-	    incoming = p1->counters.incoming;
-	    UNLOCK_CLIENT_LIST();
-            log_server_request(REQUEST_TYPE_COUNTERS, ip, mac, token, incoming, outgoing);
-	    LOCK_CLIENT_LIST();
-        free(ip);
-        free(token);
-        free(mac);
+    debug(LOG_DEBUG, "Reporting %d of %u client(s) to the log server%s", count, stats.count,
+            keyframe ? " (keyframe)" : "");
 
-     }
+    rc = -2;
+    if (count > 0 && config_get_config()->compact_reports &&
+            (compact_refused == 0 || now - compact_refused >= LOG_BATCH_RETRY)) {
+        rc = log_server_request_compact(reports, count);
+        if (rc == -2) {
+            debug(LOG_WARNING, "Log server does not accept compact counters, falling back to JSON for %d seconds", LOG_BATCH_RETRY);
+            compact_refused = now;
+        } else if (rc == 0) {
+            compact_refused = 0;
+        }
+    }
+    if (count > 0 && rc == -2 &&
+            (batch_refused == 0 || now - batch_refused >= LOG_BATCH_RETRY)) {
+        rc = log_server_request_batch(reports, count);
+        if (rc == -2) {
+            debug(LOG_WARNING, "Log server does not support batch counters, falling back to one request per client for %d seconds", LOG_BATCH_RETRY);
+            batch_refused = now;
+        } else if (rc == 0) {
+            batch_refused = 0;
+        }
+    }
 
-	//free(p1);
-	//free(p2);
+    for (i = 0; i < count; i++) {
+        /* Kept for later if the log server cannot be reached */
+        if (rc == -1 || (rc == -2 && log_server_request(REQUEST_TYPE_COUNTERS, reports[i].ip, reports[i].mac,
+                        reports[i].token, reports[i].incoming, reports[i].outgoing) == -1))
+            journal_add(HTTP_SERVER_LOG, JOURNAL_COUNTERS, reports[i].ip, reports[i].mac,
+                    reports[i].token, reports[i].incoming, reports[i].outgoing);
+        free(reports[i].ip);
+        free(reports[i].mac);
+        free(reports[i].token);
+    }
+    free(reports);
 
-    UNLOCK_CLIENT_LIST();
+    return (rc == -1) ? -1 : 0;
 }
 
-int
-log_server_request(const char *request_type, const char *ip, const char *mac, const char *token, unsigned long long int incoming, unsigned long long int outgoing)
+/** Builds the HTTP request log_server_request() sends
+@param buf Buffer the request is written to
+@param size Size of buf
+*/
+void
+log_server_build_request(char *buf, size_t size, const char *request_type, const char *ip, const char *mac, const char *token, unsigned long long int incoming, unsigned long long int outgoing)
 {
-	int sockfd;
-	ssize_t	numbytes;
-	size_t totalbytes;
-	char buf[MAX_BUF];
-	char *tmp;
-	int done, nfds;
-	fd_set			readfds;
-	struct timeval		timeout;
-	
-	/* Blanket default is error. */
-	
-	sockfd = connect_log_server();
-	if (sockfd == -1) {
-		/* Could not connect to any auth server */
-		return -1;
-	}
-
 	/**
 	 * everywhere.
 	 */
-	memset(buf, 0, sizeof(buf));
+	memset(buf, 0, size);
         //safe_token=httpdUrlEncode(token);
-	snprintf(buf, (sizeof(buf) - 1),
-		"GET %s?stage=%s&ip=%s&mac=%s&incoming=%llu&outgoing=%llu&gw_id=%s&token=%s HTTP/1.0\r\n"
+	snprintf(buf, (size - 1),
+		"GET %s?stage=%s&ip=%s&mac=%s&incoming=%llu&outgoing=%llu&gw_id=%s&token=%s HTTP/1.1\r\n"
 		"User-Agent: WiFiDog \r\n"
 		"Host: %s\r\n"
 		"\r\n",
@@ -166,58 +205,201 @@ log_server_request(const char *request_type, const char *ip, const char *mac, co
 		token,
 		"124.127.116.177"
 	);
+}
+
+/** @internal
+ * @brief Tells whether the log server acknowledged a batch. A 2xx status
+ * alone is not enough: a log server that does not know the batch stage
+ * may still answer 200, so the body must be JSON holding a "clients"
+ * array or "result":"OK".
+ */
+static int
+_log_batch_acked(const t_http_response *response)
+{
+	cJSON *root, *item;
+	int acked;
+
+	if (response->body == NULL)
+		return 0;
+	if (!(root = cJSON_Parse(response->body)))
+		return 0;
+	acked = ((item = cJSON_GetObjectItem(root, "clients")) && item->type == cJSON_Array) ||
+		((item = cJSON_GetObjectItem(root, "result")) && item->type == cJSON_String &&
+		 strcasecmp(item->valuestring, "OK") == 0);
+	cJSON_Delete(root);
+	return acked;
+}
+
+/** Sends the counters of many clients to the log server in a single POST
+ * of {"clients":[{"ip","mac","token","incoming","outgoing"},...]}, the
+ * same body as auth_server_request_batch()
+@param reports The clients to report
+@param count Number of entries in reports
+@return 0 on success, -1 if the log server could not be reached or answered
+with an error status, -2 if a 2xx answer did not acknowledge it
+*/
+int
+log_server_request_batch(const t_counters_report *reports, int count)
+{
+	int i, acked;
+	char *body, *request;
+	t_http_response	response;
+	cJSON *root, *clients, *item;
+
+	root = cJSON_CreateObject();
+	clients = cJSON_CreateArray();
+	cJSON_AddItemToObject(root, "clients", clients);
+	for (i = 0; i < count; i++) {
+		item = cJSON_CreateObject();
+		cJSON_AddItemToObject(item, "ip", cJSON_CreateString(reports[i].ip));
+		cJSON_AddItemToObject(item, "mac", cJSON_CreateString(reports[i].mac));
+		cJSON_AddItemToObject(item, "token", cJSON_CreateString(reports[i].token));
+		cJSON_AddItemToObject(item, "incoming", cJSON_CreateNumber((double)reports[i].incoming));
+		cJSON_AddItemToObject(item, "outgoing", cJSON_CreateNumber((double)reports[i].outgoing));
+		cJSON_AddItemToArray(clients, item);
+	}
+	body = cJSON_PrintUnformatted(root);
+	cJSON_Delete(root);
+
+	safe_asprintf(&request,
+		"POST %s?stage=%s&gw_id=%s HTTP/1.1\r\n"
+		"User-Agent: WiFiDog \r\n"
+		"Host: %s\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: %lu\r\n"
+		"\r\n"
+		"%s",
+		"http://Wifi-admin.ctbri.com.cn/auth",
+		REQUEST_TYPE_COUNTERS_BATCH,
+		config_get_config()->gw_mac,
+		"124.127.116.177",
+		(unsigned long)strlen(body),
+		body
+	);
+	free(body);
+
+	debug(LOG_DEBUG, "Sending batch counters for %d clients to log server", count);
+	if (http_client_request(HTTP_SERVER_LOG, request, &response) == -1) {
+		free(request);
+		return -1;
+	}
+	free(request);
+
+	if (response.status < 200 || response.status >= 300) {
+		/* An error page says nothing of the format, keep the reports */
+		debug(LOG_WARNING, "Log server answered the batch counters request with status %d", response.status);
+		http_response_free(&response);
+		return -1;
+	}
+
+	acked = _log_batch_acked(&response);
+	if (!acked)
+		debug(LOG_WARNING, "Log server did not acknowledge the batch counters request");
+	http_response_free(&response);
+
+	return acked ? 0 : -2;
+}
+
+/** Sends the counters of many clients to the log server in a single POST
+ * of compact binary records (see compact_report.c), deflated when wifidog
+ * was built with zlib
+@param reports The clients to report
+@param count Number of entries in reports
+@return 0 on success, -1 if the log server could not be reached or answered
+with an error status, -2 if a 2xx answer did not acknowledge it
+*/
+int
+log_server_request_compact(const t_counters_report *reports, int count)
+{
+	int acked, hlen;
+	char *body, *zbody, *headers, *request;
+	size_t len, zlen;
+	t_http_response	response;
+
+	body = compact_report_encode(reports, count, &len);
+	if ((zbody = compact_report_deflate(body, len, &zlen)) != NULL) {
+		debug(LOG_DEBUG, "Compact counters for %d clients: %lu bytes, %lu deflated",
+				count, (unsigned long)len, (unsigned long)zlen);
+		free(body);
+	}
+
+	hlen = safe_asprintf(&headers,
+		"POST %s?stage=%s&gw_id=%s HTTP/1.1\r\n"
+		"User-Agent: WiFiDog \r\n"
+		"Host: %s\r\n"
+		"Content-Type: %s\r\n"
+		"%s"
+		"Content-Length: %lu\r\n"
+		"\r\n",
+		"http://Wifi-admin.ctbri.com.cn/auth",
+		REQUEST_TYPE_COUNTERS_BATCH,
+		config_get_config()->gw_mac,
+		"124.127.116.177",
+		COMPACT_REPORT_TYPE,
+		zbody ? "Content-Encoding: deflate\r\n" : "",
+		(unsigned long)(zbody ? zlen : len)
+	);
+	if (zbody) {
+		body = zbody;
+		len = zlen;
+	}
+
+	request = safe_malloc(hlen + len);
+	memcpy(request, headers, hlen);
+	memcpy(request + hlen, body, len);
+	free(headers);
+	free(body);
+
+	debug(LOG_DEBUG, "Sending compact counters for %d clients to log server", count);
+	if (http_client_request_len(HTTP_SERVER_LOG, request, hlen + len, &response) == -1) {
+		free(request);
+		return -1;
+	}
+	free(request);
+
+	if (response.status < 200 || response.status >= 300) {
+		/* An error page says nothing of the format, keep the reports */
+		debug(LOG_WARNING, "Log server answered the compact counters request with status %d", response.status);
+		http_response_free(&response);
+		return -1;
+	}
+
+	acked = _log_batch_acked(&response);
+	if (!acked)
+		debug(LOG_WARNING, "Log server did not acknowledge the compact counters request");
+	http_response_free(&response);
+
+	return acked ? 0 : -2;
+}
+
+/** Sends the counters of a client to the log server
+@return 0 on success, -1 if the log server could not be reached or answered
+with an error status
+*/
+int
+log_server_request(const char *request_type, const char *ip, const char *mac, const char *token, unsigned long long int incoming, unsigned long long int outgoing)
+{
+	char buf[MAX_BUF];
+	t_http_response	response;
+
+	log_server_build_request(buf, sizeof(buf), request_type, ip, mac, token, incoming, outgoing);
 
 
 	debug(LOG_DEBUG, "Sending HTTP request to auth server: [%s]\n", buf);
-	send(sockfd, buf, strlen(buf), 0);
-
-	debug(LOG_DEBUG, "Reading response");
-	numbytes = totalbytes = 0;
-	done = 0;
-	do {
-		FD_ZERO(&readfds);
-		FD_SET(sockfd, &readfds);
-		timeout.tv_sec = 30; /* X magic... 30 second is as good a timeout as any */
-		timeout.tv_usec = 0;
-		nfds = sockfd + 1;
-
-		nfds = select(nfds, &readfds, NULL, NULL, &timeout);
-
-		if (nfds > 0) {
-			/** We don't have to use FD_ISSET() because there
-			 *  was only one fd. */
-			numbytes = read(sockfd, buf + totalbytes, MAX_BUF - (totalbytes + 1));
-			if (numbytes < 0) {
-				debug(LOG_ERR, "An error occurred while reading from auth server:");
-				close(sockfd);
-				return -1;
-			}
-			else if (numbytes == 0) {
-				done = 1;
-			}
-			else {
-				totalbytes += numbytes;
-				debug(LOG_DEBUG, "Read %d bytes, total now %d", numbytes, totalbytes);
-			}
-		}
-		else if (nfds == 0) {
-			debug(LOG_ERR, "Timed out reading data via select() from auth server");
-			close(sockfd);
-			return -1;
-		}
-		else if (nfds < 0) {
-			debug(LOG_ERR, "Error reading data via select() from auth server");
-			close(sockfd);
-			return -1;
-		}
-	} while (!done);
-
-	close(sockfd);
-
-	buf[totalbytes] = '\0';
-	debug(LOG_DEBUG, "HTTP Response from Server: [%s]", buf);
+	if (http_client_request(HTTP_SERVER_LOG, buf, &response) == -1) {
+		/* Could not talk to the log server */
+		return -1;
+	}
+
+	debug(LOG_DEBUG, "HTTP Response from Server: [%s]", response.data);
+	if (response.status < 200 || response.status >= 300) {
+		debug(LOG_WARNING, "Log server answered the counters of %s with status %d", ip, response.status);
+		http_response_free(&response);
+		return -1;
+	}
+	http_response_free(&response);
 	
-	return -1;
+	return 0;
 }
 
 
@@ -28,8 +28,34 @@
 #define _AUTH_LOG_H_
 
 #include "httpd.h"
+#include "centralserver.h"
 
+/** Seconds between two reports of the counters to the log server */
+#define LOG_INTERVAL 30
 
 void thread_client_timeout_log(const void *arg);
 
+/** @brief Builds the request sent to the log server for a client */
+void log_server_build_request(char *buf, size_t size,
+			const char *request_type,
+			const char *ip,
+			const char *mac,
+			const char *token,
+			unsigned long long int incoming,
+			unsigned long long int outgoing);
+
+/** @brief Sends the counters of many clients to the log server in one request */
+int log_server_request_batch(const t_counters_report *reports, int count);
+
+/** @brief Sends the counters of many clients to the log server as compact records */
+int log_server_request_compact(const t_counters_report *reports, int count);
+
+/** @brief Sends the counters of a client to the log server */
+int log_server_request(const char *request_type,
+			const char *ip,
+			const char *mac,
+			const char *token,
+			unsigned long long int incoming,
+			unsigned long long int outgoing);
+
 #endif
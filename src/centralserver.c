@@ -46,14 +46,21 @@
 #include "conf.h"
 #include "debug.h"
 #include "centralserver.h"
+#include "cJSON.h"
+#include "http_client.h"
+#include "conn_pool.h"
+#include "dns_cache.h"
+#include "server_health.h"
+#include "net_connect.h"
+#include "journal.h"
 #include "firewall.h"
 #include "../config.h"
 
 extern pthread_mutex_t	config_mutex;
 
-/** Initiates a transaction with the auth server, either to authenticate or to
- * update the traffic counters at the server
-@param authresponse Returns the information given by the central server 
+/** Builds the HTTP request for a transaction with the auth server
+@param buf Buffer the request is written to
+@param size Size of buf
 @param request_type Use the REQUEST_TYPE_* defines in centralserver.h
 @param ip IP adress of the client this request is related to
 @param mac MAC adress of the client this request is related to
@@ -61,43 +68,21 @@ extern pthread_mutex_t	config_mutex;
 @param incoming Current counter of the client's total incoming traffic, in bytes 
 @param outgoing Current counter of the client's total outgoing traffic, in bytes 
 */
-t_authcode
-auth_server_request(t_authresponse *authresponse, const char *request_type, const char *ip, const char *mac, const char *token, unsigned long long int incoming, unsigned long long int outgoing)
+void
+auth_server_build_request(char *buf, size_t size, const char *request_type, const char *ip, const char *mac, const char *token, unsigned long long int incoming, unsigned long long int outgoing)
 {
-	int sockfd;
-	ssize_t	numbytes;
-	size_t totalbytes;
-	char buf[MAX_BUF];
-	char *tmp;
         char *safe_token;
-	int done, nfds;
-	fd_set			readfds;
-	struct timeval		timeout;
-	t_serv	*auth_server = NULL;
-	auth_server = get_auth_server();
-	
-	/* Blanket default is error. */
-	authresponse->authcode = AUTH_ERROR;
-	
-	sockfd = connect_auth_server();
-	if (sockfd == -1) {
-		/* Could not connect to any auth server */
-		return (AUTH_ERROR);
-	}
-
-
-
-
+	t_serv	*auth_server = get_auth_server();
 
 	/**
 	 * TODO: XXX change the PHP so we can harmonize stage as request_type
 	 * everywhere.
 	 */
-	memset(buf, 0, sizeof(buf));
+	memset(buf, 0, size);
         safe_token=httpdUrlEncode(token);
         
-	snprintf(buf, (sizeof(buf) - 1),
-		"GET %s%sstage=%s&dev_id=%s&ip=%s&mac=%s&token=%s&incoming=%llu&outgoing=%llu&gw_id=%s HTTP/1.0\r\n"
+	snprintf(buf, (size - 1),
+		"GET %s%sstage=%s&dev_id=%s&ip=%s&mac=%s&token=%s&incoming=%llu&outgoing=%llu&gw_id=%s HTTP/1.1\r\n"
 		"User-Agent: WiFiDog %s\r\n"
 		"Host: %s\r\n"
 		"\r\n",
@@ -115,84 +100,261 @@ auth_server_request(t_authresponse *authresponse, const char *request_type, cons
 		auth_server->serv_hostname
 	);
         free(safe_token);
+}
 
-	debug(LOG_DEBUG, "Sending HTTP request to auth server: [%s]\n", buf);
-	send(sockfd, buf, strlen(buf), 0);
-
-	debug(LOG_DEBUG, "Reading response");
-	numbytes = totalbytes = 0;
-	done = 0;
-	do {
-		FD_ZERO(&readfds);
-		FD_SET(sockfd, &readfds);
-		timeout.tv_sec = 30; /* XXX magic... 30 second is as good a timeout as any */
-		timeout.tv_usec = 0;
-		nfds = sockfd + 1;
-
-		nfds = select(nfds, &readfds, NULL, NULL, &timeout);
-
-		if (nfds > 0) {
-			/** We don't have to use FD_ISSET() because there
-			 *  was only one fd. */
-			numbytes = read(sockfd, buf + totalbytes, MAX_BUF - (totalbytes + 1));
-			if (numbytes < 0) {
-				debug(LOG_ERR, "An error occurred while reading from auth server: %s", strerror(errno));
-				/* FIXME */
-				close(sockfd);
-				return (AUTH_ERROR);
-			}
-			else if (numbytes == 0) {
-				done = 1;
-			}
-			else {
-				totalbytes += numbytes;
-				debug(LOG_DEBUG, "Read %d bytes, total now %d", numbytes, totalbytes);
-			}
-		}
-		else if (nfds == 0) {
-			debug(LOG_ERR, "Timed out reading data via select() from auth server");
-			/* FIXME */
-			close(sockfd);
-			return (AUTH_ERROR);
-		}
-		else if (nfds < 0) {
-			debug(LOG_ERR, "Error reading data via select() from auth server: %s", strerror(errno));
-			/* FIXME */
-			close(sockfd);
-			return (AUTH_ERROR);
-		}
-	} while (!done);
+/** Reads the answer of the auth server to a request built with
+ * auth_server_build_request()
+@param authresponse Returns the information given by the central server 
+@param data Response of the server, headers included
+*/
+t_authcode
+auth_server_parse_response(t_authresponse *authresponse, const char *data)
+{
+	char *tmp;
 
-	close(sockfd);
+	/* Blanket default is error. */
+	authresponse->authcode = AUTH_ERROR;
+	authresponse->has_quota = 0;
+	authresponse->quota_bytes = 0;
+	authresponse->quota_time = 0;
+	authresponse->cache_ttl = -1;
 
-	buf[totalbytes] = '\0';
-	debug(LOG_DEBUG, "HTTP Response from Server: [%s]", buf);
+	debug(LOG_DEBUG, "HTTP Response from Server: [%s]", data);
 	
-	if ((tmp = strstr(buf, "Auth: "))) {
+	if ((tmp = strstr(data, "Auth: "))) {
 		if (sscanf(tmp, "Auth: %d", (int *)&authresponse->authcode) == 1) {
 			debug(LOG_INFO, "Auth server returned authentication code %d", authresponse->authcode);
+			/* Optional allowances, enforced locally by the quota engine */
+			if ((tmp = strstr(data, "Quota-Bytes: ")) &&
+					sscanf(tmp, "Quota-Bytes: %llu", &authresponse->quota_bytes) == 1)
+				authresponse->has_quota = 1;
+			if ((tmp = strstr(data, "Quota-Time: ")) &&
+					sscanf(tmp, "Quota-Time: %ld", &authresponse->quota_time) == 1)
+				authresponse->has_quota = 1;
+			/* Optional, how long the gateway may reuse this verdict */
+			if ((tmp = strstr(data, "Cache-TTL: ")))
+				sscanf(tmp, "Cache-TTL: %ld", &authresponse->cache_ttl);
 			return(authresponse->authcode);
 		} else {
 			debug(LOG_WARNING, "Auth server did not return expected authentication code");
+			authresponse->authcode = AUTH_ERROR;
 			return(AUTH_ERROR);
 		}
 	}
-	else {
-		return(AUTH_ERROR);
-	}
 
-	/* XXX Never reached because of the above if()/else pair. */
 	return(AUTH_ERROR);
 }
 
+/** Initiates a transaction with the auth server, either to authenticate or to
+ * update the traffic counters at the server
+@param authresponse Returns the information given by the central server 
+@param request_type Use the REQUEST_TYPE_* defines in centralserver.h
+@param ip IP adress of the client this request is related to
+@param mac MAC adress of the client this request is related to
+@param token Authentification token of the client
+@param incoming Current counter of the client's total incoming traffic, in bytes 
+@param outgoing Current counter of the client's total outgoing traffic, in bytes 
+*/
+t_authcode
+auth_server_request(t_authresponse *authresponse, const char *request_type, const char *ip, const char *mac, const char *token, unsigned long long int incoming, unsigned long long int outgoing)
+{
+	char buf[MAX_BUF];
+	t_http_response	response;
+	t_authcode authcode;
+
+	auth_server_build_request(buf, sizeof(buf), request_type, ip, mac, token, incoming, outgoing);
+
+	debug(LOG_DEBUG, "Sending HTTP request to auth server: [%s]\n", buf);
+	if (http_client_request(HTTP_SERVER_AUTH, buf, &response) == -1) {
+		/* Could not talk to any auth server */
+		authresponse->authcode = AUTH_ERROR;
+		authresponse->has_quota = 0;
+		authresponse->cache_ttl = -1;
+		return (AUTH_ERROR);
+	}
+
+	authcode = auth_server_parse_response(authresponse, response.data);
+	http_response_free(&response);
+	return(authcode);
+}
+
+/** Tells the auth server about a logout or new counters when its answer
+ * is of no use. If the auth server is offline or cannot be reached the
+ * notification is journalled and sent once it is back, see journal.c
+@param request_type REQUEST_TYPE_LOGOUT or REQUEST_TYPE_COUNTERS
+@param ip IP adress of the client this request is related to
+@param mac MAC adress of the client this request is related to
+@param token Authentification token of the client
+@param incoming Current counter of the client's total incoming traffic, in bytes 
+@param outgoing Current counter of the client's total outgoing traffic, in bytes 
+*/
+void
+auth_server_notify(const char *request_type, const char *ip, const char *mac, const char *token, unsigned long long int incoming, unsigned long long int outgoing)
+{
+	char buf[MAX_BUF];
+	t_http_response	response;
+
+	if (is_auth_online()) {
+		auth_server_build_request(buf, sizeof(buf), request_type, ip, mac, token, incoming, outgoing);
+		debug(LOG_DEBUG, "Sending HTTP request to auth server: [%s]\n", buf);
+		if (http_client_request(HTTP_SERVER_AUTH, buf, &response) != -1) {
+			debug(LOG_DEBUG, "HTTP Response from Server: [%s]", response.data);
+			http_response_free(&response);
+			return;
+		}
+	}
+
+	journal_add(HTTP_SERVER_AUTH, strcmp(request_type, REQUEST_TYPE_LOGOUT) == 0 ? JOURNAL_LOGOUT : JOURNAL_COUNTERS,
+			ip, mac, token, incoming, outgoing);
+}
+
+/** @internal
+ * @brief Fills the answer for one client of a batch from a JSON object
+ */
+static void
+_batch_apply_answer(t_counters_report *report, cJSON *item)
+{
+	cJSON *field;
+
+	if ((field = cJSON_GetObjectItem(item, "auth")) && field->type == cJSON_Number)
+		report->authresponse.authcode = field->valueint;
+	if ((field = cJSON_GetObjectItem(item, "quota_bytes")) && field->type == cJSON_Number) {
+		report->authresponse.quota_bytes = (unsigned long long)field->valuedouble;
+		report->authresponse.has_quota = 1;
+	}
+	if ((field = cJSON_GetObjectItem(item, "quota_time")) && field->type == cJSON_Number) {
+		report->authresponse.quota_time = (long)field->valuedouble;
+		report->authresponse.has_quota = 1;
+	}
+}
+
+/** @internal
+ * @brief Tells whether a JSON answer object is about the given client
+ */
+static int
+_batch_answer_matches(const t_counters_report *report, cJSON *item)
+{
+	cJSON *mac = cJSON_GetObjectItem(item, "mac");
+	cJSON *token = cJSON_GetObjectItem(item, "token");
+
+	return mac && mac->type == cJSON_String && token && token->type == cJSON_String &&
+		0 == strcmp(mac->valuestring, report->mac) &&
+		0 == strcmp(token->valuestring, report->token);
+}
+
+/** Sends the counters of many clients to the auth server in a single POST
+ * and fills in the answer for each of them.
+ *
+ * The request body is {"clients":[{"ip","mac","token","incoming","outgoing"},...]}
+ * and the server answers {"clients":[{"mac","token","auth"[,"quota_bytes"]
+ * [,"quota_time"]},...]}, preferably in the same order. Clients missing
+ * from the answer are left with AUTH_ERROR.
+@param reports The clients to report, their authresponse is filled in
+@param count Number of entries in reports
+@return 0 on success, -1 if the auth server could not be reached, -2 if
+it answered but does not understand batch requests
+*/
+int
+auth_server_request_batch(t_counters_report *reports, int count)
+{
+	int i, j, nanswers;
+	char *body, *request;
+	t_http_response	response;
+	t_serv	*auth_server = NULL;
+	cJSON *root, *clients, *item;
+
+	for (i = 0; i < count; i++) {
+		reports[i].authresponse.authcode = AUTH_ERROR;
+		reports[i].authresponse.has_quota = 0;
+		reports[i].authresponse.quota_bytes = 0;
+		reports[i].authresponse.quota_time = 0;
+		reports[i].authresponse.cache_ttl = -1;
+	}
+
+	root = cJSON_CreateObject();
+	clients = cJSON_CreateArray();
+	cJSON_AddItemToObject(root, "clients", clients);
+	for (i = 0; i < count; i++) {
+		item = cJSON_CreateObject();
+		cJSON_AddItemToObject(item, "ip", cJSON_CreateString(reports[i].ip));
+		cJSON_AddItemToObject(item, "mac", cJSON_CreateString(reports[i].mac));
+		cJSON_AddItemToObject(item, "token", cJSON_CreateString(reports[i].token));
+		cJSON_AddItemToObject(item, "incoming", cJSON_CreateNumber((double)reports[i].incoming));
+		cJSON_AddItemToObject(item, "outgoing", cJSON_CreateNumber((double)reports[i].outgoing));
+		cJSON_AddItemToArray(clients, item);
+	}
+	body = cJSON_PrintUnformatted(root);
+	cJSON_Delete(root);
+
+	auth_server = get_auth_server();
+
+	safe_asprintf(&request,
+		"POST %s%sstage=%s&dev_id=%s&gw_id=%s HTTP/1.1\r\n"
+		"User-Agent: WiFiDog %s\r\n"
+		"Host: %s\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: %lu\r\n"
+		"\r\n"
+		"%s",
+		auth_server->serv_path,
+		auth_server->serv_auth_script_path_fragment,
+		REQUEST_TYPE_COUNTERS_BATCH,
+		config_get_config()->dev_id,
+		config_get_config()->gw_id,
+		VERSION,
+		auth_server->serv_hostname,
+		(unsigned long)strlen(body),
+		body
+	);
+	free(body);
+
+	debug(LOG_DEBUG, "Sending batch counters for %d clients to auth server", count);
+	if (http_client_request(HTTP_SERVER_AUTH, request, &response) == -1) {
+		free(request);
+		return -1;
+	}
+	free(request);
+
+	if (!(root = cJSON_Parse(response.body))) {
+		debug(LOG_WARNING, "Auth server did not answer the batch counters request with JSON");
+		http_response_free(&response);
+		return -2;
+	}
+	http_response_free(&response);
+
+	if (!(clients = cJSON_GetObjectItem(root, "clients")) || clients->type != cJSON_Array) {
+		debug(LOG_WARNING, "Auth server answer to the batch counters request has no clients array");
+		cJSON_Delete(root);
+		return -2;
+	}
+
+	nanswers = cJSON_GetArraySize(clients);
+	for (i = 0; i < count; i++) {
+		/* Answers normally come back in request order */
+		item = (i < nanswers) ? cJSON_GetArrayItem(clients, i) : NULL;
+		if (!item || !_batch_answer_matches(&reports[i], item)) {
+			for (item = NULL, j = 0; j < nanswers; j++) {
+				if (_batch_answer_matches(&reports[i], cJSON_GetArrayItem(clients, j))) {
+					item = cJSON_GetArrayItem(clients, j);
+					break;
+				}
+			}
+		}
+		if (item)
+			_batch_apply_answer(&reports[i], item);
+	}
+	cJSON_Delete(root);
+
+	debug(LOG_INFO, "Auth server answered batch counters for %d clients", count);
+	return 0;
+}
+
 /* Tries really hard to connect to an auth server. Returns a file descriptor, -1 on error
  */
 int connect_auth_server() {
 	int sockfd;
 
-	LOCK_CONFIG();
 	sockfd = _connect_auth_server(0,0);
-	UNLOCK_CONFIG();
 
 	if (sockfd == -1) {
 		debug(LOG_ERR, "Failed to connect to any of the auth servers");
@@ -208,9 +370,7 @@ int connect_auth_server() {
 int connect_auth_server_ssl() {
 	int sockfd;
 
-	LOCK_CONFIG();
 	sockfd = _connect_auth_server(0,1);
-	UNLOCK_CONFIG();
 
 	if (sockfd == -1) {
 		debug(LOG_ERR, "Failed to connect to any of the auth servers");
@@ -223,14 +383,35 @@ int connect_auth_server_ssl() {
 	return (sockfd);
 }
 
+/** @internal
+ * @brief Looks a central server up in the DNS cache. Only a host name that
+ * was never seen before is resolved on the spot, so this must not be
+ * called with the config locked.
+ * @return Number of addresses stored in addrs, 0 if it does not resolve
+ */
+static int
+_resolve_server(const char *hostname, struct in_addr *addrs)
+{
+	int naddrs;
+
+	naddrs = dns_cache_lookup(hostname, addrs, DNS_CACHE_MAX_ADDRS);
+	if (naddrs == 0)
+		naddrs = dns_cache_resolve(hostname, addrs, DNS_CACHE_MAX_ADDRS);
+
+	return (naddrs > 0) ? naddrs : 0;
+}
+
 /* Helper function called by connect_auth_server() to do the actual work including recursion
  * DO NOT CALL DIRECTLY
+ * The config is only locked while the server list is read or changed, never
+ * across DNS or network I/O.
  @param level recursion level indicator must be 0 when not called by _connect_auth_server()
  */
 int _connect_auth_server(int level,int isssl) {
 	s_config *config = config_get_config();
 	t_serv *auth_server = NULL;
-	struct in_addr *h_addr;
+	struct in_addr addrs[DNS_CACHE_MAX_ADDRS], *h_addr;
+	int naddrs, which;
 	int num_servers = 0;
 	char * hostname = NULL;
 	char * popular_servers[] = {
@@ -240,12 +421,14 @@ int _connect_auth_server(int level,int isssl) {
 	};
 	char ** popularserver;
 	char * ip;
-	struct sockaddr_in their_addr;
+	int port;
 	int sockfd;
 
 	/* XXX level starts out at 0 and gets incremented by every iterations. */
 	level++;
 
+	LOCK_CONFIG();
+
 	/*
 	 * Let's calculate the number of servers we have
 	 */
@@ -260,17 +443,31 @@ int _connect_auth_server(int level,int isssl) {
 		 * This means we've cycled through all the servers in the server list
 		 * at least once and none are accessible
 		 */
+		UNLOCK_CONFIG();
 		return (-1);
 	}
 
 	/*
-	 * Let's resolve the hostname of the top server to an IP address
+	 * Pick the best server that is not known to be down, and make it the
+	 * top of the list
 	 */
-	auth_server = config->auth_servers;
+	if ((auth_server = server_health_select(&config->auth_servers)) == NULL) {
+		debug(LOG_DEBUG, "Level %d: Every auth server is down, not trying to connect", level);
+		UNLOCK_CONFIG();
+		return (-1);
+	}
+
+	/* Servers are never freed, so these stay valid once unlocked */
 	hostname = auth_server->serv_hostname;
+	port = isssl ? auth_server->serv_ssl_port : auth_server->serv_http_port;
+	UNLOCK_CONFIG();
+
+	/*
+	 * Let's resolve the hostname of the top server to an IP address
+	 */
 	debug(LOG_DEBUG, "Level %d: Resolving auth server [%s]", level, hostname);
-	h_addr = wd_gethostbyname(hostname);
-	if (!h_addr) {
+	naddrs = _resolve_server(hostname, addrs);
+	if (!naddrs) {
 		/*
 		 * DNS resolving it failed
 		 *
@@ -303,11 +500,13 @@ int _connect_auth_server(int level,int isssl) {
 			 * The auth server's DNS server is probably dead. Try the next auth server
 			 */
 			debug(LOG_DEBUG, "Level %d: Marking auth server [%s] as bad and trying next if possible", level, hostname);
+			LOCK_CONFIG();
 			if (auth_server->last_ip) {
 				free(auth_server->last_ip);
 				auth_server->last_ip = NULL;
 			}
 			mark_auth_server_bad(auth_server);
+			UNLOCK_CONFIG();
 			return _connect_auth_server(level,isssl);
 		}
 		else {
@@ -327,9 +526,26 @@ int _connect_auth_server(int level,int isssl) {
 		/*
 		 * DNS resolving was successful
 		 */
-		ip = safe_strdup(inet_ntoa(*h_addr));
-		debug(LOG_DEBUG, "Level %d: Resolving auth server [%s] succeeded = [%s]", level, hostname, ip);
+		debug(LOG_DEBUG, "Level %d: Resolving auth server [%s] succeeded with %d address(es)", level, hostname, naddrs);
 
+		/*
+		 * Connect to it
+		 */
+		debug(LOG_DEBUG, "Level %d: Connecting to auth server %s:%d", level, hostname, port);
+		if ((sockfd = net_connect(hostname, addrs, naddrs, port, &which)) == -1) {
+			/*
+			 * Failed to connect
+			 * Mark the server as bad and try the next one
+			 */
+			debug(LOG_DEBUG, "Level %d: Failed to connect to auth server %s:%d. Marking it as bad and trying next if possible", level, hostname, port);
+			LOCK_CONFIG();
+			mark_auth_server_bad(auth_server);
+			UNLOCK_CONFIG();
+			return _connect_auth_server(level,isssl); /* Yay recursion! */
+		}
+
+		ip = safe_strdup(inet_ntoa(addrs[which]));
+		LOCK_CONFIG();
 		if (!auth_server->last_ip || strcmp(auth_server->last_ip, ip) != 0) {
 			/*
 			 * But the IP address is different from the last one we knew
@@ -338,6 +554,7 @@ int _connect_auth_server(int level,int isssl) {
 			debug(LOG_DEBUG, "Level %d: Updating last_ip IP of server [%s] to [%s]", level, hostname, ip);
 			if (auth_server->last_ip) free(auth_server->last_ip);
 			auth_server->last_ip = ip;
+			conn_pool_flush(auth_server);
 
 			/* Update firewall rules */
 			fw_clear_authservers();
@@ -349,39 +566,13 @@ int _connect_auth_server(int level,int isssl) {
 			 */
 			free(ip);
 		}
+		UNLOCK_CONFIG();
 
 		/*
-		 * Connect to it
+		 * We have successfully connected
 		 */
-		debug(LOG_DEBUG, "Level %d: Connecting to auth server %s:%d", level, hostname, auth_server->serv_http_port);
-		their_addr.sin_family = AF_INET;
-		their_addr.sin_port = htons(auth_server->serv_http_port);
-		their_addr.sin_addr = *h_addr;
-		memset(&(their_addr.sin_zero), '\0', sizeof(their_addr.sin_zero));
-		free (h_addr);
-
-		if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-			debug(LOG_ERR, "Level %d: Failed to create a new SOCK_STREAM socket: %s", strerror(errno));
-			return(-1);
-		}
-
-		if (connect(sockfd, (struct sockaddr *)&their_addr, sizeof(struct sockaddr)) == -1) {
-			/*
-			 * Failed to connect
-			 * Mark the server as bad and try the next one
-			 */
-			debug(LOG_DEBUG, "Level %d: Failed to connect to auth server %s:%d (%s). Marking it as bad and trying next if possible", level, hostname, auth_server->serv_http_port, strerror(errno));
-			close(sockfd);
-			mark_auth_server_bad(auth_server);
-			return _connect_auth_server(level,isssl); /* Yay recursion! */
-		}
-		else {
-			/*
-			 * We have successfully connected
-			 */
-			debug(LOG_DEBUG, "Level %d: Successfully connected to auth server %s:%d", level, hostname, auth_server->serv_http_port);
-			return sockfd;
-		}
+		debug(LOG_DEBUG, "Level %d: Successfully connected to auth server %s:%d", level, hostname, port);
+		return sockfd;
 	}
 }
 
@@ -391,45 +582,58 @@ int connect_log_server() {
 	int sockfd;
 
 	debug(LOG_DEBUG, "connected to log  server");
-	LOCK_CONFIG();
 	sockfd = _connect_log_server(0,0);
-	UNLOCK_CONFIG();
 
 	return (sockfd);
 }
 int connect_log_server_ssl() {
 	int sockfd;
 
-	LOCK_CONFIG();
 	sockfd = _connect_log_server(0,1);
-	UNLOCK_CONFIG();
 
 	return (sockfd);
 }
 
 int _connect_log_server(int level,int isssl) {
 	t_serv *log_server = NULL;
-	struct in_addr *h_addr;
-	int num_servers = 0;
+	struct in_addr addrs[DNS_CACHE_MAX_ADDRS];
+	int naddrs, which;
 	char * hostname = NULL;
 	char * ip;
-	struct sockaddr_in their_addr;
+	int port;
 	int sockfd;
 
-	log_server = get_log_server();
+	LOCK_CONFIG();
+	if ((log_server = server_health_select(&config_get_config()->log_servers)) == NULL) {
+		debug(LOG_DEBUG, "Every log server is down, not trying to connect");
+		UNLOCK_CONFIG();
+		return(-1);
+	}
 	hostname = log_server->serv_hostname;
-	h_addr = wd_gethostbyname(hostname);
+	port = isssl ? log_server->serv_ssl_port : log_server->serv_http_port;
+	UNLOCK_CONFIG();
+
+	naddrs = _resolve_server(hostname, addrs);
 
 
 
-	if (!h_addr) {
+	if (!naddrs) {
+		server_health_failure(log_server);
 		return(-1);
 	}
 	else {
-		ip = safe_strdup(inet_ntoa(*h_addr));
+		if ((sockfd = net_connect(hostname, addrs, naddrs, port, &which)) == -1) {
+			debug(LOG_DEBUG, "connect fail");
+			server_health_failure(log_server);
+			return(-1);
+		}
+
+		ip = safe_strdup(inet_ntoa(addrs[which]));
+		LOCK_CONFIG();
 		if (!log_server->last_ip || strcmp(log_server->last_ip, ip) != 0) {
 			if (log_server->last_ip) free(log_server->last_ip);
 			log_server->last_ip = ip;
+			conn_pool_flush(log_server);
 
 			fw_clear_logservers();
 			fw_set_logservers();
@@ -440,34 +644,10 @@ int _connect_log_server(int level,int isssl) {
 			 */
 			free(ip);
 		}
+		UNLOCK_CONFIG();
 
-
-		debug(LOG_DEBUG, "connected to log  server");
-		their_addr.sin_family = AF_INET;
-		if(isssl) 
-			their_addr.sin_port = htons(log_server->serv_ssl_port);
-		else
-			their_addr.sin_port = htons(log_server->serv_http_port);
-		memset(&(their_addr.sin_zero), '\0', sizeof(their_addr.sin_zero));
-		their_addr.sin_addr = *h_addr;
-		free(h_addr);
-
-
-		if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-		debug(LOG_DEBUG, "sock fail");
-			return(-1);
-		}
-
-		if (connect(sockfd, (struct sockaddr *)&their_addr, sizeof(struct sockaddr)) == -1) {
-			debug(LOG_DEBUG, "connect fail");
-
-			close(sockfd);
-			return(-1);
-		}
-		else {
-			debug(LOG_DEBUG, "success connect log");
-			return sockfd;
-		}
+		debug(LOG_DEBUG, "success connect log");
+		return sockfd;
 	}
 }
 
@@ -475,9 +655,7 @@ int _connect_log_server(int level,int isssl) {
 int connect_update_server() {
 	int sockfd;
 
-	LOCK_CONFIG();
 	sockfd = _connect_update_server(0,0);
-	UNLOCK_CONFIG();
 
 	if (sockfd == -1) {
 		debug(LOG_ERR, "Failed to connect to update server");
@@ -491,9 +669,7 @@ int connect_update_server() {
 int connect_update_server_ssl() {
 	int sockfd;
 
-	LOCK_CONFIG();
 	sockfd = _connect_update_server(0,1);
-	UNLOCK_CONFIG();
 
 	if (sockfd == -1) {
 		debug(LOG_ERR, "Failed to connect to update server");
@@ -509,45 +685,42 @@ int connect_update_server_ssl() {
  * @param level recursion level indicator must be 0 when not called by _connect_update_server()
  */
 int _connect_update_server(int level, int isssl) {
-	struct in_addr	*h_addr;
+	struct in_addr	addrs[DNS_CACHE_MAX_ADDRS];
+	int		naddrs, which;
 	char		*hostname = NULL;
 
-	struct sockaddr_in	their_addr;
 	int			sockfd;
 	s_config	*config = config_get_config();
 	t_serv		*update_server = NULL;
+	int		port;
 
-	update_server = config->update_servers;
+	LOCK_CONFIG();
+	if ((update_server = server_health_select(&config->update_servers)) == NULL) {
+		debug(LOG_DEBUG,  "Every update server is down, not trying to connect");
+		UNLOCK_CONFIG();
+		return (-1);
+	}
 	hostname = update_server->serv_hostname;
+	port = isssl ? update_server->serv_ssl_port : update_server->serv_http_port;
+	UNLOCK_CONFIG();
+
 	debug(LOG_DEBUG,  "Update server [%s] ", hostname);
-	h_addr = wd_gethostbyname(hostname);
+	naddrs = _resolve_server(hostname, addrs);
 
-	if (!h_addr) {
+	if (!naddrs) {
 		debug(LOG_DEBUG,  "Resolving update server [%s] failed", hostname);
+		server_health_failure(update_server);
 		return (-1);
 	}
 	else {
-		their_addr.sin_family = AF_INET;
-		their_addr.sin_port = htons(update_server->serv_http_port);
-		their_addr.sin_addr = *h_addr;
-		memset(&(their_addr.sin_zero), '\0', sizeof(their_addr.sin_zero));
-		free (h_addr);
-
-		if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-			debug(LOG_DEBUG,  "Socket failed");
-			return (-1);
-		}
-
-		if (connect(sockfd, (struct sockaddr *)&their_addr, sizeof(struct sockaddr)) == -1) {
+		if ((sockfd = net_connect(hostname, addrs, naddrs, port, &which)) == -1) {
 			debug(LOG_DEBUG,  "Connect failed");
-			close(sockfd);
+			server_health_failure(update_server);
 			return (-1);
 		}
 		else {
-			debug(LOG_DEBUG, "Level %d: Successfully connected to update server [%s:%d]", level, hostname, update_server->serv_http_port);
+			debug(LOG_DEBUG, "Level %d: Successfully connected to update server [%s:%d]", level, hostname, port);
 			return sockfd;
 		}
 	}
 }
-
-
@@ -35,6 +35,8 @@
 #define REQUEST_TYPE_LOGOUT    "logout"
 /** @brief Update the central server's traffic counters */
 #define REQUEST_TYPE_COUNTERS  "counters"
+/** @brief Update the central server's traffic counters for every client at once */
+#define REQUEST_TYPE_COUNTERS_BATCH  "counters_batch"
 
 /** @brief Sent when the user's token is denied by the central server */
 #define GATEWAY_MESSAGE_DENIED     "denied"
@@ -54,6 +56,42 @@ t_authcode auth_server_request(t_authresponse *authresponse,
 			unsigned long long int incoming,
 			unsigned long long int outgoing);
 
+/** @brief Tells the auth server about a logout or counters, journalling
+ * them if it cannot be reached */
+void auth_server_notify(const char *request_type,
+			const char *ip,
+			const char *mac,
+			const char *token,
+			unsigned long long int incoming,
+			unsigned long long int outgoing);
+
+/** @brief Builds the request auth_server_request() sends */
+void auth_server_build_request(char *buf, size_t size,
+			const char *request_type,
+			const char *ip,
+			const char *mac,
+			const char *token,
+			unsigned long long int incoming,
+			unsigned long long int outgoing);
+
+/** @brief Reads the auth server answer to such a request */
+t_authcode auth_server_parse_response(t_authresponse *authresponse, const char *data);
+
+/**
+ * @brief One client in a batch counters request, with the answer for it
+ */
+typedef struct _t_counters_report {
+    char *ip;			/**< @brief IP of the client */
+    char *mac;			/**< @brief MAC of the client */
+    char *token;		/**< @brief Token of the client */
+    unsigned long long incoming;	/**< @brief Incoming counter */
+    unsigned long long outgoing;	/**< @brief Outgoing counter */
+    t_authresponse authresponse;	/**< @brief Answer of the auth server */
+} t_counters_report;
+
+/** @brief Sends the counters of many clients to the auth server in one request */
+int auth_server_request_batch(t_counters_report *reports, int count);
+
 /** @brief Tries really hard to connect to an auth server.  Returns a connected file descriptor or -1 on error */
 int connect_auth_server();
 int connect_auth_server_ssl();
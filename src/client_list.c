@@ -43,15 +43,174 @@
 #include "debug.h"
 #include "conf.h"
 #include "client_list.h"
+#include "firewall.h"
 
 /** Global mutex to protect access to the client list */
 pthread_mutex_t client_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/** Number of buckets in each client hash index, must be a power of two */
+#define CLIENT_HASH_SIZE 256
+
 /** @internal
  * Holds a pointer to the first element of the list 
  */ 
 t_client         *firstclient = NULL;
 
+/** @internal
+ * Holds a pointer to the last element of the list, so appending is O(1)
+ */
+static t_client *lastclient = NULL;
+
+/** @internal
+ * Hash indexes over the client list, chained through the *_hnext members
+ */
+static t_client *ip_hash[CLIENT_HASH_SIZE];
+static t_client *mac_hash[CLIENT_HASH_SIZE];
+static t_client *token_hash[CLIENT_HASH_SIZE];
+
+/** @internal
+ * Clients that are not authorised yet, most recently seen first. The tail
+ * is the first candidate for eviction.
+ */
+static t_client *pending_head = NULL;
+static t_client *pending_tail = NULL;
+
+/** @internal
+ * Admission control counters
+ */
+static t_client_list_stats stats;
+
+/** @internal
+ * @brief Hashes a string into a bucket index
+ */
+static unsigned int
+_client_list_hash(const char *str)
+{
+    unsigned int hash = 5381;
+
+    if (str == NULL)
+        return 0;
+
+    while (*str)
+        hash = ((hash << 5) + hash) + (unsigned char)*str++;
+
+    return hash & (CLIENT_HASH_SIZE - 1);
+}
+
+/** @internal
+ * @brief Adds a client to the IP, MAC and token hash indexes
+ */
+static void
+_client_list_hash_add(t_client * client)
+{
+    unsigned int bucket;
+
+    bucket = _client_list_hash(client->ip);
+    client->ip_hnext = ip_hash[bucket];
+    ip_hash[bucket] = client;
+
+    bucket = _client_list_hash(client->mac);
+    client->mac_hnext = mac_hash[bucket];
+    mac_hash[bucket] = client;
+
+    bucket = _client_list_hash(client->token);
+    client->token_hnext = token_hash[bucket];
+    token_hash[bucket] = client;
+}
+
+/** @internal
+ * @brief Removes a client from the IP, MAC and token hash indexes
+ */
+static void
+_client_list_hash_remove(t_client * client)
+{
+    t_client **pp;
+
+    for (pp = &ip_hash[_client_list_hash(client->ip)]; *pp != NULL; pp = &(*pp)->ip_hnext) {
+        if (*pp == client) {
+            *pp = client->ip_hnext;
+            break;
+        }
+    }
+
+    for (pp = &mac_hash[_client_list_hash(client->mac)]; *pp != NULL; pp = &(*pp)->mac_hnext) {
+        if (*pp == client) {
+            *pp = client->mac_hnext;
+            break;
+        }
+    }
+
+    for (pp = &token_hash[_client_list_hash(client->token)]; *pp != NULL; pp = &(*pp)->token_hnext) {
+        if (*pp == client) {
+            *pp = client->token_hnext;
+            break;
+        }
+    }
+}
+
+/** @internal
+ * @brief Puts a client at the head of the pending LRU
+ */
+static void
+_client_list_pending_link(t_client * client)
+{
+    client->pending = 1;
+    client->pending_prev = NULL;
+    client->pending_next = pending_head;
+
+    if (pending_head != NULL)
+        pending_head->pending_prev = client;
+    else
+        pending_tail = client;
+
+    pending_head = client;
+    stats.pending++;
+}
+
+/** @internal
+ * @brief Takes a client off the pending LRU, if it is on it
+ */
+static void
+_client_list_pending_unlink(t_client * client)
+{
+    if (!client->pending)
+        return;
+
+    if (client->pending_prev != NULL)
+        client->pending_prev->pending_next = client->pending_next;
+    else
+        pending_head = client->pending_next;
+
+    if (client->pending_next != NULL)
+        client->pending_next->pending_prev = client->pending_prev;
+    else
+        pending_tail = client->pending_prev;
+
+    client->pending_prev = client->pending_next = NULL;
+    client->pending = 0;
+    stats.pending--;
+}
+
+/** @internal
+ * @brief Evicts the oldest pending client
+ * @return 1 if a client was evicted, 0 if there was no pending client
+ */
+static int
+_client_list_evict_pending(void)
+{
+    t_client *victim = pending_tail;
+
+    if (victim == NULL)
+        return 0;
+
+    debug(LOG_INFO, "Evicting pending client IP: %s MAC: %s to make room",
+          victim->ip, victim->mac);
+    stats.evicted++;
+    client_list_delete(victim);
+
+    return 1;
+}
+
 /** Get the first element of the list of connected clients
  */
 t_client *
@@ -67,26 +226,72 @@ void
 client_list_init(void)
 {
     firstclient = NULL;
+    lastclient = NULL;
+    pending_head = pending_tail = NULL;
+    memset(ip_hash, 0, sizeof(ip_hash));
+    memset(mac_hash, 0, sizeof(mac_hash));
+    memset(token_hash, 0, sizeof(token_hash));
+    memset(&stats, 0, sizeof(stats));
+}
+
+/** Links a client that has already been allocated and filled in at the
+ * end of the connections list and into the indexes. Clients that are not
+ * in the KNOWN or PROBATION state are put on the pending LRU. No capacity
+ * check is done, this is used for clients inherited from a parent process.
+ * @param client The client to link in
+ */
+void
+client_list_insert(t_client * client)
+{
+    client->next = NULL;
+    client->prev = lastclient;
+
+    if (lastclient == NULL)
+        firstclient = client;
+    else
+        lastclient->next = client;
+    lastclient = client;
+
+    _client_list_hash_add(client);
+    stats.count++;
+
+    client->pending = 0;
+    if (client->fw_connection_state != FW_MARK_KNOWN &&
+            client->fw_connection_state != FW_MARK_PROBATION)
+        _client_list_pending_link(client);
 }
 
 /** Based on the parameters it receives, this function creates a new entry
  * in the connections list. All the memory allocation is done here.
+ * The new client starts on the pending LRU. If MaxPendingClients or
+ * MaxClients would be exceeded the oldest pending client is evicted first;
+ * if the list is full of authorised clients the new one is refused.
  * @param ip IP address
  * @param mac MAC address
  * @param token Token
- * @return Pointer to the client we just created
+ * @return Pointer to the client we just created, or NULL if it was refused
  */
 t_client         *
 client_list_append(const char *ip, const char *mac, const char *token)
 {
-    t_client         *curclient, *prevclient;
+    t_client         *curclient;
+    s_config         *config = config_get_config();
 
-    prevclient = NULL;
-    curclient = firstclient;
+    if (config->maxpendingclients > 0) {
+        while (stats.pending >= (unsigned int)config->maxpendingclients &&
+                _client_list_evict_pending())
+            ;
+    }
 
-    while (curclient != NULL) {
-        prevclient = curclient;
-        curclient = curclient->next;
+    if (config->maxclients > 0) {
+        while (stats.count >= (unsigned int)config->maxclients) {
+            if (!_client_list_evict_pending()) {
+                stats.rejected++;
+                debug(LOG_WARNING, "Client list full (%u clients), refusing IP: %s MAC: %s",
+                      stats.count, ip, mac);
+                return NULL;
+            }
+        }
     }
 
     curclient = safe_malloc(sizeof(t_client));
@@ -97,12 +302,9 @@ client_list_append(const char *ip, const char *mac, const char *token)
     curclient->token = safe_strdup(token);
     curclient->counters.incoming = curclient->counters.incoming_history = curclient->counters.outgoing = curclient->counters.outgoing_history = 0;
     curclient->counters.last_updated = time(NULL);
+    curclient->counters.log_dirty = 1;
 
-    if (prevclient == NULL) {
-        firstclient = curclient;
-    } else {
-        prevclient->next = curclient;
-    }
+    client_list_insert(curclient);
 
     debug(LOG_INFO, "Added a new client to linked list: IP: %s Token: %s",
           ip, token);
@@ -110,6 +312,105 @@ client_list_append(const char *ip, const char *mac, const char *token)
     return curclient;
 }
 
+/** Takes a client off the pending LRU. Called once the client has been
+ * given the KNOWN or PROBATION state, so it can no longer be evicted.
+ * @param client The client that was authorised
+ */
+void
+client_list_authorise(t_client * client)
+{
+    _client_list_pending_unlink(client);
+}
+
+/** Moves a pending client to the head of the pending LRU, so it is the
+ * last one to be evicted. Authorised clients are left alone.
+ * @param client The client that was just seen
+ */
+void
+client_list_touch(t_client * client)
+{
+    if (client->pending && client != pending_head) {
+        _client_list_pending_unlink(client);
+        _client_list_pending_link(client);
+    }
+}
+
+/** @internal
+ * @brief Moves an EWMA one step towards a new sample
+ */
+static unsigned long
+_client_rate_ewma(unsigned long average, unsigned long sample)
+{
+    if (sample >= average)
+        return average + ((sample - average) >> CLIENT_RATE_EWMA_SHIFT);
+    else
+        return average - ((average - sample) >> CLIENT_RATE_EWMA_SHIFT);
+}
+
+/** Folds the current counters of a client into its throughput estimate.
+ * Called with the client list locked, right after the counters have been
+ * read from the firewall. The first call (or a call after the counters
+ * went backwards, e.g. when they were reset) only records a baseline.
+ * @param client The client whose counters were just updated
+ * @param now Time the counters were read
+ */
+void
+client_update_rates(t_client * client, time_t now)
+{
+    t_rates *rates = &client->rates;
+    unsigned long in_rate, out_rate;
+    time_t elapsed;
+
+    elapsed = now - rates->last_sample;
+
+    if (rates->last_sample != 0 && elapsed <= 0)
+        return;
+
+    if (rates->last_sample == 0 ||
+            client->counters.incoming < rates->last_incoming ||
+            client->counters.outgoing < rates->last_outgoing) {
+        rates->last_incoming = client->counters.incoming;
+        rates->last_outgoing = client->counters.outgoing;
+        rates->last_sample = now;
+        return;
+    }
+
+    in_rate = (unsigned long)((client->counters.incoming - rates->last_incoming) / elapsed);
+    out_rate = (unsigned long)((client->counters.outgoing - rates->last_outgoing) / elapsed);
+
+    if (rates->sample_count == 0) {
+        rates->incoming = in_rate;
+        rates->outgoing = out_rate;
+    } else {
+        rates->incoming = _client_rate_ewma(rates->incoming, in_rate);
+        rates->outgoing = _client_rate_ewma(rates->outgoing, out_rate);
+    }
+
+    if (in_rate > rates->incoming_peak)
+        rates->incoming_peak = in_rate;
+    if (out_rate > rates->outgoing_peak)
+        rates->outgoing_peak = out_rate;
+
+    rates->incoming_samples[rates->sample_pos] = in_rate;
+    rates->outgoing_samples[rates->sample_pos] = out_rate;
+    rates->sample_pos = (rates->sample_pos + 1) % CLIENT_RATE_SAMPLES;
+    if (rates->sample_count < CLIENT_RATE_SAMPLES)
+        rates->sample_count++;
+
+    rates->last_incoming = client->counters.incoming;
+    rates->last_outgoing = client->counters.outgoing;
+    rates->last_sample = now;
+}
+
+/** Copies the admission control counters
+ * @param stats_out Where to copy the counters
+ */
+void
+client_list_get_stats(t_client_list_stats * stats_out)
+{
+    *stats_out = stats;
+}
+
 /** Finds a  client by its IP and MAC, returns NULL if the client could not
  * be found
  * @param ip IP we are looking for in the linked list
@@ -121,11 +422,9 @@ client_list_find(const char *ip, const char *mac)
 {
     t_client         *ptr;
 
-    ptr = firstclient;
-    while (NULL != ptr) {
+    for (ptr = ip_hash[_client_list_hash(ip)]; NULL != ptr; ptr = ptr->ip_hnext) {
         if (0 == strcmp(ptr->ip, ip) && 0 == strcmp(ptr->mac, mac))
             return ptr;
-        ptr = ptr->next;
     }
 
     return NULL;
@@ -142,11 +441,9 @@ client_list_find_by_ip(const char *ip)
 {
     t_client         *ptr;
 
-    ptr = firstclient;
-    while (NULL != ptr) {
+    for (ptr = ip_hash[_client_list_hash(ip)]; NULL != ptr; ptr = ptr->ip_hnext) {
         if (0 == strcmp(ptr->ip, ip))
             return ptr;
-        ptr = ptr->next;
     }
 
     return NULL;
@@ -163,11 +460,9 @@ client_list_find_by_mac(const char *mac)
 {
     t_client         *ptr;
 
-    ptr = firstclient;
-    while (NULL != ptr) {
+    for (ptr = mac_hash[_client_list_hash(mac)]; NULL != ptr; ptr = ptr->mac_hnext) {
         if (0 == strcmp(ptr->mac, mac))
             return ptr;
-        ptr = ptr->next;
     }
 
     return NULL;
@@ -182,11 +477,9 @@ client_list_find_by_token(const char *token)
 {
     t_client         *ptr;
 
-    ptr = firstclient;
-    while (NULL != ptr) {
-        if (0 == strcmp(ptr->token, token))
+    for (ptr = token_hash[_client_list_hash(token)]; NULL != ptr; ptr = ptr->token_hnext) {
+        if (ptr->token != NULL && 0 == strcmp(ptr->token, token))
             return ptr;
-        ptr = ptr->next;
     }
 
     return NULL;
@@ -217,34 +510,36 @@ _client_list_free_node(t_client * client)
 /**
  * @brief Deletes a client from the connections list
  *
- * Removes the specified client from the connections list and then calls
- * the function to free the memory used by the client.
+ * Removes the specified client from the connections list and the indexes
+ * and then calls the function to free the memory used by the client.
  * @param client Points to the client to be deleted
  */
 void
 client_list_delete(t_client * client)
 {
-    t_client         *ptr;
-
-    ptr = firstclient;
-
-    if (ptr == NULL) {
+    if (firstclient == NULL) {
         debug(LOG_ERR, "Node list empty!");
-    } else if (ptr == client) {
-        firstclient = ptr->next;
-        _client_list_free_node(client);
-    } else {
-        /* Loop forward until we reach our point in the list. */
-        while (ptr->next != NULL && ptr->next != client) {
-            ptr = ptr->next;
-        }
-        /* If we reach the end before finding out element, complain. */
-        if (ptr->next == NULL) {
-            debug(LOG_ERR, "Node to delete could not be found.");
-        /* Free element. */
-        } else {
-            ptr->next = client->next;
-            _client_list_free_node(client);
-        }
+        return;
+    }
+
+    if (client->prev == NULL && firstclient != client) {
+        debug(LOG_ERR, "Node to delete could not be found.");
+        return;
     }
+
+    if (client->prev != NULL)
+        client->prev->next = client->next;
+    else
+        firstclient = client->next;
+
+    if (client->next != NULL)
+        client->next->prev = client->prev;
+    else
+        lastclient = client->prev;
+
+    _client_list_hash_remove(client);
+    _client_list_pending_unlink(client);
+    stats.count--;
+
+    _client_list_free_node(client);
 }
@@ -35,12 +35,65 @@ typedef struct _t_counters {
     unsigned long long	incoming_history;	/**< @brief Incoming data before wifidog restarted*/
     unsigned long long	outgoing_history;	/**< @brief Outgoing data before wifidog restarted*/
     time_t	last_updated;	/**< @brief Last update of the counters */
+    unsigned long long	log_incoming;	/**< @brief Incoming total last reported
+					     to the log server */
+    unsigned long long	log_outgoing;	/**< @brief Outgoing total last reported
+					     to the log server */
+    int	log_dirty;		/**< @brief Set when the counters are read
+				     from the firewall and change */
 } t_counters;
 
+/** Number of recent rate samples kept per client */
+#define CLIENT_RATE_SAMPLES 8
+
+/** Weight of a new sample in the rate EWMA, as a right shift (1/4) */
+#define CLIENT_RATE_EWMA_SHIFT 2
+
+/** Throughput estimate for a client, in bytes per second, derived from the
+ * counters each time they are read from the firewall
+ */
+typedef struct _t_rates {
+    unsigned long long	last_incoming;	/**< @brief Incoming total at the last sample */
+    unsigned long long	last_outgoing;	/**< @brief Outgoing total at the last sample */
+    time_t	last_sample;	/**< @brief Time of the last sample, 0 if none yet */
+    unsigned long	incoming;	/**< @brief EWMA of the incoming rate */
+    unsigned long	outgoing;	/**< @brief EWMA of the outgoing rate */
+    unsigned long	incoming_peak;	/**< @brief Highest incoming sample seen */
+    unsigned long	outgoing_peak;	/**< @brief Highest outgoing sample seen */
+    unsigned long	incoming_samples[CLIENT_RATE_SAMPLES];	/**< @brief Ring of recent incoming samples */
+    unsigned long	outgoing_samples[CLIENT_RATE_SAMPLES];	/**< @brief Ring of recent outgoing samples */
+    unsigned int	sample_pos;	/**< @brief Next slot to write in the rings */
+    unsigned int	sample_count;	/**< @brief Number of valid slots in the rings */
+} t_rates;
+
+/** Byte and time allowances handed out by the auth server, 0 meaning
+ * unlimited
+ */
+typedef struct _t_quota {
+    unsigned long long	bytes_allowed;	/**< @brief Bytes the client may transfer */
+    unsigned long long	bytes_base;	/**< @brief incoming + outgoing when the
+					     allowance was given */
+    time_t	time_allowed;	/**< @brief Seconds the client may stay online */
+    time_t	started;	/**< @brief When the allowance was given */
+} t_quota;
+
 /** Client node for the connected client linked list.
  */
 typedef struct	_t_client {
   struct	_t_client *next;        /**< @brief Pointer to the next client */
+	struct	_t_client *prev;	/**< @brief Pointer to the previous client */
+	struct	_t_client *ip_hnext;	/**< @brief Next client in the same IP
+					     hash bucket */
+	struct	_t_client *mac_hnext;	/**< @brief Next client in the same MAC
+					     hash bucket */
+	struct	_t_client *token_hnext;	/**< @brief Next client in the same token
+					     hash bucket */
+	struct	_t_client *pending_prev;	/**< @brief Newer neighbour in the
+						     pending LRU */
+	struct	_t_client *pending_next;	/**< @brief Older neighbour in the
+						     pending LRU */
+	int	pending;		/**< @brief 1 while the client is on the
+					     pending LRU (not yet authorised) */
 	char	*ip;			/**< @brief Client Ip address */
 	char	*mac;			/**< @brief Client Mac address */
 	char	*token;			/**< @brief Client token */
@@ -51,8 +104,23 @@ typedef struct	_t_client {
 					     _http_* function is called */
 	t_counters	counters;	/**< @brief Counters for input/output of
 					     the client. */
+	t_rates	rates;		/**< @brief Throughput estimate for the
+					     client */
+	t_quota	quota;		/**< @brief Allowances enforced locally */
 } t_client;
 
+/** Admission control counters, protected by the client list mutex
+ */
+typedef struct _t_client_list_stats {
+    unsigned int	count;		/**< @brief Clients in the list */
+    unsigned int	pending;	/**< @brief Clients not yet authorised */
+    unsigned long	rejected;	/**< @brief New clients refused because
+					     the list was full of authorised
+					     clients */
+    unsigned long	evicted;	/**< @brief Pending clients evicted to
+					     make room for a new one */
+} t_client_list_stats;
+
 /** @brief Get the first element of the list of connected clients
  */
 t_client *client_get_first_client(void);
@@ -63,6 +131,21 @@ void client_list_init(void);
 /** @brief Adds a new client to the connections list */
 t_client *client_list_append(const char *ip, const char *mac, const char *token);
 
+/** @brief Links an already allocated client into the connections list */
+void client_list_insert(t_client *client);
+
+/** @brief Takes a client off the pending LRU once it has been authorised */
+void client_list_authorise(t_client *client);
+
+/** @brief Marks a pending client as the most recently seen */
+void client_list_touch(t_client *client);
+
+/** @brief Folds the current counters of a client into its rate estimate */
+void client_update_rates(t_client *client, time_t now);
+
+/** @brief Copies the admission control counters */
+void client_list_get_stats(t_client_list_stats *stats);
+
 /** @brief Finds a client by its IP and MAC */
 t_client *client_list_find(const char *ip, const char *mac);
 
@@ -0,0 +1,211 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file compact_report.c
+    @brief Compact binary encoding of bulk counter reports
+
+    With CompactReports set the counters of many clients are sent to the
+    log server as binary records instead of JSON, compressed with deflate
+    when wifidog was built with zlib:
+
+        "WDC1" <count>
+        <flags> <mac> <ip> <incoming> <outgoing> <token length> <token>
+        ...
+
+    Numbers are unsigned varints: 7 bits per byte, low bits first, the
+    high bit set on every byte but the last. The MAC is 6 bytes and the IP
+    4 bytes in network order when flags has COMPACT_MAC_BINARY or
+    COMPACT_IP_BINARY; otherwise they are strings preceded by their length
+    like the token, so nothing the JSON report carries is lost.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../config.h"
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+#include <zlib.h>
+#endif
+
+#include "safe.h"
+#include "debug.h"
+#include "compact_report.h"
+
+/** Flag of a record whose MAC is 6 bytes rather than a string */
+#define COMPACT_MAC_BINARY 0x01
+/** Flag of a record whose IP is 4 bytes rather than a string */
+#define COMPACT_IP_BINARY 0x02
+
+/** @internal
+ * A buffer the records are appended to
+ */
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+} t_compact_buf;
+
+/** @internal
+ * @brief Appends bytes, growing the buffer as needed
+ */
+static void
+_compact_put(t_compact_buf *buf, const void *data, size_t len)
+{
+    if (buf->len + len > buf->size) {
+        while (buf->len + len > buf->size)
+            buf->size *= 2;
+        buf->data = safe_realloc(buf->data, buf->size);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+/** @internal
+ * @brief Appends an unsigned varint
+ */
+static void
+_compact_put_varint(t_compact_buf *buf, unsigned long long value)
+{
+    unsigned char bytes[10];
+    size_t len = 0;
+
+    while (value >= 0x80) {
+        bytes[len++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[len++] = (unsigned char)value;
+    _compact_put(buf, bytes, len);
+}
+
+/** @internal
+ * @brief Appends a string preceded by its length
+ */
+static void
+_compact_put_string(t_compact_buf *buf, const char *str)
+{
+    size_t len = str ? strlen(str) : 0;
+
+    _compact_put_varint(buf, len);
+    if (len > 0)
+        _compact_put(buf, str, len);
+}
+
+/** @internal
+ * @brief Parses aa:bb:cc:dd:ee:ff into 6 bytes
+ */
+static int
+_compact_parse_mac(const char *mac, unsigned char *out)
+{
+    unsigned int b[6];
+    char end;
+    int i;
+
+    if (mac == NULL || sscanf(mac, "%2x:%2x:%2x:%2x:%2x:%2x%c",
+                &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &end) != 6)
+        return 0;
+    for (i = 0; i < 6; i++)
+        out[i] = (unsigned char)b[i];
+    return 1;
+}
+
+/** Encodes the counters of many clients as compact binary records
+ * @param reports The clients to report
+ * @param count Number of entries in reports
+ * @param len Set to the length of the encoding
+ * @return The encoding, to be freed by the caller
+ */
+char *
+compact_report_encode(const t_counters_report *reports, int count, size_t *len)
+{
+    t_compact_buf buf;
+    unsigned char mac[6], flags;
+    struct in_addr addr;
+    int i, has_ip;
+
+    buf.size = 64 + count * 32;
+    buf.data = safe_malloc(buf.size);
+    buf.len = 0;
+
+    _compact_put(&buf, COMPACT_REPORT_MAGIC, 4);
+    _compact_put_varint(&buf, count);
+
+    for (i = 0; i < count; i++) {
+        flags = 0;
+        if (_compact_parse_mac(reports[i].mac, mac))
+            flags |= COMPACT_MAC_BINARY;
+        has_ip = (reports[i].ip != NULL && inet_aton(reports[i].ip, &addr));
+        if (has_ip)
+            flags |= COMPACT_IP_BINARY;
+        _compact_put(&buf, &flags, 1);
+
+        if (flags & COMPACT_MAC_BINARY)
+            _compact_put(&buf, mac, 6);
+        else
+            _compact_put_string(&buf, reports[i].mac);
+        if (has_ip)
+            _compact_put(&buf, &addr.s_addr, 4);
+        else
+            _compact_put_string(&buf, reports[i].ip);
+
+        _compact_put_varint(&buf, reports[i].incoming);
+        _compact_put_varint(&buf, reports[i].outgoing);
+        _compact_put_string(&buf, reports[i].token);
+    }
+
+    *len = buf.len;
+    return (char *)buf.data;
+}
+
+/** Compresses an encoding with deflate (zlib format, RFC 1950), as sent
+ * with "Content-Encoding: deflate".
+ * @param data What to compress
+ * @param len Length of data
+ * @param outlen Set to the length of the result
+ * @return The compressed data, to be freed by the caller, or NULL if
+ * wifidog was built without zlib or compressing failed
+ */
+char *
+compact_report_deflate(const char *data, size_t len, size_t *outlen)
+{
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+    uLongf size = compressBound(len);
+    char *out = safe_malloc(size);
+    int rc;
+
+    if ((rc = compress2((Bytef *)out, &size, (const Bytef *)data, len, COMPACT_REPORT_LEVEL)) != Z_OK) {
+        debug(LOG_WARNING, "Failed to compress report: zlib error %d", rc);
+        free(out);
+        return NULL;
+    }
+    *outlen = size;
+    return out;
+#else
+    return NULL;
+#endif
+}
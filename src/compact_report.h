@@ -0,0 +1,46 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file compact_report.h
+    @brief Compact binary encoding of bulk counter reports
+*/
+
+#ifndef _COMPACT_REPORT_H_
+#define _COMPACT_REPORT_H_
+
+#include <stddef.h>
+
+#include "centralserver.h"
+
+/** Content-Type of a compact report */
+#define COMPACT_REPORT_TYPE "application/x-wifidog-counters"
+/** First bytes of a compact report, including its version */
+#define COMPACT_REPORT_MAGIC "WDC1"
+/** zlib level; reports are small, more effort buys little */
+#define COMPACT_REPORT_LEVEL 6
+
+/** @brief Encodes the counters of many clients as compact binary records */
+char *compact_report_encode(const t_counters_report *reports, int count, size_t *len);
+
+/** @brief Compresses an encoding with deflate, NULL without zlib */
+char *compact_report_deflate(const char *data, size_t len, size_t *outlen);
+
+#endif /* _COMPACT_REPORT_H_ */
@@ -40,6 +40,8 @@
 #include "safe.h"
 #include "debug.h"
 #include "conf.h"
+#include "conn_pool.h"
+#include "server_health.h"
 #include "http.h"
 #include "auth.h"
 #include "firewall.h"
@@ -94,6 +96,40 @@ typedef enum {
         oHTTPDUsername,
         oHTTPDPassword,
 	oClientTimeout,
+	oBatchCounters,
+	oPoolMaxIdle,
+	oPoolIdleTimeout,
+	oAsyncSockets,
+	oDnsCacheTTL,
+	oDnsNegativeTTL,
+	oAuthCacheSize,
+	oAuthCacheTTL,
+	oAuthWorkers,
+	oAuthQueueMax,
+	oHttpdWorkers,
+	oHttpdQueueMax,
+	oHttpdStackSize,
+	oHttpdEventLoop,
+	oHttpdEventMaxConn,
+	oHealthFailureThreshold,
+	oHealthOpenTime,
+	oHealthProbeInterval,
+	oConnectTimeout,
+	oIoTimeout,
+	oUpstreamTLS,
+	oTlsCertFile,
+	oTlsCaFile,
+	oLogKeyframeInterval,
+	oCompactReports,
+	oJournalFile,
+	oJournalSize,
+	oJournalSyncInterval,
+	oJournalWriteLimit,
+	oControlChannel,
+	oControlChannelPath,
+	oControlChannelWait,
+	oMaxClients,
+	oMaxPendingClients,
 	oCheckInterval,
 	oAuthInterval,
 	oWdctlSocket,
@@ -130,6 +166,40 @@ static const struct {
 	{ "httpdusername",		oHTTPDUsername },
 	{ "httpdpassword",		oHTTPDPassword },
 	{ "clienttimeout",      	oClientTimeout },
+	{ "batchcounters",      	oBatchCounters },
+	{ "poolmaxidle",      	oPoolMaxIdle },
+	{ "poolidletimeout",      	oPoolIdleTimeout },
+	{ "asyncsockets",      	oAsyncSockets },
+	{ "dnscachettl",      	oDnsCacheTTL },
+	{ "dnsnegativettl",      	oDnsNegativeTTL },
+	{ "authcachesize",      	oAuthCacheSize },
+	{ "authcachettl",      	oAuthCacheTTL },
+	{ "authworkers",      	oAuthWorkers },
+	{ "authqueuemax",      	oAuthQueueMax },
+	{ "httpdworkers",      	oHttpdWorkers },
+	{ "httpdqueuemax",      	oHttpdQueueMax },
+	{ "httpdstacksize",      	oHttpdStackSize },
+	{ "httpdeventloop",      	oHttpdEventLoop },
+	{ "httpdeventmaxconn",      	oHttpdEventMaxConn },
+	{ "healthfailurethreshold",      	oHealthFailureThreshold },
+	{ "healthopentime",      	oHealthOpenTime },
+	{ "healthprobeinterval",      	oHealthProbeInterval },
+	{ "connecttimeout",      	oConnectTimeout },
+	{ "iotimeout",      	oIoTimeout },
+	{ "upstreamtls",      	oUpstreamTLS },
+	{ "tlscertfile",      	oTlsCertFile },
+	{ "tlscafile",      	oTlsCaFile },
+	{ "logkeyframeinterval",      	oLogKeyframeInterval },
+	{ "compactreports",      	oCompactReports },
+	{ "journalfile",      	oJournalFile },
+	{ "journalsize",      	oJournalSize },
+	{ "journalsyncinterval",      	oJournalSyncInterval },
+	{ "journalwritelimit",      	oJournalWriteLimit },
+	{ "controlchannel",      	oControlChannel },
+	{ "controlchannelpath",      	oControlChannelPath },
+	{ "controlchannelwait",      	oControlChannelWait },
+	{ "maxclients",      	oMaxClients },
+	{ "maxpendingclients",      	oMaxPendingClients },
 	{ "checkinterval",      	oCheckInterval },
 	{ "authinterval",      	oAuthInterval },
 	{ "syslogfacility", 		oSyslogFacility },
@@ -207,6 +277,40 @@ config_init(void)
 	config.httpdusername = NULL;
 	config.httpdpassword = NULL;
 	config.clienttimeout = DEFAULT_CLIENTTIMEOUT;
+	config.batch_counters = DEFAULT_BATCHCOUNTERS;
+	config.pool_max_idle = DEFAULT_POOLMAXIDLE;
+	config.pool_idle_timeout = DEFAULT_POOLIDLETIMEOUT;
+	config.async_sockets = DEFAULT_ASYNCSOCKETS;
+	config.dns_cache_ttl = DEFAULT_DNSCACHETTL;
+	config.dns_negative_ttl = DEFAULT_DNSNEGATIVETTL;
+	config.auth_cache_size = DEFAULT_AUTHCACHESIZE;
+	config.auth_cache_ttl = DEFAULT_AUTHCACHETTL;
+	config.auth_workers = DEFAULT_AUTHWORKERS;
+	config.auth_queue_max = DEFAULT_AUTHQUEUEMAX;
+	config.httpd_workers = DEFAULT_HTTPDWORKERS;
+	config.httpd_queue_max = DEFAULT_HTTPDQUEUEMAX;
+	config.httpd_stack_size = DEFAULT_HTTPDSTACKSIZE;
+	config.httpd_event_loop = DEFAULT_HTTPDEVENTLOOP;
+	config.httpd_event_max_conn = DEFAULT_HTTPDEVENTMAXCONN;
+	config.health_failure_threshold = DEFAULT_HEALTHFAILURETHRESHOLD;
+	config.health_open_time = DEFAULT_HEALTHOPENTIME;
+	config.health_probe_interval = DEFAULT_HEALTHPROBEINTERVAL;
+	config.connect_timeout = DEFAULT_CONNECTTIMEOUT;
+	config.io_timeout = DEFAULT_IOTIMEOUT;
+	config.upstream_tls = DEFAULT_UPSTREAMTLS;
+	config.tls_cert_file = NULL;
+	config.tls_ca_file = NULL;
+	config.log_keyframe_interval = DEFAULT_LOGKEYFRAMEINTERVAL;
+	config.compact_reports = DEFAULT_COMPACTREPORTS;
+	config.journal_file = safe_strdup(DEFAULT_JOURNALFILE);
+	config.journal_size = DEFAULT_JOURNALSIZE;
+	config.journal_sync_interval = DEFAULT_JOURNALSYNCINTERVAL;
+	config.journal_write_limit = DEFAULT_JOURNALWRITELIMIT;
+	config.control_channel = DEFAULT_CONTROLCHANNEL;
+	config.control_channel_path = safe_strdup(DEFAULT_CONTROLCHANNELPATH);
+	config.control_channel_wait = DEFAULT_CONTROLCHANNELWAIT;
+	config.maxclients = DEFAULT_MAXCLIENTS;
+	config.maxpendingclients = DEFAULT_MAXPENDINGCLIENTS;
 	config.checkinterval = DEFAULT_CHECKINTERVAL;
 	config.authinterval = DEFAULT_AUTHINTERVAL;
 	config.syslog_facility = DEFAULT_SYSLOG_FACILITY;
@@ -921,6 +1025,120 @@ config_read(const char *filename)
 				case oClientTimeout:
 					sscanf(p1, "%d", &config.clienttimeout);
 					break;
+				case oBatchCounters:
+					if ((value = parse_boolean_value(p1)) != -1) {
+						config.batch_counters = value;
+					}
+					break;
+				case oPoolMaxIdle:
+					sscanf(p1, "%d", &config.pool_max_idle);
+					break;
+				case oPoolIdleTimeout:
+					sscanf(p1, "%d", &config.pool_idle_timeout);
+					break;
+				case oAsyncSockets:
+					sscanf(p1, "%d", &config.async_sockets);
+					break;
+				case oDnsCacheTTL:
+					sscanf(p1, "%d", &config.dns_cache_ttl);
+					break;
+				case oDnsNegativeTTL:
+					sscanf(p1, "%d", &config.dns_negative_ttl);
+					break;
+				case oAuthCacheSize:
+					sscanf(p1, "%d", &config.auth_cache_size);
+					break;
+				case oAuthCacheTTL:
+					sscanf(p1, "%d", &config.auth_cache_ttl);
+					break;
+				case oAuthWorkers:
+					sscanf(p1, "%d", &config.auth_workers);
+					break;
+				case oAuthQueueMax:
+					sscanf(p1, "%d", &config.auth_queue_max);
+					break;
+				case oHttpdWorkers:
+					sscanf(p1, "%d", &config.httpd_workers);
+					break;
+				case oHttpdQueueMax:
+					sscanf(p1, "%d", &config.httpd_queue_max);
+					break;
+				case oHttpdStackSize:
+					sscanf(p1, "%d", &config.httpd_stack_size);
+					break;
+				case oHttpdEventLoop:
+					if ((value = parse_boolean_value(p1)) != -1) {
+						config.httpd_event_loop = value;
+					}
+					break;
+				case oHttpdEventMaxConn:
+					sscanf(p1, "%d", &config.httpd_event_max_conn);
+					break;
+				case oHealthFailureThreshold:
+					sscanf(p1, "%d", &config.health_failure_threshold);
+					break;
+				case oHealthOpenTime:
+					sscanf(p1, "%d", &config.health_open_time);
+					break;
+				case oHealthProbeInterval:
+					sscanf(p1, "%d", &config.health_probe_interval);
+					break;
+				case oConnectTimeout:
+					sscanf(p1, "%d", &config.connect_timeout);
+					break;
+				case oIoTimeout:
+					sscanf(p1, "%d", &config.io_timeout);
+					break;
+				case oUpstreamTLS:
+					if ((value = parse_boolean_value(p1)) != -1) {
+						config.upstream_tls = value;
+					}
+					break;
+				case oTlsCertFile:
+					config.tls_cert_file = safe_strdup(p1);
+					break;
+				case oTlsCaFile:
+					config.tls_ca_file = safe_strdup(p1);
+					break;
+				case oLogKeyframeInterval:
+					sscanf(p1, "%d", &config.log_keyframe_interval);
+					break;
+				case oCompactReports:
+					if ((value = parse_boolean_value(p1)) != -1) {
+						config.compact_reports = value;
+					}
+					break;
+				case oJournalFile:
+					free(config.journal_file);
+					config.journal_file = safe_strdup(p1);
+					break;
+				case oJournalSize:
+					sscanf(p1, "%d", &config.journal_size);
+					break;
+				case oJournalSyncInterval:
+					sscanf(p1, "%d", &config.journal_sync_interval);
+					break;
+				case oJournalWriteLimit:
+					sscanf(p1, "%d", &config.journal_write_limit);
+					break;
+				case oControlChannel:
+					if ((value = parse_boolean_value(p1)) != -1) {
+						config.control_channel = value;
+					}
+					break;
+				case oControlChannelPath:
+					free(config.control_channel_path);
+					config.control_channel_path = safe_strdup(p1);
+					break;
+				case oControlChannelWait:
+					sscanf(p1, "%d", &config.control_channel_wait);
+					break;
+				case oMaxClients:
+					sscanf(p1, "%d", &config.maxclients);
+					break;
+				case oMaxPendingClients:
+					sscanf(p1, "%d", &config.maxpendingclients);
+					break;
 				case oSyslogFacility:
 					sscanf(p1, "%d", &config.syslog_facility);
 					break;
@@ -1064,8 +1282,8 @@ t_serv *
 get_portal_server(void)
 {
 
-        /* This is as good as atomic */
-        return config.portal_servers;
+        /* Users are sent to the best portal server that is up */
+        return server_health_best(config.portal_servers);
 }
 /**
  * This function returns the current (first plat_server)
@@ -1074,8 +1292,8 @@ t_serv *
 get_plat_server(void)
 {
 
-        /* This is as good as atomic */
-        return config.plat_servers;
+        /* Users are sent to the best plat server that is up */
+        return server_health_best(config.plat_servers);
 }
 
 t_serv *
@@ -1102,6 +1320,10 @@ mark_auth_server_bad(t_serv *bad_server)
 {
 	t_serv	*tmp;
 
+	/* Its idle connections are not worth keeping either */
+	conn_pool_flush(bad_server);
+	server_health_failure(bad_server);
+
 	if (config.auth_servers == bad_server && bad_server->next != NULL) {
 		/* Go to the last */
 		for (tmp = config.auth_servers; tmp->next != NULL; tmp = tmp->next);
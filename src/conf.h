@@ -46,6 +46,38 @@
 #define DEFAULT_GATEWAYPORT 2060
 #define DEFAULT_HTTPDNAME "WiFiDog"
 #define DEFAULT_CLIENTTIMEOUT 5
+#define DEFAULT_BATCHCOUNTERS 0
+#define DEFAULT_POOLMAXIDLE 2
+#define DEFAULT_POOLIDLETIMEOUT 30
+#define DEFAULT_ASYNCSOCKETS 4
+#define DEFAULT_DNSCACHETTL 300
+#define DEFAULT_DNSNEGATIVETTL 30
+#define DEFAULT_AUTHCACHESIZE 256
+#define DEFAULT_AUTHCACHETTL 300
+#define DEFAULT_AUTHWORKERS 8
+#define DEFAULT_AUTHQUEUEMAX 256
+#define DEFAULT_HTTPDWORKERS 8
+#define DEFAULT_HTTPDQUEUEMAX 64
+#define DEFAULT_HTTPDSTACKSIZE 128
+#define DEFAULT_HTTPDEVENTLOOP 0
+#define DEFAULT_HTTPDEVENTMAXCONN 1024
+#define DEFAULT_HEALTHFAILURETHRESHOLD 3
+#define DEFAULT_HEALTHOPENTIME 30
+#define DEFAULT_HEALTHPROBEINTERVAL 60
+#define DEFAULT_CONNECTTIMEOUT 5
+#define DEFAULT_IOTIMEOUT 30
+#define DEFAULT_LOGKEYFRAMEINTERVAL 600
+#define DEFAULT_COMPACTREPORTS 0
+#define DEFAULT_UPSTREAMTLS 0
+#define DEFAULT_JOURNALFILE "/etc/wifidog.journal"
+#define DEFAULT_JOURNALSIZE 1024
+#define DEFAULT_JOURNALSYNCINTERVAL 60
+#define DEFAULT_JOURNALWRITELIMIT 256
+#define DEFAULT_CONTROLCHANNEL 0
+#define DEFAULT_CONTROLCHANNELPATH "/api10/taskpoll"
+#define DEFAULT_CONTROLCHANNELWAIT 60
+#define DEFAULT_MAXCLIENTS 512
+#define DEFAULT_MAXPENDINGCLIENTS 128
 #define DEFAULT_CHECKINTERVAL 60
 #define DEFAULT_AUTHINTERVAL 60
 #define DEFAULT_LOG_SYSLOG 0
@@ -89,6 +121,8 @@ typedef struct _serv_t {
     int serv_ssl_port;	/**< @brief Https port the central server listens on */
     int serv_use_ssl;	/**< @brief Use SSL or not */
     char *last_ip;	/**< @brief Last ip used by authserver */
+    struct _t_conn_pool *pool;	/**< @brief Idle keep-alive connections, see conn_pool.c */
+    struct _t_serv_health *health;	/**< @brief Latency and circuit breaker, see server_health.c */
     struct _serv_t *next;
 } t_serv;
 
@@ -168,6 +202,70 @@ typedef struct {
     char *httpdpassword;	/**< @brief Password for HTTP authentication */
     int clienttimeout;		/**< @brief How many CheckIntervals before a client
 				     must be re-authenticated */
+    int pool_max_idle;		/**< @brief Idle keep-alive connections kept per
+				     central server (0 disables keep-alive) */
+    int pool_idle_timeout;	/**< @brief Seconds an idle connection is kept */
+    int async_sockets;		/**< @brief Concurrent connections used for the
+				     per-client counters requests (0 to send
+				     them one after the other) */
+    int dns_cache_ttl;		/**< @brief Seconds a resolved host name is kept */
+    int dns_negative_ttl;	/**< @brief Seconds a failed lookup is kept */
+    int auth_cache_size;	/**< @brief Login verdicts kept (0 disables
+				     the cache) */
+    int auth_cache_ttl;		/**< @brief Seconds a login verdict is kept
+				     unless the server says otherwise */
+    int auth_workers;		/**< @brief Threads sending logins to the auth
+				     server (0 sends them from the portal
+				     thread) */
+    int auth_queue_max;		/**< @brief Logins waiting for a worker before
+				     new ones are refused (0 for no limit) */
+    int httpd_workers;		/**< @brief Threads serving the web server */
+    int httpd_queue_max;	/**< @brief Connections waiting for a worker
+				     before new ones get a 503 (0 for no limit) */
+    int httpd_stack_size;	/**< @brief Stack of the web server threads, in KB */
+    int httpd_event_loop;	/**< @brief boolean, whether one thread reads
+				     and writes every web server connection */
+    int httpd_event_max_conn;	/**< @brief Connections open at once in the
+				     event loop (0 for no limit) */
+    int health_failure_threshold;	/**< @brief Failures in a row before a
+				     central server is considered down */
+    int health_open_time;	/**< @brief Seconds before a server that is down
+				     is probed again */
+    int health_probe_interval;	/**< @brief Seconds without traffic before a
+				     server is probed (0 to disable) */
+    int connect_timeout;	/**< @brief Seconds allowed to connect to a
+				     central server */
+    int io_timeout;		/**< @brief Seconds allowed for a request and
+				     its response once connected */
+    int upstream_tls;		/**< @brief boolean, whether servers declared
+				     SSLAvailable are reached over TLS */
+    char *tls_cert_file;	/**< @brief Client certificate and key shown
+				     to the central servers, or NULL */
+    char *tls_ca_file;		/**< @brief CA certificates the central
+				     servers are checked against, or NULL */
+    int log_keyframe_interval;	/**< @brief Seconds between two reports of
+				     every client to the log server */
+    int compact_reports;	/**< @brief boolean, whether counters go to the
+				     log server as compact binary records */
+    char *journal_file;		/**< @brief File notifications are journalled
+				     to while the servers are down */
+    int journal_size;		/**< @brief Most notifications journalled
+				     (0 to disable) */
+    int journal_sync_interval;	/**< @brief Seconds between two writes of
+				     the journal */
+    int journal_write_limit;	/**< @brief KB the journal may write per
+				     hour */
+    int control_channel;	/**< @brief boolean, whether to long-poll the
+				     auth server for tasks */
+    char *control_channel_path;	/**< @brief Path of the task long poll */
+    int control_channel_wait;	/**< @brief Seconds the auth server may hold
+				     a task long poll */
+    int batch_counters;		/**< @brief boolean, whether to report the
+				     counters of all clients in one request */
+    int maxclients;		/**< @brief Upper bound on the client list
+				     (0 for no limit) */
+    int maxpendingclients;	/**< @brief Upper bound on clients that are
+				     not yet authorised (0 for no limit) */
     int checkinterval;		/**< @brief Frequency the the client timeout check*/
     int authinterval;
     int log_syslog;		/**< @brief boolean, wether to log to syslog */
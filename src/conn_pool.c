@@ -0,0 +1,158 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file conn_pool.c
+    @brief Idle keep-alive connections to the central servers
+
+    Each t_serv keeps a short list of connected sockets whose last HTTP/1.1
+    response was read completely. A connection is handed out again only if
+    it has been idle for less than PoolIdleTimeout seconds and the server
+    has neither closed it nor sent anything unexpected on it.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "conn_pool.h"
+
+/** @internal
+ * An idle connection
+ */
+typedef struct _t_conn_pool {
+    int fd;			/**< @brief Connected socket */
+    time_t last_used;		/**< @brief When the last response completed */
+    struct _t_conn_pool *next;
+} t_conn_pool;
+
+/** Protects the idle lists of every server */
+static pthread_mutex_t conn_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * @brief Tells whether an idle socket can still carry a request
+ *
+ * The server must not have closed it, and must not have sent anything
+ * since the last response.
+ */
+static int
+_conn_pool_healthy(int fd)
+{
+    char c;
+    ssize_t rc;
+
+    rc = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 1;
+
+    return 0;
+}
+
+/** Takes an idle connection to a server out of the pool. Connections that
+ * idled for too long or failed the health check are closed on the way.
+ * @param serv The server to talk to
+ * @return A connected socket, or -1 if a new connection must be made
+ */
+int
+conn_pool_get(t_serv * serv)
+{
+    s_config *config = config_get_config();
+    t_conn_pool *conn;
+    time_t now = time(NULL);
+    int fd = -1;
+
+    pthread_mutex_lock(&conn_pool_mutex);
+    while (fd == -1 && (conn = serv->pool) != NULL) {
+        serv->pool = conn->next;
+
+        if (now - conn->last_used < config->pool_idle_timeout && _conn_pool_healthy(conn->fd)) {
+            fd = conn->fd;
+            debug(LOG_DEBUG, "Reusing connection %d to %s", fd, serv->serv_hostname);
+        } else {
+            debug(LOG_DEBUG, "Dropping stale connection %d to %s", conn->fd, serv->serv_hostname);
+            close(conn->fd);
+        }
+        free(conn);
+    }
+    pthread_mutex_unlock(&conn_pool_mutex);
+
+    return fd;
+}
+
+/** Gives a connection back to the pool once a response has been read
+ * completely from it. It is closed instead if the pool is full or
+ * disabled.
+ * @param serv The server the connection goes to
+ * @param fd The connected socket
+ */
+void
+conn_pool_put(t_serv * serv, int fd)
+{
+    s_config *config = config_get_config();
+    t_conn_pool *conn;
+    int count = 0;
+
+    pthread_mutex_lock(&conn_pool_mutex);
+    for (conn = serv->pool; conn != NULL; conn = conn->next)
+        count++;
+
+    if (count >= config->pool_max_idle) {
+        pthread_mutex_unlock(&conn_pool_mutex);
+        close(fd);
+        return;
+    }
+
+    conn = safe_malloc(sizeof(t_conn_pool));
+    conn->fd = fd;
+    conn->last_used = time(NULL);
+    conn->next = serv->pool;
+    serv->pool = conn;
+    pthread_mutex_unlock(&conn_pool_mutex);
+}
+
+/** Closes every idle connection to a server, e.g. when its address
+ * changed or it was marked bad.
+ * @param serv The server
+ */
+void
+conn_pool_flush(t_serv * serv)
+{
+    t_conn_pool *conn;
+
+    pthread_mutex_lock(&conn_pool_mutex);
+    while ((conn = serv->pool) != NULL) {
+        serv->pool = conn->next;
+        close(conn->fd);
+        free(conn);
+    }
+    pthread_mutex_unlock(&conn_pool_mutex);
+}
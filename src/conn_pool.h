@@ -0,0 +1,40 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file conn_pool.h
+    @brief Idle keep-alive connections to the central servers
+*/
+
+#ifndef _CONN_POOL_H_
+#define _CONN_POOL_H_
+
+#include "conf.h"
+
+/** @brief Takes a healthy idle connection to a server out of the pool */
+int conn_pool_get(t_serv *serv);
+
+/** @brief Gives a connection whose last response was complete back to the pool */
+void conn_pool_put(t_serv *serv, int fd);
+
+/** @brief Closes every idle connection to a server */
+void conn_pool_flush(t_serv *serv);
+
+#endif /* _CONN_POOL_H_ */
@@ -0,0 +1,237 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file control_channel.c
+    @brief Tasks pushed by the auth server over a long poll
+
+    With ControlChannel set the gateway keeps one connection open to the
+    auth server and asks ControlChannelPath for a task. The server holds
+    the request until it has one or ControlChannelWait seconds have
+    passed, so a task runs as soon as it is queued instead of at the next
+    ping, without pinging more often. The task is acknowledged on the same
+    connection before it runs:
+
+        GET <path>?gw_id=..&dev_id=..&wait=60
+        GET <path>?gw_id=..&dev_id=..&wait=0&task_results=<task_id>:OK
+
+    A reply with a body is handled like the one of /api10/taskrequest, an
+    empty one means there was no task. The reply to an ack may carry the
+    next task, which runs once the acked one is done. When the server cannot be reached
+    the channel is opened again after CONTROL_RETRY_MIN seconds, twice as
+    long after each failure up to CONTROL_RETRY_MAX. Polls are at least
+    CONTROL_POLL_MIN seconds apart, so that a server which answers at once
+    instead of holding the request does not get a tight loop of them.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../config.h"
+#include "common.h"
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "httpd.h"
+#include "centralserver.h"
+#include "http_client.h"
+#include "fetchcmd.h"
+#include "control_channel.h"
+
+/** Seconds before the channel is opened again after a failure */
+#define CONTROL_RETRY_MIN 5
+/** Longest wait before the channel is opened again */
+#define CONTROL_RETRY_MAX 300
+/** Fewest seconds between the start of two polls */
+#define CONTROL_POLL_MIN 5
+
+/** The connection to the auth server, -1 when closed */
+static int channel_fd = -1;
+/** A task the server sent in answer to an ack, run after the one acked */
+static char *ack_task = NULL;
+
+/** @internal
+ * @brief Closes the connection to the auth server
+ */
+static void
+_control_channel_close(void)
+{
+    if (channel_fd != -1) {
+        close(channel_fd);
+        channel_fd = -1;
+    }
+}
+
+/** @internal
+ * @brief Sends one poll on the channel and reads the answer
+ * @param wait Seconds the server may hold the request
+ * @param task_id Task acknowledged with this poll, or NULL
+ * @param response Filled in on success
+ * @return 0 on success, -1 if the server could not be reached
+ */
+static int
+_control_channel_poll(int wait, const char *task_id, t_http_response *response)
+{
+    s_config *config = config_get_config();
+    char request[MAX_BUF];
+    char results[256];
+    char *safe_task_id;
+    t_serv *auth_server;
+    int reused, rc;
+
+    results[0] = '\0';
+    if (task_id != NULL && (safe_task_id = httpdUrlEncode(task_id)) != NULL) {
+        snprintf(results, sizeof(results), "&task_results=%s:OK", safe_task_id);
+        free(safe_task_id);
+    }
+
+    do {
+        reused = (channel_fd != -1);
+        if (!reused && (channel_fd = http_client_connect(HTTP_SERVER_AUTH)) == -1)
+            return -1;
+        if ((auth_server = get_auth_server()) == NULL) {
+            _control_channel_close();
+            return -1;
+        }
+
+        snprintf(request, sizeof(request),
+                "GET %s?gw_id=%s&dev_id=%s&wait=%d%s HTTP/1.1\r\n"
+                "User-Agent: WiFiDog %s\r\n"
+                "Host: %s\r\n"
+                "\r\n",
+                config->control_channel_path,
+                config->gw_id,
+                config->dev_id,
+                wait,
+                results,
+                VERSION,
+                auth_server->serv_hostname);
+
+        if (http_client_send(channel_fd, request) == -1)
+            rc = HTTP_READ_EMPTY;
+        else
+            rc = http_client_read_response_timeout(channel_fd, response, wait + config->io_timeout);
+
+        if (rc != 0)
+            _control_channel_close();
+        /* The server may close an idle connection, then open a new one */
+    } while (rc == HTTP_READ_EMPTY && reused);
+
+    if (rc != 0)
+        return -1;
+    if (!response->keep_alive)
+        _control_channel_close();
+    return 0;
+}
+
+/** @internal
+ * @brief Acknowledges a task on the channel before it runs
+ */
+static void
+_control_channel_ack(const char *task_id)
+{
+    t_http_response response;
+
+    debug(LOG_DEBUG, "Acknowledging task %s on the control channel", task_id);
+    if (_control_channel_poll(0, task_id, &response) == -1) {
+        /* Better told twice than never */
+        debug(LOG_WARNING, "Failed to acknowledge task %s on the control channel", task_id);
+        confirmTasking(task_id);
+        return;
+    }
+    /* The ack is a poll, the server may hand it the next task */
+    if (response.status >= 200 && response.status < 300 && response.body_len > 0) {
+        free(ack_task);
+        ack_task = safe_strdup(response.body);
+    }
+    http_response_free(&response);
+}
+
+/** @internal
+ * @brief Waits until a given time
+ */
+static void
+_control_channel_sleep_until(time_t when)
+{
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    pthread_mutex_t cond_mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct timespec timeout;
+
+    timeout.tv_sec = when;
+    timeout.tv_nsec = 0;
+    pthread_mutex_lock(&cond_mutex);
+    pthread_cond_timedwait(&cond, &cond_mutex, &timeout);
+    pthread_mutex_unlock(&cond_mutex);
+}
+
+/** Keeps a long poll open to the auth server and runs the tasks it sends
+ * @param arg NULL
+ */
+void
+thread_control_channel(void *arg)
+{
+    t_http_response response;
+    time_t started;
+    char *body;
+    int retry = 0;
+
+    if (http_client_use_tls(HTTP_SERVER_AUTH)) {
+        debug(LOG_WARNING, "The control channel is not available over TLS, tasks come with the pings");
+        return;
+    }
+
+    while (1) {
+        started = time(NULL);
+        if (_control_channel_poll(config_get_config()->control_channel_wait, NULL, &response) == 0) {
+            if (response.status >= 200 && response.status < 300) {
+                retry = 0;
+                body = (response.body_len > 0) ? safe_strdup(response.body) : NULL;
+                http_response_free(&response);
+                while (body != NULL) {
+                    fetchcmd_run(body, _control_channel_ack);
+                    free(body);
+                    body = ack_task;
+                    ack_task = NULL;
+                }
+                /* The server answered without holding the request */
+                if (time(NULL) - started < CONTROL_POLL_MIN)
+                    _control_channel_sleep_until(started + CONTROL_POLL_MIN);
+                continue;
+            }
+            debug(LOG_WARNING, "Auth server answered the control channel with HTTP %d", response.status);
+            http_response_free(&response);
+            _control_channel_close();
+        }
+
+        retry = (retry == 0) ? CONTROL_RETRY_MIN : retry * 2;
+        if (retry > CONTROL_RETRY_MAX)
+            retry = CONTROL_RETRY_MAX;
+        debug(LOG_DEBUG, "Opening the control channel again in %d seconds", retry);
+
+        _control_channel_sleep_until(time(NULL) + retry);
+    }
+}
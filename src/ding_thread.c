@@ -52,193 +52,61 @@
 #include "cJSON.h"
 #include "util.h"
 #include "centralserver.h"
+#include "http_client.h"
 #include "retrieve_thread.h"
 #include "fetchconf.h"
 
-static void ding(void);
-
-
-/** Launches a thread that periodically checks in with the wifidog auth server to perform heartbeat function.
-@param arg NULL
-@todo This thread loops infinitely, need a watchdog to verify that it is still running?
-*/  
-void
-thread_ding(void *arg)
-{
-	pthread_cond_t		cond = PTHREAD_COND_INITIALIZER;
-	pthread_mutex_t		cond_mutex = PTHREAD_MUTEX_INITIALIZER;
-	struct	timespec	timeout;
-
-
-	
-	while (1) {
-		/* Make sure we check the servers at the very begining */
-		debug(LOG_DEBUG, "Running ding()");
-		ding();
-		
-		
-		/* Sleep for config.checkinterval seconds... */
-		timeout.tv_sec = time(NULL) + 30;
-		timeout.tv_nsec = 0;
-
-		/* Mutex must be locked for pthread_cond_timedwait... */
-		pthread_mutex_lock(&cond_mutex);
-		
-		/* Thread safe "sleep" */
-		pthread_cond_timedwait(&cond, &cond_mutex, &timeout);
-
-		/* No longer needs to be locked */
-		pthread_mutex_unlock(&cond_mutex);
-	}
-}
-
-/** @internal
- * This function does the actual request.
+/** Sends one heartbeat to the log server.  Called by the heartbeat thread
+ * in ping_thread.c, which reads the system statistics once for all the
+ * servers.
+ * @return 0 on success, -1 if the log server could not be reached
  */
-static void
-ding(void)
+int
+ding(const t_sys_stats *stats)
 {
-        ssize_t			numbytes;
-        size_t	        	totalbytes;
-	int			sockfd, nfds, done;
 	char			request[MAX_BUF];
-	fd_set			readfds;
-	struct timeval		timeout;
-	FILE * fh;
-	unsigned long int sys_uptime  = 0;
-	unsigned int      sys_memfree = 0;
-	float             sys_load    = 0;
+	t_http_response		response;
 	char            *str = NULL;
-         char            *str1 = NULL;
-	cJSON *json;
 	
 	
 	
 	debug(LOG_DEBUG, "Entering ding()");
 	
-	/*
-	 * The ping thread does not really try to see if the auth server is actually
-	 * working. Merely that there is a web server listening at the port. And that
-	 * is done by connect_auth_server() internally.
-	 */
-	sockfd = connect_log_server();
-	if (sockfd == -1) {
-		/*
-		 * No auth servers for me to talk to
-		 */
-	debug(LOG_DEBUG, "Entering ding() connect fail");
-		return;
-	}
-
-	/*
-	 * Populate uptime, memfree and load
-	 */
-	if ((fh = fopen("/proc/uptime", "r"))) {
-		if(fscanf(fh, "%lu", &sys_uptime) != 1)
-			debug(LOG_CRIT, "Failed to read uptime");
-
-		fclose(fh);
-	}
-	if ((fh = fopen("/proc/meminfo", "r"))) {
-		while (!feof(fh)) {
-			if (fscanf(fh, "MemFree: %u", &sys_memfree) == 0) {
-				/* Not on this line */
-				while (!feof(fh) && fgetc(fh) != '\n');
-			}
-			else {
-				/* Found it */
-				break;
-			}
-		}
-		fclose(fh);
-	}
-	if ((fh = fopen("/proc/loadavg", "r"))) {
-		if(fscanf(fh, "%f", &sys_load) != 1)
-			debug(LOG_CRIT, "Failed to read loadavg");
-
-		fclose(fh);
-	}
-	
-	
 	/*
 	 * Prep & send request
 	 */
 	snprintf(request, sizeof(request) - 1,
-			"GET %s?gw_id=%s&sys_uptime=%lu&sys_memfree=%u&sys_load=%.2f HTTP/1.0\r\n"
+			"GET %s?gw_id=%s&sys_uptime=%lu&sys_memfree=%u&sys_load=%.2f HTTP/1.1\r\n"
 			"User-Agent: WiFiDog %s\r\n"
 			"Host: %s\r\n"
 			"\r\n",
 			"http://Wifi-admin.ctbri.com.cn/ping",
 			config_get_config()->gw_mac,
-			sys_uptime,
-			sys_memfree,
-			sys_load,
+			stats->uptime,
+			stats->memfree,
+			stats->load,
 			VERSION,
 			"124.127.116.177");
 
 	debug(LOG_DEBUG, "HTTP Request to Server: [%s]", request);
 	
-	send(sockfd, request, strlen(request), 0);
-
-	debug(LOG_DEBUG, "Reading response");
-	
-	numbytes = totalbytes = 0;
-	done = 0;
-	do {
-		FD_ZERO(&readfds);
-		FD_SET(sockfd, &readfds);
-		timeout.tv_sec = 30; /* XXX magic... 30 second */
-		timeout.tv_usec = 0;
-		nfds = sockfd + 1;
-
-		nfds = select(nfds, &readfds, NULL, NULL, &timeout);
-
-		if (nfds > 0) {
-			/** We don't have to use FD_ISSET() because there
-			 *  was only one fd. */
-			numbytes = read(sockfd, request + totalbytes, MAX_BUF - (totalbytes + 1));
-			if (numbytes < 0) {
-				debug(LOG_ERR, "An error occurred while reading from auth server: %s", strerror(errno));
-				/* FIXME */
-				close(sockfd);
-				return;
-			}
-			else if (numbytes == 0) {
-				done = 1;
-			}
-			else {
-				totalbytes += numbytes;
-				debug(LOG_DEBUG, "Read %d bytes, total now %d", numbytes, totalbytes);
-			}
-		}
-		else if (nfds == 0) {
-			debug(LOG_ERR, "Timed out reading data via select() from auth server");
-			/* FIXME */
-			close(sockfd);
-			return;
-		}
-		else if (nfds < 0) {
-			debug(LOG_ERR, "Error reading data via select() from auth server: %s", strerror(errno));
-			/* FIXME */
-			close(sockfd);
-			return;
-		}
-	} while (!done);
-	close(sockfd);
-
-	debug(LOG_DEBUG, "Done reading reply, total %d bytes", totalbytes);
-
-	request[totalbytes] = '\0';
+	if (http_client_request(HTTP_SERVER_LOG, request, &response) == -1) {
+		/*
+		 * No log server for me to talk to
+		 */
+	debug(LOG_DEBUG, "Entering ding() connect fail");
+		return -1;
+	}
 
-	debug(LOG_DEBUG, "HTTP Response from Server: [%s]", request);
+	debug(LOG_DEBUG, "HTTP Response from Server: [%s]", response.data);
 	
-	str = strstr(request, "Pong");
+	str = strstr(response.data, "Pong");
 	if (str == 0) {
-		if(strstr(request, "Task")){
+		if(strstr(response.data, "Task")){
 			//retrieve(json);
 			debug(LOG_DEBUG, "Auth Server Says Task" );
         	}
-        	else if(strstr(request, "Close")){
+        	else if(strstr(response.data, "Close")){
 					execute("killall readfifo",0);
 					debug(LOG_DEBUG, "Auth Server Says Close" );
 		 }
@@ -252,7 +120,7 @@ ding(void)
 		debug(LOG_DEBUG, "Auth Server Says: Pong");
 	}
 	
+	http_response_free(&response);
 	
-	
-	return;	
+	return 0;
 }
@@ -27,8 +27,12 @@
 #ifndef _DING_THREAD_H_
 #define _DING_THREAD_H_
 
+#include "ping_thread.h"
 
-/** @brief Periodically checks on the auth server to see if it's alive. */
-void thread_ding(void *arg);
+/** @brief Seconds between two heartbeats to the log server */
+#define DING_INTERVAL 30
+
+/** @brief Sends one heartbeat to the log server */
+int ding(const t_sys_stats *stats);
 
 #endif
@@ -0,0 +1,347 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file dns_cache.c
+    @brief Caching resolver for the central server host names
+
+    Every connection to a central server used to resolve its host name
+    with gethostbyname() under a global lock, so one slow DNS server held
+    up logins, pings and logs alike. Host names are now resolved with
+    getaddrinfo() and kept for DnsCacheTTL seconds, with every A record
+    returned. Failures are remembered for DnsNegativeTTL seconds. A
+    background thread resolves names that are not known yet and refreshes
+    the ones in use shortly before they expire, so lookups from the
+    connect path normally never wait for the DNS server.
+
+    The system resolver does not report record TTLs, so the configured
+    values are used for every host.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "common.h"
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "util.h"
+#include "dns_cache.h"
+
+/** @internal
+ * A cached host name
+ */
+typedef struct _t_dns_entry {
+    struct _t_dns_entry *next;
+    char *name;			/**< @brief Host name */
+    struct in_addr addrs[DNS_CACHE_MAX_ADDRS];	/**< @brief Its addresses */
+    int naddrs;			/**< @brief Number of addresses, 0 if the
+				     last lookup failed */
+    time_t expires;		/**< @brief When the answer gets stale, 0 if
+				     the name was never resolved */
+    time_t resolved;		/**< @brief When the addresses were obtained */
+    time_t last_used;		/**< @brief Last lookup of the name */
+    int resolving;		/**< @brief The refresh thread is on it */
+} t_dns_entry;
+
+static t_dns_entry *dns_cache = NULL;
+
+static pthread_mutex_t dns_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signalled when a name the refresh thread should resolve is added */
+static pthread_cond_t dns_cache_cond = PTHREAD_COND_INITIALIZER;
+
+/** @internal
+ * @brief Resolves a host name with the system resolver, without the cache
+ * @return Number of addresses stored, 0 if the name did not resolve
+ */
+static int
+_dns_cache_query(const char *name, struct in_addr *addrs)
+{
+    struct addrinfo hints, *res, *ai;
+    int i, naddrs = 0, rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((rc = getaddrinfo(name, NULL, &hints, &res)) != 0) {
+        debug(LOG_DEBUG, "Resolving %s failed: %s", name, gai_strerror(rc));
+        return 0;
+    }
+
+    for (ai = res; ai != NULL && naddrs < DNS_CACHE_MAX_ADDRS; ai = ai->ai_next) {
+        struct in_addr addr = ((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+
+        /* getaddrinfo() may list an address once per protocol */
+        for (i = 0; i < naddrs && addrs[i].s_addr != addr.s_addr; i++)
+            ;
+        if (i == naddrs)
+            addrs[naddrs++] = addr;
+    }
+    freeaddrinfo(res);
+
+    if (naddrs > 0)
+        mark_online();
+
+    return naddrs;
+}
+
+/** @internal
+ * @brief Finds the entry of a host name, must be called with the cache locked
+ */
+static t_dns_entry *
+_dns_cache_find(const char *name)
+{
+    t_dns_entry *entry;
+
+    for (entry = dns_cache; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+/** @internal
+ * @brief Finds or adds the entry of a host name, must be called with the
+ * cache locked
+ */
+static t_dns_entry *
+_dns_cache_get(const char *name)
+{
+    t_dns_entry *entry;
+
+    if ((entry = _dns_cache_find(name)) == NULL) {
+        entry = safe_malloc(sizeof(t_dns_entry));
+        memset(entry, 0, sizeof(t_dns_entry));
+        entry->name = safe_strdup(name);
+        entry->next = dns_cache;
+        dns_cache = entry;
+    }
+    return entry;
+}
+
+/** @internal
+ * @brief Stores the answer of a lookup, must be called with the cache locked
+ */
+static void
+_dns_cache_store(t_dns_entry *entry, const struct in_addr *addrs, int naddrs, time_t now)
+{
+    s_config *config = config_get_config();
+
+    if (naddrs > 0) {
+        memcpy(entry->addrs, addrs, sizeof(struct in_addr) * naddrs);
+        entry->naddrs = naddrs;
+        entry->resolved = now;
+        entry->expires = now + config->dns_cache_ttl;
+    } else if (entry->naddrs > 0 && entry->resolved + 2 * config->dns_cache_ttl > now) {
+        /* Keep serving the last answer for a while if the DNS server is down */
+        debug(LOG_INFO, "Refreshing %s failed, keeping the previous addresses", entry->name);
+        entry->expires = now + config->dns_negative_ttl;
+    } else {
+        entry->naddrs = 0;
+        entry->expires = now + config->dns_negative_ttl;
+    }
+}
+
+/** @internal
+ * @brief Copies the addresses of a resolved entry
+ * @return Number of addresses copied, or -1 if the name did not resolve
+ */
+static int
+_dns_cache_copy(const t_dns_entry *entry, struct in_addr *addrs, int max)
+{
+    int n = entry->naddrs < max ? entry->naddrs : max;
+
+    if (entry->naddrs == 0)
+        return -1;
+    memcpy(addrs, entry->addrs, sizeof(struct in_addr) * n);
+    return n;
+}
+
+/** Returns the cached addresses of a host without blocking. A name that
+ * is not known yet is handed to the refresh thread.
+ * @param name Host name
+ * @param addrs Receives up to max addresses
+ * @param max Size of addrs
+ * @return Number of addresses, 0 if the name is being resolved, -1 if it
+ * recently failed to resolve
+ */
+int
+dns_cache_lookup(const char *name, struct in_addr *addrs, int max)
+{
+    t_dns_entry *entry;
+    time_t now = time(NULL);
+    int n;
+
+    pthread_mutex_lock(&dns_cache_mutex);
+    entry = _dns_cache_get(name);
+    entry->last_used = now;
+    if (entry->expires == 0) {
+        pthread_cond_signal(&dns_cache_cond);
+        n = 0;
+    } else {
+        /* A stale entry is still served while the refresh thread works */
+        n = _dns_cache_copy(entry, addrs, max);
+        if (entry->expires <= now)
+            pthread_cond_signal(&dns_cache_cond);
+    }
+    pthread_mutex_unlock(&dns_cache_mutex);
+
+    return n;
+}
+
+/** Returns the addresses of a host, resolving it first if the cache has
+ * no fresh answer for it
+ * @param name Host name
+ * @param addrs Receives up to max addresses
+ * @param max Size of addrs
+ * @return Number of addresses, -1 if the name does not resolve
+ */
+int
+dns_cache_resolve(const char *name, struct in_addr *addrs, int max)
+{
+    struct in_addr found[DNS_CACHE_MAX_ADDRS];
+    t_dns_entry *entry;
+    time_t now = time(NULL);
+    int naddrs, n;
+
+    pthread_mutex_lock(&dns_cache_mutex);
+    entry = _dns_cache_get(name);
+    entry->last_used = now;
+    if (entry->expires > now) {
+        n = _dns_cache_copy(entry, addrs, max);
+        pthread_mutex_unlock(&dns_cache_mutex);
+        return n;
+    }
+    pthread_mutex_unlock(&dns_cache_mutex);
+
+    naddrs = _dns_cache_query(name, found);
+
+    pthread_mutex_lock(&dns_cache_mutex);
+    entry = _dns_cache_get(name);
+    _dns_cache_store(entry, found, naddrs, time(NULL));
+    n = _dns_cache_copy(entry, addrs, max);
+    pthread_mutex_unlock(&dns_cache_mutex);
+
+    return n;
+}
+
+/** @internal
+ * @brief Tells whether the refresh thread should resolve an entry now.
+ * Must be called with the cache locked.
+ */
+static int
+_dns_cache_due(const t_dns_entry *entry, time_t now)
+{
+    s_config *config = config_get_config();
+    time_t margin = config->dns_cache_ttl / 10;
+
+    if (entry->resolving)
+        return 0;
+    if (entry->expires == 0)
+        return 1;
+    /* Names nobody asked for lately are left to expire */
+    if (entry->last_used + 2 * config->dns_cache_ttl < now)
+        return 0;
+    if (entry->naddrs == 0)
+        return entry->expires <= now;
+    return entry->expires - (margin > 0 ? margin : 1) <= now;
+}
+
+/** @internal
+ * @brief Drops entries nobody asked for lately, must be called with the
+ * cache locked
+ */
+static void
+_dns_cache_prune(time_t now)
+{
+    s_config *config = config_get_config();
+    t_dns_entry **prev, *entry;
+
+    prev = &dns_cache;
+    while ((entry = *prev) != NULL) {
+        if (!entry->resolving && entry->last_used + 4 * config->dns_cache_ttl < now) {
+            debug(LOG_DEBUG, "Dropping %s from the DNS cache", entry->name);
+            *prev = entry->next;
+            free(entry->name);
+            free(entry);
+        } else {
+            prev = &entry->next;
+        }
+    }
+}
+
+/** Launches a thread that resolves new host names and refreshes the
+ * cached ones before they expire
+ * @param arg NULL
+ */
+void
+thread_dns_cache(void *arg)
+{
+    struct in_addr found[DNS_CACHE_MAX_ADDRS];
+    struct timespec timeout;
+    t_dns_entry *entry;
+    char *name;
+    time_t now;
+    int naddrs;
+
+    pthread_mutex_lock(&dns_cache_mutex);
+    while (1) {
+        now = time(NULL);
+        _dns_cache_prune(now);
+
+        for (entry = dns_cache; entry != NULL && !_dns_cache_due(entry, now); entry = entry->next)
+            ;
+
+        if (entry == NULL) {
+            /* Nothing to do, sleep until a lookup needs us */
+            timeout.tv_sec = now + 1;
+            timeout.tv_nsec = 0;
+            pthread_cond_timedwait(&dns_cache_cond, &dns_cache_mutex, &timeout);
+            continue;
+        }
+
+        entry->resolving = 1;
+        name = safe_strdup(entry->name);
+        pthread_mutex_unlock(&dns_cache_mutex);
+
+        debug(LOG_DEBUG, "Refreshing %s in the DNS cache", name);
+        naddrs = _dns_cache_query(name, found);
+
+        pthread_mutex_lock(&dns_cache_mutex);
+        /* Entries being resolved are never pruned */
+        entry = _dns_cache_find(name);
+        _dns_cache_store(entry, found, naddrs, time(NULL));
+        entry->resolving = 0;
+        free(name);
+    }
+}
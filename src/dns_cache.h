@@ -0,0 +1,43 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file dns_cache.h
+    @brief Caching resolver for the central server host names
+*/
+
+#ifndef _DNS_CACHE_H_
+#define _DNS_CACHE_H_
+
+#include <netinet/in.h>
+
+/** Most addresses kept for one host name */
+#define DNS_CACHE_MAX_ADDRS 8
+
+/** @brief Returns the cached addresses of a host without blocking */
+int dns_cache_lookup(const char *name, struct in_addr *addrs, int max);
+
+/** @brief Returns the addresses of a host, resolving it if it is not cached */
+int dns_cache_resolve(const char *name, struct in_addr *addrs, int max);
+
+/** @brief Thread refreshing cached host names before they expire */
+void thread_dns_cache(void *arg);
+
+#endif /* _DNS_CACHE_H_ */
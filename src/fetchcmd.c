@@ -1,276 +1,343 @@
-﻿/********************************************************************\
- * This program is free software; you can redistribute it and/or    *
- * modify it under the terms of the GNU General Public License as   *
- * published by the Free Software Foundation; either version 2 of   *
- * the License, or (at your option) any later version.              *
- *                                                                  *
- * This program is distributed in the hope that it will be useful,  *
- * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
- * GNU General Public License for more details.                     *
- *                                                                  *
- * You should have received a copy of the GNU General Public License*
- * along with this program; if not, contact:                        *
- *                                                                  *
- * Free Software Foundation           Voice:  +1-617-542-5942       *
- * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
- * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
- *                                                                  *
-\********************************************************************/
-
-/* $Id$ */
-/** @file ping_thread.c
-    @brief Periodically checks in with the central auth server so the auth
-    server knows the gateway is still up.  Note that this is NOT how the gateway
-    detects that the central server is still up.
-    @author Copyright (C) 2004 Alexandre Carmel-Veilleux <acv@miniguru.ca>
-*/
-
-#define _GNU_SOURCE
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <pthread.h>
-#include <string.h>
-#include <stdarg.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <netdb.h>
-#include <unistd.h>
-#include <syslog.h>
-#include <signal.h>
-#include <errno.h>
-
-#include "../config.h"
-#include "safe.h"
-#include "common.h"
-#include "conf.h"
-#include "debug.h"
-#include "retrieve_thread.h"
-#include "util.h"
-#include "centralserver.h"
-#include "firewall.h"
-#include "cJSON.h"
-
-void confirmTasking(const char *task_id);
-
-void
-fetchcmd()
-{
-        ssize_t			numbytes;
-        size_t	        	totalbytes;
-	int		sockfd, nfds, done;
-
-	char			request[MAX_BUF];
-	fd_set			readfds;
-	struct timeval		timeout;
-	FILE * fh;
-	char  *str = NULL;
-    	cJSON *json;
-
-	sockfd = connect_auth_server();
-	if (sockfd == -1) {
-		return;
-	}
-
-    snprintf(request, sizeof(request) - 1,
-		    "GET %s?dev_id=%s HTTP/1.0\r\n"
-		    "User-Agent: WiFiDog %s\r\n"
-		    "Host: %s\r\n"
-		    "\r\n",
-		    "/api10/taskrequest",
-		    config_get_config()->dev_id,
-		    VERSION,
-		    get_auth_server()->serv_hostname);
-	
-	debug(LOG_DEBUG, "Sending cnd request to auth server:%s\n", request);
-
-	
-	send(sockfd, request, strlen(request), 0);
-	numbytes = totalbytes = 0;
-	done = 0;
-	do {
-		FD_ZERO(&readfds);
-		FD_SET(sockfd, &readfds);
-		timeout.tv_sec = 30; /* XXX magic... 30 second */
-		timeout.tv_usec = 0;
-		nfds = sockfd + 1;
-
-		nfds = select(nfds, &readfds, NULL, NULL, &timeout);
-
-		if (nfds > 0) {
-			/** We don't have to use FD_ISSET() because there
-			 *  was only one fd. */
-			numbytes = read(sockfd, request + totalbytes, MAX_BUF - (totalbytes + 1));
-			if (numbytes < 0) {
-				debug(LOG_ERR, "An error occurred while reading from auth server: %s", strerror(errno));
-				/* FIXME */
-				close(sockfd);
-				return;
-			}
-			else if (numbytes == 0) {
-				done = 1;
-			}
-			else {
-				totalbytes += numbytes;
-				debug(LOG_DEBUG, "Read %d bytes, total now %d", numbytes, totalbytes);
-			}
-		}
-		else if (nfds == 0) {
-			debug(LOG_ERR, "Timed out reading data via select() from auth server");
-			/* FIXME */
-			close(sockfd);
-			return;
-		}
-		else if (nfds < 0) {
-			debug(LOG_ERR, "Error reading data via select() from auth server: %s", strerror(errno));
-			/* FIXME */
-			close(sockfd);
-			return;
-		}
-	} while (!done);
-
-
-	request[totalbytes] = '\0';
-	debug(LOG_DEBUG," %s \n",request);    
-
-    str = strstr(request, "{");
-    if (str != 0) {
-	
-    	json=cJSON_Parse(str);
-	if (!json) {debug(LOG_DEBUG,"Error before: [%s]\n",cJSON_GetErrorPtr());}
-	else{
-		if (cJSON_GetObjectItem(json,"result")  && 
-			strcmp(cJSON_GetObjectItem(json,"result")->valuestring,"OK")==0){
-    			cJSON *format;
-			debug(LOG_DEBUG,"task1 \n");    
-
-			if (format = cJSON_GetObjectItem(json,"task")){
-				debug(LOG_DEBUG,"task2 \n");    
-				
-				char *task_id = cJSON_GetObjectItem(format,"task_id")->valuestring;
-				int task_code = cJSON_GetObjectItem(format,"task_code")->valueint;
-				confirmTasking(task_id);
-				debug(LOG_DEBUG,"task_code %d \n",task_code);    
-				if(task_code==1000){
-					execute("reboot",0);
-					debug(LOG_DEBUG," reboot \n");    
-				}else if(task_code == 2002){
-					//execute("smctl restart",0);
-					debug(LOG_DEBUG," smctl restart \n");    
-					fw_destroy();
-					if (!fw_init()) {
-						debug(LOG_ERR, "FATAL: Failed to initialize firewall");
-						exit(1);
-					}
-				}else if(task_code ==2003){
-					cJSON * task = cJSON_GetObjectItem(format,"task_params");
-					char *hostname = cJSON_GetObjectItem(task,"hostname")->valuestring;
-					char *ssid = cJSON_GetObjectItem(task,"ssid")->valuestring;
-					debug(LOG_DEBUG,"%s %s \n",hostname,ssid);    
-					ssidEdit(ssid);
-					hostnameEdit(hostname);
-					execute("/etc/init.d/network restart  >/dev/null 2>&1;smctl restart;",0);
-					
-				}else if(task_code == 3000){
-					char	sysupgrade[200];
-					snprintf(sysupgrade, sizeof(sysupgrade) - 1,
-							"sysupgrade -b /etc/back.tar.gz;sysupgrade -f /etc/back.tar.gz  -v %s",
-							config_get_config()->imageurl);
-						
-					debug(LOG_DEBUG,"%s \n",sysupgrade);
-					execute(sysupgrade,0);    
-					
-				}
-			}
-		}
-	}
-
-	}
-    
-
-	
-	close(sockfd);
-	return;	
-}
-
-
-void confirmTasking(const char *task_id){
-
-    unsigned int	        totalbytes;
-    int			nfds, done;
-    fd_set			readfds;
-    unsigned int		numbytes;
-	struct timeval		timeout;
-	char			request[MAX_BUF];
-
-
-int 	sockfd = connect_auth_server();
-
-
-	if (sockfd == -1) {
-		return;
-	}
-
-	snprintf(request, sizeof(request) - 1,
-			"GET %s?dev_id=%s&task_id=%s&result=%s&message=12345678 HTTP/1.0\r\n"
-			"User-Agent: WiFiDog %s\r\n"
-			"Host: %s\r\n"
-			"\r\n",
-			"/api10/taskresult",
-		    	config_get_config()->dev_id,
-			task_id,
-			"OK",
-			"1.1",
-		    get_auth_server()->serv_hostname);
-
-	
-	debug(LOG_DEBUG," %s \n",request);    
-	send(sockfd, request, strlen(request), 0);
-	
-	numbytes = totalbytes = 0;
-	done = 0;
-	do {
-		FD_ZERO(&readfds);
-		FD_SET(sockfd, &readfds);
-		timeout.tv_sec = 30; /* XXX magic... 30 second */
-		timeout.tv_usec = 0;
-		nfds = sockfd + 1;
-
-		nfds = select(nfds, &readfds, NULL, NULL, &timeout);
-
-		if (nfds > 0) {
-			numbytes = read(sockfd, request + totalbytes, MAX_BUF - (totalbytes + 1));
-
-			if (numbytes < 0) {
-				close(sockfd);
-				return;
-			}
-			else if (numbytes == 0) {
-				done = 1;
-			}
-			else {
-				totalbytes += numbytes;
-			}
-		}
-		else if (nfds == 0) {
-			close(sockfd);
-			return;
-		}
-		else if (nfds < 0) {
-			close(sockfd);
-			return;
-		}
-	} while (!done);
-
-
-    request[totalbytes] = '\0';
-	debug(LOG_DEBUG," %s \n",request);    
-	close(sockfd);
-	return;	
-
-}
-
-
+﻿/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file fetchcmd.c
+    @brief Runs the tasks the auth server sends: fetched with a request of
+    their own (legacy), or carried in the reply to the heartbeat.
+    @author Copyright (C) 2004 Alexandre Carmel-Veilleux <acv@miniguru.ca>
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "../config.h"
+#include "safe.h"
+#include "common.h"
+#include "conf.h"
+#include "debug.h"
+#include "retrieve_thread.h"
+#include "util.h"
+#include "centralserver.h"
+#include "http_client.h"
+#include "firewall.h"
+#include "cJSON.h"
+#include "httpd.h"
+
+void confirmTasking(const char *task_id);
+
+/** Number of task results that can wait for the next heartbeat */
+#define TASK_RESULTS_MAX 8
+
+/** Results of the tasks received in a heartbeat, reported in the next one */
+static char *task_results[TASK_RESULTS_MAX];
+static int task_results_count = 0;
+static pthread_mutex_t task_results_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * @brief Runs one task sent by the auth server
+ * @param format The "task" object of the server reply
+ * @param confirm Called with the task id before running it, or NULL
+ * @return The task id, or NULL if the task is not well formed
+ */
+static const char *
+_fetchcmd_execute(cJSON *format, void (*confirm)(const char *))
+{
+	cJSON *item;
+	char *task_id;
+	int task_code;
+
+	item = cJSON_GetObjectItem(format, "task_id");
+	if (item == NULL || item->valuestring == NULL)
+		return NULL;
+	task_id = item->valuestring;
+	item = cJSON_GetObjectItem(format, "task_code");
+	if (item == NULL)
+		return NULL;
+	task_code = item->valueint;
+
+	if (confirm)
+		confirm(task_id);
+	debug(LOG_DEBUG,"task_code %d \n",task_code);    
+	if(task_code==1000){
+		execute("reboot",0);
+		debug(LOG_DEBUG," reboot \n");    
+	}else if(task_code == 2002){
+		//execute("smctl restart",0);
+		debug(LOG_DEBUG," smctl restart \n");    
+		fw_destroy();
+		if (!fw_init()) {
+			debug(LOG_ERR, "FATAL: Failed to initialize firewall");
+			exit(1);
+		}
+	}else if(task_code ==2003){
+		cJSON * task = cJSON_GetObjectItem(format,"task_params");
+		char *hostname = cJSON_GetObjectItem(task,"hostname")->valuestring;
+		char *ssid = cJSON_GetObjectItem(task,"ssid")->valuestring;
+		debug(LOG_DEBUG,"%s %s \n",hostname,ssid);    
+		ssidEdit(ssid);
+		hostnameEdit(hostname);
+		execute("/etc/init.d/network restart  >/dev/null 2>&1;smctl restart;",0);
+		
+	}else if(task_code == 3000){
+		char	sysupgrade[200];
+		snprintf(sysupgrade, sizeof(sysupgrade) - 1,
+				"sysupgrade -b /etc/back.tar.gz;sysupgrade -f /etc/back.tar.gz  -v %s",
+				config_get_config()->imageurl);
+			
+		debug(LOG_DEBUG,"%s \n",sysupgrade);
+		execute(sysupgrade,0);    
+		
+	}
+	return task_id;
+}
+
+/** @internal
+ * @brief Tells whether a task takes the gateway or its network down, so
+ * that it has to be confirmed before it runs
+ */
+static int
+_fetchcmd_disruptive(int task_code)
+{
+	return task_code == 1000 || task_code == 2003 || task_code == 3000;
+}
+
+/** @internal
+ * @brief Queues the result of a task for the next heartbeat
+ */
+static void
+_fetchcmd_confirm_later(const char *task_id)
+{
+	pthread_mutex_lock(&task_results_mutex);
+	if (task_results_count < TASK_RESULTS_MAX) {
+		task_results[task_results_count++] = safe_strdup(task_id);
+		task_id = NULL;
+	}
+	pthread_mutex_unlock(&task_results_mutex);
+
+	if (task_id) {
+		debug(LOG_WARNING, "Too many task results waiting, confirming task %s now", task_id);
+		confirmTasking(task_id);
+	}
+}
+
+/** Runs the task carried in the body of a heartbeat reply.
+ *
+ * The result goes back with the next heartbeat.  Tasks that take the
+ * gateway or its network down would never see that heartbeat, so they are
+ * confirmed before they run, as in the legacy flow.
+ * @param body Body of the reply to the ping
+ * @return 1 if the body carried a task, 0 if the server uses the legacy
+ * flow and the task has to be fetched with fetchcmd()
+ */
+int
+fetchcmd_inline(const char *body)
+{
+	cJSON *json, *result, *format, *code;
+	const char *str;
+	int later, found = 0;
+
+	if (body == NULL || (str = strchr(body, '{')) == NULL)
+		return 0;
+	if ((json = cJSON_Parse(str)) == NULL) {
+		debug(LOG_DEBUG, "Heartbeat reply is not a task: [%s]", cJSON_GetErrorPtr());
+		return 0;
+	}
+
+	result = cJSON_GetObjectItem(json, "result");
+	format = cJSON_GetObjectItem(json, "task");
+	if (format != NULL) {
+		found = 1;
+		if (result && result->valuestring && strcmp(result->valuestring, "OK") == 0) {
+			code = cJSON_GetObjectItem(format, "task_code");
+			/* Unknown tasks run nothing, their result can wait too */
+			later = !(code && _fetchcmd_disruptive(code->valueint));
+			str = _fetchcmd_execute(format, later ? NULL : confirmTasking);
+			if (str == NULL)
+				debug(LOG_WARNING, "Heartbeat reply carried a malformed task");
+			else if (later)
+				_fetchcmd_confirm_later(str);
+		}
+	}
+
+	cJSON_Delete(json);
+	return found;
+}
+
+/** Runs the task in the body of a server reply.
+ * @param body Body of the reply: {"result":"OK","task":{...}}
+ * @param confirm Called with the task id before the task runs
+ * @return 1 if the body carried a task, 0 if not
+ */
+int
+fetchcmd_run(const char *body, void (*confirm)(const char *task_id))
+{
+	cJSON *json, *result, *format;
+	const char *str;
+	int found = 0;
+
+	if (body == NULL || (str = strchr(body, '{')) == NULL)
+		return 0;
+	if ((json = cJSON_Parse(str)) == NULL) {
+		debug(LOG_DEBUG, "Reply is not a task: [%s]", cJSON_GetErrorPtr());
+		return 0;
+	}
+
+	result = cJSON_GetObjectItem(json, "result");
+	format = cJSON_GetObjectItem(json, "task");
+	if (format != NULL && result && result->valuestring && strcmp(result->valuestring, "OK") == 0) {
+		found = 1;
+		if (_fetchcmd_execute(format, confirm) == NULL)
+			debug(LOG_WARNING, "Reply carried a malformed task");
+	}
+
+	cJSON_Delete(json);
+	return found;
+}
+
+/** Writes the results waiting for the next heartbeat as query parameters.
+ * @param buf Where to write them, empty if there are none
+ * @param size Size of buf
+ * @return How many results were written, to pass to fetchcmd_results_sent()
+ */
+int
+fetchcmd_results_query(char *buf, size_t size)
+{
+	size_t len = 0;
+	char *task_id;
+	int i, n;
+
+	buf[0] = '\0';
+	pthread_mutex_lock(&task_results_mutex);
+	for (i = 0; i < task_results_count; i++) {
+		/* The id comes from the server, it may hold anything */
+		if ((task_id = httpdUrlEncode(task_results[i])) == NULL)
+			break;
+		n = snprintf(buf + len, size - len, "%s%s:OK",
+				i == 0 ? "&task_results=" : ",", task_id);
+		free(task_id);
+		if (n < 0 || (size_t)n >= size - len) {
+			buf[len] = '\0';
+			break;
+		}
+		len += n;
+	}
+	pthread_mutex_unlock(&task_results_mutex);
+	return i;
+}
+
+/** Forgets the results the server has now received.
+ * @param count What fetchcmd_results_query() returned
+ */
+void
+fetchcmd_results_sent(int count)
+{
+	int i;
+
+	pthread_mutex_lock(&task_results_mutex);
+	if (count > task_results_count)
+		count = task_results_count;
+	for (i = 0; i < count; i++)
+		free(task_results[i]);
+	memmove(task_results, task_results + count,
+			(task_results_count - count) * sizeof(task_results[0]));
+	task_results_count -= count;
+	pthread_mutex_unlock(&task_results_mutex);
+}
+
+
+void
+fetchcmd()
+{
+	char			request[MAX_BUF];
+	t_http_response		response;
+
+    snprintf(request, sizeof(request) - 1,
+		    "GET %s?dev_id=%s HTTP/1.1\r\n"
+		    "User-Agent: WiFiDog %s\r\n"
+		    "Host: %s\r\n"
+		    "\r\n",
+		    "/api10/taskrequest",
+		    config_get_config()->dev_id,
+		    VERSION,
+		    get_auth_server()->serv_hostname);
+	
+	debug(LOG_DEBUG, "Sending cnd request to auth server:%s\n", request);
+
+	
+	if (http_client_request(HTTP_SERVER_AUTH, request, &response) == -1) {
+		return;
+	}
+
+	debug(LOG_DEBUG," %s \n",response.data);    
+
+	fetchcmd_run(response.body, confirmTasking);
+
+	http_response_free(&response);
+	return;	
+}
+
+
+void confirmTasking(const char *task_id){
+
+	char			request[MAX_BUF];
+	t_http_response		response;
+	char			*safe_task_id;
+
+	if ((safe_task_id = httpdUrlEncode(task_id)) == NULL)
+		return;
+	snprintf(request, sizeof(request) - 1,
+			"GET %s?dev_id=%s&task_id=%s&result=%s&message=12345678 HTTP/1.1\r\n"
+			"User-Agent: WiFiDog %s\r\n"
+			"Host: %s\r\n"
+			"\r\n",
+			"/api10/taskresult",
+		    	config_get_config()->dev_id,
+			safe_task_id,
+			"OK",
+			"1.1",
+		    get_auth_server()->serv_hostname);
+	free(safe_task_id);
+
+	
+	debug(LOG_DEBUG," %s \n",request);    
+	if (http_client_request(HTTP_SERVER_AUTH, request, &response) == -1) {
+		return;
+	}
+
+	debug(LOG_DEBUG," %s \n",response.data);    
+	http_response_free(&response);
+	return;	
+
+}
@@ -27,6 +27,24 @@
 #ifndef _RETRIEVE_THREAD_H_
 #define _RETRIEVE_THREAD_H_
 
+#include <stddef.h>
+
+/** @brief Fetches the task the auth server has for the gateway and runs it */
 void fetchcmd();
 
+/** @brief Tells the auth server a task was received */
+void confirmTasking(const char *task_id);
+
+/** @brief Runs the task carried in a heartbeat reply, if there is one */
+int fetchcmd_inline(const char *body);
+
+/** @brief Runs the task in a server reply, confirming it first */
+int fetchcmd_run(const char *body, void (*confirm)(const char *task_id));
+
+/** @brief Writes the task results waiting for the next heartbeat */
+int fetchcmd_results_query(char *buf, size_t size);
+
+/** @brief Forgets the task results the server has received */
+void fetchcmd_results_sent(int count);
+
 #endif
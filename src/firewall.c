@@ -64,6 +64,7 @@
 #endif
 
 #include "httpd.h"
+#include "common.h"
 #include "safe.h"
 #include "debug.h"
 #include "conf.h"
@@ -72,12 +73,22 @@
 #include "auth.h"
 #include "centralserver.h"
 #include "client_list.h"
+#include "quota.h"
+#include "auth_cache.h"
+#include "http_client.h"
+#include "http_async.h"
+#include "util.h"
+#include "journal.h"
 
 extern pthread_mutex_t client_list_mutex;
 
 /* from commandline.c */
 extern pid_t restart_orig_pid;
 
+/** Seconds before batch counters are tried again on an auth server that
+ * refused them */
+#define FW_BATCH_RETRY 3600
+
 
 
 /**
@@ -267,8 +278,310 @@ fw_destroy(void)
     return iptables_fw_destroy();
 }
 
+/** @internal
+ * @brief Checks one client for inactivity and applies the auth server answer
+ *
+ * Must be called with the client list locked. The client may be deleted.
+ * @param p1 The client
+ * @param authresponse What the auth server answered for this client
+ * @return 1 if the client timed out and the logout should be advertised
+ */
+static int
+_fw_sync_client(t_client *p1, const t_authresponse *authresponse)
+{
+    s_config *config = config_get_config();
+    time_t	current_time=time(NULL);
+
+    debug(LOG_INFO, "Checking client %s for timeout:  Last updated %ld (%ld seconds ago), timeout delay %ld seconds, current time %ld, ",
+                        p1->ip, p1->counters.last_updated, current_time-p1->counters.last_updated, config->checkinterval * config->clienttimeout, current_time);
+    if (p1->counters.last_updated +
+				(config->checkinterval * config->clienttimeout)
+				<= current_time) {
+        /* Timing out user */
+        debug(LOG_INFO, "%s - Inactive for more than %ld seconds, removing client and denying in firewall",
+                        p1->ip, config->checkinterval * config->clienttimeout);
+        fw_deny(p1->ip, p1->mac, p1->fw_connection_state);
+        auth_cache_invalidate(p1->token);
+        client_list_delete(p1);
+        return 1;
+    }
+
+    /*
+     * This handles any change in
+     * the status this allows us
+     * to change the status of a
+     * user while he's connected
+     *
+     * Only run if we have an auth server
+     * configured!
+     */
+    if (config->auth_servers != NULL) {
+        switch (authresponse->authcode) {
+            case AUTH_DENIED:
+                debug(LOG_NOTICE, "%s - Denied. Removing client and firewall rules", p1->ip);
+                fw_deny(p1->ip, p1->mac, p1->fw_connection_state);
+                auth_cache_invalidate(p1->token);
+                client_list_delete(p1);
+                break;
+
+            case AUTH_VALIDATION_FAILED:
+                debug(LOG_NOTICE, "%s - Validation timeout, now denied. Removing client and firewall rules", p1->ip);
+                fw_deny(p1->ip, p1->mac, p1->fw_connection_state);
+                auth_cache_invalidate(p1->token);
+                client_list_delete(p1);
+                break;
+
+            case AUTH_ALLOWED:
+                if (p1->fw_connection_state != FW_MARK_KNOWN) {
+                    debug(LOG_INFO, "%s - Access has changed to allowed, refreshing firewall and clearing counters", p1->ip);
+                    //WHY did we deny, then allow!?!? benoitg 2007-06-21
+                    //fw_deny(p1->ip, p1->mac, p1->fw_connection_state);
+
+                    if (p1->fw_connection_state != FW_MARK_PROBATION) {
+                        p1->counters.incoming = p1->counters.outgoing = 0;
+                    }
+                    else {
+                        //We don't want to clear counters if the user was in validation, it probably already transmitted data..
+                        debug(LOG_INFO, "%s - Skipped clearing counters after all, the user was previously in validation", p1->ip);
+                    }
+                    p1->fw_connection_state = FW_MARK_KNOWN;
+                    client_list_authorise(p1);
+                    fw_allow(p1->ip, p1->mac, p1->fw_connection_state);
+                }
+                quota_update(p1, authresponse);
+                break;
+
+            case AUTH_VALIDATION:
+                /*
+                 * Do nothing, user
+                 * is in validation
+                 * period
+                 */
+                debug(LOG_INFO, "%s - User in validation period", p1->ip);
+                break;
+
+            case AUTH_ERROR:
+                debug(LOG_WARNING, "Error communicating with auth server - leaving %s as-is for now", p1->ip);
+                break;
+
+            default:
+                debug(LOG_ERR, "I do not know about authentication code %d", authresponse->authcode);
+                break;
+        }
+    }
+
+    return 0;
+}
+
+/** @internal
+ * @brief Copies what the auth server needs to know about every client
+ *
+ * The clients are pinged as well, see fw_sync_with_authserver() about
+ * keeping the link active.
+ * @param count Returns the number of clients
+ * @return The reports, to be freed with _fw_sync_free_reports()
+ */
+static t_counters_report *
+_fw_sync_snapshot(int *count)
+{
+    t_counters_report *reports;
+    t_client_list_stats stats;
+    t_client        *p1;
+    int             i;
+
+    LOCK_CLIENT_LIST();
+    client_list_get_stats(&stats);
+    reports = safe_malloc(sizeof(t_counters_report) * (stats.count + 1));
+    i = 0;
+    for (p1 = client_get_first_client(); NULL != p1; p1 = p1->next) {
+        reports[i].ip = safe_strdup(p1->ip);
+        reports[i].mac = safe_strdup(p1->mac);
+        reports[i].token = safe_strdup(p1->token);
+        reports[i].incoming = p1->counters.incoming;
+        reports[i].outgoing = p1->counters.outgoing;
+        reports[i].authresponse.authcode = AUTH_ERROR;
+        reports[i].authresponse.has_quota = 0;
+        i++;
+    }
+    UNLOCK_CLIENT_LIST();
+
+    *count = i;
+    for (i = 0; i < *count; i++)
+        icmp_ping(reports[i].ip);
+
+    return reports;
+}
+
+/** @internal
+ * @brief Applies the answers gathered for a snapshot to the client list,
+ * then advertises the logouts with the list unlocked
+ */
+static void
+_fw_sync_apply(t_counters_report *reports, int count)
+{
+    t_client        *p1;
+    char            *timed_out;
+    int             i;
+
+    timed_out = safe_malloc(count + 1);
+    LOCK_CLIENT_LIST();
+    for (i = 0; i < count; i++) {
+        timed_out[i] = 0;
+        if (!(p1 = client_list_find(reports[i].ip, reports[i].mac))) {
+            debug(LOG_ERR, "Node %s was freed while being re-validated!", reports[i].ip);
+        } else {
+            timed_out[i] = _fw_sync_client(p1, &reports[i].authresponse);
+        }
+    }
+    UNLOCK_CLIENT_LIST();
+
+    for (i = 0; i < count; i++) {
+        if (timed_out[i])
+            auth_server_notify(REQUEST_TYPE_LOGOUT, reports[i].ip, reports[i].mac, reports[i].token, 0, 0);
+    }
+    free(timed_out);
+}
+
+/** @internal
+ * @brief Frees a snapshot made by _fw_sync_snapshot()
+ */
+static void
+_fw_sync_free_reports(t_counters_report *reports, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        free(reports[i].ip);
+        free(reports[i].mac);
+        free(reports[i].token);
+    }
+    free(reports);
+}
+
+/** @internal
+ * @brief Journals the counters of a snapshot the auth server did not get
+ */
+static void
+_fw_sync_journal(t_counters_report *reports, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        journal_add(HTTP_SERVER_AUTH, JOURNAL_COUNTERS, reports[i].ip, reports[i].mac,
+                reports[i].token, reports[i].incoming, reports[i].outgoing);
+}
+
+/** @internal
+ * @brief Sync pass used while the auth server is offline: the counters are
+ * journalled and only inactive clients are removed
+ */
+static void
+_fw_sync_offline(void)
+{
+    t_counters_report *reports;
+    int             count;
+
+    debug(LOG_INFO, "Auth server offline, journalling counters");
+    reports = _fw_sync_snapshot(&count);
+    _fw_sync_journal(reports, count);
+    _fw_sync_apply(reports, count);
+    _fw_sync_free_reports(reports, count);
+}
+
+/** @internal
+ * @brief Sync pass that reports every client in one batch request
+ *
+ * Once the auth server refused a batch request, the per-client pass is
+ * used for FW_BATCH_RETRY seconds before batches are tried again.
+ *
+ * @return 0 if the pass was done, -1 if the auth server does not support
+ * batch requests and the per-client pass should be used instead
+ */
+static int
+_fw_sync_batch(void)
+{
+    static time_t   refused = 0;
+    t_counters_report *reports;
+    time_t          now = time(NULL);
+    int             count, rc;
+
+    if (refused != 0 && now - refused < FW_BATCH_RETRY)
+        return -1;
+
+    reports = _fw_sync_snapshot(&count);
+
+    rc = (count > 0) ? auth_server_request_batch(reports, count) : 0;
+
+    if (rc == -1)
+        _fw_sync_journal(reports, count);
+
+    if (rc != -2) {
+        _fw_sync_apply(reports, count);
+        if (rc == 0 && count > 0)
+            refused = 0;
+    } else {
+        debug(LOG_WARNING, "Auth server does not support batch counters, falling back to one request per client for %d seconds", FW_BATCH_RETRY);
+        refused = now;
+    }
+
+    _fw_sync_free_reports(reports, count);
+
+    return (rc == -2) ? -1 : 0;
+}
+
+/** @internal
+ * @brief Stores the auth server answer for one client of an async pass
+ */
+static void
+_fw_sync_async_done(t_http_response *response, void *arg)
+{
+    t_counters_report *report = arg;
+
+    if (response != NULL)
+        auth_server_parse_response(&report->authresponse, response->data);
+    else
+        journal_add(HTTP_SERVER_AUTH, JOURNAL_COUNTERS, report->ip, report->mac,
+                report->token, report->incoming, report->outgoing);
+}
+
+/** @internal
+ * @brief Sync pass that sends one request per client, AsyncSockets of them
+ * at a time
+ *
+ * @return 0 if the pass was done, -1 if the engine could not be set up
+ */
+static int
+_fw_sync_async(void)
+{
+    t_counters_report *reports;
+    t_http_async    *engine;
+    char            buf[MAX_BUF];
+    int             count, i;
+
+    if ((engine = http_async_new(HTTP_SERVER_AUTH, config_get_config()->async_sockets)) == NULL)
+        return -1;
+
+    reports = _fw_sync_snapshot(&count);
+
+    for (i = 0; i < count; i++) {
+        auth_server_build_request(buf, sizeof(buf), REQUEST_TYPE_COUNTERS, reports[i].ip, reports[i].mac,
+                reports[i].token, reports[i].incoming, reports[i].outgoing);
+        http_async_submit(engine, buf, _fw_sync_async_done, &reports[i]);
+    }
+    http_async_run(engine);
+    http_async_free(engine);
+
+    _fw_sync_apply(reports, count);
+    _fw_sync_free_reports(reports, count);
+
+    return 0;
+}
+
 /**Probably a misnomer, this function actually refreshes the entire client list's traffic counter, re-authenticates every client with the central server and update's the central servers traffic counters and notifies it if a client has logged-out.
- * @todo Make this function smaller and use sub-fonctions
+ * With BatchCounters enabled every client is reported in a single request,
+ * otherwise (or if the auth server does not understand it) one request is
+ * made per client, AsyncSockets of them in parallel. While the auth server
+ * is offline the counters and logouts are journalled, see journal.c
  */
 void
 fw_sync_with_authserver(void)
@@ -284,6 +597,20 @@ fw_sync_with_authserver(void)
         return;
     }
 
+    /* Tell the auth server about clients cut off by the quota engine */
+    quota_report();
+
+    if (config->auth_servers != NULL && !is_auth_online()) {
+        _fw_sync_offline();
+        return;
+    }
+
+    if (config->batch_counters && config->auth_servers != NULL && _fw_sync_batch() == 0)
+        return;
+
+    if (config->async_sockets > 0 && config->auth_servers != NULL && _fw_sync_async() == 0)
+        return;
+
     LOCK_CLIENT_LIST();
 
     for (p1 = p2 = client_get_first_client(); NULL != p1; p1 = p2) {
@@ -302,6 +629,8 @@ fw_sync_with_authserver(void)
          * short:  Shorter than config->checkinterval * config->clienttimeout */
         icmp_ping(ip);
         /* Update the counters on the remote server only if we have an auth server */
+        authresponse.authcode = AUTH_ERROR;
+        authresponse.has_quota = 0;
         if (config->auth_servers != NULL) {
             auth_server_request(&authresponse, REQUEST_TYPE_COUNTERS, ip, mac, token, incoming, outgoing);
         }
@@ -309,85 +638,12 @@ fw_sync_with_authserver(void)
 
         if (!(p1 = client_list_find(ip, mac))) {
             debug(LOG_ERR, "Node %s was freed while being re-validated!", ip);
-        } else {
-        	time_t	current_time=time(NULL);
-        	debug(LOG_INFO, "Checking client %s for timeout:  Last updated %ld (%ld seconds ago), timeout delay %ld seconds, current time %ld, ",
-                        p1->ip, p1->counters.last_updated, current_time-p1->counters.last_updated, config->checkinterval * config->clienttimeout, current_time);
-            if (p1->counters.last_updated +
-				(config->checkinterval * config->clienttimeout)
-				<= current_time) {
-                /* Timing out user */
-                debug(LOG_INFO, "%s - Inactive for more than %ld seconds, removing client and denying in firewall",
-                        p1->ip, config->checkinterval * config->clienttimeout);
-                fw_deny(p1->ip, p1->mac, p1->fw_connection_state);
-                client_list_delete(p1);
-
-                /* Advertise the logout if we have an auth server */
-                if (config->auth_servers != NULL) {
-					UNLOCK_CLIENT_LIST();
-					auth_server_request(&authresponse, REQUEST_TYPE_LOGOUT, ip, mac, token, 0, 0);
-					LOCK_CLIENT_LIST();
-                }
-            } else {
-                /*
-                 * This handles any change in
-                 * the status this allows us
-                 * to change the status of a
-                 * user while he's connected
-                 *
-                 * Only run if we have an auth server
-                 * configured!
-                 */
-                if (config->auth_servers != NULL) {
-                    switch (authresponse.authcode) {
-                        case AUTH_DENIED:
-                            debug(LOG_NOTICE, "%s - Denied. Removing client and firewall rules", p1->ip);
-                            fw_deny(p1->ip, p1->mac, p1->fw_connection_state);
-                            client_list_delete(p1);
-                            break;
-
-                        case AUTH_VALIDATION_FAILED:
-                            debug(LOG_NOTICE, "%s - Validation timeout, now denied. Removing client and firewall rules", p1->ip);
-                            fw_deny(p1->ip, p1->mac, p1->fw_connection_state);
-                            client_list_delete(p1);
-                            break;
-
-                        case AUTH_ALLOWED:
-                            if (p1->fw_connection_state != FW_MARK_KNOWN) {
-                                debug(LOG_INFO, "%s - Access has changed to allowed, refreshing firewall and clearing counters", p1->ip);
-                                //WHY did we deny, then allow!?!? benoitg 2007-06-21
-                                //fw_deny(p1->ip, p1->mac, p1->fw_connection_state);
-
-                                if (p1->fw_connection_state != FW_MARK_PROBATION) {
-     p1->counters.incoming = p1->counters.outgoing = 0;
-                                }
-                                else {
-                                	//We don't want to clear counters if the user was in validation, it probably already transmitted data..
-                                    debug(LOG_INFO, "%s - Skipped clearing counters after all, the user was previously in validation", p1->ip);
-                                }
-                                p1->fw_connection_state = FW_MARK_KNOWN;
-                                fw_allow(p1->ip, p1->mac, p1->fw_connection_state);
-                            }
-                            break;
-
-                        case AUTH_VALIDATION:
-                            /*
-                             * Do nothing, user
-                             * is in validation
-                             * period
-                             */
-                            debug(LOG_INFO, "%s - User in validation period", p1->ip);
-                            break;
-
-                              case AUTH_ERROR:
-                                    debug(LOG_WARNING, "Error communicating with auth server - leaving %s as-is for now", p1->ip);
-                                    break;
-
-                        default:
-                            debug(LOG_ERR, "I do not know about authentication code %d", authresponse.authcode);
-                            break;
-                    }
-                }
+        } else if (_fw_sync_client(p1, &authresponse)) {
+            /* Advertise the logout if we have an auth server */
+            if (config->auth_servers != NULL) {
+                UNLOCK_CLIENT_LIST();
+                auth_server_notify(REQUEST_TYPE_LOGOUT, ip, mac, token, 0, 0);
+                LOCK_CLIENT_LIST();
             }
         }
 
@@ -47,6 +47,7 @@
 #include "debug.h"
 #include "util.h"
 #include "client_list.h"
+#include "quota.h"
 
 static int iptables_do_command(const char *format, ...);
 static char *iptables_compile(const char *, const char *, const t_firewall_rule *);
@@ -642,6 +643,7 @@ iptables_fw_counters_update(void)
 	unsigned long long int counter;
 	t_client *p1;
 	struct in_addr tempaddr;
+	time_t now;
 
 	/* Look for outgoing traffic */
 	safe_asprintf(&script, "%s %s", "iptables", "-v -n -x -t mangle -L " TABLE_WIFIDOG_OUTGOING);
@@ -673,6 +675,7 @@ iptables_fw_counters_update(void)
 				if ((p1->counters.outgoing - p1->counters.outgoing_history) < counter) {
 					p1->counters.outgoing = p1->counters.outgoing_history + counter;
 					p1->counters.last_updated = time(NULL);
+					p1->counters.log_dirty = 1;
 					debug(LOG_DEBUG, "%s - Updated counter.outgoing to %llu bytes.  Updated last_updated to %d", ip, counter, p1->counters.last_updated);
 				}
 			} else {
@@ -715,6 +718,7 @@ iptables_fw_counters_update(void)
 			if ((p1 = client_list_find_by_ip(ip))) {
 				if ((p1->counters.incoming - p1->counters.incoming_history) < counter) {
 					p1->counters.incoming = p1->counters.incoming_history + counter;
+					p1->counters.log_dirty = 1;
 					debug(LOG_DEBUG, "%s - Updated counter.incoming to %llu bytes", ip, counter);
 				}
 			} else {
@@ -729,5 +733,14 @@ iptables_fw_counters_update(void)
 	}
 	pclose(output);
 
+	/* Both directions are read, fold them into the rate estimates */
+	now = time(NULL);
+	LOCK_CLIENT_LIST();
+	for (p1 = client_get_first_client(); p1 != NULL; p1 = p1->next) {
+		client_update_rates(p1, now);
+	}
+	quota_enforce(now);
+	UNLOCK_CLIENT_LIST();
+
 	return 1;
 }
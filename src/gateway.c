@@ -59,9 +59,15 @@
 #include "wdctl_thread.h"
 #include "ping_thread.h"
 #include "ding_thread.h"
+#include "control_channel.h"
 #include "httpd_thread.h"
 #include "util.h"
 #include "update.h"
+#include "dns_cache.h"
+#include "journal.h"
+#include "tls.h"
+#include "auth_dispatch.h"
+#include "server_health.h"
 
 /** XXX Ugly hack 
  * We need to remember the thread IDs of threads that simulate wait with pthread_cond_timedwait
@@ -69,9 +75,12 @@
  */
 static pthread_t tid_fw_counter = 0;
 static pthread_t tid_ping = 0; 
-static pthread_t tid_ding = 0; 
 static pthread_t tid_authlog = 0;
 static pthread_t tid_update = 0; 
+static pthread_t tid_dns_cache = 0;
+static pthread_t tid_server_health = 0;
+static pthread_t tid_journal = 0;
+static pthread_t tid_control = 0;
 /* The internal web server */
 httpd * webserver = NULL;
 
@@ -120,7 +129,6 @@ void get_clients_from_parent(void) {
 	char *key = NULL;
 	char *value = NULL;
 	t_client * client = NULL;
-	t_client * lastclient = NULL;
 
 	config = config_get_config();
 	
@@ -214,6 +222,18 @@ void get_clients_from_parent(void) {
 						else if (strcmp(key, "counters_last_updated") == 0) {
 							client->counters.last_updated = atol(value);
 						}
+						else if (strcmp(key, "quota_bytes_allowed") == 0) {
+							client->quota.bytes_allowed = atoll(value);
+						}
+						else if (strcmp(key, "quota_bytes_base") == 0) {
+							client->quota.bytes_base = atoll(value);
+						}
+						else if (strcmp(key, "quota_time_allowed") == 0) {
+							client->quota.time_allowed = atol(value);
+						}
+						else if (strcmp(key, "quota_started") == 0) {
+							client->quota.started = atol(value);
+						}
 						else {
 							debug(LOG_NOTICE, "I don't know how to inherit key [%s] value [%s] from parent", key, value);
 						}
@@ -224,14 +244,7 @@ void get_clients_from_parent(void) {
 			/* End of parsing this command */
 			if (client) {
 				/* Add this client to the client list */
-				if (!firstclient) {
-					firstclient = client;
-					lastclient = firstclient;
-				}
-				else {
-					lastclient->next = client;
-					lastclient = client;
-				}
+				client_list_insert(client);
 			}
 
 			/* Clean up */
@@ -289,6 +302,9 @@ termination_handler(int s)
 	debug(LOG_INFO, "Flushing firewall rules...");
 	fw_destroy();
 
+	/* Keep what the central servers have not been told yet */
+	journal_flush();
+
 	/* XXX Hack
 	 * Aparently pthread_cond_timedwait under openwrt prevents signals (and therefore
 	 * termination handler) from happening so we need to explicitly kill the threads 
@@ -304,11 +320,12 @@ termination_handler(int s)
 		pthread_kill(tid_ping, SIGKILL);
 	}
 
-	if (tid_ding) {
-		debug(LOG_INFO, "Explicitly killing the ding thread");
-		pthread_kill(tid_ding, SIGKILL);
-	}
 	
+	if (tid_control) {
+		debug(LOG_INFO, "Explicitly killing the control channel thread");
+		pthread_kill(tid_control, SIGKILL);
+	}
+
 	if (tid_authlog) {
 		debug(LOG_INFO, "Explicitly killing the fetchconf thread");
 		pthread_kill(tid_authlog, SIGKILL);
@@ -386,7 +403,6 @@ main_loop(void)
 	pthread_t	tid;
 	s_config *config = config_get_config();
 	request *r;
-	void **params;
 
     /* Set the time when wifidog started */
 	if (!started_time) {
@@ -443,6 +459,41 @@ main_loop(void)
 		exit(1);
 	}
 	
+	/* Shared by every TLS connection to the central servers */
+	if (tls_init() == -1)
+		debug(LOG_ERR, "TLS is not available, secure requests to the central servers will fail");
+
+	/* Start the threads sending logins to the auth server */
+	auth_dispatch_init();
+
+	/* Start the threads serving the web server */
+	httpd_pool_init(webserver);
+
+	/* Start central server probe thread */
+	result = pthread_create(&tid_server_health, NULL, (void *)thread_server_health, NULL);
+	if (result != 0) {
+	    debug(LOG_ERR, "FATAL: Failed to create a new thread (server_health) - exiting");
+		termination_handler(0);
+	}
+	pthread_detach(tid_server_health);
+
+	/* Start DNS cache refresh thread */
+	result = pthread_create(&tid_dns_cache, NULL, (void *)thread_dns_cache, NULL);
+	if (result != 0) {
+	    debug(LOG_ERR, "FATAL: Failed to create a new thread (dns_cache) - exiting");
+		termination_handler(0);
+	}
+	pthread_detach(tid_dns_cache);
+
+	/* Start offline journal thread */
+	journal_init();
+	result = pthread_create(&tid_journal, NULL, (void *)thread_journal, NULL);
+	if (result != 0) {
+	    debug(LOG_ERR, "FATAL: Failed to create a new thread (journal) - exiting");
+		termination_handler(0);
+	}
+	pthread_detach(tid_journal);
+
 	/* Start update thread */
 	result = pthread_create(&tid_update, NULL, (void *)thread_update, NULL);
 	if (result != 0) {
@@ -474,14 +525,16 @@ main_loop(void)
 		termination_handler(0);
 	}
 	pthread_detach(tid_ping);
-	
-		
-	result = pthread_create(&tid_ding, NULL, (void *)thread_ding, NULL);
-	if (result != 0) {
-	    debug(LOG_ERR, "FATAL: Failed to create a new thread (ding) - exiting");
-		termination_handler(0);
+
+	/* Start control channel thread */
+	if (config->control_channel) {
+		result = pthread_create(&tid_control, NULL, (void *)thread_control_channel, NULL);
+		if (result != 0) {
+		    debug(LOG_ERR, "FATAL: Failed to create a new thread (control channel) - exiting");
+			termination_handler(0);
+		}
+		pthread_detach(tid_control);
 	}
-	pthread_detach(tid_ding);
 	
 	result = pthread_create(&tid_authlog, NULL, (void *)thread_client_timeout_log, NULL);
 	if (result != 0) {
@@ -491,6 +544,20 @@ main_loop(void)
 	pthread_detach(tid_authlog);
 	
 	
+	if (config->httpd_event_loop) {
+		httpdEvent *event = httpdEventCreate(webserver, config->httpd_event_max_conn, httpd_pool_dispatch);
+
+		if (event == NULL) {
+			debug(LOG_WARNING, "The event driven web server is not available, accepting connections one at a time");
+		}
+		else {
+			debug(LOG_NOTICE, "Waiting for connections, event driven");
+			httpdEventRun(event);
+			debug(LOG_ERR, "FATAL: web server event loop failed: %s", strerror(errno));
+			termination_handler(0);
+		}
+	}
+
 	debug(LOG_NOTICE, "Waiting for connections");
 	while(1) {
 		webserver->lastError = 0;
@@ -518,19 +585,8 @@ main_loop(void)
 			 *
 			 * We should create another thread
 			 */
-			debug(LOG_INFO, "Received connection from %s, spawning worker thread", r->clientAddr);
-			/* The void**'s are a simulation of the normal C
-			 * function calling sequence. */
-			params = safe_malloc(2 * sizeof(void *));
-			*params = webserver;
-			*(params + 1) = r;
-
-			result = pthread_create(&tid, NULL, (void *)thread_httpd, (void *)params);
-			if (result != 0) {
-				debug(LOG_ERR, "FATAL: Failed to create a new thread (httpd) - exiting");
-				termination_handler(0);
-			}
-			pthread_detach(tid);
+			debug(LOG_INFO, "Received connection from %s, handing it to a worker thread", r->clientAddr);
+			httpd_pool_dispatch(webserver, r);
 		}
 		else {
 			debug(LOG_DEBUG, "lastError=%d", webserver->lastError);
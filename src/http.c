@@ -52,6 +52,8 @@
 #include "client_list.h"
 #include "common.h"
 #include "centralserver.h"
+#include "auth_cache.h"
+#include "template.h"
 
 #include "util.h"
 
@@ -110,6 +112,7 @@ http_callback_logout(httpd *webserver, request *r)
 			} else {
 			    				    	
 			    fw_deny(client->ip, client->mac, client->fw_connection_state);
+			    auth_cache_invalidate(client->token);
 			    client_list_delete(client);
 			    debug(LOG_DEBUG, "Got logout from %s", client->ip);
  			} 
@@ -311,9 +314,13 @@ http_callback_auth(httpd *webserver, request *r)
 			
 			if ((client = client_list_find(r->clientAddr, mac)) == NULL) {
 				debug(LOG_DEBUG, "New client for %s", r->clientAddr);
-				client_list_append(r->clientAddr, mac, token->value);
+				if (client_list_append(r->clientAddr, mac, token->value) == NULL) {
+					UNLOCK_CLIENT_LIST();
+					send_http_page(r, "网络繁忙", "当前接入用户已满，请稍后再试");
+					free(mac);
+					return;
+				}
 			} else if (logout&&client) {
-			    t_authresponse  authresponse;
 			    s_config *config = config_get_config();
 			    unsigned long long incoming = client->counters.incoming;
 			    unsigned long long outgoing = client->counters.outgoing;
@@ -321,6 +328,7 @@ http_callback_auth(httpd *webserver, request *r)
 			    t_serv	*auth_server = get_auth_server();
 			    				    	
 			    fw_deny(client->ip, client->mac, client->fw_connection_state);
+			    auth_cache_invalidate(client->token);
 			    debug(LOG_DEBUG, "Got logout from %s", client->ip);
 			    debug(LOG_INFO, "Got manual logout from client ip %s, mac %s, token %s"
 					"- redirecting them to logout message", ip, mac, client->mac);
@@ -328,7 +336,7 @@ http_callback_auth(httpd *webserver, request *r)
 			    /* Advertise the logout if we have an auth server */
 			    if (config->auth_servers != NULL) {
 					UNLOCK_CLIENT_LIST();
-					auth_server_request(&authresponse, REQUEST_TYPE_LOGOUT, ip, mac, token->value, 
+					auth_server_notify(REQUEST_TYPE_LOGOUT, ip, mac, token->value, 
 									    incoming, outgoing);
 					LOCK_CLIENT_LIST();
 					
@@ -342,6 +350,7 @@ http_callback_auth(httpd *webserver, request *r)
  			} 
  			else {
 				debug(LOG_DEBUG, "Client for %s is already in the client list", client->ip);
+				client_list_touch(client);
 			}
 			UNLOCK_CLIENT_LIST();
 			if (!logout && (url = httpdGetVariableByName(r, "url"))) {
@@ -358,38 +367,17 @@ http_callback_auth(httpd *webserver, request *r)
 void send_http_page(request *r, const char *title, const char* message)
 {
     s_config	*config = config_get_config();
-    char *buffer;
-    struct stat stat_info;
-    int fd;
-    ssize_t written;
-
-    fd=open(config->htmlmsgfile, O_RDONLY);
-    if (fd==-1) {
-        debug(LOG_CRIT, "Failed to open HTML message file %s: %s", config->htmlmsgfile, strerror(errno));
-        return;
-    }
+    t_template *page;
+    const char *values[TEMPLATE_VARS];
 
-    if (fstat(fd, &stat_info)==-1) {
-        debug(LOG_CRIT, "Failed to stat HTML message file: %s", strerror(errno));
-        close(fd);
+    /* Read once and kept until the file changes */
+    if ((page = template_get(config->htmlmsgfile)) == NULL)
         return;
-    }
-
-    buffer=(char*)safe_malloc(stat_info.st_size+1);
-    written=read(fd, buffer, stat_info.st_size);
-    if (written==-1) {
-        debug(LOG_CRIT, "Failed to read HTML message file: %s", strerror(errno));
-        free(buffer);
-        close(fd);
-        return;
-    }
-    close(fd);
-
-    buffer[written]=0;
-    httpdAddVariable(r, "title", title);
-    httpdAddVariable(r, "message", message);
-    httpdAddVariable(r, "nodeID", config->gw_id);
-    httpdOutput(r, buffer);
-    free(buffer);
+
+    values[TEMPLATE_TITLE] = title;
+    values[TEMPLATE_MESSAGE] = message;
+    values[TEMPLATE_NODEID] = config->gw_id;
+    template_render(r, page, values);
+    template_release(page);
 }
 
@@ -0,0 +1,570 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file http_async.c
+    @brief Many concurrent requests to a central server over a bounded set
+    of non-blocking sockets
+
+    Requests are queued with http_async_submit() and driven by
+    http_async_run() from the calling thread with epoll: up to max_sockets
+    connections are opened (or taken from the keep-alive pool), each
+    carries one request at a time, and kept-alive connections pick up the
+    next queued request. Callbacks run from http_async_run() in the order
+    responses complete.
+
+    The server and its address are chosen by opening the first connection
+    through http_client_connect(), so the circuit breaker, the failover to
+    the next server and the list of addresses apply as they do to single
+    requests. No new connection is opened once the breaker has tripped.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "util.h"
+#include "conn_pool.h"
+#include "server_health.h"
+#include "http_client.h"
+#include "http_async.h"
+
+extern pthread_mutex_t config_mutex;
+
+/** @internal
+ * Connection states
+ */
+enum {
+    CONN_IDLE,			/**< No request, the socket may be kept alive */
+    CONN_CONNECTING,		/**< Non-blocking connect in progress */
+    CONN_SENDING,		/**< Writing the request */
+    CONN_READING		/**< Reading the response */
+};
+
+/** @internal
+ * A queued request
+ */
+typedef struct _t_async_req {
+    struct _t_async_req *next;
+    char *request;		/**< @brief Complete HTTP request */
+    size_t len;			/**< @brief Length of request */
+    http_async_callback callback;
+    void *arg;
+    int retried;		/**< @brief Already retried after a stale connection */
+} t_async_req;
+
+/** @internal
+ * One of the engine sockets
+ */
+typedef struct _t_async_conn {
+    int fd;			/**< @brief Socket, -1 when closed */
+    int state;			/**< @brief One of the CONN_* states */
+    int reused;			/**< @brief Carried a request before this one */
+    t_async_req *req;		/**< @brief Request in progress */
+    size_t sent;		/**< @brief Bytes of the request written */
+    t_http_parser parser;	/**< @brief Response parser */
+    time_t deadline;		/**< @brief When the request is given up:
+				     ConnectTimeout after the connect
+				     started, then IoTimeout for the
+				     exchange */
+    struct timeval started;	/**< @brief When the request was started */
+} t_async_conn;
+
+struct _t_http_async {
+    t_http_server server;	/**< @brief Which central server */
+    int epfd;			/**< @brief epoll instance */
+    int max_sockets;		/**< @brief Number of entries in conns */
+    t_async_conn *conns;	/**< @brief Sockets */
+    t_async_req *head;		/**< @brief Queue of requests not started */
+    t_async_req *tail;
+    int in_flight;		/**< @brief Requests on a socket */
+    struct sockaddr_in addr;	/**< @brief Address of the server */
+};
+
+/** @internal
+ * @brief Completes a request with a response, or with NULL on failure
+ */
+static void
+_http_async_complete(t_async_req *req, t_http_response *response)
+{
+    req->callback(response, req->arg);
+    free(req->request);
+    free(req);
+}
+
+/** @internal
+ * @brief Closes a connection
+ */
+static void
+_http_async_close(t_http_async *engine, t_async_conn *conn)
+{
+    if (conn->fd != -1) {
+        epoll_ctl(engine->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+    }
+    conn->fd = -1;
+    conn->state = CONN_IDLE;
+    conn->reused = 0;
+}
+
+/** @internal
+ * @brief Changes the events a connection waits for
+ */
+static void
+_http_async_watch(t_http_async *engine, t_async_conn *conn, unsigned int events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl(engine->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/** @internal
+ * @brief Gives up the request on a connection and closes it. A request
+ * that failed on a reused connection before any answer is queued again.
+ */
+static void
+_http_async_fail(t_http_async *engine, t_async_conn *conn)
+{
+    t_async_req *req = conn->req;
+    t_serv *serv;
+    int retry = conn->reused && conn->parser.received == 0 && !req->retried;
+
+    if (conn->state == CONN_READING)
+        http_parser_free(&conn->parser);
+    _http_async_close(engine, conn);
+    conn->req = NULL;
+    engine->in_flight--;
+
+    if (retry) {
+        debug(LOG_DEBUG, "Kept-alive connection was closed by the server, retrying the request");
+        req->retried = 1;
+        req->next = engine->head;
+        engine->head = req;
+        if (engine->tail == NULL)
+            engine->tail = req;
+    } else {
+        if ((serv = http_client_server(engine->server)) != NULL)
+            server_health_failure(serv);
+        _http_async_complete(req, NULL);
+    }
+}
+
+/** @internal
+ * @brief Registers a socket with epoll and makes it non-blocking
+ */
+static int
+_http_async_attach(t_http_async *engine, t_async_conn *conn, int fd)
+{
+    struct epoll_event ev;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    memset(&ev, 0, sizeof(ev));
+    ev.data.ptr = conn;
+    if (epoll_ctl(engine->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        debug(LOG_ERR, "epoll_ctl(): %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    conn->fd = fd;
+    return 0;
+}
+
+/** @internal
+ * @brief Starts the request at the head of the queue on an idle connection
+ */
+static void
+_http_async_start(t_http_async *engine, t_async_conn *conn)
+{
+    t_async_req *req = engine->head;
+    t_serv_health health;
+    t_serv *serv;
+    int fd;
+
+    engine->head = req->next;
+    if (engine->head == NULL)
+        engine->tail = NULL;
+
+    conn->req = req;
+    conn->sent = 0;
+    /* A kept-alive connection goes straight to the send and receive budget */
+    conn->deadline = time(NULL) + config_get_config()->io_timeout;
+    gettimeofday(&conn->started, NULL);
+    memset(&conn->parser, 0, sizeof(conn->parser));
+    engine->in_flight++;
+
+    if (conn->fd != -1) {
+        conn->state = CONN_SENDING;
+        _http_async_watch(engine, conn, EPOLLOUT);
+        return;
+    }
+
+    /* Stop opening connections once the breaker has tripped */
+    if ((serv = http_client_server(engine->server)) != NULL) {
+        server_health_get(serv, &health);
+        if (health.state == SERV_OPEN) {
+            debug(LOG_DEBUG, "Central server is down, not opening another connection");
+            conn->req = NULL;
+            engine->in_flight--;
+            _http_async_complete(req, NULL);
+            return;
+        }
+    }
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 || _http_async_attach(engine, conn, fd) == -1) {
+        debug(LOG_ERR, "Failed to create a socket for the central server: %s", strerror(errno));
+        conn->state = CONN_IDLE;
+        _http_async_fail(engine, conn);
+        return;
+    }
+
+    if (connect(fd, (struct sockaddr *)&engine->addr, sizeof(engine->addr)) == -1 && errno != EINPROGRESS) {
+        debug(LOG_DEBUG, "Failed to connect to central server: %s", strerror(errno));
+        _http_async_fail(engine, conn);
+        return;
+    }
+
+    conn->state = CONN_CONNECTING;
+    conn->deadline = time(NULL) + config_get_config()->connect_timeout;
+    _http_async_watch(engine, conn, EPOLLOUT);
+}
+
+/** @internal
+ * @brief Moves a connection along after epoll reported it ready
+ */
+static void
+_http_async_event(t_http_async *engine, t_async_conn *conn, unsigned int events)
+{
+    t_http_response response;
+    struct timeval now;
+    t_serv *serv;
+    char buf[MAX_BUF];
+    ssize_t numbytes;
+    socklen_t errlen;
+    int err, rc;
+
+    switch (conn->state) {
+        case CONN_IDLE:
+            /* The server closed a kept-alive connection */
+            _http_async_close(engine, conn);
+            return;
+
+        case CONN_CONNECTING:
+            err = 0;
+            errlen = sizeof(err);
+            getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+            if (err != 0) {
+                debug(LOG_DEBUG, "Failed to connect to central server: %s", strerror(err));
+                _http_async_fail(engine, conn);
+                return;
+            }
+            if (engine->server == HTTP_SERVER_AUTH)
+                mark_auth_online();
+            conn->state = CONN_SENDING;
+            conn->deadline = time(NULL) + config_get_config()->io_timeout;
+            /* fall through */
+
+        case CONN_SENDING:
+            numbytes = send(conn->fd, conn->req->request + conn->sent,
+                    conn->req->len - conn->sent, MSG_NOSIGNAL);
+            if (numbytes < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    return;
+                _http_async_fail(engine, conn);
+                return;
+            }
+            conn->sent += numbytes;
+            if (conn->sent < conn->req->len)
+                return;
+            conn->state = CONN_READING;
+            http_parser_init(&conn->parser);
+            _http_async_watch(engine, conn, EPOLLIN);
+            return;
+
+        case CONN_READING:
+            for (;;) {
+                numbytes = read(conn->fd, buf, sizeof(buf));
+                if (numbytes < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return;
+                    if (errno == EINTR)
+                        continue;
+                    _http_async_fail(engine, conn);
+                    return;
+                }
+                if (numbytes == 0) {
+                    if (conn->parser.received == 0 || http_parser_eof(&conn->parser) != HTTP_PARSE_DONE) {
+                        _http_async_fail(engine, conn);
+                        return;
+                    }
+                    rc = HTTP_PARSE_DONE;
+                } else {
+                    rc = http_parser_feed(&conn->parser, buf, numbytes);
+                }
+
+                if (rc == HTTP_PARSE_ERROR) {
+                    _http_async_fail(engine, conn);
+                    return;
+                }
+                if (rc == HTTP_PARSE_DONE)
+                    break;
+            }
+
+            http_parser_finish(&conn->parser, &response);
+            engine->in_flight--;
+            if ((serv = http_client_server(engine->server)) != NULL) {
+                gettimeofday(&now, NULL);
+                server_health_success(serv, (now.tv_sec - conn->started.tv_sec) * 1000 +
+                        (now.tv_usec - conn->started.tv_usec) / 1000);
+            }
+            if (response.keep_alive) {
+                conn->state = CONN_IDLE;
+                conn->reused = 1;
+                _http_async_watch(engine, conn, 0);
+            } else {
+                _http_async_close(engine, conn);
+            }
+            _http_async_complete(conn->req, &response);
+            conn->req = NULL;
+            http_response_free(&response);
+            return;
+    }
+}
+
+/** Creates an engine for a central server
+ * @param server Which central server the requests go to
+ * @param max_sockets Upper bound on concurrent connections
+ * @return The engine, or NULL if epoll is not available or the server is
+ * reached over TLS, which the engine does not speak
+ */
+t_http_async *
+http_async_new(t_http_server server, int max_sockets)
+{
+    t_http_async *engine;
+    int i;
+
+    if (http_client_use_tls(server))
+        return NULL;
+
+    engine = safe_malloc(sizeof(t_http_async));
+    memset(engine, 0, sizeof(t_http_async));
+
+    if ((engine->epfd = epoll_create(max_sockets > 0 ? max_sockets : 1)) == -1) {
+        debug(LOG_ERR, "epoll_create(): %s", strerror(errno));
+        free(engine);
+        return NULL;
+    }
+
+    engine->server = server;
+    engine->max_sockets = max_sockets > 0 ? max_sockets : 1;
+    engine->conns = safe_malloc(sizeof(t_async_conn) * engine->max_sockets);
+    memset(engine->conns, 0, sizeof(t_async_conn) * engine->max_sockets);
+    for (i = 0; i < engine->max_sockets; i++)
+        engine->conns[i].fd = -1;
+
+    return engine;
+}
+
+/** Queues a request. Nothing is sent until http_async_run() is called.
+ * @param engine The engine
+ * @param request Complete HTTP request, headers included; it is copied
+ * @param callback Called with the response, or NULL if the request failed
+ * @param arg Passed to the callback
+ */
+void
+http_async_submit(t_http_async *engine, const char *request,
+        http_async_callback callback, void *arg)
+{
+    t_async_req *req;
+
+    req = safe_malloc(sizeof(t_async_req));
+    memset(req, 0, sizeof(t_async_req));
+    req->request = safe_strdup(request);
+    req->len = strlen(request);
+    req->callback = callback;
+    req->arg = arg;
+
+    if (engine->tail != NULL)
+        engine->tail->next = req;
+    else
+        engine->head = req;
+    engine->tail = req;
+}
+
+/** Runs every queued request to completion, calling the callbacks as
+ * responses come in. Requests queued from a callback are run too.
+ * @param engine The engine
+ */
+void
+http_async_run(t_http_async *engine)
+{
+    struct epoll_event *events;
+    t_async_conn *conn;
+    t_serv *serv;
+    time_t now;
+    int i, n, fd, found;
+
+    if (engine->head == NULL)
+        return;
+
+    /* The first connection is opened the way the sequential path opens
+       one, which picks the server and the address for the others */
+    fd = -1;
+    serv = http_client_server(engine->server);
+    if (serv != NULL && serv->last_ip != NULL && config_get_config()->pool_max_idle > 0)
+        fd = conn_pool_get(serv);
+    if (fd == -1) {
+        fd = http_client_connect(engine->server);
+        serv = http_client_server(engine->server);
+    }
+
+    memset(&engine->addr, 0, sizeof(engine->addr));
+    LOCK_CONFIG();
+    found = serv != NULL && serv->last_ip != NULL && inet_aton(serv->last_ip, &engine->addr.sin_addr) != 0;
+    if (found)
+        engine->addr.sin_port = htons(serv->serv_http_port);
+    UNLOCK_CONFIG();
+
+    if (fd == -1 || !found) {
+        debug(LOG_ERR, "Could not reach the central server, failing queued requests");
+        if (fd != -1)
+            close(fd);
+        while (engine->head != NULL) {
+            t_async_req *req = engine->head;
+            engine->head = req->next;
+            _http_async_complete(req, NULL);
+        }
+        engine->tail = NULL;
+        return;
+    }
+    engine->addr.sin_family = AF_INET;
+
+    for (i = 0; i < engine->max_sockets && engine->conns[i].fd != -1; i++)
+        ;
+    if (i == engine->max_sockets)
+        close(fd);
+    else
+        _http_async_attach(engine, &engine->conns[i], fd);
+
+    /* Warm connections first */
+    for (i = 0; i < engine->max_sockets && config_get_config()->pool_max_idle > 0; i++) {
+        conn = &engine->conns[i];
+        if (conn->fd == -1 && (fd = conn_pool_get(serv)) != -1) {
+            if (_http_async_attach(engine, conn, fd) == 0)
+                conn->reused = 1;
+        }
+    }
+
+    events = safe_malloc(sizeof(struct epoll_event) * engine->max_sockets);
+
+    while (engine->head != NULL || engine->in_flight > 0) {
+        for (i = 0; i < engine->max_sockets && engine->head != NULL; i++) {
+            if (engine->conns[i].state == CONN_IDLE)
+                _http_async_start(engine, &engine->conns[i]);
+        }
+        if (engine->in_flight == 0)
+            continue;
+
+        n = epoll_wait(engine->epfd, events, engine->max_sockets, 1000);
+        if (n < 0 && errno != EINTR) {
+            debug(LOG_ERR, "epoll_wait(): %s", strerror(errno));
+            break;
+        }
+        for (i = 0; i < n; i++)
+            _http_async_event(engine, events[i].data.ptr, events[i].events);
+
+        now = time(NULL);
+        for (i = 0; i < engine->max_sockets; i++) {
+            conn = &engine->conns[i];
+            if (conn->state != CONN_IDLE && conn->deadline <= now) {
+                debug(LOG_ERR, "Timed out waiting for the central server");
+                conn->reused = 0;
+                _http_async_fail(engine, conn);
+            }
+        }
+    }
+
+    /* Only reached on epoll failure with work left */
+    for (i = 0; i < engine->max_sockets; i++) {
+        conn = &engine->conns[i];
+        if (conn->state != CONN_IDLE) {
+            conn->reused = 0;
+            _http_async_fail(engine, conn);
+        }
+    }
+    while (engine->head != NULL) {
+        t_async_req *req = engine->head;
+        engine->head = req->next;
+        _http_async_complete(req, NULL);
+    }
+    engine->tail = NULL;
+
+    free(events);
+}
+
+/** Frees an engine. Connections the server kept alive go back to the pool.
+ * @param engine The engine
+ */
+void
+http_async_free(t_http_async *engine)
+{
+    t_serv *serv = http_client_server(engine->server);
+    t_async_conn *conn;
+    int i, fd;
+
+    for (i = 0; i < engine->max_sockets; i++) {
+        conn = &engine->conns[i];
+        if (conn->fd == -1)
+            continue;
+        if (serv != NULL && config_get_config()->pool_max_idle > 0) {
+            fd = conn->fd;
+            epoll_ctl(engine->epfd, EPOLL_CTL_DEL, fd, NULL);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            conn_pool_put(serv, fd);
+            conn->fd = -1;
+        } else {
+            _http_async_close(engine, conn);
+        }
+    }
+
+    close(engine->epfd);
+    free(engine->conns);
+    free(engine);
+}
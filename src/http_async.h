@@ -0,0 +1,51 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file http_async.h
+    @brief Many concurrent requests to a central server over a bounded set
+    of non-blocking sockets
+*/
+
+#ifndef _HTTP_ASYNC_H_
+#define _HTTP_ASYNC_H_
+
+#include "http_client.h"
+
+/** @brief Called once per request, with NULL if the request failed */
+typedef void (*http_async_callback)(t_http_response *response, void *arg);
+
+/** @brief An engine driving requests to one central server */
+typedef struct _t_http_async t_http_async;
+
+/** @brief Creates an engine for a central server */
+t_http_async *http_async_new(t_http_server server, int max_sockets);
+
+/** @brief Queues a request, the callback runs from http_async_run() */
+void http_async_submit(t_http_async *engine, const char *request,
+		http_async_callback callback, void *arg);
+
+/** @brief Runs every queued request to completion */
+void http_async_run(t_http_async *engine);
+
+/** @brief Frees an engine, its idle connections go back to the pool */
+void http_async_free(t_http_async *engine);
+
+#endif /* _HTTP_ASYNC_H_ */
@@ -0,0 +1,794 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file http_client.c
+    @brief HTTP/1.1 requests to the central servers over pooled connections
+
+    Requests are written by the callers, complete with headers. Responses
+    are framed with Content-Length, chunked transfer encoding or the end
+    of the connection, and kept in a buffer that grows as needed, or
+    handed piece by piece to a callback for large bodies. When the server
+    keeps the connection open it goes back to the pool of its t_serv for
+    the next request.
+
+    With UpstreamTLS set, servers declared SSLAvailable are reached over
+    TLS on their SSLPort instead. Such connections are not pooled, the
+    TLS session is resumed on the next one instead (see tls.c).
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "common.h"
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "centralserver.h"
+#include "conn_pool.h"
+#include "server_health.h"
+#include "tls.h"
+#include "http_client.h"
+
+/** Largest status line and header block accepted from a server */
+#define HTTP_CLIENT_MAX_HEADERS 16384
+
+/** Returns the server currently used for a given kind of request
+ * @param server Which central server
+ * @return The server, or NULL
+ */
+t_serv *
+http_client_server(t_http_server server)
+{
+    switch (server) {
+        case HTTP_SERVER_AUTH:
+            return get_auth_server();
+        case HTTP_SERVER_LOG:
+            return get_log_server();
+        case HTTP_SERVER_UPDATE:
+            return get_update_server();
+    }
+    return NULL;
+}
+
+/** @internal
+ * @brief Opens a new connection to the server for a given kind of request
+ */
+static int
+_http_client_connect(t_http_server server)
+{
+    switch (server) {
+        case HTTP_SERVER_AUTH:
+            return connect_auth_server();
+        case HTTP_SERVER_LOG:
+            return connect_log_server();
+        case HTTP_SERVER_UPDATE:
+            return connect_update_server();
+    }
+    return -1;
+}
+
+/** @internal
+ * @brief Opens a new connection to the SSL port of the server
+ */
+static int
+_http_client_connect_ssl(t_http_server server)
+{
+    switch (server) {
+        case HTTP_SERVER_AUTH:
+            return connect_auth_server_ssl();
+        case HTTP_SERVER_LOG:
+            return connect_log_server_ssl();
+        case HTTP_SERVER_UPDATE:
+            return connect_update_server_ssl();
+    }
+    return -1;
+}
+
+/** Tells whether requests to a server go over TLS
+ * @param server Which central server
+ * @return 1 if they do
+ */
+int
+http_client_use_tls(t_http_server server)
+{
+    t_serv *serv = http_client_server(server);
+
+    return config_get_config()->upstream_tls && serv != NULL && serv->serv_use_ssl;
+}
+
+/** Tells whether a URL is on a central server, so that it can be fetched
+ * over the connections to that server. The host must be the hostname of
+ * the server and the port its HTTPPort, or its SSLPort for https.
+ * @param server Which central server
+ * @param url An http:// or https:// URL
+ * @return The path of the URL, within url, or NULL if the URL is malformed
+ * or names another host or port
+ */
+const char *
+http_client_url_path(t_http_server server, const char *url)
+{
+    t_serv *serv = http_client_server(server);
+    const char *host, *path, *colon;
+    char *end;
+    long port;
+    int tls;
+
+    if (serv == NULL || url == NULL)
+        return NULL;
+    if (strncasecmp(url, "http://", 7) == 0) {
+        host = url + 7;
+        tls = 0;
+    } else if (strncasecmp(url, "https://", 8) == 0) {
+        host = url + 8;
+        tls = 1;
+    } else {
+        return NULL;
+    }
+
+    path = host + strcspn(host, "/?#");
+    if (*path != '/')
+        return NULL;
+
+    if ((colon = memchr(host, ':', path - host)) != NULL) {
+        port = strtol(colon + 1, &end, 10);
+        if (end != path || port <= 0 || port > 65535)
+            return NULL;
+    } else {
+        colon = path;
+        port = tls ? 443 : 80;
+    }
+
+    if (strlen(serv->serv_hostname) != (size_t)(colon - host) ||
+            strncasecmp(host, serv->serv_hostname, colon - host) != 0 ||
+            port != (tls ? serv->serv_ssl_port : serv->serv_http_port))
+        return NULL;
+
+    return path;
+}
+
+/** @internal
+ * @brief Writes a whole buffer to a socket
+ */
+static int
+_http_client_send(int fd, const char *buf, size_t len)
+{
+    ssize_t written;
+
+    while (len > 0) {
+        written = send(fd, buf, len, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            debug(LOG_ERR, "Failed to send request to central server: %s", strerror(errno));
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/** Opens a connection of its own to a central server, for callers that
+ * keep it rather than hand it back to the pool.
+ * @param server Which central server to connect to
+ * @return The connected socket, or -1
+ */
+int
+http_client_connect(t_http_server server)
+{
+    return _http_client_connect(server);
+}
+
+/** Writes a whole request to a connection opened with
+ * http_client_connect().
+ * @param fd The connection
+ * @param request Complete HTTP request, headers included
+ * @return 0 on success, -1 on error
+ */
+int
+http_client_send(int fd, const char *request)
+{
+    return _http_client_send(fd, request, strlen(request));
+}
+
+/** @internal
+ * Parser states
+ */
+enum {
+    PARSE_HEADERS,		/**< Reading the status line and headers */
+    PARSE_BODY_LENGTH,		/**< Reading a body of known length */
+    PARSE_BODY_EOF,		/**< Reading a body that ends with the connection */
+    PARSE_CHUNK_SIZE,		/**< Reading a chunk size line */
+    PARSE_CHUNK_DATA,		/**< Reading chunk data */
+    PARSE_CHUNK_CRLF,		/**< Reading the CRLF after chunk data */
+    PARSE_TRAILERS,		/**< Reading trailers after the last chunk */
+    PARSE_DONE			/**< The response is complete */
+};
+
+/** @internal
+ * @brief Appends bytes to the parser buffer, keeping it NUL terminated
+ */
+static void
+_http_parser_append(t_http_parser *parser, const char *data, size_t len)
+{
+    if (parser->len + len + 1 > parser->size) {
+        while (parser->len + len + 1 > parser->size)
+            parser->size *= 2;
+        parser->buf = safe_realloc(parser->buf, parser->size);
+    }
+    memcpy(parser->buf + parser->len, data, len);
+    parser->len += len;
+    parser->buf[parser->len] = '\0';
+}
+
+/** @internal
+ * @brief Passes body bytes to the callback, or keeps them
+ */
+static int
+_http_parser_body(t_http_parser *parser, const char *data, size_t len)
+{
+    if (parser->body_cb == NULL) {
+        _http_parser_append(parser, data, len);
+    } else if (len > 0 && parser->body_cb(data, len, parser->body_arg) == -1) {
+        debug(LOG_WARNING, "Response body from central server refused");
+        return HTTP_PARSE_ERROR;
+    }
+    return HTTP_PARSE_MORE;
+}
+
+/** @internal
+ * @brief Finds a header in a header block, case insensitively
+ * @return Pointer to the header value, or NULL
+ */
+static const char *
+_http_client_header(const char *headers, const char *end, const char *name)
+{
+    size_t namelen = strlen(name);
+    const char *line = headers;
+
+    while (line < end) {
+        if (strncasecmp(line, name, namelen) == 0 && line[namelen] == ':') {
+            line += namelen + 1;
+            while (*line == ' ' || *line == '\t')
+                line++;
+            return line;
+        }
+        if (!(line = strstr(line, "\r\n")))
+            break;
+        line += 2;
+    }
+    return NULL;
+}
+
+/** @internal
+ * @brief Works out status and framing once the headers are complete
+ */
+static int
+_http_parser_headers(t_http_parser *parser)
+{
+    const char *value, *end = parser->buf + parser->hdr_len - 2;
+    int minor = 0;
+
+    if (sscanf(parser->buf, "HTTP/1.%d %d", &minor, &parser->response.status) != 2) {
+        debug(LOG_WARNING, "Central server sent a malformed status line");
+        return HTTP_PARSE_ERROR;
+    }
+
+    parser->response.keep_alive = (minor >= 1);
+    if ((value = _http_client_header(parser->buf, end, "Connection"))) {
+        if (strncasecmp(value, "close", 5) == 0)
+            parser->response.keep_alive = 0;
+        else if (strncasecmp(value, "keep-alive", 10) == 0)
+            parser->response.keep_alive = 1;
+    }
+
+    if (parser->response.status == 204 || parser->response.status == 304 ||
+            (parser->response.status >= 100 && parser->response.status < 200)) {
+        parser->state = PARSE_DONE;
+    } else if ((value = _http_client_header(parser->buf, end, "Transfer-Encoding")) &&
+            strncasecmp(value, "chunked", 7) == 0) {
+        parser->state = PARSE_CHUNK_SIZE;
+        parser->line_len = 0;
+    } else if ((value = _http_client_header(parser->buf, end, "Content-Length"))) {
+        parser->remaining = strtoull(value, NULL, 10);
+        parser->state = parser->remaining ? PARSE_BODY_LENGTH : PARSE_DONE;
+    } else {
+        /* No framing, the body ends with the connection */
+        parser->response.keep_alive = 0;
+        parser->state = PARSE_BODY_EOF;
+    }
+    return HTTP_PARSE_MORE;
+}
+
+/** Prepares a parser for a new response
+ * @param parser The parser
+ */
+void
+http_parser_init(t_http_parser *parser)
+{
+    memset(parser, 0, sizeof(t_http_parser));
+    parser->size = MAX_BUF;
+    parser->buf = safe_malloc(parser->size);
+    parser->buf[0] = '\0';
+    parser->state = PARSE_HEADERS;
+}
+
+/** Hands the body of the response to a callback as it arrives instead of
+ * keeping it, for bodies too large to hold in memory. The response then
+ * only holds the headers.
+ * @param parser The parser
+ * @param cb Called with each piece of the body
+ * @param arg Passed to cb
+ */
+void
+http_parser_set_body_callback(t_http_parser *parser, http_body_callback cb, void *arg)
+{
+    parser->body_cb = cb;
+    parser->body_arg = arg;
+}
+
+/** Feeds raw bytes from the connection to the parser. Chunked bodies are
+ * decoded on the way in.
+ * @param parser The parser
+ * @param data Bytes read from the connection
+ * @param len Number of bytes
+ * @return HTTP_PARSE_MORE, HTTP_PARSE_DONE or HTTP_PARSE_ERROR
+ */
+int
+http_parser_feed(t_http_parser *parser, const char *data, size_t len)
+{
+    const char *end = data + len, *p;
+    size_t take, start;
+    char *hdr_end;
+
+    parser->received += len;
+
+    while (data < end) {
+        switch (parser->state) {
+            case PARSE_HEADERS:
+                /* The end of headers may straddle two reads */
+                start = parser->len > 3 ? parser->len - 3 : 0;
+                _http_parser_append(parser, data, end - data);
+                if (!(hdr_end = strstr(parser->buf + start, "\r\n\r\n"))) {
+                    if (parser->len > HTTP_CLIENT_MAX_HEADERS) {
+                        debug(LOG_WARNING, "Central server sent oversized headers");
+                        return HTTP_PARSE_ERROR;
+                    }
+                    return HTTP_PARSE_MORE;
+                }
+                parser->hdr_len = hdr_end + 4 - parser->buf;
+                /* Give back what came after the headers */
+                data = end - (parser->len - parser->hdr_len);
+                parser->len = parser->hdr_len;
+                parser->buf[parser->len] = '\0';
+                if (_http_parser_headers(parser) == HTTP_PARSE_ERROR)
+                    return HTTP_PARSE_ERROR;
+                break;
+
+            case PARSE_BODY_LENGTH:
+            case PARSE_CHUNK_DATA:
+                take = end - data;
+                if (take > parser->remaining)
+                    take = parser->remaining;
+                if (_http_parser_body(parser, data, take) == HTTP_PARSE_ERROR)
+                    return HTTP_PARSE_ERROR;
+                data += take;
+                parser->remaining -= take;
+                if (parser->remaining == 0)
+                    parser->state = (parser->state == PARSE_CHUNK_DATA) ? PARSE_CHUNK_CRLF : PARSE_DONE;
+                break;
+
+            case PARSE_BODY_EOF:
+                if (_http_parser_body(parser, data, end - data) == HTTP_PARSE_ERROR)
+                    return HTTP_PARSE_ERROR;
+                data = end;
+                break;
+
+            case PARSE_CHUNK_SIZE:
+            case PARSE_CHUNK_CRLF:
+            case PARSE_TRAILERS:
+                /* Line oriented states */
+                for (p = data; p < end && *p != '\n'; p++)
+                    ;
+                take = p - data;
+                if (parser->line_len + take >= sizeof(parser->line)) {
+                    if (parser->state != PARSE_TRAILERS) {
+                        debug(LOG_WARNING, "Central server sent a malformed chunk");
+                        return HTTP_PARSE_ERROR;
+                    }
+                    /* Long trailers are skipped, only emptiness matters */
+                    parser->line_len = 1;
+                } else {
+                    memcpy(parser->line + parser->line_len, data, take);
+                    parser->line_len += take;
+                }
+                if (p == end)
+                    return HTTP_PARSE_MORE;
+                data = p + 1;
+
+                if (parser->line_len > 0 && parser->line[parser->line_len - 1] == '\r')
+                    parser->line_len--;
+                parser->line[parser->line_len] = '\0';
+
+                if (parser->state == PARSE_CHUNK_CRLF) {
+                    if (parser->line_len != 0) {
+                        debug(LOG_WARNING, "Central server sent a malformed chunk");
+                        return HTTP_PARSE_ERROR;
+                    }
+                    parser->state = PARSE_CHUNK_SIZE;
+                } else if (parser->state == PARSE_CHUNK_SIZE) {
+                    parser->remaining = strtoull(parser->line, NULL, 16);
+                    parser->state = parser->remaining ? PARSE_CHUNK_DATA : PARSE_TRAILERS;
+                } else if (parser->line_len == 0) {
+                    parser->state = PARSE_DONE;
+                }
+                parser->line_len = 0;
+                break;
+
+            case PARSE_DONE:
+                /* Pipelined or stray data, the connection cannot be reused */
+                parser->response.keep_alive = 0;
+                data = end;
+                break;
+        }
+    }
+
+    return (parser->state == PARSE_DONE) ? HTTP_PARSE_DONE : HTTP_PARSE_MORE;
+}
+
+/** Tells the parser the server closed the connection
+ * @param parser The parser
+ * @return HTTP_PARSE_DONE if that ended the response, HTTP_PARSE_ERROR if
+ * the response was cut short
+ */
+int
+http_parser_eof(t_http_parser *parser)
+{
+    parser->response.keep_alive = 0;
+    if (parser->state == PARSE_BODY_EOF)
+        parser->state = PARSE_DONE;
+    return (parser->state == PARSE_DONE) ? HTTP_PARSE_DONE : HTTP_PARSE_ERROR;
+}
+
+/** Hands the parsed response over to the caller, who must free it with
+ * http_response_free(). The parser is left empty.
+ * @param parser A parser that returned HTTP_PARSE_DONE
+ * @param response Filled in
+ */
+void
+http_parser_finish(t_http_parser *parser, t_http_response *response)
+{
+    *response = parser->response;
+    response->data = parser->buf;
+    response->len = parser->len;
+    response->body = parser->buf + parser->hdr_len;
+    response->body_len = parser->len - parser->hdr_len;
+    parser->buf = NULL;
+}
+
+/** Frees whatever a parser still holds
+ * @param parser The parser
+ */
+void
+http_parser_free(t_http_parser *parser)
+{
+    if (parser->buf != NULL)
+        free(parser->buf);
+    parser->buf = NULL;
+}
+
+/** @internal
+ * @brief Reads one HTTP response, from a socket with select() or through
+ * a read function that blocks for at most IoTimeout seconds, within
+ * timeout seconds
+ */
+static int
+_http_client_read(int fd, http_client_reader reader, void *conn, t_http_response *response,
+        http_body_callback cb, void *arg, int timeout_sec)
+{
+    t_http_parser parser;
+    char buf[MAX_BUF];
+    fd_set readfds;
+    struct timeval timeout;
+    ssize_t numbytes;
+    time_t deadline = time(NULL) + timeout_sec;
+    int nfds, rc = HTTP_PARSE_MORE;
+
+    memset(response, 0, sizeof(t_http_response));
+    http_parser_init(&parser);
+    http_parser_set_body_callback(&parser, cb, arg);
+
+    while (rc == HTTP_PARSE_MORE) {
+        if (reader != NULL) {
+            if (time(NULL) > deadline) {
+                debug(LOG_ERR, "Timed out reading data from central server");
+                break;
+            }
+            numbytes = reader(conn, buf, sizeof(buf));
+        } else {
+            FD_ZERO(&readfds);
+            FD_SET(fd, &readfds);
+            timeout.tv_sec = deadline - time(NULL);
+            timeout.tv_usec = 0;
+            if (timeout.tv_sec < 0)
+                timeout.tv_sec = 0;
+            nfds = select(fd + 1, &readfds, NULL, NULL, &timeout);
+
+            if (nfds < 0 && errno == EINTR)
+                continue;
+            if (nfds == 0) {
+                debug(LOG_ERR, "Timed out reading data via select() from central server");
+                break;
+            }
+            if (nfds < 0) {
+                debug(LOG_ERR, "Error reading data via select() from central server: %s", strerror(errno));
+                break;
+            }
+            numbytes = read(fd, buf, sizeof(buf));
+        }
+
+        if (numbytes < 0) {
+            if (errno == EINTR)
+                continue;
+            debug(LOG_ERR, "An error occurred while reading from central server: %s", strerror(errno));
+            break;
+        }
+        if (numbytes == 0) {
+            if (parser.received == 0) {
+                http_parser_free(&parser);
+                return HTTP_READ_EMPTY;
+            }
+            rc = http_parser_eof(&parser);
+        } else {
+            rc = http_parser_feed(&parser, buf, numbytes);
+            /* A streamed body may be large, it only has to keep coming */
+            if (cb != NULL)
+                deadline = time(NULL) + config_get_config()->io_timeout;
+        }
+    }
+
+    if (rc != HTTP_PARSE_DONE) {
+        http_parser_free(&parser);
+        return -1;
+    }
+
+    http_parser_finish(&parser, response);
+    return 0;
+}
+
+/** Reads one HTTP response from a connected socket. The body is decoded
+ * if it was sent chunked.
+ * The whole response must arrive within IoTimeout seconds.
+ * @param fd Connected socket the request was sent on
+ * @param response Filled in; free it with http_response_free()
+ * @return 0 on success, -1 on error, HTTP_READ_EMPTY if the server closed
+ * the connection without answering
+ */
+int
+http_client_read_response(int fd, t_http_response *response)
+{
+    return _http_client_read(fd, NULL, NULL, response, NULL, NULL, config_get_config()->io_timeout);
+}
+
+/** Reads one HTTP response from a connected socket like
+ * http_client_read_response(), but waits up to timeout seconds for it,
+ * for requests the server may hold on to such as long polls.
+ * @param fd Connected socket the request was sent on
+ * @param response Filled in; free it with http_response_free()
+ * @param timeout Seconds the whole response may take
+ * @return 0 on success, -1 on error, HTTP_READ_EMPTY if the server closed
+ * the connection without answering
+ */
+int
+http_client_read_response_timeout(int fd, t_http_response *response, int timeout)
+{
+    return _http_client_read(fd, NULL, NULL, response, NULL, NULL, timeout);
+}
+
+/** Reads one HTTP response through a read function, for connections that
+ * cannot be waited on with select(), such as TLS ones that buffer data.
+ * The reader must not block for longer than IoTimeout, which holds for
+ * sockets opened by net_connect().
+ * @param reader Reads from the connection like read(2)
+ * @param conn Passed to reader
+ * @param response Filled in; free it with http_response_free()
+ * @return 0 on success, -1 on error, HTTP_READ_EMPTY if the server closed
+ * the connection without answering
+ */
+int
+http_client_read_response_with(http_client_reader reader, void *conn, t_http_response *response)
+{
+    return _http_client_read(-1, reader, conn, response, NULL, NULL, config_get_config()->io_timeout);
+}
+
+/** @internal
+ * @brief Sends a request over a new TLS connection and reads the response
+ */
+static int
+_http_client_request_tls(t_http_server server, const char *request, size_t len,
+        t_http_response *response, http_body_callback cb, void *arg)
+{
+    struct timeval start, end;
+    t_serv *serv;
+    SSL *ssl;
+    int fd, rc;
+
+    if ((fd = _http_client_connect_ssl(server)) == -1)
+        return -1;
+    if ((serv = http_client_server(server)) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    gettimeofday(&start, NULL);
+    rc = -1;
+    if ((ssl = tls_connect(fd, serv->serv_hostname)) != NULL) {
+        if (tls_write(ssl, request, len) == 0)
+            rc = _http_client_read(-1, tls_read, ssl, response, cb, arg, config_get_config()->io_timeout);
+        tls_close(ssl);
+    }
+    close(fd);
+
+    if (rc != 0) {
+        server_health_failure(serv);
+        return -1;
+    }
+
+    gettimeofday(&end, NULL);
+    server_health_success(serv, (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000);
+    return 0;
+}
+
+/** @internal
+ * @brief Does the work of http_client_request() and
+ * http_client_request_stream()
+ */
+static int
+_http_client_request(t_http_server server, const char *request, size_t len,
+        t_http_response *response, http_body_callback cb, void *arg)
+{
+    s_config *config = config_get_config();
+    struct timeval start, end;
+    t_serv *serv;
+    int fd, reused, rc, attempt;
+
+    memset(response, 0, sizeof(t_http_response));
+
+    if (http_client_use_tls(server))
+        return _http_client_request_tls(server, request, len, response, cb, arg);
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        fd = -1;
+        serv = http_client_server(server);
+        if (attempt == 0 && serv != NULL && config->pool_max_idle > 0)
+            fd = conn_pool_get(serv);
+
+        reused = (fd != -1);
+        if (!reused) {
+            if ((fd = _http_client_connect(server)) == -1)
+                return -1;
+            /* Connecting may have moved on to another server */
+            serv = http_client_server(server);
+        }
+
+        gettimeofday(&start, NULL);
+        if (_http_client_send(fd, request, len) == -1)
+            rc = HTTP_READ_EMPTY;
+        else
+            rc = _http_client_read(fd, NULL, NULL, response, cb, arg, config->io_timeout);
+
+        if (rc != 0) {
+            close(fd);
+            /* Only retry when the server cannot have seen the request */
+            if (reused && rc == HTTP_READ_EMPTY) {
+                debug(LOG_DEBUG, "Pooled connection was closed by the server, retrying on a new one");
+                continue;
+            }
+            if (serv != NULL)
+                server_health_failure(serv);
+            return -1;
+        }
+
+        gettimeofday(&end, NULL);
+        if (serv != NULL)
+            server_health_success(serv, (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000);
+
+        if (response->keep_alive && serv != NULL && config->pool_max_idle > 0)
+            conn_pool_put(serv, fd);
+        else
+            close(fd);
+        return 0;
+    }
+
+    return -1;
+}
+
+/** Sends a request to a central server and reads the whole response.
+ * An idle pooled connection is used when there is one; if that turns out
+ * to have been closed by the server the request is retried once on a new
+ * connection.
+ * @param server Which central server to talk to
+ * @param request Complete HTTP request, headers included
+ * @param response Filled in on success; free it with http_response_free()
+ * @return 0 on success, -1 on failure
+ */
+int
+http_client_request(t_http_server server, const char *request, t_http_response *response)
+{
+    return _http_client_request(server, request, strlen(request), response, NULL, NULL);
+}
+
+/** Sends a request to a central server like http_client_request(), for
+ * requests whose body is binary and may hold NUL bytes.
+ * @param server Which central server to talk to
+ * @param request Complete HTTP request, headers included
+ * @param len Length of request
+ * @param response Filled in on success; free it with http_response_free()
+ * @return 0 on success, -1 on failure
+ */
+int
+http_client_request_len(t_http_server server, const char *request, size_t len, t_http_response *response)
+{
+    return _http_client_request(server, request, len, response, NULL, NULL);
+}
+
+/** Sends a request to a central server like http_client_request(), but
+ * hands the response body to a callback as it arrives so it never has
+ * to fit in memory. IoTimeout then bounds the wait for each piece rather
+ * than the whole response. Whatever the callback was given before a
+ * failure must be thrown away by the caller.
+ * @param server Which central server to talk to
+ * @param request Complete HTTP request, headers included
+ * @param response Filled in with the status and headers on success; free
+ * it with http_response_free()
+ * @param cb Called with each piece of the body
+ * @param arg Passed to cb
+ * @return 0 on success, -1 on failure
+ */
+int
+http_client_request_stream(t_http_server server, const char *request, t_http_response *response,
+        http_body_callback cb, void *arg)
+{
+    return _http_client_request(server, request, strlen(request), response, cb, arg);
+}
+
+/** Frees the memory held by a response
+ * @param response The response
+ */
+void
+http_response_free(t_http_response *response)
+{
+    if (response->data != NULL)
+        free(response->data);
+    memset(response, 0, sizeof(t_http_response));
+}
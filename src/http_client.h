@@ -0,0 +1,146 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file http_client.h
+    @brief HTTP/1.1 requests to the central servers over pooled connections
+*/
+
+#ifndef _HTTP_CLIENT_H_
+#define _HTTP_CLIENT_H_
+
+#include <sys/types.h>
+
+#include "conf.h"
+
+/** The central servers a request can be sent to */
+typedef enum {
+    HTTP_SERVER_AUTH,		/**< The current auth server */
+    HTTP_SERVER_LOG,		/**< The log server */
+    HTTP_SERVER_UPDATE		/**< The update server */
+} t_http_server;
+
+/** A response read from a central server
+ */
+typedef struct _t_http_response {
+    int status;			/**< @brief HTTP status code, 0 if unknown */
+    char *data;			/**< @brief Headers followed by the decoded
+				     body, NUL terminated */
+    size_t len;			/**< @brief Length of data */
+    char *body;			/**< @brief Start of the body within data */
+    size_t body_len;		/**< @brief Length of the body */
+    int keep_alive;		/**< @brief Whether the connection can carry
+				     another request */
+} t_http_response;
+
+/** @brief Called with each piece of a response body as it arrives, in
+ * place of keeping it in the response; returns 0 to go on, -1 to abort */
+typedef int (*http_body_callback)(const char *data, size_t len, void *arg);
+
+/** @brief Reads from a connection like read(2), for connections that are
+ * not plain sockets */
+typedef ssize_t (*http_client_reader)(void *conn, char *buf, size_t len);
+
+/** Returned by http_client_read_response() when the server closed the
+ * connection before sending anything */
+#define HTTP_READ_EMPTY -2
+
+/** Result of feeding data to a t_http_parser */
+#define HTTP_PARSE_ERROR -1	/**< The response is malformed */
+#define HTTP_PARSE_MORE 0	/**< More data is needed */
+#define HTTP_PARSE_DONE 1	/**< The response is complete */
+
+/** Incremental HTTP/1.x response parser. Data can be fed in pieces of any
+ * size; headers and the decoded body accumulate in a growable buffer.
+ */
+typedef struct _t_http_parser {
+    int state;			/**< @brief Where the parser is, see http_client.c */
+    char *buf;			/**< @brief Headers followed by the decoded body */
+    size_t len;			/**< @brief Bytes used in buf */
+    size_t size;		/**< @brief Bytes allocated for buf */
+    size_t hdr_len;		/**< @brief Length of the headers, once known */
+    unsigned long long remaining;	/**< @brief Body or chunk bytes still expected */
+    char line[64];		/**< @brief Partial chunk size line */
+    size_t line_len;		/**< @brief Bytes used in line */
+    size_t received;		/**< @brief Raw bytes fed so far */
+    http_body_callback body_cb;	/**< @brief Where the body goes, NULL to
+				     keep it in buf */
+    void *body_arg;		/**< @brief Passed to body_cb */
+    t_http_response response;	/**< @brief Status and framing of the response */
+} t_http_parser;
+
+/** @brief Prepares a parser for a new response */
+void http_parser_init(t_http_parser *parser);
+
+/** @brief Hands the body to a callback instead of keeping it */
+void http_parser_set_body_callback(t_http_parser *parser, http_body_callback cb, void *arg);
+
+/** @brief Feeds raw bytes from the connection to the parser */
+int http_parser_feed(t_http_parser *parser, const char *data, size_t len);
+
+/** @brief Tells the parser the server closed the connection */
+int http_parser_eof(t_http_parser *parser);
+
+/** @brief Hands the parsed response over, the parser is left empty */
+void http_parser_finish(t_http_parser *parser, t_http_response *response);
+
+/** @brief Frees whatever a parser still holds */
+void http_parser_free(t_http_parser *parser);
+
+/** @brief Returns the server currently used for a given kind of request */
+t_serv *http_client_server(t_http_server server);
+
+/** @brief Tells whether requests to a server go over TLS */
+int http_client_use_tls(t_http_server server);
+
+/** @brief Returns the path of a URL if it is on a central server */
+const char *http_client_url_path(t_http_server server, const char *url);
+
+/** @brief Opens a connection of its own to a central server */
+int http_client_connect(t_http_server server);
+
+/** @brief Writes a whole request to a connection */
+int http_client_send(int fd, const char *request);
+
+/** @brief Sends a request to a central server and reads the whole response */
+int http_client_request(t_http_server server, const char *request, t_http_response *response);
+
+/** @brief Sends a request with a binary body to a central server */
+int http_client_request_len(t_http_server server, const char *request, size_t len,
+		t_http_response *response);
+
+/** @brief Sends a request to a central server, streaming the response body */
+int http_client_request_stream(t_http_server server, const char *request,
+		t_http_response *response, http_body_callback cb, void *arg);
+
+/** @brief Reads one HTTP response from a connected socket */
+int http_client_read_response(int fd, t_http_response *response);
+
+/** @brief Reads one HTTP response the server may take a while to send */
+int http_client_read_response_timeout(int fd, t_http_response *response, int timeout);
+
+/** @brief Reads one HTTP response through a read function, e.g. over TLS */
+int http_client_read_response_with(http_client_reader reader, void *conn,
+		t_http_response *response);
+
+/** @brief Frees the memory held by a response */
+void http_response_free(t_http_response *response);
+
+#endif /* _HTTP_CLIENT_H_ */
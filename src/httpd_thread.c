@@ -22,6 +22,13 @@
 
 /** @file httpd_thread.c
     @brief Handles on web request.
+
+    Accepted connections are queued for HttpdWorkers threads started once,
+    with stacks of HttpdStackSize KB, rather than each getting a thread of
+    its own with the default stack of several MB. When HttpdQueueMax
+    connections are already waiting a new one is answered 503 at once and
+    closed, so a storm of captive portal probes cannot exhaust the memory
+    of the gateway.
     @author Copyright (C) 2004 Alexandre Carmel-Veilleux <acv@acv.ca>
 */
 
@@ -35,15 +42,68 @@
 #include <syslog.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 #include "httpd.h"
 
 #include "../config.h"
 #include "common.h"
+#include "safe.h"
+#include "conf.h"
 #include "debug.h"
 #include "httpd_thread.h"
 
-/** Main request handling thread.
+/** Answer to connections shed because the queue is full */
+#define HTTPD_OVERLOAD_RESPONSE "HTTP/1.0 503 Service Unavailable\r\n" \
+	"Retry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+/** @internal
+ * A connection waiting for a worker
+ */
+typedef struct _t_httpd_job {
+	struct _t_httpd_job	*next;
+	request			*r;
+} t_httpd_job;
+
+static httpd *pool_webserver = NULL;
+
+/** Queue of connections waiting for a worker */
+static t_httpd_job *queue_head = NULL;
+static t_httpd_job *queue_tail = NULL;
+
+static t_httpd_pool_stats stats;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signalled when a connection is queued */
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/** @internal
+ * @brief Reads, answers and closes one connection
+ */
+static void
+_httpd_serve(httpd *webserver, request *r)
+{
+	if (httpdReadRequest(webserver, r) == 0) {
+		/*
+		 * We read the request fine
+		 */
+		debug(LOG_DEBUG, "Processing request from %s", r->clientAddr);
+		debug(LOG_DEBUG, "Calling httpdProcessRequest() for %s", r->clientAddr);
+		httpdProcessRequest(webserver, r);
+		debug(LOG_DEBUG, "Returned from httpdProcessRequest() for %s", r->clientAddr);
+	}
+	else {
+		debug(LOG_DEBUG, "No valid request received from %s", r->clientAddr);
+	}
+	debug(LOG_DEBUG, "Closing connection with %s", r->clientAddr);
+	httpdEndRequest(r);
+}
+
+/** Main request handling thread, for a connection that has a thread of
+ * its own when there are no HttpdWorkers.
 @param args Two item array of void-cast pointers to the httpd and request struct
 */
 void
@@ -58,18 +118,174 @@ thread_httpd(void *args)
 	r = *(params + 1);
 	free(params); /* XXX We must release this ourselves. */
 	
-	if (httpdReadRequest(webserver, r) == 0) {
-		/*
-		 * We read the request fine
-		 */
-		debug(LOG_DEBUG, "Processing request from %s", r->clientAddr);
-		debug(LOG_DEBUG, "Calling httpdProcessRequest() for %s", r->clientAddr);
-		httpdProcessRequest(webserver, r);
-		debug(LOG_DEBUG, "Returned from httpdProcessRequest() for %s", r->clientAddr);
+	_httpd_serve(webserver, r);
+}
+
+/** @internal
+ * @brief Worker thread, serves queued connections one at a time
+ */
+static void
+_httpd_worker(void *arg)
+{
+	t_httpd_job	*job;
+	request		*r;
+
+	pthread_mutex_lock(&pool_mutex);
+	while (1) {
+		while (queue_head == NULL)
+			pthread_cond_wait(&queue_cond, &pool_mutex);
+
+		job = queue_head;
+		queue_head = job->next;
+		if (queue_head == NULL)
+			queue_tail = NULL;
+		stats.queued--;
+		stats.busy++;
+		pthread_mutex_unlock(&pool_mutex);
+
+		r = job->r;
+		free(job);
+		_httpd_serve(pool_webserver, r);
+
+		pthread_mutex_lock(&pool_mutex);
+		stats.busy--;
+		stats.served++;
 	}
-	else {
-		debug(LOG_DEBUG, "No valid request received from %s", r->clientAddr);
+}
+
+/** @internal
+ * @brief Prepares the attributes of the web server threads
+ */
+static void
+_httpd_thread_attr(pthread_attr_t *attr)
+{
+	size_t	stack = (size_t)config_get_config()->httpd_stack_size * 1024;
+
+	pthread_attr_init(attr);
+	if (stack < HTTPD_STACK_MIN * 1024)
+		stack = HTTPD_STACK_MIN * 1024;
+	if (stack < PTHREAD_STACK_MIN)
+		stack = PTHREAD_STACK_MIN;
+	if (pthread_attr_setstacksize(attr, stack) != 0)
+		debug(LOG_WARNING, "Could not set the stack size of web server threads to %lu bytes", (unsigned long)stack);
+}
+
+/** Starts HttpdWorkers threads serving the web server. With no workers
+ * each connection gets a thread of its own, as before, with the same
+ * small stack.
+ * @param webserver The web server the connections are accepted on
+ */
+void
+httpd_pool_init(httpd *webserver)
+{
+	pthread_attr_t	attr;
+	pthread_t	tid;
+	int		i, n = config_get_config()->httpd_workers;
+
+	pool_webserver = webserver;
+	_httpd_thread_attr(&attr);
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&tid, &attr, (void *)_httpd_worker, NULL) != 0) {
+			debug(LOG_ERR, "Failed to create web server worker thread: only %d started", i);
+			break;
+		}
+		pthread_detach(tid);
 	}
-	debug(LOG_DEBUG, "Closing connection with %s", r->clientAddr);
+	pthread_attr_destroy(&attr);
+
+	pthread_mutex_lock(&pool_mutex);
+	stats.workers = i;
+	pthread_mutex_unlock(&pool_mutex);
+	debug(LOG_INFO, "Started %d web server worker threads", i);
+}
+
+/** @internal
+ * @brief Answers a connection 503 without waiting and closes it
+ */
+static void
+_httpd_shed(request *r)
+{
+	/* The socket buffer is empty, this never blocks */
+	send(r->clientSock, HTTPD_OVERLOAD_RESPONSE, sizeof(HTTPD_OVERLOAD_RESPONSE) - 1,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
 	httpdEndRequest(r);
 }
+
+/** Hands an accepted connection to a worker thread
+ * @param webserver The web server the connection was accepted on
+ * @param r The connection, freed once served
+ * @return 0 if it will be served, -1 if it was refused because the queue
+ * is full or no thread could be started
+ */
+int
+httpd_pool_dispatch(httpd *webserver, request *r)
+{
+	s_config	*config = config_get_config();
+	pthread_attr_t	attr;
+	pthread_t	tid;
+	t_httpd_job	*job;
+	void		**params;
+	int		result;
+
+	pthread_mutex_lock(&pool_mutex);
+	stats.requests++;
+
+	if (stats.workers == 0) {
+		pthread_mutex_unlock(&pool_mutex);
+		/* The void**'s are a simulation of the normal C
+		 * function calling sequence. */
+		params = safe_malloc(2 * sizeof(void *));
+		*params = webserver;
+		*(params + 1) = r;
+
+		_httpd_thread_attr(&attr);
+		result = pthread_create(&tid, &attr, (void *)thread_httpd, (void *)params);
+		pthread_attr_destroy(&attr);
+		if (result != 0) {
+			debug(LOG_ERR, "Failed to create a new thread (httpd) for %s", r->clientAddr);
+			free(params);
+			pthread_mutex_lock(&pool_mutex);
+			stats.shed++;
+			pthread_mutex_unlock(&pool_mutex);
+			_httpd_shed(r);
+			return -1;
+		}
+		pthread_detach(tid);
+		return 0;
+	}
+
+	if (config->httpd_queue_max > 0 && stats.queued >= config->httpd_queue_max) {
+		stats.shed++;
+		pthread_mutex_unlock(&pool_mutex);
+		debug(LOG_WARNING, "Web server queue is full (%d connections), refusing %s", config->httpd_queue_max, r->clientAddr);
+		_httpd_shed(r);
+		return -1;
+	}
+
+	job = safe_malloc(sizeof(t_httpd_job));
+	job->next = NULL;
+	job->r = r;
+	if (queue_tail)
+		queue_tail->next = job;
+	else
+		queue_head = job;
+	queue_tail = job;
+
+	if (++stats.queued > stats.queued_peak)
+		stats.queued_peak = stats.queued;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&pool_mutex);
+
+	return 0;
+}
+
+/** Reads the web server pool counters
+ * @param out Receives the counters
+ */
+void
+httpd_pool_get_stats(t_httpd_pool_stats *out)
+{
+	pthread_mutex_lock(&pool_mutex);
+	*out = stats;
+	pthread_mutex_unlock(&pool_mutex);
+}
@@ -27,7 +27,34 @@
 #ifndef _HTTPD_THREAD_H_
 #define _HTTPD_THREAD_H_
 
+#include "httpd.h"
+
+/** Smallest stack given to web server threads, in KB */
+#define HTTPD_STACK_MIN 64
+
+/**
+ * @brief Counters shown in the status page
+ */
+typedef struct _t_httpd_pool_stats {
+    int workers;		/**< @brief Worker threads */
+    int busy;			/**< @brief Workers serving a connection */
+    int queued;			/**< @brief Connections waiting for a worker */
+    int queued_peak;		/**< @brief Highest queue depth seen */
+    unsigned long requests;	/**< @brief Connections accepted */
+    unsigned long served;	/**< @brief Connections served by the workers */
+    unsigned long shed;		/**< @brief Connections refused with a 503 */
+} t_httpd_pool_stats;
+
 /** @brief Handle a web request */
 void thread_httpd(void *args);
 
+/** @brief Starts the web server worker threads */
+void httpd_pool_init(httpd *webserver);
+
+/** @brief Hands an accepted connection to a worker thread */
+int httpd_pool_dispatch(httpd *webserver, request *r);
+
+/** @brief Reads the web server pool counters */
+void httpd_pool_get_stats(t_httpd_pool_stats *stats);
+
 #endif
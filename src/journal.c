@@ -0,0 +1,716 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file journal.c
+    @brief Notifications kept for the central servers while they are down
+
+    Traffic counters and logouts that cannot be delivered, because the
+    auth server is offline or the request failed, are journalled instead
+    of being lost. Counters are cumulative, so a newer report for a client
+    replaces the waiting one rather than adding to the journal, which
+    holds at most JournalSize notifications; the oldest one is dropped
+    when it is full.
+
+    Every JournalSyncInterval seconds the changes are appended to
+    JournalFile as text lines and synced once, so billing data survives a
+    reboot during the outage:
+
+        R <seq> <server> <kind> <time> <incoming> <outgoing> <ip> <mac> <token>
+        A <seq>
+
+    An "A" line means every notification up to that sequence number was
+    delivered. A line for a sequence number already in the file replaces
+    it. The file is rewritten from memory once it holds more than twice
+    the lines needed, and no more than JournalWriteLimit KB are written
+    per hour so a long outage cannot wear out the flash.
+
+    When its server is back the journal is replayed, at most
+    JOURNAL_REPLAY_MAX notifications at a time over AsyncSockets
+    connections, or one by one over TLS. After a failed round the next one waits twice as long,
+    from JOURNAL_RETRY_MIN up to JOURNAL_RETRY_MAX seconds.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "common.h"
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "util.h"
+#include "centralserver.h"
+#include "authlog.h"
+#include "http_async.h"
+#include "journal.h"
+
+/** Number of hash buckets */
+#define JOURNAL_BUCKETS 256
+/** Longest token that is journalled */
+#define JOURNAL_TOKEN_MAX 255
+/** Most notifications sent in one replay round */
+#define JOURNAL_REPLAY_MAX 256
+/** Seconds to wait after a failed replay round, doubled each time */
+#define JOURNAL_RETRY_MIN 30
+/** Longest wait between two replay rounds */
+#define JOURNAL_RETRY_MAX 900
+/** Lines the file may hold before it is considered for a rewrite */
+#define JOURNAL_REWRITE_MIN 128
+
+/** @internal
+ * A journalled notification
+ */
+typedef struct _t_journal_record {
+    struct _t_journal_record *hnext;	/**< @brief Next in the hash bucket */
+    struct _t_journal_record *prev;	/**< @brief Journalled earlier */
+    struct _t_journal_record *next;	/**< @brief Journalled later */
+    unsigned long seq;		/**< @brief Sequence number in the file */
+    t_http_server server;	/**< @brief Server it is meant for */
+    t_journal_kind kind;
+    time_t when;		/**< @brief Last time it was updated */
+    char *ip;
+    char *mac;
+    char *token;
+    unsigned long long incoming;
+    unsigned long long outgoing;
+    int dirty;			/**< @brief Not in the file yet */
+    int sending;		/**< @brief Being replayed, unchanged since */
+} t_journal_record;
+
+/** @internal
+ * A notification taking part in a replay round
+ */
+typedef struct _t_journal_replay {
+    t_http_server server;
+    t_journal_kind kind;
+    char *mac;
+    char *token;
+    char *request;
+    int delivered;
+} t_journal_replay;
+
+static t_journal_record *buckets[JOURNAL_BUCKETS];
+
+/** Oldest notification */
+static t_journal_record *journal_head = NULL;
+/** Newest notification */
+static t_journal_record *journal_tail = NULL;
+
+static int count = 0;
+static unsigned long next_seq = 1;
+/** Everything up to this sequence number was delivered */
+static unsigned long acked = 0;
+/** The ack line in the file is older than acked */
+static int ack_dirty = 0;
+/** The file must be rewritten rather than appended to */
+static int rewrite = 0;
+/** Lines in the file */
+static int file_lines = 0;
+
+static unsigned long journalled = 0;
+static unsigned long compacted = 0;
+static unsigned long replayed = 0;
+static unsigned long dropped = 0;
+
+/** Start of the hour the write budget is counted over */
+static time_t budget_start = 0;
+/** Bytes written since budget_start */
+static unsigned long budget_used = 0;
+
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * @brief Hashes a token
+ */
+static unsigned int
+_journal_hash(const char *token)
+{
+    unsigned int h = 5381;
+
+    while (*token)
+        h = (h << 5) + h + (unsigned char)*token++;
+    return h % JOURNAL_BUCKETS;
+}
+
+/** @internal
+ * @brief Finds the waiting notification of a kind for a client, must be
+ * called with the journal locked
+ */
+static t_journal_record *
+_journal_find(t_http_server server, t_journal_kind kind, const char *token, const char *mac)
+{
+    t_journal_record *record;
+
+    for (record = buckets[_journal_hash(token)]; record != NULL; record = record->hnext) {
+        if (record->server == server && record->kind == kind &&
+                strcmp(record->token, token) == 0 && strcasecmp(record->mac, mac) == 0)
+            return record;
+    }
+    return NULL;
+}
+
+/** @internal
+ * @brief Adds a notification at the end of the journal, must be called
+ * with the journal locked
+ */
+static t_journal_record *
+_journal_insert(unsigned long seq, t_http_server server, t_journal_kind kind,
+        const char *ip, const char *mac, const char *token)
+{
+    t_journal_record *record;
+    unsigned int h;
+
+    record = safe_malloc(sizeof(t_journal_record));
+    memset(record, 0, sizeof(t_journal_record));
+    record->seq = seq;
+    record->server = server;
+    record->kind = kind;
+    record->ip = safe_strdup(ip);
+    record->mac = safe_strdup(mac);
+    record->token = safe_strdup(token);
+
+    h = _journal_hash(token);
+    record->hnext = buckets[h];
+    buckets[h] = record;
+
+    record->prev = journal_tail;
+    if (journal_tail)
+        journal_tail->next = record;
+    else
+        journal_head = record;
+    journal_tail = record;
+    count++;
+
+    return record;
+}
+
+/** @internal
+ * @brief Removes and frees a notification, must be called with the
+ * journal locked
+ */
+static void
+_journal_remove(t_journal_record *record)
+{
+    t_journal_record **pp;
+
+    for (pp = &buckets[_journal_hash(record->token)]; *pp != record; pp = &(*pp)->hnext)
+        ;
+    *pp = record->hnext;
+
+    if (record->prev)
+        record->prev->next = record->next;
+    else
+        journal_head = record->next;
+    if (record->next)
+        record->next->prev = record->prev;
+    else
+        journal_tail = record->prev;
+    count--;
+
+    free(record->ip);
+    free(record->mac);
+    free(record->token);
+    free(record);
+}
+
+/** @internal
+ * @brief Moves a notification whose sequence number changed to its place
+ * in the list, which is kept in sequence order so that the ack is taken
+ * from its head. Must be called with the journal locked.
+ */
+static void
+_journal_reorder(t_journal_record *record)
+{
+    t_journal_record *after;
+
+    if ((record->prev == NULL || record->prev->seq <= record->seq) &&
+            (record->next == NULL || record->next->seq >= record->seq))
+        return;
+
+    if (record->prev)
+        record->prev->next = record->next;
+    else
+        journal_head = record->next;
+    if (record->next)
+        record->next->prev = record->prev;
+    else
+        journal_tail = record->prev;
+
+    for (after = journal_tail; after != NULL && after->seq > record->seq; after = after->prev)
+        ;
+    record->prev = after;
+    record->next = after ? after->next : journal_head;
+    if (record->prev)
+        record->prev->next = record;
+    else
+        journal_head = record;
+    if (record->next)
+        record->next->prev = record;
+    else
+        journal_tail = record;
+}
+
+/** @internal
+ * @brief Moves the ack up to just before the oldest waiting notification,
+ * must be called with the journal locked
+ */
+static void
+_journal_update_ack(void)
+{
+    unsigned long ack = journal_head ? journal_head->seq - 1 : next_seq - 1;
+
+    if (ack > acked) {
+        acked = ack;
+        ack_dirty = 1;
+    }
+}
+
+/** @internal
+ * @brief Reads the journal file, must be called with the journal locked
+ */
+static void
+_journal_load(const char *path)
+{
+    char line[MAX_BUF], ip[16], mac[18], token[JOURNAL_TOKEN_MAX + 1];
+    t_journal_record *record, *next;
+    unsigned long long incoming, outgoing;
+    unsigned long seq;
+    int server, kind;
+    long when;
+    FILE *fh;
+
+    if ((fh = fopen(path, "r")) == NULL) {
+        if (errno != ENOENT)
+            debug(LOG_ERR, "Could not read journal %s: %s", path, strerror(errno));
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fh) != NULL) {
+        file_lines++;
+        if (strchr(line, '\n') == NULL) {
+            /* Cut short by a crash, the next append would be garbled */
+            rewrite = 1;
+        } else if (sscanf(line, "A %lu", &seq) == 1) {
+            if (seq > acked)
+                acked = seq;
+            if (seq >= next_seq)
+                next_seq = seq + 1;
+        } else if (sscanf(line, "R %lu %d %d %ld %llu %llu %15s %17s %255s", &seq, &server, &kind,
+                    &when, &incoming, &outgoing, ip, mac, token) == 9 &&
+                (server == HTTP_SERVER_AUTH || server == HTTP_SERVER_LOG) &&
+                (kind == JOURNAL_COUNTERS || kind == JOURNAL_LOGOUT)) {
+            if ((record = _journal_find(server, kind, token, mac)) == NULL)
+                record = _journal_insert(seq, server, kind, ip, mac, token);
+            record->seq = seq;
+            _journal_reorder(record);
+            record->when = when;
+            record->incoming = incoming;
+            record->outgoing = outgoing;
+            if (seq >= next_seq)
+                next_seq = seq + 1;
+        } else {
+            debug(LOG_WARNING, "Ignoring bad line in journal %s", path);
+            rewrite = 1;
+        }
+    }
+    fclose(fh);
+
+    for (record = journal_head; record != NULL; record = next) {
+        next = record->next;
+        if (record->seq <= acked)
+            _journal_remove(record);
+    }
+    while (count > config_get_config()->journal_size && journal_head != NULL) {
+        _journal_remove(journal_head);
+        dropped++;
+    }
+}
+
+/** Loads what the journal file holds from before a restart. Must be
+ * called before thread_journal() is started.
+ */
+void
+journal_init(void)
+{
+    s_config *config = config_get_config();
+
+    if (config->journal_size <= 0 || config->journal_file == NULL)
+        return;
+
+    pthread_mutex_lock(&journal_mutex);
+    _journal_load(config->journal_file);
+    if (count > 0)
+        debug(LOG_NOTICE, "%d notification(s) left in journal %s from before the restart",
+                count, config->journal_file);
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+/** Keeps a notification until its server can be reached again. Counters
+ * replace those already waiting for the same client.
+ * @param server Server the notification is meant for
+ * @param kind What the notification is about
+ * @param ip IP of the client
+ * @param mac MAC of the client
+ * @param token Token of the client
+ * @param incoming Incoming counter of the client
+ * @param outgoing Outgoing counter of the client
+ */
+void
+journal_add(t_http_server server, t_journal_kind kind, const char *ip, const char *mac,
+        const char *token, unsigned long long incoming, unsigned long long outgoing)
+{
+    s_config *config = config_get_config();
+    t_journal_record *record;
+
+    if (config->journal_size <= 0)
+        return;
+
+    if (strlen(token) > JOURNAL_TOKEN_MAX || strlen(ip) > 15 || strlen(mac) > 17 ||
+            strpbrk(token, " \t\r\n") != NULL) {
+        debug(LOG_WARNING, "Cannot journal notification for token %s at %s", token, mac);
+        return;
+    }
+
+    pthread_mutex_lock(&journal_mutex);
+
+    if ((record = _journal_find(server, kind, token, mac)) != NULL) {
+        compacted++;
+    } else {
+        if (count >= config->journal_size && journal_head != NULL) {
+            debug(LOG_WARNING, "Journal full, dropping notification for %s", journal_head->mac);
+            _journal_remove(journal_head);
+            _journal_update_ack();
+            dropped++;
+        }
+        record = _journal_insert(next_seq++, server, kind, ip, mac, token);
+        journalled++;
+    }
+    record->when = time(NULL);
+    record->incoming = incoming;
+    record->outgoing = outgoing;
+    record->dirty = 1;
+    record->sending = 0;
+
+    pthread_mutex_unlock(&journal_mutex);
+
+    debug(LOG_DEBUG, "Journalled %s for %s", kind == JOURNAL_LOGOUT ? "logout" : "counters", ip);
+}
+
+/** @internal
+ * @brief Formats a notification as a line of the file
+ */
+static char *
+_journal_format(const t_journal_record *record)
+{
+    char *line;
+
+    safe_asprintf(&line, "R %lu %d %d %ld %llu %llu %s %s %s\n", record->seq, record->server,
+            record->kind, (long)record->when, record->incoming, record->outgoing,
+            record->ip, record->mac, record->token);
+    return line;
+}
+
+/** @internal
+ * @brief Writes a string to a file and syncs it
+ * @return 0 on success, -1 on error
+ */
+static int
+_journal_write(const char *path, const char *mode, const char *data)
+{
+    FILE *fh;
+    int rc;
+
+    if ((fh = fopen(path, mode)) == NULL) {
+        debug(LOG_ERR, "Could not open journal %s: %s", path, strerror(errno));
+        return -1;
+    }
+    rc = (fputs(data, fh) == EOF || fflush(fh) == EOF || fsync(fileno(fh)) == -1) ? -1 : 0;
+    if (fclose(fh) == EOF)
+        rc = -1;
+    if (rc == -1)
+        debug(LOG_ERR, "Could not write journal %s: %s", path, strerror(errno));
+    return rc;
+}
+
+/** Writes what changed since the last flush to the journal file, or the
+ * whole journal when the file has grown too much. Done by thread_journal()
+ * and on exit.
+ */
+void
+journal_flush(void)
+{
+    s_config *config = config_get_config();
+    t_journal_record *record;
+    char *data, *line, *tmp;
+    size_t size, len;
+    int lines, whole;
+    time_t now = time(NULL);
+
+    if (config->journal_size <= 0 || config->journal_file == NULL)
+        return;
+
+    pthread_mutex_lock(&journal_mutex);
+
+    whole = rewrite || (file_lines >= JOURNAL_REWRITE_MIN && file_lines > 2 * (count + 1));
+    size = 256;
+    data = safe_malloc(size);
+    len = 0;
+    data[0] = '\0';
+    lines = 0;
+    for (record = journal_head; record != NULL; record = record->next) {
+        if (!whole && !record->dirty)
+            continue;
+        line = _journal_format(record);
+        if (len + strlen(line) + 1 > size) {
+            size = 2 * (len + strlen(line) + 1);
+            data = safe_realloc(data, size);
+        }
+        strcpy(data + len, line);
+        len += strlen(line);
+        free(line);
+        lines++;
+    }
+    if (whole || ack_dirty) {
+        safe_asprintf(&line, "A %lu\n", acked);
+        data = safe_realloc(data, len + strlen(line) + 1);
+        strcpy(data + len, line);
+        len += strlen(line);
+        free(line);
+        lines++;
+    }
+
+    if (lines == 0) {
+        pthread_mutex_unlock(&journal_mutex);
+        free(data);
+        return;
+    }
+
+    if (now - budget_start >= 3600) {
+        budget_start = now;
+        budget_used = 0;
+    }
+    if (budget_used + len > (unsigned long)config->journal_write_limit * 1024) {
+        pthread_mutex_unlock(&journal_mutex);
+        debug(LOG_WARNING, "Journal write budget of %d KB per hour used up, keeping %d notification(s) in memory",
+                config->journal_write_limit, count);
+        free(data);
+        return;
+    }
+    budget_used += len;
+
+    /* Everything formatted is considered written; on failure the next
+     * flush rewrites the whole file */
+    for (record = journal_head; record != NULL; record = record->next)
+        record->dirty = 0;
+    ack_dirty = 0;
+    rewrite = 0;
+    file_lines = whole ? lines : file_lines + lines;
+
+    pthread_mutex_unlock(&journal_mutex);
+
+    if (whole) {
+        safe_asprintf(&tmp, "%s.tmp", config->journal_file);
+        if (_journal_write(tmp, "w", data) == -1 || rename(tmp, config->journal_file) == -1) {
+            unlink(tmp);
+            whole = -1;
+        }
+        free(tmp);
+    } else if (_journal_write(config->journal_file, "a", data) == -1) {
+        whole = -1;
+    }
+    free(data);
+
+    if (whole == -1) {
+        pthread_mutex_lock(&journal_mutex);
+        rewrite = 1;
+        pthread_mutex_unlock(&journal_mutex);
+    }
+}
+
+/** @internal
+ * @brief Stores the outcome of a replayed notification
+ */
+static void
+_journal_replay_done(t_http_response *response, void *arg)
+{
+    t_journal_replay *replay = arg;
+
+    replay->delivered = (response != NULL);
+}
+
+/** @internal
+ * @brief Sends the oldest waiting notifications for a server
+ * @return Number sent, -1 if any of them could not be delivered
+ */
+static int
+_journal_replay(t_http_server server)
+{
+    s_config *config = config_get_config();
+    t_journal_replay *replays;
+    t_journal_record *record;
+    t_http_async *engine;
+    t_http_response response;
+    char buf[MAX_BUF];
+    const char *type;
+    int n, i, failed;
+
+    replays = safe_malloc(sizeof(t_journal_replay) * JOURNAL_REPLAY_MAX);
+    n = 0;
+
+    pthread_mutex_lock(&journal_mutex);
+    for (record = journal_head; record != NULL && n < JOURNAL_REPLAY_MAX; record = record->next) {
+        if (record->server != server)
+            continue;
+        type = (record->kind == JOURNAL_LOGOUT) ? REQUEST_TYPE_LOGOUT : REQUEST_TYPE_COUNTERS;
+        if (server == HTTP_SERVER_LOG)
+            log_server_build_request(buf, sizeof(buf), type, record->ip, record->mac,
+                    record->token, record->incoming, record->outgoing);
+        else
+            auth_server_build_request(buf, sizeof(buf), type, record->ip, record->mac,
+                    record->token, record->incoming, record->outgoing);
+        replays[n].server = record->server;
+        replays[n].kind = record->kind;
+        replays[n].mac = safe_strdup(record->mac);
+        replays[n].token = safe_strdup(record->token);
+        replays[n].request = safe_strdup(buf);
+        replays[n].delivered = 0;
+        record->sending = 1;
+        n++;
+    }
+    pthread_mutex_unlock(&journal_mutex);
+
+    if (n == 0) {
+        free(replays);
+        return 0;
+    }
+
+    debug(LOG_INFO, "Replaying %d journalled notification(s)", n);
+    if ((engine = http_async_new(server, config->async_sockets > 0 ? config->async_sockets : 1)) != NULL) {
+        for (i = 0; i < n; i++)
+            http_async_submit(engine, replays[i].request, _journal_replay_done, &replays[i]);
+        http_async_run(engine);
+        http_async_free(engine);
+    } else {
+        /* One at a time then, stopping at the first failure */
+        for (i = 0; i < n && (i == 0 || replays[i - 1].delivered); i++) {
+            if (http_client_request(server, replays[i].request, &response) == 0) {
+                replays[i].delivered = 1;
+                http_response_free(&response);
+            }
+        }
+    }
+
+    failed = 0;
+    pthread_mutex_lock(&journal_mutex);
+    for (i = 0; i < n; i++) {
+        record = _journal_find(replays[i].server, replays[i].kind, replays[i].token, replays[i].mac);
+        if (record != NULL && record->sending) {
+            record->sending = 0;
+            if (replays[i].delivered) {
+                _journal_remove(record);
+                replayed++;
+            }
+        }
+        if (!replays[i].delivered)
+            failed = 1;
+        free(replays[i].mac);
+        free(replays[i].token);
+        free(replays[i].request);
+    }
+    _journal_update_ack();
+    pthread_mutex_unlock(&journal_mutex);
+    free(replays);
+
+    return failed ? -1 : n;
+}
+
+/** Reads the journal counters
+ * @param stats Receives the counters
+ */
+void
+journal_get_stats(t_journal_stats *stats)
+{
+    pthread_mutex_lock(&journal_mutex);
+    stats->count = count;
+    stats->journalled = journalled;
+    stats->compacted = compacted;
+    stats->replayed = replayed;
+    stats->dropped = dropped;
+    stats->written = budget_used;
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+/** Launches a thread that writes the journal to flash every
+ * JournalSyncInterval seconds and replays it once the servers are back.
+ */
+void
+thread_journal(void *arg)
+{
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    pthread_mutex_t cond_mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct timespec timeout;
+    s_config *config = config_get_config();
+    time_t now, next_flush, next_replay;
+    int wait, rc;
+
+    now = time(NULL);
+    next_flush = now + config->journal_sync_interval;
+    next_replay = now;
+    wait = JOURNAL_RETRY_MIN;
+
+    while (1) {
+        timeout.tv_sec = time(NULL) + 1;
+        timeout.tv_nsec = 0;
+
+        pthread_mutex_lock(&cond_mutex);
+        pthread_cond_timedwait(&cond, &cond_mutex, &timeout);
+        pthread_mutex_unlock(&cond_mutex);
+
+        now = time(NULL);
+
+        if (now >= next_replay) {
+            rc = 0;
+            if (config->auth_servers != NULL && is_auth_online())
+                rc = _journal_replay(HTTP_SERVER_AUTH);
+            if (rc != -1 && config->log_servers != NULL)
+                rc = _journal_replay(HTTP_SERVER_LOG);
+            if (rc == -1) {
+                next_replay = now + wait;
+                debug(LOG_INFO, "Journal replay failed, retrying in %d seconds", wait);
+                wait = (wait * 2 < JOURNAL_RETRY_MAX) ? wait * 2 : JOURNAL_RETRY_MAX;
+            } else {
+                wait = JOURNAL_RETRY_MIN;
+            }
+        }
+
+        if (now >= next_flush) {
+            journal_flush();
+            next_flush = now + config->journal_sync_interval;
+        }
+    }
+}
@@ -0,0 +1,66 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file journal.h
+    @brief Notifications kept for the central servers while they are down
+*/
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "http_client.h"
+
+/** @brief What a journalled notification is about */
+typedef enum {
+    JOURNAL_COUNTERS,		/**< Traffic counters of a client */
+    JOURNAL_LOGOUT		/**< Logout of a client */
+} t_journal_kind;
+
+/**
+ * @brief Counters shown in the status page
+ */
+typedef struct _t_journal_stats {
+    int count;			/**< @brief Notifications waiting */
+    unsigned long journalled;	/**< @brief Notifications journalled */
+    unsigned long compacted;	/**< @brief Updates folded into a waiting one */
+    unsigned long replayed;	/**< @brief Notifications delivered late */
+    unsigned long dropped;	/**< @brief Notifications lost to a full journal */
+    unsigned long written;	/**< @brief Bytes written to the file this hour */
+} t_journal_stats;
+
+/** @brief Loads what the journal file holds from before a restart */
+void journal_init(void);
+
+/** @brief Keeps a notification until its server can be reached again */
+void journal_add(t_http_server server, t_journal_kind kind,
+		const char *ip, const char *mac, const char *token,
+		unsigned long long incoming, unsigned long long outgoing);
+
+/** @brief Writes the changes to the journal file */
+void journal_flush(void);
+
+/** @brief Reads the journal counters */
+void journal_get_stats(t_journal_stats *stats);
+
+/** @brief Writes the journal to flash and replays it to the servers */
+void thread_journal(void *arg);
+
+#endif /* _JOURNAL_H_ */
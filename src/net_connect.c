@@ -0,0 +1,216 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file net_connect.c
+    @brief Connecting to the central servers within a deadline
+
+    A blocking connect() to a server that drops SYNs only gives up after
+    the kernel retries, over two minutes. net_connect() starts a
+    non-blocking connect to the first address of the server and, if it
+    has not completed after NET_CONNECT_STAGGER_MS, to the next one as
+    well, and so on; the first connection to complete wins and the others
+    are closed. Everything is given up after ConnectTimeout seconds. The
+    socket returned is blocking, with IoTimeout seconds allowed for each
+    send and receive.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "conf.h"
+#include "dns_cache.h"
+#include "net_connect.h"
+
+/** @internal
+ * @brief Current time in milliseconds
+ */
+static long long
+_net_now_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/** @internal
+ * @brief Starts a non-blocking connect
+ * @param fd Returns the socket
+ * @return 1 if connected already, 0 if in progress, -1 on failure
+ */
+static int
+_net_connect_start(const struct in_addr *addr, int port, int *fd)
+{
+    struct sockaddr_in their_addr;
+
+    if ((*fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        debug(LOG_ERR, "Failed to create a new SOCK_STREAM socket: %s", strerror(errno));
+        return -1;
+    }
+    fcntl(*fd, F_SETFL, fcntl(*fd, F_GETFL) | O_NONBLOCK);
+
+    memset(&their_addr, 0, sizeof(their_addr));
+    their_addr.sin_family = AF_INET;
+    their_addr.sin_port = htons(port);
+    their_addr.sin_addr = *addr;
+
+    if (connect(*fd, (struct sockaddr *)&their_addr, sizeof(their_addr)) == 0)
+        return 1;
+    if (errno == EINPROGRESS)
+        return 0;
+
+    close(*fd);
+    *fd = -1;
+    return -1;
+}
+
+/** Applies the IoTimeout send and receive budget to a socket, so that a
+ * server that stops answering cannot hold a blocking call forever
+ * @param fd The socket
+ */
+void
+net_set_io_timeout(int fd)
+{
+    struct timeval tv;
+
+    tv.tv_sec = config_get_config()->io_timeout;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/** Connects to one of the addresses of a server. The addresses are tried
+ * in order, a new one every NET_CONNECT_STAGGER_MS while the earlier ones
+ * are still pending, and the first to connect is kept.
+ * @param hostname Name of the server, for the logs
+ * @param addrs Addresses of the server
+ * @param naddrs Number of addresses
+ * @param port Port to connect to
+ * @param which Returns the index of the address connected to
+ * @return A connected blocking socket, or -1 if no address answered in
+ * ConnectTimeout seconds
+ */
+int
+net_connect(const char *hostname, const struct in_addr *addrs, int naddrs, int port, int *which)
+{
+    struct pollfd pfds[DNS_CACHE_MAX_ADDRS];
+    int index[DNS_CACHE_MAX_ADDRS];
+    long long now, deadline, next_start, wait;
+    int i, n, fd, rc, err, started = 0, pending = 0, winner = -1;
+    socklen_t errlen;
+
+    if (naddrs > DNS_CACHE_MAX_ADDRS)
+        naddrs = DNS_CACHE_MAX_ADDRS;
+
+    now = _net_now_ms();
+    deadline = now + (long long)config_get_config()->connect_timeout * 1000;
+    next_start = now;
+
+    while (winner == -1) {
+        now = _net_now_ms();
+
+        if (started < naddrs && now >= next_start) {
+            rc = _net_connect_start(&addrs[started], port, &fd);
+            if (rc == 1) {
+                /* Connected at once, typically on the loopback */
+                pfds[pending].fd = fd;
+                index[pending] = started;
+                winner = pending++;
+                break;
+            } else if (rc == 0) {
+                pfds[pending].fd = fd;
+                pfds[pending].events = POLLOUT;
+                index[pending] = started;
+                pending++;
+                next_start = now + NET_CONNECT_STAGGER_MS;
+            } else {
+                debug(LOG_DEBUG, "Failed to connect to %s at %s:%d (%s)", hostname, inet_ntoa(addrs[started]), port, strerror(errno));
+                next_start = now;
+            }
+            started++;
+            continue;
+        }
+
+        for (i = 0, n = 0; i < pending; i++) {
+            if (pfds[i].fd != -1)
+                n++;
+        }
+        if (n == 0 && started == naddrs)
+            break;
+        if (now >= deadline) {
+            debug(LOG_DEBUG, "Timed out connecting to %s:%d", hostname, port);
+            break;
+        }
+
+        wait = ((started < naddrs && next_start < deadline) ? next_start : deadline) - now;
+        rc = poll(pfds, pending, wait > 0 ? (int)wait : 0);
+        if (rc < 0 && errno != EINTR)
+            break;
+
+        for (i = 0; i < pending && rc > 0; i++) {
+            if (pfds[i].fd == -1 || pfds[i].revents == 0)
+                continue;
+            err = 0;
+            errlen = sizeof(err);
+            if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1)
+                err = errno;
+            if (err == 0) {
+                winner = i;
+                break;
+            }
+            debug(LOG_DEBUG, "Failed to connect to %s at %s:%d (%s)", hostname, inet_ntoa(addrs[index[i]]), port, strerror(err));
+            close(pfds[i].fd);
+            /* A negative fd is ignored by poll() */
+            pfds[i].fd = -1;
+            /* Do not wait for the stagger, the next address can go now */
+            next_start = _net_now_ms();
+        }
+    }
+
+    for (i = 0; i < pending; i++) {
+        if (i != winner && pfds[i].fd != -1)
+            close(pfds[i].fd);
+    }
+
+    if (winner == -1)
+        return -1;
+
+    fd = pfds[winner].fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    net_set_io_timeout(fd);
+    *which = index[winner];
+
+    return fd;
+}
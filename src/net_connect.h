@@ -0,0 +1,40 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file net_connect.h
+    @brief Connecting to the central servers within a deadline
+*/
+
+#ifndef _NET_CONNECT_H_
+#define _NET_CONNECT_H_
+
+#include <netinet/in.h>
+
+/** Milliseconds before the next address of a server is tried alongside */
+#define NET_CONNECT_STAGGER_MS 250
+
+/** @brief Connects to one of the addresses of a server within ConnectTimeout */
+int net_connect(const char *hostname, const struct in_addr *addrs, int naddrs, int port, int *which);
+
+/** @brief Applies the IoTimeout send and receive budget to a socket */
+void net_set_io_timeout(int fd);
+
+#endif /* _NET_CONNECT_H_ */
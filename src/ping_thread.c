@@ -20,8 +20,8 @@
 
 /* $Id$ */
 /** @file ping_thread.c
-    @brief Periodically checks in with the central auth server so the auth
-    server knows the gateway is still up.  Note that this is NOT how the gateway
+    @brief Periodically checks in with the central auth and log servers so
+    they know the gateway is still up.  Note that this is NOT how the gateway
     detects that the central server is still up.
     @author Copyright (C) 2004 Alexandre Carmel-Veilleux <acv@miniguru.ca>
 */
@@ -42,6 +42,7 @@
 #include <syslog.h>
 #include <signal.h>
 #include <errno.h>
+#include <sys/sysinfo.h>
 
 #include "../config.h"
 #include "safe.h"
@@ -49,134 +50,157 @@
 #include "conf.h"
 #include "debug.h"
 #include "ping_thread.h"
+#include "ding_thread.h"
 #include "util.h"
 #include "centralserver.h"
+#include "http_client.h"
 #include "fetchcmd.h"
+#include "schedule.h"
 
-static void ping(void);
+/** @internal
+ * @brief One destination of the heartbeat
+ */
+typedef struct {
+	const char	*name;		/**< @brief For the debug log */
+	int		(*interval)(void); /**< @brief Seconds between heartbeats */
+	int		(*send)(const t_sys_stats *stats); /**< @brief Sends one
+					     heartbeat, 0 on success */
+	t_schedule	sched;		/**< @brief When the next one is due */
+} t_heartbeat_target;
+
+static int ping_interval(void);
+static int ding_interval(void);
+static int ping(const t_sys_stats *stats);
 
+static t_heartbeat_target targets[] = {
+	{ .name = "auth server", .interval = ping_interval, .send = ping },
+	{ .name = "log server", .interval = ding_interval, .send = ding },
+};
 
+#define HEARTBEAT_TARGETS (sizeof(targets) / sizeof(targets[0]))
+
+/** Latest system statistics, shared with whoever wants them */
+static t_sys_stats sys_stats;
+static pthread_mutex_t sys_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 extern int level;
 extern time_t started_time;
 
-/** Launches a thread that periodically checks in with the wifidog auth server to perform heartbeat function.
+static int
+ping_interval(void)
+{
+	return config_get_config()->checkinterval;
+}
+
+static int
+ding_interval(void)
+{
+	return DING_INTERVAL;
+}
+
+/** @internal
+ * @brief Reads uptime, free memory and load in one system call
+ */
+static void
+sample_sys_stats(void)
+{
+	struct sysinfo	info;
+	t_sys_stats	stats;
+
+	memset(&stats, 0, sizeof(stats));
+	if (sysinfo(&info) == 0) {
+		stats.uptime = info.uptime;
+		stats.memfree = (unsigned int)((unsigned long long)info.freeram * info.mem_unit / 1024);
+		stats.load = (float)info.loads[0] / (1 << SI_LOAD_SHIFT);
+	}
+	else {
+		debug(LOG_CRIT, "Failed to read system statistics: %s", strerror(errno));
+	}
+	stats.sampled = time(NULL);
+
+	pthread_mutex_lock(&sys_stats_mutex);
+	sys_stats = stats;
+	pthread_mutex_unlock(&sys_stats_mutex);
+}
+
+/** Copies the system statistics taken at the last heartbeat */
+void
+heartbeat_get_stats(t_sys_stats *stats)
+{
+	pthread_mutex_lock(&sys_stats_mutex);
+	*stats = sys_stats;
+	pthread_mutex_unlock(&sys_stats_mutex);
+}
+
+/** Launches a thread that periodically sends the heartbeats of the gateway
+ * to the auth and log servers, each on its own schedule (see schedule.c).
 @param arg NULL
 @todo This thread loops infinitely, need a watchdog to verify that it is still running?
 */  
 void
 thread_ping(void *arg)
 {
-	pthread_cond_t		cond = PTHREAD_COND_INITIALIZER;
-	pthread_mutex_t		cond_mutex = PTHREAD_MUTEX_INITIALIZER;
-	struct	timespec	timeout;
-
-	/*
-	timeout.tv_sec = time(NULL) + 30;
-	timeout.tv_nsec = 0;
-
-	pthread_mutex_lock(&cond_mutex);
+	t_sys_stats		stats;
+	time_t			now, wake;
+	unsigned int		i;
+	int			sampled, rc;
 
-	pthread_cond_timedwait(&cond, &cond_mutex, &timeout);
-
-	pthread_mutex_unlock(&cond_mutex);
-	*/
+	for (i = 0; i < HEARTBEAT_TARGETS; i++)
+		schedule_init(&targets[i].sched, targets[i].name, targets[i].interval());
 
 	while (1) {
-		/* Make sure we check the servers at the very begining */
-		debug(LOG_DEBUG, "Running ping()");
-		ping();
-		
-		
-		/* Sleep for config.checkinterval seconds... */
-		timeout.tv_sec = time(NULL) + config_get_config()->checkinterval;
-		timeout.tv_nsec = 0;
-
-		/* Mutex must be locked for pthread_cond_timedwait... */
-		pthread_mutex_lock(&cond_mutex);
-		
-		/* Thread safe "sleep" */
-		pthread_cond_timedwait(&cond, &cond_mutex, &timeout);
+		/* The statistics are read once for all the heartbeats due now */
+		sampled = 0;
+		now = time(NULL);
+		for (i = 0; i < HEARTBEAT_TARGETS; i++) {
+			if (targets[i].sched.next > now)
+				continue;
+			if (!sampled) {
+				sample_sys_stats();
+				heartbeat_get_stats(&stats);
+				sampled = 1;
+			}
+			debug(LOG_DEBUG, "Sending heartbeat to the %s", targets[i].name);
+			rc = targets[i].send(&stats);
+			schedule_done(&targets[i].sched, targets[i].interval(), rc == 0);
+		}
 
-		/* No longer needs to be locked */
-		pthread_mutex_unlock(&cond_mutex);
+		/* Sleep until the next heartbeat is due... */
+		wake = targets[0].sched.next;
+		for (i = 1; i < HEARTBEAT_TARGETS; i++)
+			if (targets[i].sched.next < wake)
+				wake = targets[i].sched.next;
+		schedule_sleep_until(wake);
 	}
 }
 
 /** @internal
  * This function does the actual request.
+ * @return 0 on success, -1 if the auth server could not be reached
  */
-static void
-ping(void)
+static int
+ping(const t_sys_stats *stats)
 {
-	ssize_t			numbytes;
-	size_t	        	totalbytes;
-	int			sockfd, nfds, done;
 	char			request[MAX_BUF];
-	fd_set			readfds;
-	struct timeval		timeout;
-	FILE * fh;
-	unsigned long int sys_uptime  = 0;
-	unsigned int      sys_memfree = 0;
-	float             sys_load    = 0;
+	t_http_response		response;
 	t_serv	*auth_server = NULL;
 	auth_server = get_auth_server();
 	char            *str = NULL;
-	char            *str1 = NULL;
-	s_config *config=config_get_config();
+	char		results[256];
+	int		nresults;
 	
 	
 	
 	debug(LOG_DEBUG, "Entering ping()");
-	
-	/*
-	 * The ping thread does not really try to see if the auth server is actually
-	 * working. Merely that there is a web server listening at the port. And that
-	 * is done by connect_auth_server() internally.
-	 */
-	sockfd = connect_auth_server();
-	if (sockfd == -1) {
-		/*
-		 * No auth servers for me to talk to
-		 */
-		return;
-	}
 
-	/*
-	 * Populate uptime, memfree and load
-	 */
-	if ((fh = fopen("/proc/uptime", "r"))) {
-		if(fscanf(fh, "%lu", &sys_uptime) != 1)
-			debug(LOG_CRIT, "Failed to read uptime");
-
-		fclose(fh);
-	}
-	if ((fh = fopen("/proc/meminfo", "r"))) {
-		while (!feof(fh)) {
-			if (fscanf(fh, "MemFree: %u", &sys_memfree) == 0) {
-				/* Not on this line */
-				while (!feof(fh) && fgetc(fh) != '\n');
-			}
-			else {
-				/* Found it */
-				break;
-			}
-		}
-		fclose(fh);
-	}
-	if ((fh = fopen("/proc/loadavg", "r"))) {
-		if(fscanf(fh, "%f", &sys_load) != 1)
-			debug(LOG_CRIT, "Failed to read loadavg");
-
-		fclose(fh);
-	}
-	
+	/* Results of the tasks that came with the last heartbeat */
+	nresults = fetchcmd_results_query(results, sizeof(results));
 	
 	/*
 	 * Prep & send request
 	 */
 	snprintf(request, sizeof(request) - 1,
-			"GET %s%sgw_id=%s&dev_id=%s&wan_ip=%s&wan_proto=%s&sys_uptime=%lu&sys_memfree=%u&sys_load=%.2f&uptime=%lu&ssid=%s&hard_ver=1&soft_ver=1 HTTP/1.0\r\n"
+			"GET %s%sgw_id=%s&dev_id=%s&wan_ip=%s&wan_proto=%s&sys_uptime=%lu&sys_memfree=%u&sys_load=%.2f&uptime=%lu&ssid=%s&hard_ver=1&soft_ver=1&task_inline=1%s HTTP/1.1\r\n"
 			"User-Agent: WiFiDog %s\r\n"
 			"Host: %s\r\n"
 			"\r\n",
@@ -186,11 +210,12 @@ ping(void)
 			config_get_config()->dev_id,
 			"192.168.10.1",
 			"static",
-			sys_uptime,
-			sys_memfree,
-			sys_load,
+			stats->uptime,
+			stats->memfree,
+			stats->load,
 			(long unsigned int)((long unsigned int)time(NULL) - (long unsigned int)started_time),
 			config_get_config()->ssid,
+			results,
 			VERSION,
 			auth_server->serv_hostname);
 
@@ -198,65 +223,34 @@ ping(void)
 
 	debug(LOG_DEBUG, "HTTP Request to Server: [%s]", request);
 	
-	send(sockfd, request, strlen(request), 0);
-
-	debug(LOG_DEBUG, "Reading response");
-	
-	numbytes = totalbytes = 0;
-	done = 0;
-	do {
-		FD_ZERO(&readfds);
-		FD_SET(sockfd, &readfds);
-		timeout.tv_sec = 30; /* XXX magic... 30 second */
-		timeout.tv_usec = 0;
-		nfds = sockfd + 1;
-
-		nfds = select(nfds, &readfds, NULL, NULL, &timeout);
-
-		if (nfds > 0) {
-			/** We don't have to use FD_ISSET() because there
-			 *  was only one fd. */
-			numbytes = read(sockfd, request + totalbytes, MAX_BUF - (totalbytes + 1));
-			if (numbytes < 0) {
-				debug(LOG_ERR, "An error occurred while reading from auth server: %s", strerror(errno));
-				/* FIXME */
-				close(sockfd);
-				return;
-			}
-			else if (numbytes == 0) {
-				done = 1;
-			}
-			else {
-				totalbytes += numbytes;
-				debug(LOG_DEBUG, "Read %d bytes, total now %d", numbytes, totalbytes);
-			}
-		}
-		else if (nfds == 0) {
-			debug(LOG_ERR, "Timed out reading data via select() from auth server");
-			/* FIXME */
-			close(sockfd);
-			return;
-		}
-		else if (nfds < 0) {
-			debug(LOG_ERR, "Error reading data via select() from auth server: %s", strerror(errno));
-			/* FIXME */
-			close(sockfd);
-			return;
-		}
-	} while (!done);
-	close(sockfd);
-
-	debug(LOG_DEBUG, "Done reading reply, total %d bytes", totalbytes);
-
-	request[totalbytes] = '\0';
+	/*
+	 * The ping thread does not really try to see if the auth server is actually
+	 * working. Merely that there is a web server listening at the port. And that
+	 * is done by connect_auth_server() internally, or by reusing a connection
+	 * it made before.
+	 */
+	if (http_client_request(HTTP_SERVER_AUTH, request, &response) == -1) {
+		/*
+		 * No auth servers for me to talk to
+		 */
+		return -1;
+	}
+	fetchcmd_results_sent(nresults);
 
-	debug(LOG_DEBUG, "HTTP Response from Server: [%s]", request);
+	debug(LOG_DEBUG, "HTTP Response from Server: [%s]", response.data);
 	
-	str = strstr(request, "Pong");
+	str = strstr(response.data, "Pong");
 	if (str == 0) {
-		if(strstr(request, "Task")){
-			fetchcmd();
+		if(strstr(response.data, "Task")){
+			/* Done with this response before talking to the server again */
+			str = safe_strdup(response.body ? response.body : "");
+			http_response_free(&response);
 			debug(LOG_DEBUG, "Auth Server Says Task" );
+			/* Servers that do not send the task along want it fetched */
+			if (!fetchcmd_inline(str))
+				fetchcmd();
+			free(str);
+			return 0;
         	}
 		else{	
 
@@ -267,7 +261,7 @@ ping(void)
 		debug(LOG_DEBUG, "Auth Server Says: Pong");
 	}
 	
+	http_response_free(&response);
 	
-	
-	return;	
+	return 0;
 }
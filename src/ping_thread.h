@@ -29,7 +29,20 @@
 
 #define MINIMUM_STARTED_TIME 1041379200 /* 2003-01-01 */
 
-/** @brief Periodically checks on the auth server to see if it's alive. */
+#include <time.h>
+
+/** @brief System statistics reported in the heartbeats */
+typedef struct _t_sys_stats {
+	unsigned long	uptime;		/**< @brief Seconds since boot */
+	unsigned int	memfree;	/**< @brief Free memory in kB */
+	float		load;		/**< @brief One minute load average */
+	time_t		sampled;	/**< @brief When they were read */
+} t_sys_stats;
+
+/** @brief Copies the system statistics taken at the last heartbeat */
+void heartbeat_get_stats(t_sys_stats *stats);
+
+/** @brief Periodically checks in with the auth and log servers. */
 void thread_ping(void *arg);
 
 #endif
@@ -0,0 +1,216 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file quota.c
+    @brief Gateway side enforcement of per-client byte and time quotas
+
+    The auth server may hand out a byte and/or a time allowance with its
+    answer. They are checked locally every time the counters are read
+    from the firewall, so a client is cut off as soon as its quota is
+    used up instead of on the next counters round trip. The logout is
+    queued and sent to the auth server later, without the client list
+    locked.
+
+    The allowances of the login answer count from the login. Later
+    answers (counters, the confirmation of a cached login) carry what is
+    left: the allowance is resized to it but keeps counting from the
+    login, so repeating an answer does not give the client a new quota.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "httpd.h"
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "auth.h"
+#include "client_list.h"
+#include "firewall.h"
+#include "centralserver.h"
+#include "quota.h"
+#include "auth_cache.h"
+
+extern pthread_mutex_t client_list_mutex;
+
+/** @internal
+ * A logout that still has to be sent to the auth server
+ */
+typedef struct _t_quota_report {
+    struct _t_quota_report *next;
+    char *ip;
+    char *mac;
+    char *token;
+    unsigned long long incoming;
+    unsigned long long outgoing;
+} t_quota_report;
+
+/** @internal
+ * Logouts waiting to be reported, protected by the client list mutex
+ */
+static t_quota_report *pending_reports = NULL;
+
+/** Sets the allowances of a client from the auth server answer to its
+ * login. Does nothing if the answer carried no quota. The byte allowance
+ * counts from the current counters and the time allowance from now.
+ * @param client The client that logged in, client list locked
+ * @param authresponse The response from the auth server
+ */
+void
+quota_apply(t_client * client, const t_authresponse * authresponse)
+{
+    if (!authresponse->has_quota)
+        return;
+
+    client->quota.bytes_allowed = authresponse->quota_bytes;
+    client->quota.bytes_base = client->counters.incoming + client->counters.outgoing;
+    client->quota.time_allowed = authresponse->quota_time;
+    client->quota.started = time(NULL);
+
+    debug(LOG_INFO, "Quota for %s: %llu bytes, %ld seconds (0 is unlimited)",
+          client->ip, client->quota.bytes_allowed, (long)client->quota.time_allowed);
+}
+
+/** Updates the allowances of a client from a later auth server answer,
+ * which carries what the client has left. The allowance keeps counting
+ * from the login, only its size changes. Does nothing if the answer
+ * carried no quota.
+ * @param client The client the answer was about, client list locked
+ * @param authresponse The response from the auth server
+ */
+void
+quota_update(t_client * client, const t_authresponse * authresponse)
+{
+    unsigned long long total = client->counters.incoming + client->counters.outgoing;
+    time_t now = time(NULL);
+
+    if (!authresponse->has_quota)
+        return;
+    if (client->quota.started == 0) {
+        /* The login carried no quota, this is the first allowance */
+        quota_apply(client, authresponse);
+        return;
+    }
+
+    /* The counters are cleared when a client leaves validation */
+    if (total < client->quota.bytes_base)
+        client->quota.bytes_base = total;
+
+    client->quota.bytes_allowed = authresponse->quota_bytes ?
+        total - client->quota.bytes_base + authresponse->quota_bytes : 0;
+    client->quota.time_allowed = authresponse->quota_time ?
+        now - client->quota.started + authresponse->quota_time : 0;
+
+    debug(LOG_DEBUG, "Quota left for %s: %llu bytes, %ld seconds (0 is unlimited)",
+          client->ip, authresponse->quota_bytes, authresponse->quota_time);
+}
+
+/** Tells whether a client has used up its byte or time allowance
+ * @param client The client to check, client list locked
+ * @param now Current time
+ * @return 1 if the client must be cut off, 0 otherwise
+ */
+int
+quota_exhausted(const t_client * client, time_t now)
+{
+    const t_quota *quota = &client->quota;
+
+    if (quota->bytes_allowed != 0 &&
+            client->counters.incoming + client->counters.outgoing >=
+            quota->bytes_base + quota->bytes_allowed)
+        return 1;
+
+    if (quota->time_allowed != 0 && now - quota->started >= quota->time_allowed)
+        return 1;
+
+    return 0;
+}
+
+/** Walks the client list and revokes every authorised client that has
+ * used up its allowance: the firewall rules are removed, the client is
+ * deleted and a logout is queued for quota_report().
+ * Must be called with the client list locked.
+ * @param now Time the counters were read
+ */
+void
+quota_enforce(time_t now)
+{
+    t_client *p1, *p2;
+    t_quota_report *report;
+
+    for (p1 = p2 = client_get_first_client(); NULL != p1; p1 = p2) {
+        p2 = p1->next;
+
+        if (p1->pending || !quota_exhausted(p1, now))
+            continue;
+
+        debug(LOG_INFO, "%s - Quota exhausted (%llu bytes used), denying in firewall",
+              p1->ip, p1->counters.incoming + p1->counters.outgoing - p1->quota.bytes_base);
+
+        report = safe_malloc(sizeof(t_quota_report));
+        report->ip = safe_strdup(p1->ip);
+        report->mac = safe_strdup(p1->mac);
+        report->token = safe_strdup(p1->token);
+        report->incoming = p1->counters.incoming;
+        report->outgoing = p1->counters.outgoing;
+        report->next = pending_reports;
+        pending_reports = report;
+
+        fw_deny(p1->ip, p1->mac, p1->fw_connection_state);
+        auth_cache_invalidate(p1->token);
+        client_list_delete(p1);
+    }
+}
+
+/** Sends the logouts queued by quota_enforce() to the auth server. Must be
+ * called without the client list locked.
+ */
+void
+quota_report(void)
+{
+    t_quota_report *report, *next;
+
+    LOCK_CLIENT_LIST();
+    report = pending_reports;
+    pending_reports = NULL;
+    UNLOCK_CLIENT_LIST();
+
+    for (; report != NULL; report = next) {
+        next = report->next;
+
+        if (config_get_config()->auth_servers != NULL) {
+            auth_server_notify(REQUEST_TYPE_LOGOUT, report->ip, report->mac,
+                    report->token, report->incoming, report->outgoing);
+        }
+
+        free(report->ip);
+        free(report->mac);
+        free(report->token);
+        free(report);
+    }
+}
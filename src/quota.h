@@ -0,0 +1,47 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file quota.h
+    @brief Gateway side enforcement of per-client byte and time quotas
+*/
+
+#ifndef _QUOTA_H_
+#define _QUOTA_H_
+
+#include "auth.h"
+#include "client_list.h"
+
+/** @brief Sets the allowances of a client from the answer to its login */
+void quota_apply(t_client *client, const t_authresponse *authresponse);
+
+/** @brief Updates the allowances of a client from a later answer */
+void quota_update(t_client *client, const t_authresponse *authresponse);
+
+/** @brief Tells whether a client has used up its allowance */
+int quota_exhausted(const t_client *client, time_t now);
+
+/** @brief Revokes every client that has used up its allowance */
+void quota_enforce(time_t now);
+
+/** @brief Sends the logouts queued by quota_enforce() to the auth server */
+void quota_report(void);
+
+#endif /* _QUOTA_H_ */
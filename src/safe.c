@@ -52,6 +52,16 @@ void * safe_malloc (size_t size) {
 	return (retval);
 }
 
+void * safe_realloc (void *ptr, size_t size) {
+	void * retval = NULL;
+	retval = realloc(ptr, size);
+	if (!retval) {
+		debug(LOG_CRIT, "Failed to realloc %d bytes of memory: %s.  Bailing out", size, strerror(errno));
+		exit(1);
+	}
+	return (retval);
+}
+
 char * safe_strdup(const char *s) {
 	char * retval = NULL;
 	if (!s) {
@@ -35,6 +35,10 @@
  */
 void *safe_malloc (size_t size);
 
+/** @brief Safe version of realloc
+ */
+void *safe_realloc (void *ptr, size_t size);
+
 /* @brief Safe version of strdup
  */
 char *safe_strdup(const char *s);
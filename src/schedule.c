@@ -0,0 +1,164 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file schedule.c
+    @brief When the periodic tasks of the gateway run
+
+    Gateways that boot together after a power cut would otherwise ping,
+    report and sync with the central servers on the same second for as
+    long as they run. Each task instead starts at an offset within its
+    first period, then keeps that phase. The offset is taken from a hash
+    of the whole gateway MAC and the task name, so it is the same across
+    restarts of one gateway but differs between gateways and between the
+    tasks of one gateway.
+
+    After a failure the task waits twice its period, four times after two
+    failures, up to SCHEDULE_BACKOFF_MAX times, plus its offset so the
+    retries of many gateways stay spread as well.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "debug.h"
+#include "conf.h"
+#include "schedule.h"
+
+/** Hashes the gateway MAC together with a name (32 bit FNV-1a)
+ * @param name Tells apart the tasks of a gateway
+ * @return A hash that differs between gateways and names
+ */
+unsigned int
+schedule_device_hash(const char *name)
+{
+    s_config *config = config_get_config();
+    const char *id = config->gw_mac ? config->gw_mac : config->gw_id;
+    unsigned int h = 2166136261u;
+
+    while (id && *id) {
+        h ^= (unsigned char)*id++;
+        h *= 16777619u;
+    }
+    h ^= '/';
+    h *= 16777619u;
+    while (name && *name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/** Offset of this gateway within a span of time, for a task
+ * @param sched The task
+ * @param span Seconds the offsets of all gateways spread over
+ * @return Seconds, from 0 to span - 1
+ */
+unsigned int
+schedule_jitter(const t_schedule *sched, unsigned int span)
+{
+    return span > 0 ? sched->hash % span : 0;
+}
+
+/** Prepares a task to first run at its offset within its first period
+ * @param sched The task
+ * @param name Name of the task, for the log and the offset
+ * @param interval Seconds between two runs
+ */
+void
+schedule_init(t_schedule *sched, const char *name, int interval)
+{
+    sched->name = name;
+    sched->hash = schedule_device_hash(name);
+    sched->failures = 0;
+    sched->next = time(NULL) + schedule_jitter(sched, interval > 0 ? interval : 1);
+    debug(LOG_DEBUG, "Scheduling %s every %d seconds, first in %ld", name, interval,
+            (long)(sched->next - time(NULL)));
+}
+
+/** Works out when a task runs next, once it ran
+ * @param sched The task
+ * @param interval Seconds between two runs
+ * @param ok Whether the run succeeded
+ */
+void
+schedule_done(t_schedule *sched, int interval, int ok)
+{
+    time_t now = time(NULL);
+    int factor;
+
+    if (interval < 1)
+        interval = 1;
+
+    if (ok) {
+        sched->failures = 0;
+        /* Keep the phase, skipping the runs that were missed */
+        while (sched->next <= now)
+            sched->next += interval;
+        return;
+    }
+
+    sched->failures++;
+    factor = 1 << (sched->failures < 4 ? sched->failures : 4);
+    if (factor > SCHEDULE_BACKOFF_MAX)
+        factor = SCHEDULE_BACKOFF_MAX;
+    sched->next = now + (time_t)interval * factor + schedule_jitter(sched, interval);
+    debug(LOG_DEBUG, "%s failed %d time(s) in a row, next in %ld seconds", sched->name,
+            sched->failures, (long)(sched->next - now));
+}
+
+/** Sleeps until a given time
+ * @param when Time to wake up at
+ */
+void
+schedule_sleep_until(time_t when)
+{
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    pthread_mutex_t cond_mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct timespec timeout;
+
+    timeout.tv_sec = when;
+    timeout.tv_nsec = 0;
+
+    /* Mutex must be locked for pthread_cond_timedwait... */
+    pthread_mutex_lock(&cond_mutex);
+
+    /* Thread safe "sleep" */
+    pthread_cond_timedwait(&cond, &cond_mutex, &timeout);
+
+    /* No longer needs to be locked */
+    pthread_mutex_unlock(&cond_mutex);
+}
+
+/** Sleeps until a task is due
+ * @param sched The task
+ */
+void
+schedule_wait(const t_schedule *sched)
+{
+    while (time(NULL) < sched->next)
+        schedule_sleep_until(sched->next);
+}
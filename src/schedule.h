@@ -0,0 +1,62 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file schedule.h
+    @brief When the periodic tasks of the gateway run
+*/
+
+#ifndef _SCHEDULE_H_
+#define _SCHEDULE_H_
+
+#include <time.h>
+
+/** Most periods a failing task waits before it runs again */
+#define SCHEDULE_BACKOFF_MAX 8
+
+/**
+ * @brief A periodic task
+ */
+typedef struct _t_schedule {
+    const char *name;		/**< @brief For the log and the offset */
+    unsigned int hash;		/**< @brief Hash of the gateway MAC and name */
+    int failures;		/**< @brief Failed runs in a row */
+    time_t next;		/**< @brief When it runs next */
+} t_schedule;
+
+/** @brief Hashes the gateway MAC together with a name */
+unsigned int schedule_device_hash(const char *name);
+
+/** @brief Offset of this gateway within a span of time, for a task */
+unsigned int schedule_jitter(const t_schedule *sched, unsigned int span);
+
+/** @brief Prepares a task to first run at its offset within its first period */
+void schedule_init(t_schedule *sched, const char *name, int interval);
+
+/** @brief Works out when a task runs next, once it ran */
+void schedule_done(t_schedule *sched, int interval, int ok);
+
+/** @brief Sleeps until a given time */
+void schedule_sleep_until(time_t when);
+
+/** @brief Sleeps until a task is due */
+void schedule_wait(const t_schedule *sched);
+
+#endif /* _SCHEDULE_H_ */
@@ -0,0 +1,452 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file server_health.c
+    @brief Latency, error rate and circuit breaker of each central server
+
+    Every request to a central server feeds the response time and outcome
+    of that server into moving averages. After HealthFailureThreshold
+    failures in a row the server's breaker opens and requests skip it
+    without trying to connect. A background thread probes open servers
+    with a TCP connect once HealthOpenTime seconds have passed (doubling
+    while they stay down); when a probe answers the breaker half-opens
+    and the next request is allowed to try the server, which closes the
+    breaker on success. The same thread checks servers that carried no
+    traffic for HealthProbeInterval seconds, such as the portal servers.
+
+    Of the servers whose breaker lets requests through, the one with the
+    lowest response time, penalised by its error rate, is used.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "dns_cache.h"
+#include "net_connect.h"
+#include "server_health.h"
+
+extern pthread_mutex_t config_mutex;
+
+/** Weight of a new sample in the averages, as a shift */
+#define SERVER_HEALTH_EWMA_SHIFT 2
+
+/** Milliseconds added to the score of a server per thousandth of errors */
+#define SERVER_HEALTH_ERROR_PENALTY 10
+
+/** Longest an open breaker waits before a probe, in multiples of HealthOpenTime */
+#define SERVER_HEALTH_MAX_BACKOFF 8
+
+/** Seconds between two rounds of the probe thread */
+#define SERVER_HEALTH_TICK 5
+
+/** Protects the health of every server */
+static pthread_mutex_t server_health_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * @brief Returns the health of a server, creating it on first use. Must be
+ * called with the health mutex locked.
+ */
+static t_serv_health *
+_server_health(t_serv *serv)
+{
+    if (serv->health == NULL) {
+        serv->health = safe_malloc(sizeof(t_serv_health));
+        memset(serv->health, 0, sizeof(t_serv_health));
+        serv->health->state = SERV_CLOSED;
+    }
+    return serv->health;
+}
+
+/** @internal
+ * @brief Moves an EWMA one step towards a new sample
+ */
+static unsigned long
+_server_health_ewma(unsigned long average, unsigned long sample)
+{
+    if (sample > average)
+        return average + ((sample - average) >> SERVER_HEALTH_EWMA_SHIFT);
+    else
+        return average - ((average - sample) >> SERVER_HEALTH_EWMA_SHIFT);
+}
+
+/** @internal
+ * @brief Seconds an open breaker waits before its server is probed
+ */
+static time_t
+_server_health_cooldown(const t_serv_health *health)
+{
+    time_t cooldown = config_get_config()->health_open_time;
+    int i;
+
+    for (i = 1; i < health->opens && cooldown < config_get_config()->health_open_time * SERVER_HEALTH_MAX_BACKOFF; i++)
+        cooldown *= 2;
+    return cooldown;
+}
+
+/** @internal
+ * @brief Tells whether requests may use a server. Must be called with the
+ * health mutex locked.
+ */
+static int
+_server_health_usable(const t_serv_health *health)
+{
+    return health->state == SERV_CLOSED || (health->state == SERV_HALF_OPEN && !health->trial);
+}
+
+/** @internal
+ * @brief Lower is better. Must be called with the health mutex locked.
+ */
+static unsigned long
+_server_health_score(const t_serv_health *health)
+{
+    return health->latency_ms + health->error_rate * SERVER_HEALTH_ERROR_PENALTY;
+}
+
+/** Records a successful request to a server
+ * @param serv The server
+ * @param latency_ms How long the request took
+ */
+void
+server_health_success(t_serv *serv, unsigned long latency_ms)
+{
+    t_serv_health *health;
+
+    pthread_mutex_lock(&server_health_mutex);
+    health = _server_health(serv);
+    health->latency_ms = health->successes + health->errors == 0 ?
+        latency_ms : _server_health_ewma(health->latency_ms, latency_ms);
+    health->error_rate = _server_health_ewma(health->error_rate, 0);
+    health->failures = 0;
+    health->successes++;
+    health->last_sample = time(NULL);
+    if (health->state != SERV_CLOSED) {
+        debug(LOG_NOTICE, "Server %s is back up", serv->serv_hostname);
+        health->state = SERV_CLOSED;
+        health->opens = 0;
+        health->trial = 0;
+    }
+    pthread_mutex_unlock(&server_health_mutex);
+}
+
+/** Records a failed request to a server. The breaker opens after
+ * HealthFailureThreshold failures in a row, or at once if the server was
+ * on trial.
+ * @param serv The server
+ */
+void
+server_health_failure(t_serv *serv)
+{
+    s_config *config = config_get_config();
+    t_serv_health *health;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&server_health_mutex);
+    health = _server_health(serv);
+    health->error_rate = _server_health_ewma(health->error_rate, 1000);
+    health->failures++;
+    health->errors++;
+    health->last_sample = now;
+
+    if (health->state == SERV_HALF_OPEN ||
+            (health->state == SERV_CLOSED && config->health_failure_threshold > 0 &&
+             health->failures >= config->health_failure_threshold)) {
+        health->state = SERV_OPEN;
+        health->opens++;
+        health->trial = 0;
+        health->opened_at = now;
+        debug(LOG_WARNING, "Server %s is down after %d failure(s), skipping it for %ld seconds",
+                serv->serv_hostname, health->failures, (long)_server_health_cooldown(health));
+    } else if (health->state == SERV_OPEN) {
+        /* A failed probe */
+        health->opens++;
+        health->opened_at = now;
+    }
+    pthread_mutex_unlock(&server_health_mutex);
+}
+
+/** @internal
+ * @brief Finds the best usable server of a list. Must be called with the
+ * health mutex locked.
+ * @param trial Whether a recovering server picked will carry the request
+ * that decides if it is back up
+ */
+static t_serv *
+_server_health_best(t_serv *list, int trial)
+{
+    t_serv *serv, *best = NULL;
+    t_serv_health *health;
+    unsigned long score, best_score = 0;
+
+    for (serv = list; serv != NULL; serv = serv->next) {
+        health = _server_health(serv);
+        if (!_server_health_usable(health))
+            continue;
+        score = _server_health_score(health);
+        /* Ties keep the order of the list */
+        if (best == NULL || score < best_score) {
+            best = serv;
+            best_score = score;
+        }
+    }
+
+    if (trial && best != NULL && best->health->state == SERV_HALF_OPEN)
+        best->health->trial = 1;
+
+    return best;
+}
+
+/** Moves the best usable server of a list to its head, so that the
+ * get_*_server() functions return it. Must be called with the config
+ * locked.
+ * @param list The list of servers
+ * @return The server, or NULL if every server is down
+ */
+t_serv *
+server_health_select(t_serv **list)
+{
+    t_serv *best, *prev;
+
+    pthread_mutex_lock(&server_health_mutex);
+    best = _server_health_best(*list, 1);
+    pthread_mutex_unlock(&server_health_mutex);
+
+    if (best != NULL && best != *list) {
+        for (prev = *list; prev->next != best; prev = prev->next)
+            ;
+        prev->next = best->next;
+        best->next = *list;
+        *list = best;
+    }
+
+    return best;
+}
+
+/** Returns the best usable server of a list, or the head of the list if
+ * every server is down
+ * @param list The list of servers
+ * @return The server
+ */
+t_serv *
+server_health_best(t_serv *list)
+{
+    t_serv *best;
+
+    pthread_mutex_lock(&server_health_mutex);
+    best = _server_health_best(list, 0);
+    pthread_mutex_unlock(&server_health_mutex);
+
+    return (best != NULL) ? best : list;
+}
+
+/** Copies the health of a server
+ * @param serv The server
+ * @param health Receives the health
+ */
+void
+server_health_get(t_serv *serv, t_serv_health *health)
+{
+    pthread_mutex_lock(&server_health_mutex);
+    *health = *_server_health(serv);
+    pthread_mutex_unlock(&server_health_mutex);
+}
+
+/** Human readable name of a breaker state
+ * @param state The state
+ * @return A static string
+ */
+const char *
+server_health_state_name(t_serv_state state)
+{
+    switch (state) {
+        case SERV_CLOSED:
+            return "up";
+        case SERV_OPEN:
+            return "down";
+        case SERV_HALF_OPEN:
+            return "recovering";
+    }
+    return "unknown";
+}
+
+/** @internal
+ * @brief Tells whether the probe thread should check a server now
+ */
+static int
+_server_health_probe_due(t_serv *serv, time_t now)
+{
+    s_config *config = config_get_config();
+    t_serv_health *health;
+    int due;
+
+    pthread_mutex_lock(&server_health_mutex);
+    health = _server_health(serv);
+    if (health->state == SERV_OPEN)
+        due = health->opened_at + _server_health_cooldown(health) <= now;
+    else if (health->state == SERV_CLOSED)
+        due = config->health_probe_interval > 0 &&
+            health->last_sample + config->health_probe_interval <= now;
+    else
+        /* Nobody took up the trial, check it ourselves */
+        due = health->last_sample + config->health_open_time <= now;
+    pthread_mutex_unlock(&server_health_mutex);
+
+    return due;
+}
+
+/** @internal
+ * @brief Port requests to a server go to, the SSL one when they go over TLS
+ * as http_client_use_tls() decides
+ */
+static int
+_server_health_port(t_serv *serv)
+{
+    return (config_get_config()->upstream_tls && serv->serv_use_ssl) ?
+        serv->serv_ssl_port : serv->serv_http_port;
+}
+
+/** @internal
+ * @brief Connects to a server with a timeout and closes the connection
+ * @return Milliseconds the connect took, or -1 if it failed
+ */
+static long
+_server_health_connect(t_serv *serv)
+{
+    struct in_addr addrs[DNS_CACHE_MAX_ADDRS];
+    struct timeval start, end;
+    int fd, naddrs, which;
+
+    if ((naddrs = dns_cache_lookup(serv->serv_hostname, addrs, DNS_CACHE_MAX_ADDRS)) == 0)
+        naddrs = dns_cache_resolve(serv->serv_hostname, addrs, DNS_CACHE_MAX_ADDRS);
+    if (naddrs <= 0)
+        return -1;
+
+    gettimeofday(&start, NULL);
+    if ((fd = net_connect(serv->serv_hostname, addrs, naddrs, _server_health_port(serv), &which)) == -1)
+        return -1;
+    gettimeofday(&end, NULL);
+    close(fd);
+
+    return (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+}
+
+/** @internal
+ * @brief Probes one server and records the outcome
+ */
+static void
+_server_health_probe(t_serv *serv)
+{
+    t_serv_health *health;
+    long ms;
+
+    debug(LOG_DEBUG, "Probing server %s:%d", serv->serv_hostname, _server_health_port(serv));
+    ms = _server_health_connect(serv);
+
+    if (ms < 0) {
+        debug(LOG_DEBUG, "Probe of server %s failed", serv->serv_hostname);
+        server_health_failure(serv);
+        return;
+    }
+
+    pthread_mutex_lock(&server_health_mutex);
+    health = _server_health(serv);
+    if (health->state == SERV_OPEN) {
+        /* Let the next request decide */
+        debug(LOG_INFO, "Server %s answers again, trying it on the next request", serv->serv_hostname);
+        health->state = SERV_HALF_OPEN;
+        health->trial = 0;
+        health->last_sample = time(NULL);
+        pthread_mutex_unlock(&server_health_mutex);
+    } else {
+        pthread_mutex_unlock(&server_health_mutex);
+        server_health_success(serv, ms);
+    }
+}
+
+/** @internal
+ * @brief Adds the servers of a list to an array
+ */
+static int
+_server_health_collect(t_serv ***servers, int count, t_serv *list)
+{
+    for (; list != NULL; list = list->next) {
+        *servers = safe_realloc(*servers, sizeof(t_serv *) * (count + 1));
+        (*servers)[count++] = list;
+    }
+    return count;
+}
+
+/** Launches a thread that probes central servers that are down, or that
+ * carried no traffic for a while
+ * @param arg NULL
+ */
+void
+thread_server_health(void *arg)
+{
+    pthread_cond_t		cond = PTHREAD_COND_INITIALIZER;
+    pthread_mutex_t		cond_mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct	timespec	timeout;
+    s_config *config = config_get_config();
+    t_serv **servers;
+    time_t now;
+    int i, count;
+
+    while (1) {
+        /* Servers are never freed, only reordered, so a snapshot is safe */
+        servers = NULL;
+        count = 0;
+        LOCK_CONFIG();
+        count = _server_health_collect(&servers, count, config->auth_servers);
+        count = _server_health_collect(&servers, count, config->portal_servers);
+        count = _server_health_collect(&servers, count, config->plat_servers);
+        count = _server_health_collect(&servers, count, config->log_servers);
+        count = _server_health_collect(&servers, count, config->update_servers);
+        UNLOCK_CONFIG();
+
+        now = time(NULL);
+        for (i = 0; i < count; i++) {
+            if (_server_health_probe_due(servers[i], now))
+                _server_health_probe(servers[i]);
+        }
+        free(servers);
+
+        timeout.tv_sec = time(NULL) + SERVER_HEALTH_TICK;
+        timeout.tv_nsec = 0;
+
+        pthread_mutex_lock(&cond_mutex);
+        pthread_cond_timedwait(&cond, &cond_mutex, &timeout);
+        pthread_mutex_unlock(&cond_mutex);
+    }
+}
@@ -0,0 +1,75 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file server_health.h
+    @brief Latency, error rate and circuit breaker of each central server
+*/
+
+#ifndef _SERVER_HEALTH_H_
+#define _SERVER_HEALTH_H_
+
+#include "conf.h"
+
+/** Circuit breaker states */
+typedef enum {
+    SERV_CLOSED,		/**< Requests go through */
+    SERV_OPEN,			/**< Server is down, requests skip it */
+    SERV_HALF_OPEN		/**< A probe answered, one request may try it */
+} t_serv_state;
+
+/**
+ * @brief Health of one central server
+ */
+typedef struct _t_serv_health {
+    t_serv_state state;		/**< @brief Circuit breaker state */
+    unsigned long latency_ms;	/**< @brief Response time (EWMA) */
+    unsigned int error_rate;	/**< @brief Failed requests per thousand (EWMA) */
+    int failures;		/**< @brief Failures in a row */
+    int opens;			/**< @brief Times opened in a row, for backoff */
+    int trial;			/**< @brief A half-open trial is in progress */
+    time_t opened_at;		/**< @brief When the breaker last opened */
+    time_t last_sample;		/**< @brief Last request or probe */
+    unsigned long successes;	/**< @brief Successful requests */
+    unsigned long errors;	/**< @brief Failed requests */
+} t_serv_health;
+
+/** @brief Records a successful request and how long it took */
+void server_health_success(t_serv *serv, unsigned long latency_ms);
+
+/** @brief Records a failed request */
+void server_health_failure(t_serv *serv);
+
+/** @brief Moves the best usable server of a list to its head */
+t_serv *server_health_select(t_serv **list);
+
+/** @brief Returns the best usable server of a list without reordering it */
+t_serv *server_health_best(t_serv *list);
+
+/** @brief Copies the health of a server */
+void server_health_get(t_serv *serv, t_serv_health *health);
+
+/** @brief Human readable name of a breaker state */
+const char *server_health_state_name(t_serv_state state);
+
+/** @brief Thread probing servers that are down or idle */
+void thread_server_health(void *arg);
+
+#endif /* _SERVER_HEALTH_H_ */
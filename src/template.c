@@ -0,0 +1,267 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file template.c
+    @brief Cached HTML message page
+
+    The message file is read and split into text and $variable segments
+    once, then sent with a single writev() per page. It is read again
+    when its modification time, size or inode change, checked at most
+    once a second. Pages being sent hold a reference, so a reload never
+    frees a page under them.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "httpd.h"
+
+#include "safe.h"
+#include "debug.h"
+#include "template.h"
+
+/** Names of the page variables, indexed by TEMPLATE_* */
+static const char *template_names[TEMPLATE_VARS] = { "title", "message", "nodeID" };
+
+/** The page last read */
+static t_template *cached = NULL;
+
+/** When the message file was last checked for changes */
+static time_t checked = 0;
+
+static pthread_mutex_t template_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * @brief Frees a page
+ */
+static void
+_template_free(t_template *page)
+{
+    int i;
+
+    for (i = 0; i < page->count; i++)
+        free(page->segments[i].name);
+    free(page->segments);
+    free(page->data);
+    free(page->path);
+    free(page);
+}
+
+/** @internal
+ * @brief Appends a segment to a page
+ */
+static void
+_template_add(t_template *page, int *size, const char *text, size_t len, int var)
+{
+    t_template_segment *seg;
+
+    if (len == 0)
+        return;
+    if (page->count == *size) {
+        *size = *size ? *size * 2 : 16;
+        page->segments = safe_realloc(page->segments, *size * sizeof(t_template_segment));
+    }
+    seg = &page->segments[page->count++];
+    seg->text = text;
+    seg->len = len;
+    seg->var = var;
+    seg->name = NULL;
+    if (var == TEMPLATE_VARS) {
+        /* Past the $ */
+        seg->name = safe_malloc(len);
+        memcpy(seg->name, text + 1, len - 1);
+        seg->name[len - 1] = 0;
+    }
+}
+
+/** @internal
+ * @brief Reads a message file and splits it the way httpdOutput() reads
+ * variables: a $ followed by up to TEMPLATE_NAME_MAX letters, digits or
+ * underscores
+ */
+static t_template *
+_template_load(const char *path)
+{
+    t_template *page;
+    struct stat st;
+    const char *p, *q, *text, *end;
+    ssize_t got, total = 0;
+    int fd, size = 0, var;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        debug(LOG_CRIT, "Failed to open HTML message file %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1) {
+        debug(LOG_CRIT, "Failed to stat HTML message file: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    page = safe_malloc(sizeof(t_template));
+    memset(page, 0, sizeof(t_template));
+    page->path = safe_strdup(path);
+    page->mtime = st.st_mtime;
+    page->size = st.st_size;
+    page->ino = st.st_ino;
+    page->refs = 1;
+    page->data = safe_malloc(st.st_size + 1);
+    while (total < st.st_size) {
+        got = read(fd, page->data + total, st.st_size - total);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got == -1) {
+            debug(LOG_CRIT, "Failed to read HTML message file: %s", strerror(errno));
+            close(fd);
+            _template_free(page);
+            return NULL;
+        }
+        if (got == 0)
+            break;
+        total += got;
+    }
+    close(fd);
+    page->data[total] = 0;
+
+    text = p = page->data;
+    end = page->data + total;
+    while ((p = memchr(p, '$', end - p)) != NULL) {
+        for (q = p + 1; q < end && q - p - 1 < TEMPLATE_NAME_MAX && (isalnum((unsigned char)*q) || *q == '_'); q++)
+            ;
+        if (q == p + 1) {
+            /* A lone $ stays in the text */
+            p++;
+            continue;
+        }
+        for (var = 0; var < TEMPLATE_VARS; var++) {
+            if (strlen(template_names[var]) == (size_t)(q - p - 1) &&
+                    strncmp(template_names[var], p + 1, q - p - 1) == 0)
+                break;
+        }
+        _template_add(page, &size, text, p - text, -1);
+        _template_add(page, &size, p, q - p, var);
+        text = p = q;
+    }
+    _template_add(page, &size, text, end - text, -1);
+
+    debug(LOG_DEBUG, "Read HTML message file %s: %d segments", path, page->count);
+    return page;
+}
+
+/** Returns the page read from a message file, reading it again if it
+ * changed since
+ * @param path The message file
+ * @return The page, to give back with template_release(), or NULL if the
+ * file could never be read
+ */
+t_template *
+template_get(const char *path)
+{
+    t_template *page;
+    struct stat st;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&template_mutex);
+    if (cached == NULL || now != checked || strcmp(cached->path, path) != 0) {
+        checked = now;
+        if (cached != NULL && strcmp(cached->path, path) == 0 && stat(path, &st) == 0 &&
+                st.st_mtime == cached->mtime && st.st_size == cached->size && st.st_ino == cached->ino) {
+            /* Unchanged */
+        }
+        else if ((page = _template_load(path)) != NULL) {
+            if (cached != NULL) {
+                debug(LOG_INFO, "HTML message file %s changed, read it again", path);
+                if (--cached->refs == 0)
+                    _template_free(cached);
+            }
+            cached = page;
+        }
+        /* Otherwise keep sending the page read before */
+    }
+    page = cached;
+    if (page != NULL)
+        page->refs++;
+    pthread_mutex_unlock(&template_mutex);
+
+    return page;
+}
+
+/** Gives back a page returned by template_get(), freeing it if the
+ * file was read again meanwhile
+ * @param page The page
+ */
+void
+template_release(t_template *page)
+{
+    pthread_mutex_lock(&template_mutex);
+    if (--page->refs == 0)
+        _template_free(page);
+    pthread_mutex_unlock(&template_mutex);
+}
+
+/** Sends a page. A $variable that is not one of the page variables is
+ * taken from the request, and one that is nowhere is sent as written,
+ * as httpdOutput() did.
+ * @param r The request
+ * @param page The page
+ * @param values Values of the page variables, indexed by TEMPLATE_*
+ */
+void
+template_render(request *r, const t_template *page, const char *values[TEMPLATE_VARS])
+{
+    const t_template_segment *seg;
+    struct iovec *iov;
+    httpVar *var;
+    int i;
+
+    iov = safe_malloc((page->count + 1) * sizeof(struct iovec));
+    for (i = 0; i < page->count; i++) {
+        seg = &page->segments[i];
+        iov[i].iov_base = (void *)seg->text;
+        iov[i].iov_len = seg->len;
+        if (seg->var < 0)
+            continue;
+        if (seg->var < TEMPLATE_VARS) {
+            if (values[seg->var] != NULL) {
+                iov[i].iov_base = (void *)values[seg->var];
+                iov[i].iov_len = strlen(values[seg->var]);
+            }
+        }
+        else if ((var = httpdGetVariableByName(r, seg->name)) != NULL) {
+            iov[i].iov_base = var->value;
+            iov[i].iov_len = strlen(var->value);
+        }
+    }
+    httpdOutputVector(r, iov, page->count);
+    free(iov);
+}
@@ -0,0 +1,78 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file template.h
+    @brief Cached HTML message page
+*/
+
+#ifndef _TEMPLATE_H_
+#define _TEMPLATE_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "httpd.h"
+
+/** Variables of the message page, set by send_http_page() */
+#define TEMPLATE_TITLE		0
+#define TEMPLATE_MESSAGE	1
+#define TEMPLATE_NODEID		2
+#define TEMPLATE_VARS		3
+
+/** Longest variable name, as in httpdOutput() */
+#define TEMPLATE_NAME_MAX	80
+
+/**
+ * @brief Part of a page, either text or a $variable
+ */
+typedef struct _t_template_segment {
+    const char *text;		/**< @brief Text, or the $name as written */
+    size_t len;			/**< @brief Length of text */
+    int var;			/**< @brief TEMPLATE_* for a page variable, -1
+				     for text, TEMPLATE_VARS for any other
+				     $name, looked up in the request */
+    char *name;			/**< @brief Name of any other variable */
+} t_template_segment;
+
+/**
+ * @brief A message file split into segments
+ */
+typedef struct _t_template {
+    char *path;			/**< @brief File it was read from */
+    char *data;			/**< @brief Its content, the segments point in it */
+    t_template_segment *segments;
+    int count;			/**< @brief Number of segments */
+    time_t mtime;		/**< @brief To notice the file changed */
+    off_t size;
+    ino_t ino;
+    int refs;			/**< @brief The cache and each page being sent */
+} t_template;
+
+/** @brief Returns the page read from a file, read again once it changes */
+t_template *template_get(const char *path);
+
+/** @brief Gives back a page returned by template_get() */
+void template_release(t_template *page);
+
+/** @brief Sends a page with the values of its variables */
+void template_render(request *r, const t_template *page, const char *values[TEMPLATE_VARS]);
+
+#endif /* _TEMPLATE_H_ */
@@ -0,0 +1,368 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file tls.c
+    @brief TLS connections to the central servers
+
+    One TLS context is set up at start-up and shared by every connection,
+    so the certificates are only read once. Each server's most recent
+    session is kept, by host name, and offered on the next connection so
+    the server can resume it with an abbreviated handshake.
+
+    SSLv2 and SSLv3 are refused. The server certificate, and that it was
+    issued to the host name or address connected to, are checked when
+    TlsCaFile is set, and TlsCertFile is presented to servers that ask
+    for a client certificate.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "tls.h"
+
+/** @internal
+ * The last session agreed with a server
+ */
+typedef struct _t_tls_session {
+    struct _t_tls_session *next;
+    char *hostname;
+    SSL_SESSION *session;
+} t_tls_session;
+
+static SSL_CTX *tls_ctx = NULL;
+static t_tls_session *tls_sessions = NULL;
+
+static unsigned long handshakes = 0;
+static unsigned long resumed = 0;
+static unsigned long failures = 0;
+
+static pthread_mutex_t tls_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/** Locks OpenSSL needs to be used from several threads */
+static pthread_mutex_t *tls_locks = NULL;
+
+/** @internal
+ * @brief Locking callback for OpenSSL
+ */
+static void
+_tls_locking(int mode, int n, const char *file, int line)
+{
+    if (mode & CRYPTO_LOCK)
+        pthread_mutex_lock(&tls_locks[n]);
+    else
+        pthread_mutex_unlock(&tls_locks[n]);
+}
+
+/** @internal
+ * @brief Thread id callback for OpenSSL
+ */
+static unsigned long
+_tls_thread_id(void)
+{
+    return (unsigned long)pthread_self();
+}
+#endif
+
+/** @internal
+ * @brief Finds the session entry of a server, must be called with the
+ * TLS mutex locked
+ */
+static t_tls_session *
+_tls_find(const char *hostname)
+{
+    t_tls_session *entry;
+
+    for (entry = tls_sessions; entry != NULL; entry = entry->next) {
+        if (strcasecmp(entry->hostname, hostname) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+/** @internal
+ * @brief Called by OpenSSL when a server hands out a session, which may
+ * be after the handshake with TLS 1.3
+ * @return 1, the session is kept
+ */
+static int
+_tls_new_session(SSL *ssl, SSL_SESSION *session)
+{
+    const char *hostname = SSL_get_app_data(ssl);
+    t_tls_session *entry;
+
+    if (hostname == NULL)
+        return 0;
+
+    pthread_mutex_lock(&tls_mutex);
+    if ((entry = _tls_find(hostname)) == NULL) {
+        entry = safe_malloc(sizeof(t_tls_session));
+        entry->hostname = safe_strdup(hostname);
+        entry->session = NULL;
+        entry->next = tls_sessions;
+        tls_sessions = entry;
+    }
+    if (entry->session != NULL)
+        SSL_SESSION_free(entry->session);
+    entry->session = session;
+    pthread_mutex_unlock(&tls_mutex);
+
+    return 1;
+}
+
+/** @internal
+ * @brief Logs the OpenSSL error queue
+ */
+static void
+_tls_log_errors(const char *what)
+{
+    unsigned long err;
+    char buf[256];
+
+    while ((err = ERR_get_error()) != 0) {
+        ERR_error_string_n(err, buf, sizeof(buf));
+        debug(LOG_ERR, "%s: %s", what, buf);
+    }
+}
+
+/** Sets up the shared TLS context, once at start-up before any thread
+ * talks to a central server.
+ * @return 0 on success, -1 if TLS cannot be used
+ */
+int
+tls_init(void)
+{
+    s_config *config = config_get_config();
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    int i;
+#endif
+
+    SSL_library_init();
+    SSL_load_error_strings();
+    OpenSSL_add_all_algorithms();
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    tls_locks = safe_malloc(sizeof(pthread_mutex_t) * CRYPTO_num_locks());
+    for (i = 0; i < CRYPTO_num_locks(); i++)
+        pthread_mutex_init(&tls_locks[i], NULL);
+    CRYPTO_set_id_callback(_tls_thread_id);
+    CRYPTO_set_locking_callback(_tls_locking);
+#endif
+
+    if ((tls_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) {
+        _tls_log_errors("Could not create TLS context");
+        return -1;
+    }
+    SSL_CTX_set_options(tls_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION);
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls_ctx, _tls_new_session);
+
+    if (config->tls_ca_file != NULL) {
+        if (SSL_CTX_load_verify_locations(tls_ctx, config->tls_ca_file, NULL) != 1) {
+            _tls_log_errors("Could not load TlsCaFile");
+            goto error;
+        }
+        SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+    }
+
+    if (config->tls_cert_file != NULL) {
+        /* The key may be in the same file as the certificate */
+        if (SSL_CTX_use_certificate_chain_file(tls_ctx, config->tls_cert_file) != 1 ||
+                SSL_CTX_use_PrivateKey_file(tls_ctx, config->tls_cert_file, SSL_FILETYPE_PEM) != 1 ||
+                SSL_CTX_check_private_key(tls_ctx) != 1) {
+            _tls_log_errors("Could not load TlsCertFile");
+            goto error;
+        }
+    }
+
+    debug(LOG_INFO, "TLS context ready");
+    return 0;
+
+error:
+    SSL_CTX_free(tls_ctx);
+    tls_ctx = NULL;
+    return -1;
+}
+
+/** @internal
+ * @brief Makes the handshake check that the certificate was issued for
+ * the server. A chain that verifies is not enough on its own: with a CA
+ * bundle any publicly issued certificate would pass.
+ * @return 1 on success
+ */
+static int
+_tls_check_name(SSL *ssl, const char *hostname)
+{
+    X509_VERIFY_PARAM *param = SSL_get0_param(ssl);
+
+    X509_VERIFY_PARAM_set_hostflags(param, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
+    /* A server given by address must have that address in its certificate */
+    if (X509_VERIFY_PARAM_set1_ip_asc(param, hostname) == 1)
+        return 1;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    return SSL_set1_host(ssl, hostname);
+#else
+    return X509_VERIFY_PARAM_set1_host(param, hostname, 0);
+#endif
+}
+
+/** Starts TLS on a connected socket, resuming the last session with the
+ * server when it allows it.
+ * @param fd Connected socket
+ * @param hostname Name of the server, sent with SNI and used to find its
+ * session
+ * @return The TLS connection, to be ended with tls_close(), or NULL
+ */
+SSL *
+tls_connect(int fd, const char *hostname)
+{
+    t_tls_session *entry;
+    SSL *ssl;
+    int reused;
+
+    if (tls_ctx == NULL) {
+        debug(LOG_ERR, "No TLS context, cannot connect securely to %s", hostname);
+        return NULL;
+    }
+
+    if ((ssl = SSL_new(tls_ctx)) == NULL) {
+        _tls_log_errors("Could not create TLS connection");
+        return NULL;
+    }
+    SSL_set_fd(ssl, fd);
+    SSL_set_app_data(ssl, safe_strdup(hostname));
+    SSL_set_tlsext_host_name(ssl, hostname);
+    if (config_get_config()->tls_ca_file != NULL && _tls_check_name(ssl, hostname) != 1) {
+        _tls_log_errors("Could not set the name to check the certificate against");
+        free(SSL_get_app_data(ssl));
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&tls_mutex);
+    if ((entry = _tls_find(hostname)) != NULL && entry->session != NULL)
+        SSL_set_session(ssl, entry->session);
+    pthread_mutex_unlock(&tls_mutex);
+
+    if (SSL_connect(ssl) != 1) {
+        _tls_log_errors("TLS handshake failed");
+        debug(LOG_ERR, "TLS handshake with %s failed", hostname);
+        pthread_mutex_lock(&tls_mutex);
+        failures++;
+        pthread_mutex_unlock(&tls_mutex);
+        free(SSL_get_app_data(ssl));
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    reused = SSL_session_reused(ssl);
+    pthread_mutex_lock(&tls_mutex);
+    handshakes++;
+    if (reused)
+        resumed++;
+    pthread_mutex_unlock(&tls_mutex);
+
+    debug(LOG_DEBUG, "TLS %s with %s", reused ? "session resumed" : "full handshake", hostname);
+    return ssl;
+}
+
+/** Writes a whole buffer over TLS
+ * @return 0 on success, -1 on error
+ */
+int
+tls_write(SSL *ssl, const char *buf, size_t len)
+{
+    int written;
+
+    while (len > 0) {
+        if ((written = SSL_write(ssl, buf, len)) <= 0) {
+            _tls_log_errors("TLS write failed");
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/** Reads over TLS like read(2). A server closing without a TLS shutdown
+ * ends the data too, as plain HTTP servers often do.
+ * @param conn The SSL connection
+ */
+ssize_t
+tls_read(void *conn, char *buf, size_t len)
+{
+    SSL *ssl = conn;
+    int numbytes;
+
+    errno = 0;
+    if ((numbytes = SSL_read(ssl, buf, len)) > 0)
+        return numbytes;
+
+    switch (SSL_get_error(ssl, numbytes)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0)
+                return 0;
+            return -1;
+        default:
+            _tls_log_errors("TLS read failed");
+            if (errno == 0)
+                errno = EIO;
+            return -1;
+    }
+}
+
+/** Ends TLS on a connection and frees it, the socket is left open
+ */
+void
+tls_close(SSL *ssl)
+{
+    SSL_shutdown(ssl);
+    free(SSL_get_app_data(ssl));
+    SSL_free(ssl);
+}
+
+/** Reads the TLS counters
+ * @param stats Receives the counters
+ */
+void
+tls_get_stats(t_tls_stats *stats)
+{
+    pthread_mutex_lock(&tls_mutex);
+    stats->handshakes = handshakes;
+    stats->resumed = resumed;
+    stats->failures = failures;
+    pthread_mutex_unlock(&tls_mutex);
+}
@@ -0,0 +1,59 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file tls.h
+    @brief TLS connections to the central servers
+*/
+
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+/**
+ * @brief Counters shown in the status page
+ */
+typedef struct _t_tls_stats {
+    unsigned long handshakes;	/**< @brief Handshakes completed */
+    unsigned long resumed;	/**< @brief Of which abbreviated ones */
+    unsigned long failures;	/**< @brief Handshakes that failed */
+} t_tls_stats;
+
+/** @brief Sets up the shared TLS context, once at start-up */
+int tls_init(void);
+
+/** @brief Starts TLS on a connected socket */
+SSL *tls_connect(int fd, const char *hostname);
+
+/** @brief Writes a whole buffer over TLS */
+int tls_write(SSL *ssl, const char *buf, size_t len);
+
+/** @brief Reads over TLS like read(2), see http_client_read_response_with() */
+ssize_t tls_read(void *conn, char *buf, size_t len);
+
+/** @brief Ends TLS on a connection, the socket is left open */
+void tls_close(SSL *ssl);
+
+/** @brief Reads the TLS counters */
+void tls_get_stats(t_tls_stats *stats);
+
+#endif /* _TLS_H_ */
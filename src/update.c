@@ -46,8 +46,10 @@
 #include "debug.h"
 #include "util.h"
 #include "centralserver.h"
+#include "http_client.h"
 #include "fetchcmd.h"
 #include "update.h"
+#include "schedule.h"
 
 void
 thread_update(void *arg)
@@ -72,7 +74,7 @@ thread_update(void *arg)
 		rand_time = random_delay_time();
 		debug(LOG_DEBUG, "Update procedure will execute after random delay time %d seconds", rand_time);
 #if DEBUG == 0
-		sleep(rand_time);
+		schedule_sleep_until(time(NULL) + rand_time);
 #endif
 		if (update()) {
 			debug(LOG_DEBUG, "Update failed");
@@ -93,9 +95,6 @@ thread_update(void *arg)
 int
 delay_to_next_day()
 {
-	pthread_cond_t		cond = PTHREAD_COND_INITIALIZER;
-	pthread_mutex_t		cond_mutex = PTHREAD_MUTEX_INITIALIZER;
-	struct	timespec	time_to_update;
 	time_t				timep;
 	struct tm			*p_tm;
 	int					current_hour, interval_hour;
@@ -106,45 +105,18 @@ delay_to_next_day()
 	/* Calculate hours need to sleep */
 	interval_hour = (26 - current_hour) % 24;
 	/* Convert hours to seconds */
-	time_to_update.tv_sec = time(NULL) + interval_hour * 3600;
-	time_to_update.tv_nsec = 0;
-
-	/* Mutex must be locked for pthread_cond_timedwait... */
-	pthread_mutex_lock(&cond_mutex);
-
-	/* Thread safe "sleep" */
-	pthread_cond_timedwait(&cond, &cond_mutex, &time_to_update);
-
-	/* No longer needs to be locked */
-	pthread_mutex_unlock(&cond_mutex);
+	schedule_sleep_until(time(NULL) + interval_hour * 3600);
 
 	return 0;
 }
 
-/* Delay sending request for a random time
- * Using random function regarding the last 2 characters of MAC address as seed */
+/* Delay sending request for a time that differs between gateways
+ * Derived from a hash of the whole MAC address, see schedule.c */
 unsigned int
 random_delay_time()
 {
-	unsigned int	delay_time = 0;
-	unsigned int	seed = 0;
-	
-	s_config		*config = config_get_config();
-	char			*mac = config->gw_mac;
-	/* Point to last 2 characters */
-	char			*sub_mac = mac + strlen(config->gw_mac) - 2;
-	int				ctoi_1 = *sub_mac;
-	int				ctoi_2 = *(sub_mac + 1);
-	char			str_seed[10];
-	/* Convert characters to integers */
-	sprintf(str_seed, "%d%d", ctoi_1, ctoi_2);
-	
-	seed = atoi(str_seed);
-	srand(seed);
-	/* Random delay time is in the range of 0 - 3600 seconds (a hour) */
-	delay_time = rand() % 3600;
-
-	return delay_time;
+	/* Delay time is in the range of 0 - 3600 seconds (a hour) */
+	return schedule_device_hash("update") % 3600;
 }
 
 /* Check the current time or current time with delay time
@@ -177,8 +149,8 @@ in_update_time_period(unsigned int delay_time)
 int
 update(void)
 {
-	int				sockfd;
-	char			request[MAX_BUF], response[MAX_BUF];
+	char			request[MAX_BUF];
+	t_http_response	response;
 	t_serv			*update_server = get_update_server();
 	s_config		*config = config_get_config();
 	unsigned int	delay_time = DELAY_TIME;
@@ -187,7 +159,7 @@ update(void)
 	char			*update_supplier_read = update_supplier_Read();
 	char			*update_postcode_read = update_postcode_Read();
 	int				is_update_url = 0;
-	char			*update_url;
+	char			*update_url = NULL;
 	char			update_ver[VER_LENGTH];
 	memset(update_ver, 0, VER_LENGTH);
 
@@ -224,32 +196,31 @@ update(void)
 	debug(LOG_DEBUG, "HTTP Request to Server: [%s]", request);
 
 	do {
-		/* XXX Function conncet() should re-execute after finishing read()?
-		 * it sounds like unreasonale and ridiculous! */
-		if ((sockfd = connect_update_server()) == -1) {
+		if (http_client_request(HTTP_SERVER_UPDATE, request, &response) == -1) {
 			return -1;
 		}
-
-		send_request(sockfd, &request, &response);
 		
 		/* XXX The premiss is that the url for update file is in the end of the response,
 		 * if not, need to find the update url ended by the suffix ".bin" */
-		if (strstr(response, ".bin") == NULL) {
+		if (strstr(response.body, ".bin") == NULL) {
+			http_response_free(&response);
 			times++;
 			if (in_update_time_period(delay_time) == 0) {
 #if DEBUG == 0
 				/* Sleep for a while then try to send request again */
 				sleep(delay_time);
 #endif
-				close(sockfd);
 				continue;
 			} else {
-				close(sockfd);
 				return -1;
 			}
 		} else {
 			is_update_url = 1;
-			close(sockfd);
+			if ((update_url = strstr(response.body, "http://apupgrade.51awifi.com/upload"))) {
+				update_url = safe_strdup(update_url);
+				update_url[strcspn(update_url, " \t\r\n\"")] = '\0';
+			}
+			http_response_free(&response);
 			break;
 		}
 	} while (times < 3);
@@ -262,11 +233,11 @@ update(void)
 	}
 
 	/* The correct URL returned is a download address for update file suffixed with ".bin" */
-	if (is_update_url) {
-		update_url = strstr(response, "http://apupgrade.51awifi.com/upload");
+	if (is_update_url && update_url != NULL) {
 		debug(LOG_DEBUG, "Update url is: %s", update_url);
 		if (retrieve_update_file(update_url)) {
 			debug(LOG_DEBUG, "Retrieving update file failed");
+			free(update_url);
 			return -1;
 		}
 	} else {
@@ -276,15 +247,18 @@ update(void)
 
 	if (check_network_traffic()) {
 		debug(LOG_DEBUG, "Network traffic rate is too high for update procedure");
+		free(update_url);
 		return -1;
 	}
 
 	if (do_update()) {
 		debug(LOG_DEBUG, "Update command failed");
+		free(update_url);
 		return -1;
 	}
 
 	get_update_ver(update_url, &update_ver);
+	free(update_url);
 	if (strlen(update_ver) == 0) {
 		debug(LOG_DEBUG, "Getting update version failed");
 		return -1;
@@ -297,80 +271,64 @@ update(void)
 	return 0;
 }
 
-int
-send_request(int sockfd, char *request, char *response)
+/* Writes a piece of the update file as it is downloaded */
+static int
+write_update_file(const char *data, size_t len, void *arg)
 {
-	ssize_t		numbytes = 0;
-	size_t		totalbytes = 0;
-	int			nfds, done = 0;
-	fd_set		readfds;
-
-	send(sockfd, request, strlen(request), 0);
-	debug(LOG_DEBUG, "Reading response");
-
-	do {
-		FD_ZERO(&readfds);
-		FD_SET(sockfd, &readfds);
-
-		nfds = sockfd + 1;
-		nfds = select(nfds, &readfds, NULL, NULL, NULL);
-
-		if (nfds > 0) {
-			numbytes = read(sockfd, response + totalbytes, MAX_BUF - (totalbytes + 1));
-			if (numbytes < 0) {
-				debug(LOG_ERR, "An error occurred while reading from update server: %s", strerror(errno));
-				return -1;
-			}
-			else if (numbytes == 0) {
-				done = 1;
-			}
-			else {
-				totalbytes += numbytes;
-				debug(LOG_DEBUG, "Read %d bytes, total now %d", numbytes, totalbytes);
-			}
-		}
-		else if (nfds == 0) {
-			debug(LOG_ERR, "Timed out reading data via select() from update server");
-			return -1;
-		}
-		else if (nfds < 0) {
-			debug(LOG_ERR, "Error reading data via select() from update server: %s", strerror(errno));
-			return -1;
-		}
-	} while (!done);
-
-	debug(LOG_DEBUG, "Done reading reply, total %d bytes", totalbytes);
-	response[totalbytes] = '\0';
-
-	return totalbytes;
+	return (fwrite(data, 1, len, (FILE *)arg) == len) ? 0 : -1;
 }
 
-/* Retrieve update file from update server */
+/* Retrieve update file from update server
+ * The file is streamed to UPDATE_FILE over the update server connection,
+ * so a url naming another host or port is refused */
 int
 retrieve_update_file(char *request)
 {
-	char cmd[MAX_BUF];
-	char rm_cmd[MAX_BUF];
-	sprintf(rm_cmd, "rm %s", UPDATE_FILE);
-	if(access(UPDATE_FILE, F_OK) == 0)
-	{
-		if (execute(rm_cmd, 0) == 0) {
-			debug(LOG_DEBUG, "rm update file command successfully: %s", rm_cmd);
-		}
-		else
-		{
-			debug(LOG_DEBUG, "rm update file command no: ");
-		}
+	char			buf[MAX_BUF];
+	const char		*host, *path;
+	t_http_response	response;
+	t_serv			*update_server = get_update_server();
+	FILE			*fh;
+	int				rc;
+
+	if ((path = http_client_url_path(HTTP_SERVER_UPDATE, request)) == NULL) {
+		debug(LOG_WARNING, "Update file url %s is not on the update server %s:%d, not fetching it",
+				request, update_server->serv_hostname, update_server->serv_http_port);
+		return -1;
 	}
+	host = strstr(request, "://") + 3;
 
-	sprintf(cmd, "wget -c -O %s %s", UPDATE_FILE, request);
+	snprintf(buf, sizeof(buf) - 1,
+			"GET %s HTTP/1.1\r\n"
+			"User-Agent: SmartWiFi 1.1 \r\n"
+			"Host: %.*s\r\n"
+			"\r\n",
+			path,
+			(int)(path - host), host);
 
-	if (execute(cmd, 0)) {
-		debug(LOG_DEBUG, "Retrieving update file command failed: %s", cmd);
+	if ((fh = fopen(UPDATE_FILE, "w")) == NULL) {
+		debug(LOG_DEBUG, "Could not create update file %s: %s", UPDATE_FILE, strerror(errno));
+		return -1;
+	}
+
+	rc = http_client_request_stream(HTTP_SERVER_UPDATE, buf, &response, write_update_file, fh);
+	if (rc == 0) {
+		if (response.status != 200) {
+			debug(LOG_DEBUG, "Update server answered %d for %s", response.status, request);
+			rc = -1;
+		}
+		http_response_free(&response);
+	}
+	if (fclose(fh) == EOF)
+		rc = -1;
+
+	if (rc == -1) {
+		debug(LOG_DEBUG, "Retrieving update file failed: %s", request);
+		unlink(UPDATE_FILE);
 		return -1;
 	}
 
-	debug(LOG_DEBUG, "Retrieving update file command executed successfully: [%s]", cmd);
+	debug(LOG_DEBUG, "Retrieved update file %s from %s", UPDATE_FILE, request);
 
 	return 0;
 }
@@ -44,14 +44,13 @@
 void thread_update(void *arg);
 /* Delay time until 2:00 next day */
 int delay_to_next_day();
-/* Delay sending request for a random time
- * Using random function with seed which is the last 2 character of MAC address */
+/* Delay sending request for a time that differs between gateways
+ * Derived from a hash of the whole MAC address */
 unsigned int random_delay_time();
 /* Check the current time whether in the period 2:00 - 5:00 */
 int in_update_time_period(unsigned int delay_time);
 /* Main procedure of update */
 int update(void);
-int send_request(int sockfd, char *request, char *response);
 /* Retrieve update file from update server */
 int retrieve_update_file(char *request);
 /* Check network traffic, if the rate is high, check it minutes later
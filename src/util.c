@@ -67,11 +67,16 @@
 #include "util.h"
 #include "conf.h"
 #include "debug.h"
+#include "dns_cache.h"
+#include "auth_cache.h"
+#include "auth_dispatch.h"
+#include "httpd_thread.h"
+#include "journal.h"
+#include "tls.h"
+#include "server_health.h"
 
 #include "../config.h"
 
-static pthread_mutex_t ghbn_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 /* Defined in ping_thread.c */
 extern time_t started_time;
 
@@ -369,33 +374,24 @@ execute_argv(const char *cmd_line,const char *cmd_argv, int quiet)
         return (WEXITSTATUS(status));
 }
 
+/** Resolves a host name through the DNS cache
+ * @param name Host name
+ * @return First address of the host, to be freed by the caller, or NULL
+ */
 	struct in_addr *
 wd_gethostbyname(const char *name)
 {
-	struct hostent *he;
-	struct in_addr *h_addr, *in_addr_temp;
+	struct in_addr *h_addr;
 
 	/* XXX Calling function is reponsible for free() */
 
 	h_addr = safe_malloc(sizeof(struct in_addr));
 
-	LOCK_GHBN();
-
-	he = gethostbyname(name);
-
-	if (he == NULL) {
+	if (dns_cache_resolve(name, h_addr, 1) != 1) {
 		free(h_addr);
-		UNLOCK_GHBN();
 		return NULL;
 	}
 
-	mark_online();
-
-	in_addr_temp = (struct in_addr *)he->h_addr_list[0];
-	h_addr->s_addr = in_addr_temp->s_addr;
-
-	UNLOCK_GHBN();
-
 	return h_addr;
 }
 
@@ -675,6 +671,13 @@ get_ext_iface(void)
 		s_config *config;
 		t_serv *auth_server;
 		t_client	*first;
+		t_client_list_stats	client_stats;
+		t_auth_cache_stats	cache_stats;
+		t_auth_dispatch_stats	dispatch_stats;
+		t_httpd_pool_stats	httpd_stats;
+		t_journal_stats	journal_stats;
+		t_tls_stats	tls_stats;
+		t_serv_health	health;
 		int		count;
 		unsigned long int uptime = 0;
 		unsigned int days = 0, hours = 0, minutes = 0, seconds = 0;
@@ -721,20 +724,17 @@ get_ext_iface(void)
 
 		LOCK_CLIENT_LIST();
 
-		first = client_get_first_client();
+		client_list_get_stats(&client_stats);
+		config = config_get_config();
 
-		if (first == NULL) {
-			count = 0;
-		} else {
-			count = 1;
-			while (first->next != NULL) {
-				first = first->next;
-				count++;
-			}
-		}
+		snprintf((buffer + len), (sizeof(buffer) - len), "%u clients "
+				"connected.\n", client_stats.count);
+		len = strlen(buffer);
 
-		snprintf((buffer + len), (sizeof(buffer) - len), "%d clients "
-				"connected.\n", count);
+		snprintf((buffer + len), (sizeof(buffer) - len), "Pending clients: %u (limit %d)\n"
+				"Client limit: %d\nClients evicted: %lu\nClients rejected: %lu\n",
+				client_stats.pending, config->maxpendingclients, config->maxclients,
+				client_stats.evicted, client_stats.rejected);
 		len = strlen(buffer);
 
 		first = client_get_first_client();
@@ -753,6 +753,11 @@ get_ext_iface(void)
 			snprintf((buffer + len), (sizeof(buffer) - len), "  Downloaded: %llu\n  Uploaded: %llu\n" , first->counters.incoming, first->counters.outgoing);
 			len = strlen(buffer);
 
+			snprintf((buffer + len), (sizeof(buffer) - len), "  Download rate: %lu B/s (peak %lu B/s)\n  Upload rate: %lu B/s (peak %lu B/s)\n",
+					first->rates.incoming, first->rates.incoming_peak,
+					first->rates.outgoing, first->rates.outgoing_peak);
+			len = strlen(buffer);
+
 			count++;
 			first = first->next;
 		}
@@ -777,11 +782,58 @@ get_ext_iface(void)
 		LOCK_CONFIG();
 
 		for (auth_server = config->auth_servers; auth_server != NULL; auth_server = auth_server->next) {
-			snprintf((buffer + len), (sizeof(buffer) - len), "  Host: %s (%s)\n", auth_server->serv_hostname, auth_server->last_ip);
+			server_health_get(auth_server, &health);
+			snprintf((buffer + len), (sizeof(buffer) - len), "  Host: %s (%s) %s, %lu ms, %u.%u%% errors\n",
+					auth_server->serv_hostname, auth_server->last_ip,
+					server_health_state_name(health.state), health.latency_ms,
+					health.error_rate / 10, health.error_rate % 10);
 			len = strlen(buffer);
 		}
 
 		UNLOCK_CONFIG();
 
+		auth_cache_get_stats(&cache_stats);
+		snprintf((buffer + len), (sizeof(buffer) - len), "\nCached login verdicts: %d (limit %d)\n"
+				"Logins authorised from the cache: %lu\nLogins sent to the auth server: %lu\n",
+				cache_stats.count, config->auth_cache_size, cache_stats.hits, cache_stats.misses);
+		len = strlen(buffer);
+
+		auth_dispatch_get_stats(&dispatch_stats);
+		snprintf((buffer + len), (sizeof(buffer) - len), "Auth workers: %d, %d login(s) in flight\n"
+				"Auth queue: %d (peak %d, limit %d)\n"
+				"Logins: %lu (%lu in the background), coalesced: %lu, refused: %lu\n"
+				"Auth queue wait: %lu ms (max %lu ms)\nAuth server round trip: %lu ms (max %lu ms)\n",
+				dispatch_stats.workers, dispatch_stats.in_flight,
+				dispatch_stats.queued, dispatch_stats.queued_peak, config->auth_queue_max,
+				dispatch_stats.requests, dispatch_stats.background,
+				dispatch_stats.coalesced, dispatch_stats.rejected,
+				dispatch_stats.wait_ms, dispatch_stats.wait_ms_max,
+				dispatch_stats.upstream_ms, dispatch_stats.upstream_ms_max);
+		len = strlen(buffer);
+
+		httpd_pool_get_stats(&httpd_stats);
+		snprintf((buffer + len), (sizeof(buffer) - len), "Web server workers: %d, %d busy\n"
+				"Web server queue: %d (peak %d, limit %d)\n"
+				"Connections: %lu, refused with 503: %lu\n",
+				httpd_stats.workers, httpd_stats.busy,
+				httpd_stats.queued, httpd_stats.queued_peak, config->httpd_queue_max,
+				httpd_stats.requests, httpd_stats.shed);
+		len = strlen(buffer);
+
+		journal_get_stats(&journal_stats);
+		snprintf((buffer + len), (sizeof(buffer) - len), "\nJournalled notifications: %d waiting (limit %d)\n"
+				"Journalled: %lu, compacted: %lu, replayed: %lu, dropped: %lu\n"
+				"Journal written this hour: %lu KB (limit %d KB)\n",
+				journal_stats.count, config->journal_size,
+				journal_stats.journalled, journal_stats.compacted,
+				journal_stats.replayed, journal_stats.dropped,
+				journal_stats.written / 1024, config->journal_write_limit);
+		len = strlen(buffer);
+
+		tls_get_stats(&tls_stats);
+		snprintf((buffer + len), (sizeof(buffer) - len), "TLS handshakes: %lu (%lu resumed), failed: %lu\n",
+				tls_stats.handshakes, tls_stats.resumed, tls_stats.failures);
+		len = strlen(buffer);
+
 		return safe_strdup(buffer);
 	}
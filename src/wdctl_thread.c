@@ -49,6 +49,7 @@
 #include "fw_iptables.h"
 #include "firewall.h"
 #include "client_list.h"
+#include "auth_cache.h"
 #include "wdctl_thread.h"
 #include "gateway.h"
 #include "safe.h"
@@ -329,7 +330,7 @@ wdctl_restart(int afd)
 		client = client_get_first_client();
 		while (client) {
 			/* Send this client */
-			safe_asprintf(&tempstring, "CLIENT|ip=%s|mac=%s|token=%s|fw_connection_state=%u|fd=%d|counters_incoming=%llu|counters_outgoing=%llu|counters_last_updated=%lu\n", client->ip, client->mac, client->token, client->fw_connection_state, client->fd, client->counters.incoming, client->counters.outgoing, client->counters.last_updated);
+			safe_asprintf(&tempstring, "CLIENT|ip=%s|mac=%s|token=%s|fw_connection_state=%u|fd=%d|counters_incoming=%llu|counters_outgoing=%llu|counters_last_updated=%lu|quota_bytes_allowed=%llu|quota_bytes_base=%llu|quota_time_allowed=%ld|quota_started=%lu\n", client->ip, client->mac, client->token, client->fw_connection_state, client->fd, client->counters.incoming, client->counters.outgoing, client->counters.last_updated, client->quota.bytes_allowed, client->quota.bytes_base, (long)client->quota.time_allowed, (unsigned long)client->quota.started);
 			debug(LOG_DEBUG, "Sending to child client data: %s", tempstring);
 			len = 0;
 			while (len != strlen(tempstring)) {
@@ -404,6 +405,7 @@ wdctl_reset(int fd, const char *arg)
 	/* TODO: maybe just deleting the connection is not best... But this
 	 * is a manual command, I don't anticipate it'll be that useful. */
 	fw_deny(node->ip, node->mac, node->fw_connection_state);
+	auth_cache_invalidate(node->token);
 	client_list_delete(node);
 
 	UNLOCK_CLIENT_LIST();